@@ -5,6 +5,7 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 
 #include "isolate.h"
 
@@ -12,6 +13,16 @@ int verbose = 0;
 int background = 0;
 char pidfile[MAXPATHLEN];
 char *configfile = (char *) "/etc/isolate/config.ini";
+char *control_socket = (char *) "/var/run/isolate/control.sock";
+
+extern int bench_runs;
+extern char *bench_only;
+extern int start_jobs;
+extern int start_rate;
+extern int start_burst;
+extern int stop_timeout;
+extern int stats_watch;
+extern int stats_json;
 
 const char short_opts[] = "vVhbc:p:";
 const struct option long_opts[] = {
@@ -40,14 +51,46 @@ const struct option long_opts[] = {
 	{ "nice", required_argument, NULL, 17 },
 	{ "no-new-privs", required_argument, NULL, 18 },
 	{ "init", required_argument, NULL, 19 },
+	{ "start-timeout", required_argument, NULL, 20 },
+	{ "spawn", required_argument, NULL, 21 },
+	{ "timing-file", required_argument, NULL, 22 },
+	{ "trace-file", required_argument, NULL, 23 },
+	{ "bench-runs", required_argument, NULL, 24 },
+	{ "bench-only", required_argument, NULL, 25 },
+	{ "state-dir", required_argument, NULL, 26 },
+	{ "control-socket", required_argument, NULL, 27 },
+	{ "start-jobs", required_argument, NULL, 28 },
+	{ "start-rate", required_argument, NULL, 29 },
+	{ "start-burst", required_argument, NULL, 30 },
+	{ "stop-timeout", required_argument, NULL, 31 },
+	{ "watch", optional_argument, NULL, 32 },
+	{ "json", no_argument, NULL, 33 },
 	{ NULL, 0, NULL, 0 }
 };
 
+/*
+ * The long options which override the options of a container section.
+ */
+static const char *const section_opts[] = {
+	"name", "root-dir", "hostname", "input", "output", "devices-file",
+	"environ-file", "seccomp-file", "fstab-file", "cap-add", "cap-drop",
+	"uid", "gid", "unshare", "cgroups", "nice", "no-new-privs", "init",
+	"start-timeout", "spawn", "timing-file", "trace-file", NULL
+};
+
 void __attribute__((noreturn))
 usage(int code)
 {
 	dprintf(STDOUT_FILENO,
-	        "Usage: %s [options] [--] (start|stop|status) NAME\n"
+	        "Usage: %s [options] [--] (start|stop|status) NAME...\n"
+	        "   or: %s [options] [--] bench NAME\n"
+	        "   or: %s [options] [--] prewarm [NAME]\n"
+	        "   or: %s [options] [--] update NAME KEY=VALUE...\n"
+	        "   or: %s [options] [--] stats [NAME...]\n"
+	        "   or: %s [options] [--] rebalance [NAME...]\n"
+	        "   or: %s [options] [--] (daemon|list|pool|start-all|stop-all)\n"
+	        "   or: %s [options] [--] image import ARCHIVE NAME\n"
+	        "   or: %s [options] [--] image checkout NAME DIR\n"
 	        "\n"
 	        "Utility allows to isolate process inside predefined environment.\n"
 	        "\n"
@@ -56,10 +99,36 @@ usage(int code)
 	        " -b, --background      run as a background process\n"
 	        " -h, --help            display this help and exit\n"
 	        " -v, --verbose         print a message for each action\n"
+	        " --state-dir=DIR       keep compiled profiles and caches in DIR\n"
+	        "                       (default: /var/lib/isolate)\n"
+	        " --control-socket=FILE use FILE as the supervisor control socket\n"
+	        "                       (default: /var/run/isolate/control.sock)\n"
 	        " -V, --version         output version information and exit\n"
 	        "\n"
+	        "Supervisor options:\n"
+	        " --start-jobs=NUM      start at most NUM containers at once (default: 4)\n"
+	        " --start-rate=NUM      start at most NUM containers per second, 0 means\n"
+	        "                       no limit (default: 10)\n"
+	        " --start-burst=NUM     allow a burst of NUM starts (default: 4)\n"
+	        " --stop-timeout=MSEC   kill containers that are still running MSEC\n"
+	        "                       after the stop request (default: 5000)\n"
+	        "\n"
+	        "Statistics options:\n"
+	        " --watch[=MSEC]        sample the containers again every MSEC\n"
+	        "                       (default: 1000)\n"
+	        " --json                print a JSON object per container and sample\n"
+	        "\n"
+	        "Benchmark options:\n"
+	        " --bench-runs=NUM      start every case NUM times (default: 20)\n"
+	        " --bench-only=LIST     run only the listed cases (baseline, fstab,\n"
+	        "                       devices, seccomp, cgroups, concurrency)\n"
+	        "\n"
 	        "Report bugs to authors.\n"
 	        "\n",
+	        program_invocation_short_name, program_invocation_short_name,
+	        program_invocation_short_name, program_invocation_short_name,
+	        program_invocation_short_name, program_invocation_short_name,
+	        program_invocation_short_name, program_invocation_short_name,
 	        program_invocation_short_name);
 	exit(code);
 }
@@ -76,6 +145,19 @@ print_version_and_exit(void)
 	exit(EXIT_SUCCESS);
 }
 
+static int
+parse_number(const char *arg)
+{
+	long value;
+
+	errno = 0;
+	value = strtol(arg, NULL, 10);
+	if (errno == ERANGE || value < 0 || value > INT_MAX)
+		myerror(EXIT_FAILURE, 0, "bad value: %s", arg);
+
+	return (int) value;
+}
+
 void
 parse_global_arguments(int argc, char **argv, struct container *data)
 {
@@ -106,6 +188,41 @@ parse_global_arguments(int argc, char **argv, struct container *data)
 			case 'V':
 				print_version_and_exit();
 				break;
+			case 24:
+				errno = 0;
+				bench_runs = (int) strtol(optarg, NULL, 10);
+				if (errno == ERANGE)
+					myerror(EXIT_FAILURE, 0, "bad value: %s", optarg);
+				break;
+			case 25:
+				bench_only = optarg;
+				break;
+			case 26:
+				set_state_dir(data, optarg);
+				break;
+			case 27:
+				control_socket = optarg;
+				break;
+			case 28:
+				start_jobs = parse_number(optarg);
+				break;
+			case 29:
+				start_rate = parse_number(optarg);
+				break;
+			case 30:
+				start_burst = parse_number(optarg);
+				break;
+			case 31:
+				stop_timeout = parse_number(optarg);
+				break;
+			case 32:
+				stats_watch = optarg ? parse_number(optarg) : 1000;
+				if (!stats_watch)
+					myerror(EXIT_FAILURE, 0, "bad value: %s", optarg);
+				break;
+			case 33:
+				stats_json = 1;
+				break;
 		}
 	}
 }
@@ -185,8 +302,45 @@ parse_section_arguments(int argc, char **argv, struct container *data)
 			case 19:
 				set_argv(data, optarg);
 				break;
+			case 20:
+				errno = 0;
+				arg = (int) strtol(optarg, NULL, 10);
+				if (errno == ERANGE)
+					myerror(EXIT_FAILURE, 0, "bad value: %s", optarg);
+				set_start_timeout(data, arg);
+				break;
+			case 21:
+				set_spawn(data, optarg);
+				break;
+			case 22:
+				set_timing_file(data, optarg);
+				break;
+			case 23:
+				set_trace_file(data, optarg);
+				break;
 			case '?':
 				usage(EXIT_FAILURE);
 		}
 	}
 }
+
+/*
+ * Returns non-zero if the command line overrides any container option.
+ */
+int
+has_section_arguments(int argc, char **argv)
+{
+	int idx = -1, found = 0;
+
+	optind = opterr = optopt = 0;
+
+	while (getopt_long(argc, argv, short_opts, long_opts, &idx) != EOF) {
+		for (size_t i = 0; idx >= 0 && section_opts[i]; i++) {
+			if (!strcmp(long_opts[idx].name, section_opts[i]))
+				found = 1;
+		}
+		idx = -1;
+	}
+
+	return found;
+}
@@ -2,136 +2,413 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
 
+#include <poll.h>
+
+#include <linux/magic.h>
+
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
 #include <errno.h>
 
 #include "isolate.h"
 
 #define LINESIZ 256
+#define FREEZER_MAX_DELAY 10000000
+
+/*
+ * Controllers of the v1 hierarchies under their unified names. The freezer is
+ * built into every cgroup2 directory, the others have no counterpart.
+ */
+static const struct {
+	const char *v1;
+	const char *v2;
+} unifiedControllers[] = {
+	{ "cpuacct",    "cpu" },
+	{ "blkio",      "io"  },
+	{ "freezer",    NULL  },
+	{ "devices",    NULL  },
+	{ "net_cls",    NULL  },
+	{ "net_prio",   NULL  },
+	{ "perf_event", NULL  },
+};
+
+/*
+ * The unified hierarchy is used when the cgroups directory is a cgroup2 mount,
+ * otherwise every controller gets its own v1 hierarchy below it.
+ */
+cgroup_version_t
+cgroup_version(struct cgroups *cg)
+{
+	struct statfs st;
+
+	if (cg->version != CGROUP_UNKNOWN)
+		return cg->version;
+
+	if (statfs(cg->rootdir, &st) == 0 && st.f_type == CGROUP2_SUPER_MAGIC)
+		cg->version = CGROUP_V2;
+	else
+		cg->version = CGROUP_V1;
+
+	return cg->version;
+}
+
+static const char *
+unified_controller(const char *controller)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(unifiedControllers); i++) {
+		if (!strcmp(controller, unifiedControllers[i].v1))
+			return unifiedControllers[i].v2;
+	}
+	return controller;
+}
 
 static int
-mountpoint(const char *path)
+has_word(const char *str, const char *word)
 {
-	dev_t st_dev;
-	struct stat st;
-	char path0[MAXPATHLEN + 1];
+	size_t len = strlen(word);
+
+	for (const char *p = str; (p = strstr(p, word)); p += len) {
+		if ((p == str || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\n' || !p[len]))
+			return 1;
+	}
+	return 0;
+}
 
-	if (lstat(path, &st) < 0) {
+/*
+ * The name is looked up relative to its parent directory, which is also the
+ * directory the mount point would be compared with.
+ */
+static int
+mountpoint(int dirfd, const char *name)
+{
+	struct stat st, parent;
+
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
 		if (errno != ENOENT)
-			myerror(EXIT_FAILURE, errno, "lstat: %s", path);
+			myerror(EXIT_FAILURE, errno, "lstat: %s", name);
 		return 0;
 	}
 
-	st_dev = st.st_dev;
+	if (fstat(dirfd, &parent) < 0)
+		myerror(EXIT_FAILURE, errno, "fstat: %s/..", name);
 
-	snprintf(path0, MAXPATHLEN, "%s/..", path);
+	return (st.st_dev != parent.st_dev);
+}
 
-	if (lstat(path0, &st) < 0)
-		myerror(EXIT_FAILURE, errno, "lstat: %s", path0);
+static int
+make_directory(int dirfd, const char *path)
+{
+	struct stat st = {};
+
+	if (fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		if (errno != ENOENT) {
+			errmsg("lstat: %s", path);
+			return -1;
+		}
+
+		if (mkdirat(dirfd, path, 0700) < 0 && errno != EEXIST) {
+			errmsg("mkdir: %s", path);
+			return -1;
+		}
+
+	} else if ((st.st_mode & S_IFMT) != S_IFDIR) {
+		info("not directory: %s", path);
+		return -1;
+	}
 
-	return (st_dev != st.st_dev);
+	return 0;
 }
 
-static void
-make_directory(const char *path)
+/*
+ * The hierarchies are shared by all containers of the group. Creating and
+ * destroying them must be serialized, otherwise one container may unmount a
+ * hierarchy that another one has just populated.
+ */
+static int
+cgroup_lock(struct cgroups *cg)
 {
-	struct stat st = {};
+	int fd;
+	char path[MAXPATHLEN + 1];
+
+	snprintf(path, MAXPATHLEN, "%s/%s", cg->rootdir, cg->group);
 
-	if (lstat(path, &st) < 0) {
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
 		if (errno != ENOENT)
-			myerror(EXIT_FAILURE, errno, "lstat: %s", path);
+			errmsg("open: %s", path);
+		return -1;
+	}
 
-		if (mkdir(path, 0700) < 0)
-			myerror(EXIT_FAILURE, errno, "mkdir: %s", path);
+	if (TEMP_FAILURE_RETRY(flock(fd, LOCK_EX)) < 0) {
+		errmsg("flock: %s", path);
+		close(fd);
+		return -1;
+	}
 
-	} else if ((st.st_mode & S_IFMT) != S_IFDIR) {
-		myerror(EXIT_FAILURE, errno, "not directory: %s", path);
+	return fd;
+}
+
+static int
+has_subdirs(const char *path)
+{
+	DIR *dir;
+	struct dirent *ent;
+	int found = 0;
+
+	if (!(dir = opendir(path)))
+		return 0;
+
+	while ((ent = readdir(dir))) {
+		if (ent->d_type != DT_DIR || !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		found = 1;
+		break;
 	}
+
+	closedir(dir);
+	return found;
 }
 
-void
+/*
+ * A directory left by a previous run is re-created, so it starts empty.
+ */
+static int
+make_container_dir(int groupfd, const char *dirname, const char *name)
+{
+	int fd, rc = -1;
+
+	if ((fd = openat(groupfd, dirname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", dirname);
+		return -1;
+	}
+
+	if (mkdirat(fd, name, 0700) < 0) {
+		if (errno != EEXIST) {
+			errmsg("mkdir: %s/%s", dirname, name);
+			goto out;
+		}
+
+		if (unlinkat(fd, name, AT_REMOVEDIR) < 0) {
+			if (errno == EBUSY)
+				info("%s/%s: directory already exists, unable to re-create", dirname, name);
+			else
+				errmsg("rmdir: %s/%s", dirname, name);
+			goto out;
+		}
+
+		if (mkdirat(fd, name, 0700) < 0) {
+			errmsg("mkdir: %s/%s", dirname, name);
+			goto out;
+		}
+	}
+
+	rc = 0;
+out:
+	close(fd);
+	return rc;
+}
+
+static void
+write_value(const char *path, const char *value)
+{
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", path);
+		return;
+	}
+
+	if (dprintf(fd, "%s", value) <= 0)
+		errmsg("dprintf(%s): %s", value, path);
+
+	close(fd);
+}
+
+/*
+ * Enables the controllers for the children of the directory. Those that are
+ * already enabled are not written again, because the directory may have
+ * processes of its own, and then the kernel refuses any change.
+ */
+static int
+unified_delegate(int dirfd, const char *path, struct cgroups *cg)
+{
+	int fd, rc = -1;
+	ssize_t len;
+	char buf[LINESIZ];
+
+	if ((fd = openat(dirfd, "cgroup.subtree_control", O_RDWR | O_CLOEXEC)) < 0) {
+		errmsg("open: %s/cgroup.subtree_control", path);
+		return -1;
+	}
+
+	if ((len = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf) - 1))) < 0) {
+		errmsg("read: %s/cgroup.subtree_control", path);
+		goto out;
+	}
+	buf[len] = '\0';
+
+	for (size_t i = 0; cg->controller && cg->controller[i]; i++) {
+		const char *name = unified_controller(cg->controller[i]);
+
+		if (!name || has_word(buf, name))
+			continue;
+
+		if (dprintf(fd, "+%s", name) < 0) {
+			errmsg("unable to enable %s controller: %s", name, path);
+			goto out;
+		}
+	}
+
+	rc = 0;
+out:
+	close(fd);
+	return rc;
+}
+
+/*
+ * In the unified hierarchy the group is an ordinary cgroup that delegates the
+ * controllers to one directory per container.
+ */
+static int
+unified_create(struct cgroups *cg)
+{
+	int rootfd = -1, fd_lock, rc = -1;
+	char path[MAXPATHLEN + 1];
+
+	snprintf(path, MAXPATHLEN, "%s/%s", cg->rootdir, cg->group);
+
+	if (make_directory(AT_FDCWD, path) < 0 || (fd_lock = cgroup_lock(cg)) < 0)
+		return -1;
+
+	if ((rootfd = open(cg->rootdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", cg->rootdir);
+		goto out;
+	}
+
+	if (unified_delegate(rootfd, cg->rootdir, cg) < 0 ||
+	    unified_delegate(fd_lock, path, cg) < 0 ||
+	    make_container_dir(fd_lock, ".", cg->name) < 0 ||
+	    cgroup_apply_limits(cg, cg->limits) < 0)
+		goto out;
+
+	rc = 0;
+out:
+	if (rootfd >= 0)
+		close(rootfd);
+	close(fd_lock);
+	return rc;
+}
+
+int
 cgroup_create(struct cgroups *cg)
 {
 	size_t i = 0;
+	int fd_lock, rc = -1;
 	char path[MAXPATHLEN + 1];
 
 	if (!cg)
-		return;
+		return 0;
+
+	if (cgroup_version(cg) == CGROUP_V2)
+		return unified_create(cg);
 
 	snprintf(path, MAXPATHLEN, "%s/%s", cg->rootdir, cg->group);
-	make_directory(path);
 
-	path[0] = '\0';
+	if (make_directory(AT_FDCWD, path) < 0 || (fd_lock = cgroup_lock(cg)) < 0)
+		return -1;
 
+	// The lock descriptor is the group directory, everything else is relative to it.
 	while (cg->controller && cg->controller[i]) {
 		char *dirname = cg->dirname[i];
 
 		if (!dirname)
 			dirname = cg->controller[i];
 
-		snprintf(path, MAXPATHLEN, "%s/%s/%s", cg->rootdir, cg->group, dirname);
-		make_directory(path);
-
-		if (!mountpoint(path) && mount("cgroup", path, "cgroup", 0, cg->controller[i]) < 0)
-			myerror(EXIT_FAILURE, errno, "mount(cgroup,%s): %s", cg->controller[i], path);
-
-		path[0] = '\0';
-
-		snprintf(path, MAXPATHLEN, "%s/%s/%s/%s", cg->rootdir, cg->group, dirname, cg->name);
+		if (make_directory(fd_lock, dirname) < 0)
+			goto out;
 
-		if (mkdir(path, 0700) < 0) {
-			if (errno != EEXIST)
-				myerror(EXIT_FAILURE, errno, "mkdir: %s", path);
+		if (!mountpoint(fd_lock, dirname)) {
+			snprintf(path, MAXPATHLEN, "%s/%s/%s", cg->rootdir, cg->group, dirname);
 
-			if (rmdir(path) < 0) {
-				if (errno == EBUSY)
-					myerror(EXIT_FAILURE, 0, "%s: directory already exists, unable to re-create", path);
-				myerror(EXIT_FAILURE, errno, "rmdir: %s", path);
+			if (mount("cgroup", path, "cgroup", 0, cg->controller[i]) < 0) {
+				errmsg("mount(cgroup,%s): %s", cg->controller[i], path);
+				goto out;
 			}
+		}
 
-			if (mkdir(path, 0700) < 0)
-				myerror(EXIT_FAILURE, errno, "mkdir: %s", path);
+		// The new cpuset directory inherits cpus and mems, or it takes no tasks.
+		if (!strcmp(cg->controller[i], "cpuset")) {
+			snprintf(path, MAXPATHLEN, "%s/%s/%s/cgroup.clone_children", cg->rootdir, cg->group, dirname);
+			write_value(path, "1");
 		}
 
-		path[0] = '\0';
+		if (make_container_dir(fd_lock, dirname, cg->name) < 0)
+			goto out;
 
 		i++;
 	}
+
+	if (cgroup_apply_limits(cg, cg->limits) < 0)
+		goto out;
+
+	rc = 0;
+out:
+	close(fd_lock);
+	return rc;
 }
 
 void
 cgroup_destroy(struct cgroups *cg)
 {
 	size_t i = 0;
+	int fd_lock;
 	char path[MAXPATHLEN + 1];
 
 	if (!cg)
 		return;
 
+	fd_lock = cgroup_lock(cg);
+
+	// The group directory stays, it only costs an inode.
+	if (cgroup_version(cg) == CGROUP_V2) {
+		snprintf(path, MAXPATHLEN, "%s/%s/%s", cg->rootdir, cg->group, cg->name);
+
+		if (rmdir(path) < 0 && errno != ENOENT)
+			errmsg("rmdir: %s", path);
+	}
+
 	while (cg->controller && cg->controller[i]) {
 		char *dirname = cg->dirname[i];
 
 		if (!dirname)
 			dirname = cg->controller[i];
 
-		snprintf(path, MAXPATHLEN, "%s/%s/%s/%s", cg->rootdir, cg->group, dirname, cg->name);
+		if (cg->version == CGROUP_V1) {
+			snprintf(path, MAXPATHLEN, "%s/%s/%s/%s", cg->rootdir, cg->group, dirname, cg->name);
 
-		if (rmdir(path) < 0 && errno != ENOENT)
-			errmsg("rmdir: %s", path);
+			if (rmdir(path) < 0 && errno != ENOENT)
+				errmsg("rmdir: %s", path);
 
-		path[0] = '\0';
+			path[0] = '\0';
 
-		snprintf(path, MAXPATHLEN, "%s/%s/%s", cg->rootdir, cg->group, dirname);
+			snprintf(path, MAXPATHLEN, "%s/%s/%s", cg->rootdir, cg->group, dirname);
 
-		if (!umount(path) && rmdir(path) < 0 && errno != EBUSY && errno != ENOENT)
-			errmsg("rmdir: %s", path);
+			// Other containers still use the hierarchy.
+			if (!has_subdirs(path) && !umount(path) && rmdir(path) < 0 && errno != EBUSY && errno != ENOENT)
+				errmsg("rmdir: %s", path);
 
-		path[0] = '\0';
+			path[0] = '\0';
+		}
 
 		cg->controller[i] = xfree(cg->controller[i]);
 		cg->dirname[i] = xfree(cg->dirname[i]);
@@ -141,6 +418,23 @@ cgroup_destroy(struct cgroups *cg)
 
 	cg->controller = xfree(cg->controller);
 	cg->dirname = xfree(cg->dirname);
+
+	if (fd_lock >= 0)
+		close(fd_lock);
+}
+
+static void
+write_pid(const char *path, pid_t pid)
+{
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_NOFOLLOW | O_TRUNC | O_CREAT | O_CLOEXEC, 0666)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: %s", path);
+
+	if (dprintf(fd, "%d", pid) <= 0)
+		myerror(EXIT_FAILURE, errno, "dprintf(pid=%d): %s", pid, path);
+
+	close(fd);
 }
 
 void
@@ -152,26 +446,111 @@ cgroup_add(struct cgroups *cg, pid_t pid)
 	if (!cg)
 		return;
 
+	if (cgroup_version(cg) == CGROUP_V2) {
+		snprintf(path, MAXPATHLEN, "%s/%s/%s/cgroup.procs", cg->rootdir, cg->group, cg->name);
+		write_pid(path, pid);
+		return;
+	}
+
 	while (cg->controller && cg->controller[i]) {
-		int fd;
 		char *dirname = cg->dirname[i];
 
 		if (!dirname)
 			dirname = cg->controller[i];
 
 		snprintf(path, MAXPATHLEN, "%s/%s/%s/%s/tasks", cg->rootdir, cg->group, dirname, cg->name);
+		write_pid(path, pid);
 
-		if ((fd = open(path, O_WRONLY | O_NOFOLLOW | O_TRUNC | O_CREAT | O_CLOEXEC, 0666)) < 0)
-			myerror(EXIT_FAILURE, errno, "open: %s", path);
+		path[0] = '\0';
+
+		i++;
+	}
+}
 
-		if (dprintf(fd, "%d", pid) <= 0)
-			myerror(EXIT_FAILURE, errno, "dprintf(pid=%d): %s", pid, path);
+int
+cgroup_open_unified(struct cgroups *cg)
+{
+	size_t i = 0;
+	char path[MAXPATHLEN + 1];
+
+	if (!cg)
+		return -1;
+
+	if (cgroup_version(cg) == CGROUP_V2) {
+		snprintf(path, MAXPATHLEN, "%s/%s/%s", cg->rootdir, cg->group, cg->name);
+		return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	while (cg->controller && cg->controller[i]) {
+		struct statfs st;
+		char *dirname = cg->dirname[i];
+
+		if (!dirname)
+			dirname = cg->controller[i];
+
+		snprintf(path, MAXPATHLEN, "%s/%s/%s/%s", cg->rootdir, cg->group, dirname, cg->name);
+
+		if (statfs(path, &st) < 0)
+			myerror(EXIT_FAILURE, errno, "statfs: %s", path);
+
+		// CLONE_INTO_CGROUP accepts only cgroup2 directories.
+		if (st.f_type == CGROUP2_SUPER_MAGIC)
+			return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-		close(fd);
 		path[0] = '\0';
 
 		i++;
 	}
+
+	return -1;
+}
+
+/*
+ * The kernel notifies the pollers of cgroup.events when the frozen state is
+ * reached, so there is nothing to spin on.
+ */
+static void
+unified_freeze(struct cgroups *cg, int frozen)
+{
+	int fd;
+	char path[MAXPATHLEN + 1];
+
+	snprintf(path, MAXPATHLEN, "%s/%s/%s/cgroup.freeze", cg->rootdir, cg->group, cg->name);
+
+	if ((fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		// Linux < 5.2 can not freeze a cgroup2 directory.
+		if (errno == ENOENT)
+			return;
+		myerror(EXIT_FAILURE, errno, "open: %s", path);
+	}
+
+	if (dprintf(fd, "%d", frozen) <= 0)
+		myerror(EXIT_FAILURE, errno, "dprintf(%d): %s", frozen, path);
+
+	close(fd);
+
+	snprintf(path, MAXPATHLEN, "%s/%s/%s/cgroup.events", cg->rootdir, cg->group, cg->name);
+
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: %s", path);
+
+	while (1) {
+		struct pollfd pfd = { .fd = fd, .events = POLLPRI };
+		char buf[LINESIZ], *p;
+		ssize_t len;
+
+		if ((len = TEMP_FAILURE_RETRY(pread(fd, buf, sizeof(buf) - 1, 0))) < 0)
+			myerror(EXIT_FAILURE, errno, "read: %s", path);
+		buf[len] = '\0';
+
+		if ((p = strstr(buf, "frozen ")) && atoi(p + 7) == frozen)
+			break;
+
+		if (TEMP_FAILURE_RETRY(poll(&pfd, 1, 1000)) < 0)
+			myerror(EXIT_FAILURE, errno, "poll: %s", path);
+	}
+
+	close(fd);
 }
 
 static void
@@ -179,10 +558,16 @@ cgroup_state(struct cgroups *cg, const char *state)
 {
 	int fd;
 	char path[MAXPATHLEN + 1];
+	struct timespec delay = { 0, 50000 };
 
 	if (!cg)
 		return;
 
+	if (cgroup_version(cg) == CGROUP_V2) {
+		unified_freeze(cg, !strcmp(state, "FROZEN"));
+		return;
+	}
+
 	snprintf(path, MAXPATHLEN, "%s/%s/%s/%s/freezer.state", cg->rootdir, cg->group, CGROUP_FREEZER, cg->name);
 
 	if ((fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC)) < 0)
@@ -210,7 +595,11 @@ cgroup_state(struct cgroups *cg, const char *state)
 		if (!strcmp(state, buf) || !strcmp("THAWED", buf))
 			break;
 
-		usleep(500);
+		// The v1 freezer has no notification, so back off instead.
+		nanosleep(&delay, NULL);
+
+		if (delay.tv_nsec < FREEZER_MAX_DELAY)
+			delay.tv_nsec *= 2;
 	}
 
 	close(fd);
@@ -228,6 +617,80 @@ cgroup_unfreeze(struct cgroups *cg)
 	cgroup_state(cg, "THAWED");
 }
 
+static void
+freezer_file(struct cgroups *cg, char *path, size_t size)
+{
+	if (cgroup_version(cg) == CGROUP_V2)
+		snprintf(path, size, "%s/%s/%s/cgroup.freeze", cg->rootdir, cg->group, cg->name);
+	else
+		snprintf(path, size, "%s/%s/%s/%s/freezer.state", cg->rootdir, cg->group, CGROUP_FREEZER, cg->name);
+}
+
+/*
+ * Asks the kernel to freeze or thaw the container without waiting for it. The
+ * end of the freeze is reported by cgroup_frozen() and in v2 also through
+ * cgroup_watch().
+ */
+int
+cgroup_set_frozen(struct cgroups *cg, int frozen)
+{
+	int fd;
+	char path[MAXPATHLEN + 1];
+	const char *value;
+
+	freezer_file(cg, path, sizeof(path));
+
+	if (cgroup_version(cg) == CGROUP_V2)
+		value = frozen ? "1" : "0";
+	else
+		value = frozen ? "FROZEN" : "THAWED";
+
+	if ((fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", path);
+		return -1;
+	}
+
+	if (write(fd, value, strlen(value)) < 0) {
+		errmsg("write(%s): %s", value, path);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Returns non-zero if the freeze of the container has completed.
+ */
+int
+cgroup_frozen(struct cgroups *cg)
+{
+	int fd;
+	ssize_t len;
+	char path[MAXPATHLEN + 1], buf[LINESIZ], *p;
+
+	if (cgroup_version(cg) == CGROUP_V2)
+		snprintf(path, MAXPATHLEN, "%s/%s/%s/cgroup.events", cg->rootdir, cg->group, cg->name);
+	else
+		freezer_file(cg, path, sizeof(path));
+
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		return 0;
+
+	len = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf) - 1));
+	close(fd);
+
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	if (cg->version == CGROUP_V2)
+		return (p = strstr(buf, "frozen ")) && atoi(p + 7) == 1;
+
+	return !strncmp(buf, "FROZEN", 6);
+}
+
 size_t
 cgroup_signal(struct cgroups *cg, int signum)
 {
@@ -238,7 +701,10 @@ cgroup_signal(struct cgroups *cg, int signum)
 	if (!cg)
 		return 0;
 
-	snprintf(path, MAXPATHLEN, "%s/%s/%s/%s/tasks", cg->rootdir, cg->group, CGROUP_FREEZER, cg->name);
+	if (cgroup_version(cg) == CGROUP_V2)
+		snprintf(path, MAXPATHLEN, "%s/%s/%s/cgroup.procs", cg->rootdir, cg->group, cg->name);
+	else
+		snprintf(path, MAXPATHLEN, "%s/%s/%s/%s/tasks", cg->rootdir, cg->group, CGROUP_FREEZER, cg->name);
 
 	errno = 0;
 	if (!(fd = fopen(path, "r"))) {
@@ -257,7 +723,8 @@ cgroup_signal(struct cgroups *cg, int signum)
 			break;
 		}
 
-		if (kill(pid, signum) < 0)
+		// The process may have exited after the tasks file was read.
+		if (kill(pid, signum) < 0 && errno != ESRCH)
 			myerror(EXIT_FAILURE, errno, "Could not send signal %d to pid %d", signum, pid);
 
 		procs += 1;
@@ -268,6 +735,445 @@ cgroup_signal(struct cgroups *cg, int signum)
 	return procs;
 }
 
+/*
+ * Reads up to max pids of the container processes. Returns the number of the
+ * processes, which may be more than max.
+ */
+size_t
+cgroup_pids(struct cgroups *cg, pid_t *pids, size_t max)
+{
+	FILE *fd;
+	char path[MAXPATHLEN + 1];
+	size_t procs = 0;
+	pid_t pid;
+
+	if (!cg)
+		return 0;
+
+	if (cgroup_version(cg) == CGROUP_V2)
+		snprintf(path, MAXPATHLEN, "%s/%s/%s/cgroup.procs", cg->rootdir, cg->group, cg->name);
+	else
+		snprintf(path, MAXPATHLEN, "%s/%s/%s/%s/cgroup.procs", cg->rootdir, cg->group, CGROUP_FREEZER, cg->name);
+
+	if (!(fd = fopen(path, "re"))) {
+		if (errno == ENOENT)
+			return 0;
+		myerror(EXIT_FAILURE, errno, "fopen: %s", path);
+	}
+
+	while (fscanf(fd, "%d\n", &pid) == 1) {
+		if (procs < max)
+			pids[procs] = pid;
+		procs++;
+	}
+
+	fclose(fd);
+
+	return procs;
+}
+
+/*
+ * Returns non-zero while the container has processes.
+ */
+int
+cgroup_populated(struct cgroups *cg)
+{
+	int fd;
+	ssize_t len;
+	char path[MAXPATHLEN + 1], buf[LINESIZ], *p;
+
+	if (!cg)
+		return 0;
+
+	if (cgroup_version(cg) == CGROUP_V1)
+		return cgroup_pids(cg, NULL, 0) > 0;
+
+	snprintf(path, MAXPATHLEN, "%s/%s/%s/cgroup.events", cg->rootdir, cg->group, cg->name);
+
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		myerror(EXIT_FAILURE, errno, "open: %s", path);
+	}
+
+	if ((len = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf) - 1))) < 0)
+		myerror(EXIT_FAILURE, errno, "read: %s", path);
+	buf[len] = '\0';
+
+	close(fd);
+
+	return !(p = strstr(buf, "populated ")) || atoi(p + 10) != 0;
+}
+
+/*
+ * Returns an inotify descriptor that becomes readable when cgroup.events of the
+ * container changes, or -1 for cgroup v1, which has no such file.
+ */
+int
+cgroup_watch(struct cgroups *cg)
+{
+	int fd;
+	char path[MAXPATHLEN + 1];
+
+	if (!cg || cgroup_version(cg) != CGROUP_V2)
+		return -1;
+
+	snprintf(path, MAXPATHLEN, "%s/%s/%s/cgroup.events", cg->rootdir, cg->group, cg->name);
+
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "inotify_init1");
+
+	if (inotify_add_watch(fd, path, IN_MODIFY) < 0) {
+		errmsg("inotify_add_watch: %s", path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Kills every process of the container at once. Returns -1 if the kernel can
+ * not do that, which is the case for cgroup v1 and Linux < 5.14.
+ */
+int
+cgroup_kill(struct cgroups *cg)
+{
+	int fd;
+	char path[MAXPATHLEN + 1];
+
+	if (!cg || cgroup_version(cg) != CGROUP_V2)
+		return -1;
+
+	snprintf(path, MAXPATHLEN, "%s/%s/%s/cgroup.kill", cg->rootdir, cg->group, cg->name);
+
+	if ((fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT)
+			errmsg("open: %s", path);
+		return -1;
+	}
+
+	if (dprintf(fd, "1") <= 0) {
+		errmsg("dprintf(1): %s", path);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Moves the container cgroups to a new name together with their tasks. The
+ * caller is responsible for updating cg->name.
+ */
+int
+cgroup_rename(struct cgroups *cg, const char *name)
+{
+	size_t i = 0;
+	int fd_lock, rc = -1;
+	char path[MAXPATHLEN + 1], newpath[MAXPATHLEN + 1];
+
+	if (!cg)
+		return 0;
+
+	if ((fd_lock = cgroup_lock(cg)) < 0)
+		return -1;
+
+	if (cgroup_version(cg) == CGROUP_V2) {
+		snprintf(path, MAXPATHLEN, "%s/%s/%s", cg->rootdir, cg->group, cg->name);
+		snprintf(newpath, MAXPATHLEN, "%s/%s/%s", cg->rootdir, cg->group, name);
+
+		// A leftover of a previous container.
+		if (rmdir(newpath) < 0 && errno != ENOENT)
+			errmsg("rmdir: %s", newpath);
+		else if (rename(path, newpath) < 0)
+			errmsg("rename: %s", path);
+		else
+			rc = 0;
+
+		close(fd_lock);
+		return rc;
+	}
+
+	while (cg->controller && cg->controller[i]) {
+		char *dirname = cg->dirname[i];
+
+		if (!dirname)
+			dirname = cg->controller[i];
+
+		snprintf(path, MAXPATHLEN, "%s/%s/%s/%s", cg->rootdir, cg->group, dirname, cg->name);
+		snprintf(newpath, MAXPATHLEN, "%s/%s/%s/%s", cg->rootdir, cg->group, dirname, name);
+
+		// A leftover of a previous container.
+		if (rmdir(newpath) < 0 && errno != ENOENT) {
+			errmsg("rmdir: %s", newpath);
+			goto out;
+		}
+
+		if (rename(path, newpath) < 0) {
+			errmsg("rename: %s", path);
+			goto out;
+		}
+
+		i++;
+	}
+
+	rc = 0;
+out:
+	// Do not leave the container split between two names.
+	while (rc < 0 && i-- > 0) {
+		char *dirname = cg->dirname[i] ? cg->dirname[i] : cg->controller[i];
+
+		snprintf(path, MAXPATHLEN, "%s/%s/%s/%s", cg->rootdir, cg->group, dirname, cg->name);
+		snprintf(newpath, MAXPATHLEN, "%s/%s/%s/%s", cg->rootdir, cg->group, dirname, name);
+
+		if (rename(newpath, path) < 0)
+			errmsg("rename: %s", newpath);
+	}
+
+	close(fd_lock);
+	return rc;
+}
+
+/*
+ * Returns the path of a control file of the container. In the v1 hierarchies
+ * the controller must be one of the mounted ones, v2 ignores it.
+ */
+static int
+cgroup_file(struct cgroups *cg, const char *controller, const char *file, char *path, size_t size)
+{
+	size_t i = 0;
+
+	if (cgroup_version(cg) == CGROUP_V2) {
+		snprintf(path, size, "%s/%s/%s/%s", cg->rootdir, cg->group, cg->name, file);
+		return 0;
+	}
+
+	while (controller && cg->controller && cg->controller[i]) {
+		if (!strcmp(cg->controller[i], controller)) {
+			snprintf(path, size, "%s/%s/%s/%s/%s", cg->rootdir, cg->group,
+			         (cg->dirname[i] ? cg->dirname[i] : controller), cg->name, file);
+			return 0;
+		}
+		i++;
+	}
+
+	return -1;
+}
+
+int
+cgroup_write(struct cgroups *cg, const char *controller, const char *file, const char *value)
+{
+	int fd;
+	size_t len = strlen(value);
+	char path[MAXPATHLEN + 1];
+
+	if (!cg)
+		return -1;
+
+	if (cgroup_file(cg, controller, file, path, sizeof(path)) < 0) {
+		info("%s: controller is not enabled", controller);
+		return -1;
+	}
+
+	if ((fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		if (errno == ENOENT)
+			info("%s: no such file, is the %s controller enabled and the container running?",
+			     path, controller);
+		else
+			errmsg("open: %s", path);
+		return -1;
+	}
+
+	if (TEMP_FAILURE_RETRY(write(fd, value, len)) != (ssize_t) len) {
+		errmsg("write(%s): %s", value, path);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Opens a control file of the container for reading. Returns -1 without a
+ * message if there is no such file, because the controller is not enabled or
+ * the container is not running.
+ */
+int
+cgroup_open(struct cgroups *cg, const char *controller, const char *file)
+{
+	int fd;
+	char path[MAXPATHLEN + 1];
+
+	if (!cg || cgroup_file(cg, controller, file, path, sizeof(path)) < 0)
+		return -1;
+
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0 && errno != ENOENT)
+		errmsg("open: %s", path);
+
+	return fd;
+}
+
+/*
+ * Returns the names of the other containers of the group that have a cgroup of
+ * the controller, or NULL if there are none.
+ */
+char **
+cgroup_siblings(struct cgroups *cg, const char *controller)
+{
+	DIR *dir;
+	struct dirent *ent;
+	char path[MAXPATHLEN + 1];
+	char **names = NULL;
+	size_t i = 0, nr = 0;
+
+	if (!cg)
+		return NULL;
+
+	if (cgroup_version(cg) == CGROUP_V2) {
+		snprintf(path, MAXPATHLEN, "%s/%s", cg->rootdir, cg->group);
+	} else {
+		while (cg->controller && cg->controller[i] && strcmp(cg->controller[i], controller))
+			i++;
+
+		if (!cg->controller || !cg->controller[i])
+			return NULL;
+
+		snprintf(path, MAXPATHLEN, "%s/%s/%s", cg->rootdir, cg->group,
+		         (cg->dirname[i] ? cg->dirname[i] : controller));
+	}
+
+	if (!(dir = opendir(path)))
+		return NULL;
+
+	while ((ent = readdir(dir))) {
+		if (ent->d_type != DT_DIR || ent->d_name[0] == '.' || !strcmp(ent->d_name, cg->name))
+			continue;
+
+		names = xrealloc(names, nr + 2, sizeof(char *));
+		names[nr++] = xstrdup(ent->d_name);
+		names[nr] = NULL;
+	}
+
+	closedir(dir);
+	return names;
+}
+
+/*
+ * Registers a PSI trigger on the pressure file of the container. The returned
+ * descriptor reports POLLPRI every time the trigger fires, at most once per
+ * window. The v1 hierarchies have no pressure files.
+ */
+int
+cgroup_pressure_trigger(struct cgroups *cg, const char *file, const struct pressure_trigger *trigger)
+{
+	int fd, len;
+	char path[MAXPATHLEN + 1], buf[LINESIZ];
+
+	if (!cg || cgroup_version(cg) != CGROUP_V2 || cgroup_file(cg, NULL, file, path, sizeof(path)) < 0)
+		return -1;
+
+	if ((fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", path);
+		return -1;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%s %d %d", (trigger->full ? "full" : "some"),
+	               trigger->threshold * 1000, trigger->window * 1000);
+
+	// The kernel wants the terminating zero as well.
+	if (write(fd, buf, (size_t) len + 1) < 0) {
+		errmsg("write(%s): %s", buf, path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Returns a descriptor that becomes readable on the OOM events of the container.
+ * The file with the oom_kill counter is opened to fd_stat, which is
+ * memory.events in v2 and memory.oom_control in v1.
+ */
+int
+cgroup_oom_watch(struct cgroups *cg, int *fd_stat)
+{
+	int fd = -1, fd_control = -1;
+	char path[MAXPATHLEN + 1];
+	const char *file = (cgroup_version(cg) == CGROUP_V2) ? "memory.events" : "memory.oom_control";
+
+	*fd_stat = -1;
+
+	if (cgroup_file(cg, "memory", file, path, sizeof(path)) < 0) {
+		info("memory: controller is not enabled");
+		return -1;
+	}
+
+	if ((*fd_stat = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", path);
+		return -1;
+	}
+
+	if (cg->version == CGROUP_V2) {
+		if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+			myerror(EXIT_FAILURE, errno, "inotify_init1");
+
+		if (inotify_add_watch(fd, path, IN_MODIFY) < 0) {
+			errmsg("inotify_add_watch: %s", path);
+			goto fail;
+		}
+
+		return fd;
+	}
+
+	// The v1 notification is an eventfd registered with cgroup.event_control.
+	if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "eventfd");
+
+	cgroup_file(cg, "memory", "cgroup.event_control", path, sizeof(path));
+
+	if ((fd_control = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", path);
+		goto fail;
+	}
+
+	if (dprintf(fd_control, "%d %d", fd, *fd_stat) <= 0) {
+		errmsg("dprintf: %s", path);
+		goto fail;
+	}
+
+	close(fd_control);
+	return fd;
+fail:
+	if (fd_control >= 0)
+		close(fd_control);
+	close(fd);
+	close(*fd_stat);
+	*fd_stat = -1;
+	return -1;
+}
+
+int __attribute__((__format__(__printf__, 4, 5)))
+cgroup_printf(struct cgroups *cg, const char *controller, const char *file, const char *fmt, ...)
+{
+	int rc;
+	char *value = NULL;
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (vasprintf(&value, fmt, ap) < 0)
+		myerror(EXIT_FAILURE, errno, "vasprintf");
+	va_end(ap);
+
+	rc = cgroup_write(cg, controller, file, value);
+	xfree(value);
+
+	return rc;
+}
+
 void
 cgroup_controller(struct cgroups *cg, const char *controller, const char *dirname)
 {
@@ -292,6 +1198,28 @@ cgroup_controller(struct cgroups *cg, const char *controller, const char *dirnam
 	cg->dirname[i + 1] = NULL;
 }
 
+/*
+ * Adds the controllers of another description. cgroup_destroy() drops the list,
+ * a container created again takes it from a copy.
+ */
+void
+cgroup_copy_controllers(struct cgroups *cg, const struct cgroups *from)
+{
+	for (size_t i = 0; from->controller && from->controller[i]; i++)
+		cgroup_controller(cg, from->controller[i], from->dirname[i]);
+}
+
+void
+cgroup_free_controllers(struct cgroups *cg)
+{
+	for (size_t i = 0; cg->controller && cg->controller[i]; i++) {
+		xfree(cg->controller[i]);
+		xfree(cg->dirname[i]);
+	}
+	cg->controller = xfree(cg->controller);
+	cg->dirname = xfree(cg->dirname);
+}
+
 void
 cgroup_split_controllers(struct cgroups *cg, const char *opts)
 {
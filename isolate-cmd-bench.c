@@ -0,0 +1,509 @@
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <limits.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+extern int verbose;
+extern int background;
+extern char pidfile[MAXPATHLEN];
+
+int bench_runs = 20;
+char *bench_only = NULL;
+
+struct bench_case {
+	const char *name;
+	int value;
+};
+
+static const struct bench_case bench_cases[] = {
+	{ "baseline", 0 },
+	{ "fstab", 16 },
+	{ "fstab", 128 },
+	{ "devices", 16 },
+	{ "devices", 256 },
+	{ "seccomp", 8 },
+	{ "seccomp", 43 },
+	{ "cgroups", 2 },
+	{ "cgroups", 5 },
+	{ "concurrency", 4 },
+	{ "concurrency", 16 },
+};
+
+// Syscalls denied by the synthetic seccomp policy (see example/system/seccomp.x86_64).
+static const char *const bench_syscalls[] = {
+	"bpf", "clock_adjtime", "clock_settime", "clone", "create_module",
+	"delete_module", "finit_module", "get_kernel_syms", "get_mempolicy",
+	"init_module", "ioperm", "iopl", "kcmp", "kexec_file_load", "kexec_load",
+	"keyctl", "lookup_dcookie", "mbind", "mount", "move_pages",
+	"name_to_handle_at", "nfsservctl", "open_by_handle_at", "perf_event_open",
+	"personality", "pivot_root", "process_vm_readv", "process_vm_writev",
+	"ptrace", "query_module", "quotactl", "reboot", "request_key",
+	"set_mempolicy", "setns", "swapon", "swapoff", "sysfs", "umount",
+	"unshare", "uselib", "userfaultfd", "ustat"
+};
+
+// The init runs until it is stopped. It reports the start on the output.
+#define BENCH_READY "bench-ready"
+
+static const char *const bench_init[] = {
+	"/bin/sh", "-c", "trap 'exit 0' TERM; sleep 3600 & echo " BENCH_READY "; wait", NULL
+};
+
+// The freezer controller is always present.
+static const char *const bench_controllers[] = {
+	"memory", "pids", "cpu", "cpuacct", "blkio"
+};
+
+struct bench_sample {
+	int rc;
+	uint64_t start_ns;
+	uint64_t teardown_ns;
+	long maxrss_kb;
+};
+
+struct bench_ctx {
+	char tmpdir[MAXPATHLEN];
+	int unprivileged;
+};
+
+static int
+bench_selected(const char *name)
+{
+	size_t len = strlen(name);
+	const char *s = bench_only;
+
+	if (!s)
+		return 1;
+
+	while ((s = strstr(s, name)) != NULL) {
+		if ((s == bench_only || s[-1] == ',') && (s[len] == ',' || s[len] == '\0'))
+			return 1;
+		s += len;
+	}
+
+	return 0;
+}
+
+static void
+bench_enter_userns(void)
+{
+	uid_t uid = geteuid();
+	gid_t gid = getegid();
+
+	if (unshare(CLONE_NEWUSER) < 0)
+		myerror(EXIT_FAILURE, errno, "unshare(CLONE_NEWUSER)");
+
+	setgroups_control(getpid(), "deny");
+	map_id("uid", "uid_map", getpid(), 0, uid);
+	map_id("gid", "gid_map", getpid(), 0, gid);
+}
+
+static char *
+bench_file(struct bench_ctx *ctx, const char *fmt, int value)
+{
+	char *filename = NULL;
+	char *name = NULL;
+
+	xasprintf(&name, fmt, value);
+	xasprintf(&filename, "%s/%s", ctx->tmpdir, name);
+	xfree(name);
+
+	return filename;
+}
+
+static char *
+bench_devices(struct bench_ctx *ctx, int value)
+{
+	FILE *fd;
+	int i;
+	char *filename = bench_file(ctx, "devices.%d", value);
+
+	if (!(fd = fopen(filename, "w")))
+		myerror(EXIT_FAILURE, errno, "fopen: %s", filename);
+
+	for (i = 0; i < value; i++)
+		fprintf(fd, "nod /tmp/bench-null%d 0666 0 0 c 1 3\n", i);
+
+	if (ferror(fd) | fclose(fd))
+		myerror(EXIT_FAILURE, errno, "unable to write: %s", filename);
+
+	return filename;
+}
+
+static char *
+bench_seccomp(struct bench_ctx *ctx, int value)
+{
+	FILE *fd;
+	int i;
+	char *filename = bench_file(ctx, "seccomp.%d", value);
+
+	if (!(fd = fopen(filename, "w")))
+		myerror(EXIT_FAILURE, errno, "fopen: %s", filename);
+
+	if (value > (int) ARRAY_SIZE(bench_syscalls))
+		value = (int) ARRAY_SIZE(bench_syscalls);
+
+	fprintf(fd, "POLICY bench {\n\tERRNO(1) {\n");
+	for (i = 0; i < value; i++)
+		fprintf(fd, "\t\t%s%s\n", bench_syscalls[i], (i + 1 < value ? "," : ""));
+	fprintf(fd, "\t}\n}\nUSE bench DEFAULT ALLOW\n");
+
+	if (ferror(fd) | fclose(fd))
+		myerror(EXIT_FAILURE, errno, "unable to write: %s", filename);
+
+	return filename;
+}
+
+static void
+bench_add_mount(struct container *data, const char *dir, const char *opts)
+{
+	size_t n = 0;
+
+	while (data->mounts && data->mounts[n])
+		n++;
+
+	data->mounts = xrealloc(data->mounts, n + 2, sizeof(struct mountspec *));
+
+	data->mounts[n] = compile_mount("tmpfs", dir, "tmpfs", opts);
+	data->mounts[n + 1] = NULL;
+}
+
+static void
+bench_cgroups(struct container *data, struct bench_ctx *ctx, int value)
+{
+	size_t i;
+	struct cgroups *cg = data->cgroups;
+
+	cgroup_free_controllers(cg);
+
+	// Without privileges there is no way to mount a cgroup v1 hierarchy.
+	if (ctx->unprivileged) {
+		set_cgroups_dir(data, ctx->tmpdir);
+		return;
+	}
+
+	cgroup_controller(cg, "freezer", CGROUP_FREEZER);
+
+	for (i = 1; i < (size_t) value && i <= ARRAY_SIZE(bench_controllers); i++)
+		cgroup_controller(cg, bench_controllers[i - 1], NULL);
+}
+
+static void
+bench_set_init(struct container *data)
+{
+	size_t i;
+
+	for (i = 0; data->argv && data->argv[i]; i++)
+		xfree(data->argv[i]);
+	xfree(data->argv);
+
+	data->argv = xcalloc(ARRAY_SIZE(bench_init), sizeof(char *));
+
+	for (i = 0; bench_init[i]; i++)
+		data->argv[i] = xstrdup(bench_init[i]);
+}
+
+/*
+ * Stops the container with cmd_stop() as soon as the init reports that it runs.
+ * The output of the container is a fifo read by this process.
+ */
+static pid_t
+bench_stopper(struct container *data, const char *fifo)
+{
+	char line[PIPE_BUF];
+	FILE *fp;
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+		myerror(EXIT_FAILURE, errno, "fork");
+
+	if (pid)
+		return pid;
+
+	if (!(fp = fopen(fifo, "re")))
+		myerror(EXIT_FAILURE, errno, "fopen: %s", fifo);
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strcmp(line, BENCH_READY "\n"))
+			_exit(cmd_stop(data));
+		if (verbose > 1)
+			fputs(line, stderr);
+	}
+
+	_exit(EXIT_FAILURE);
+}
+
+static void __attribute__((noreturn))
+bench_runner(struct container *data, struct bench_ctx *ctx, const struct bench_case *bc, int idx)
+{
+	int i, rc, fd;
+	char *name = NULL;
+	char *filename, *fifo;
+	pid_t stopper, self = getpid();
+	struct rusage usage;
+	struct bench_sample sample = {};
+	const struct timing_phase *start, *stop, *destroy;
+
+	xasprintf(&name, "%s-bench-%d", data->name, idx);
+	set_name(data, name);
+	xfree(name);
+
+	if (snprintf(pidfile, MAXPATHLEN, "%s/%s.pid", ctx->tmpdir, data->name) >= MAXPATHLEN)
+		myerror(EXIT_FAILURE, 0, "path is too long: %s", ctx->tmpdir);
+
+	fifo = bench_file(ctx, "output.%d", idx);
+
+	if (mkfifo(fifo, 0600) < 0 && errno != EEXIST)
+		myerror(EXIT_FAILURE, errno, "mkfifo: %s", fifo);
+
+	bench_set_init(data);
+	set_input(data, (char *) "/dev/null");
+	set_output(data, fifo);
+
+	data->unshare_flags |= CLONE_NEWNS;
+	bench_add_mount(data, "/tmp", "rw,nosuid,nodev");
+
+	bench_cgroups(data, ctx, (!strcmp(bc->name, "cgroups") ? bc->value : 1));
+
+	if (!strcmp(bc->name, "fstab")) {
+		for (i = 0; i < bc->value; i++) {
+			char dir[64];
+			snprintf(dir, sizeof(dir), "/tmp/bench-%d", i);
+			bench_add_mount(data, dir, "rw,x-mount.mkdir=0755");
+		}
+	} else if (!strcmp(bc->name, "devices")) {
+		filename = bench_devices(ctx, bc->value);
+		set_devices_file(data, filename);
+		xfree(filename);
+	} else if (!strcmp(bc->name, "seccomp")) {
+		data->seccomp = xfree(data->seccomp);
+		data->seccomp = bench_seccomp(ctx, bc->value);
+	}
+
+	if (ctx->unprivileged)
+		set_devices_file(data, (char *) "");
+
+	stopper = bench_stopper(data, fifo);
+
+	rc = cmd_start(data);
+
+	// The client processes return here only on failure.
+	if (getpid() != self)
+		exit(rc);
+
+	// The parent loop may have reaped it already.
+	kill(stopper, SIGKILL);
+	waitpid(stopper, NULL, 0);
+
+	unlink(fifo);
+	xfree(fifo);
+
+	sample.rc = rc;
+
+	start = timing_lookup("start");
+	stop = timing_lookup("kill_container");
+	destroy = timing_lookup("cgroup_destroy");
+
+	if (start && start->end_ns)
+		sample.start_ns = start->end_ns - start->start_ns;
+
+	if (stop && destroy && destroy->end_ns)
+		sample.teardown_ns = destroy->end_ns - stop->start_ns;
+
+	if (!getrusage(RUSAGE_SELF, &usage))
+		sample.maxrss_kb = usage.ru_maxrss;
+
+	filename = bench_file(ctx, "sample.%d", idx);
+
+	if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: %s", filename);
+
+	if (write(fd, &sample, sizeof(sample)) != sizeof(sample))
+		myerror(EXIT_FAILURE, errno, "write: %s", filename);
+
+	close(fd);
+	xfree(filename);
+
+	exit(rc);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t
+percentile(uint64_t *values, size_t n, size_t pct)
+{
+	if (!n)
+		return 0;
+	return values[((n - 1) * pct + 50) / 100];
+}
+
+static int
+bench_case_run(struct container *data, struct bench_ctx *ctx, const struct bench_case *bc)
+{
+	int run, i, failed = 0;
+	int concurrency = (!strcmp(bc->name, "concurrency") ? bc->value : 1);
+	size_t n = 0;
+	long maxrss_kb = 0;
+	uint64_t *start, *teardown;
+
+	start = xcalloc((size_t) (bench_runs * concurrency), sizeof(uint64_t));
+	teardown = xcalloc((size_t) (bench_runs * concurrency), sizeof(uint64_t));
+
+	for (run = 0; run < bench_runs; run++) {
+		for (i = 0; i < concurrency; i++) {
+			pid_t pid;
+
+			if ((pid = fork()) < 0)
+				myerror(EXIT_FAILURE, errno, "fork");
+
+			if (!pid)
+				bench_runner(data, ctx, bc, i);
+		}
+
+		for (i = 0; i < concurrency; i++) {
+			if (TEMP_FAILURE_RETRY(wait(NULL)) < 0)
+				myerror(EXIT_FAILURE, errno, "wait");
+		}
+
+		for (i = 0; i < concurrency; i++) {
+			int fd;
+			char *filename;
+			struct bench_sample sample = {};
+
+			filename = bench_file(ctx, "sample.%d", i);
+
+			if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0 ||
+			    read(fd, &sample, sizeof(sample)) != sizeof(sample) ||
+			    sample.rc != EXIT_SUCCESS || !sample.start_ns) {
+				failed++;
+			} else {
+				start[n] = sample.start_ns;
+				teardown[n] = sample.teardown_ns;
+				n++;
+
+				if (sample.maxrss_kb > maxrss_kb)
+					maxrss_kb = sample.maxrss_kb;
+			}
+
+			if (fd >= 0)
+				close(fd);
+
+			unlink(filename);
+			xfree(filename);
+		}
+	}
+
+	qsort(start, n, sizeof(uint64_t), cmp_u64);
+	qsort(teardown, n, sizeof(uint64_t), cmp_u64);
+
+	printf("%-12s %6d %5zu %6d %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+	       " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %8ld\n",
+	       bc->name, bc->value, n, failed,
+	       percentile(start, n, 50) / 1000, percentile(start, n, 99) / 1000, (n ? start[n - 1] / 1000 : 0),
+	       percentile(teardown, n, 50) / 1000, percentile(teardown, n, 99) / 1000, (n ? teardown[n - 1] / 1000 : 0),
+	       maxrss_kb);
+	fflush(stdout);
+
+	xfree(start);
+	xfree(teardown);
+
+	return failed;
+}
+
+int
+cmd_bench(struct container *data)
+{
+	size_t i;
+	int failed = 0;
+	char *path;
+	struct bench_ctx ctx = {};
+
+	if (background) {
+		info("benchmark can not run in the background");
+		return EXIT_FAILURE;
+	}
+
+	if (bench_runs <= 0) {
+		info("bad number of benchmark runs: %d", bench_runs);
+		return EXIT_FAILURE;
+	}
+
+	xasprintf(&path, "%s/tmp", data->root);
+	if (access(path, F_OK) < 0) {
+		errmsg("access: %s", path);
+		xfree(path);
+		return EXIT_FAILURE;
+	}
+	xfree(path);
+
+	snprintf(ctx.tmpdir, sizeof(ctx.tmpdir), "%s/isolate-bench.XXXXXX",
+	         (getenv("TMPDIR") ?: "/tmp"));
+
+	if (!mkdtemp(ctx.tmpdir))
+		myerror(EXIT_FAILURE, errno, "mkdtemp: %s", ctx.tmpdir);
+
+	if (geteuid() != 0) {
+		if (verbose)
+			info("running unprivileged: user namespace, no cgroups and no devices");
+		bench_enter_userns();
+		ctx.unprivileged = 1;
+	}
+
+	printf("%-12s %6s %5s %6s %10s %10s %10s %10s %10s %10s %8s\n",
+	       "case", "value", "runs", "failed",
+	       "start-p50", "start-p99", "start-max",
+	       "stop-p50", "stop-p99", "stop-max", "rss-kb");
+	fflush(stdout);
+
+	for (i = 0; i < ARRAY_SIZE(bench_cases); i++) {
+		if (!bench_selected(bench_cases[i].name))
+			continue;
+		if (ctx.unprivileged && !strcmp(bench_cases[i].name, "devices"))
+			continue;
+		failed += bench_case_run(data, &ctx, &bench_cases[i]);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(bench_cases); i++) {
+		char *filename;
+
+		filename = bench_file(&ctx, "devices.%d", bench_cases[i].value);
+		unlink(filename);
+		xfree(filename);
+
+		filename = bench_file(&ctx, "seccomp.%d", bench_cases[i].value);
+		unlink(filename);
+		xfree(filename);
+	}
+
+	if (ctx.unprivileged) {
+		xasprintf(&path, "%s/%s", ctx.tmpdir, data->cgroups->group);
+		rmdir(path);
+		xfree(path);
+	}
+
+	if (rmdir(ctx.tmpdir) < 0)
+		errmsg("rmdir: %s", ctx.tmpdir);
+
+	return (failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
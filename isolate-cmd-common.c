@@ -38,10 +38,28 @@ free_data(struct container *data)
 
 	if (data->mounts) {
 		for (i = 0; data->mounts[i]; i++)
-			free_mntent(data->mounts[i]);
+			free_mountspec(data->mounts[i]);
 		data->mounts = xfree(data->mounts);
 	}
 
+	if (data->devices) {
+		for (i = 0; data->devices[i]; i++)
+			free_devnode(data->devices[i]);
+		data->devices = xfree(data->devices);
+	}
+
+	if (data->envs) {
+		for (i = 0; data->envs[i]; i++)
+			xfree(data->envs[i]);
+		data->envs = xfree(data->envs);
+	}
+
+	if (data->after) {
+		for (i = 0; data->after[i]; i++)
+			xfree(data->after[i]);
+		data->after = xfree(data->after);
+	}
+
 	if (data->argv) {
 		for (i = 0; data->argv[i]; i++)
 			xfree(data->argv[i]);
@@ -55,6 +73,9 @@ free_data(struct container *data)
 		}
 		data->cgroups->controller = xfree(data->cgroups->controller);
 		data->cgroups->dirname = xfree(data->cgroups->dirname);
+		for (i = 0; data->cgroups->limits && data->cgroups->limits[i]; i++)
+			xfree(data->cgroups->limits[i]);
+		data->cgroups->limits = xfree(data->cgroups->limits);
 		data->cgroups->rootdir = xfree(data->cgroups->rootdir);
 		data->cgroups->group = xfree(data->cgroups->group);
 		data->cgroups = xfree(data->cgroups);
@@ -67,41 +88,53 @@ free_data(struct container *data)
 
 	data->name = xfree(data->name);
 	data->root = xfree(data->root);
+	data->root_image = xfree(data->root_image);
 	data->hostname = xfree(data->hostname);
 	data->devfile = xfree(data->devfile);
 	data->envfile = xfree(data->envfile);
+	data->fstabfile = xfree(data->fstabfile);
+	data->overlay = xfree(data->overlay);
+	data->overlay_dir = xfree(data->overlay_dir);
 	data->seccomp = xfree(data->seccomp);
+	data->statedir = xfree(data->statedir);
 	data->input = xfree(data->input);
 	data->output = xfree(data->output);
+	data->timing_file = xfree(data->timing_file);
+	data->trace_file = xfree(data->trace_file);
+	data->stop_signals = xfree(data->stop_signals);
 }
 
+/*
+ * Stops the container and waits for it. The events are handled in a private
+ * epoll, so it can be called from anywhere. With force the stop signals are
+ * skipped and the processes are killed at once.
+ */
 void
-kill_container(struct container *data)
+kill_container(struct container *data, int force)
 {
-	int signum = SIGPWR;
+	int fd_ep;
+	struct teardown td;
 
-	if (verbose > 1) {
-		info("killing container by signal=%d", signum);
-	} else if (verbose) {
-		info("killing container");
-	}
+	fd_ep = epollin_init();
+
+	teardown_start(&td, data->cgroups, data->stop_signals, fd_ep);
+
+	if (force)
+		teardown_kill(&td);
 
-	while (cgroup_signal(data->cgroups, 0) > 0) {
-		cgroup_freeze(data->cgroups);
-		cgroup_signal(data->cgroups, signum);
-		cgroup_unfreeze(data->cgroups);
-		switch (signum) {
-			case SIGPWR:
-				signum = SIGTERM;
-				if (verbose > 1)
-					info("killing container by signal=%d", signum);
-				break;
-			case SIGTERM:
-				signum = SIGKILL;
-				if (verbose > 1)
-					info("killing container by signal=%d", signum);
-				break;
+	while (td.state != TEARDOWN_DONE) {
+		struct epoll_event ev[8];
+		int i, fdcount;
+
+		if ((fdcount = epoll_wait(fd_ep, ev, ARRAY_SIZE(ev), -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			myerror(EXIT_FAILURE, errno, "epoll_wait");
 		}
-		usleep(500);
+
+		for (i = 0; i < fdcount && td.state != TEARDOWN_DONE; i++)
+			teardown_event(&td, ev[i].data.fd);
 	}
+
+	close(fd_ep);
 }
@@ -0,0 +1,1335 @@
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/param.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <syslog.h>
+
+#include "isolate.h"
+
+extern int verbose;
+extern int background;
+extern int use_syslog;
+extern char *configfile;
+extern char *control_socket;
+
+extern const char *program_subname;
+
+int start_jobs = 4;
+int start_rate = 10;
+int start_burst = 4;
+int stop_timeout = 5000;
+
+struct client {
+	int fd;
+	int eof;
+	char *config;
+	size_t pending;
+	size_t len;
+	char buf[4096];
+};
+
+struct managed {
+	struct container data;
+	struct instance in;
+	struct client *waiter;
+	struct client *stop_waiter;
+	int queued;
+	uint64_t restart_at;
+	struct restarts restarts;
+	uint64_t stop_deadline;
+	uint64_t config_hash;
+	char *cgname;
+};
+
+/*
+ * A warm pool keeps sandboxes of a section prepared up to the exec, so that a
+ * start only has to let one of them go.
+ */
+struct pool {
+	char *name;
+	int size;
+	int failures;
+	size_t nr_hits;
+	size_t nr_misses;
+};
+
+#define POOL_MAX_FAILURES 3
+
+struct supervisor {
+	int fd_ep;
+	int fd_signal;
+	int fd_listen;
+	int fd_timer;
+	int quit;
+	int tokens;
+	uint64_t refill_ns;
+	char *configfile;
+	struct container *defaults;
+	struct reaper reaper;
+	struct client **clients;
+	size_t nr_clients;
+	struct managed **containers;
+	size_t nr_containers;
+	struct managed **members;
+	size_t nr_members;
+	struct pool **pools;
+	size_t nr_pools;
+	unsigned long pool_seq;
+};
+
+static void
+reply(struct client *cl, int rc, const char *name, const char *msg)
+{
+	char *buf = NULL;
+	int len;
+
+	if (!cl || cl->fd < 0)
+		return;
+
+	len = xasprintf(&buf, "%d %s %s\n", rc, name, msg);
+
+	if (control_send(cl->fd, buf, (size_t) len) < 0) {
+		close(cl->fd);
+		cl->fd = -1;
+	}
+
+	xfree(buf);
+}
+
+static struct managed *
+find_container(struct supervisor *sv, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sv->nr_containers; i++) {
+		if (!strcmp(sv->containers[i]->data.name, name))
+			return sv->containers[i];
+	}
+	return NULL;
+}
+
+static void
+unlink_managed(struct managed **list, size_t *nr, struct managed *m)
+{
+	size_t i;
+
+	// Keep the order of the queue.
+	for (i = 0; i < *nr; i++) {
+		if (list[i] != m)
+			continue;
+		(*nr)--;
+		memmove(list + i, list + i + 1, (*nr - i) * sizeof(m));
+		break;
+	}
+}
+
+static void
+free_managed(struct managed *m)
+{
+	free_data(&m->data);
+	xfree(m->cgname);
+	xfree(m);
+}
+
+static void
+remove_container(struct supervisor *sv, struct managed *m)
+{
+	unlink_managed(sv->containers, &sv->nr_containers, m);
+	free_managed(m);
+}
+
+static void
+release(struct client **waiter, const char *name, int rc, const char *msg)
+{
+	if (!*waiter)
+		return;
+
+	reply(*waiter, rc, name, msg);
+
+	(*waiter)->pending--;
+	*waiter = NULL;
+}
+
+static void
+release_waiter(struct managed *m, int rc, const char *msg)
+{
+	release(&m->waiter, m->data.name, rc, msg);
+}
+
+/*
+ * The configuration is parsed in a separate process so that a broken section
+ * cannot take the supervisor down. The result is passed back as a profile.
+ */
+static int
+load_container(struct supervisor *sv, const char *filename, char *name, struct container *data, uint64_t *hash)
+{
+	int fds[2], status, rc = -1;
+	char *buf = NULL;
+	size_t len = 0, size = 0;
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		errmsg("pipe2");
+		return -1;
+	}
+
+	if ((pid = fork()) < 0) {
+		errmsg("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (!pid) {
+		program_subname = "config";
+		close(fds[0]);
+
+		load_config(filename, name, sv->defaults);
+		profile_encode(filename, sv->defaults, &buf, &len);
+
+		while (len > 0) {
+			if ((n = TEMP_FAILURE_RETRY(write(fds[1], buf, len))) < 0)
+				myerror(EXIT_FAILURE, errno, "write");
+			buf += n;
+			len -= (size_t) n;
+		}
+
+		exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+
+	while (1) {
+		if (len == size) {
+			size += 4096;
+			buf = xrealloc(buf, size, 1);
+		}
+
+		if ((n = TEMP_FAILURE_RETRY(read(fds[0], buf + len, size - len))) <= 0)
+			break;
+
+		len += (size_t) n;
+	}
+
+	if (n < 0)
+		errmsg("read");
+
+	close(fds[0]);
+
+	if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) < 0) {
+		errmsg("waitpid");
+		goto out;
+	}
+
+	if (n < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		goto out;
+
+	rc = profile_decode(buf, len, data);
+
+	if (hash)
+		*hash = fnv1a(FNV1A_INIT, buf, len);
+out:
+	xfree(buf);
+	return rc;
+}
+
+static struct pool *
+find_pool(struct supervisor *sv, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sv->nr_pools; i++) {
+		if (!strcmp(sv->pools[i]->name, name))
+			return sv->pools[i];
+	}
+	return NULL;
+}
+
+static void
+pool_add(struct supervisor *sv, const char *name, int size)
+{
+	struct pool *pool;
+
+	if ((pool = find_pool(sv, name))) {
+		pool->size = size;
+		return;
+	}
+
+	pool = xcalloc(1, sizeof(*pool));
+	pool->name = xstrdup(name);
+	pool->size = size;
+
+	sv->pools = xrealloc(sv->pools, sv->nr_pools + 1, sizeof(pool));
+	sv->pools[sv->nr_pools++] = pool;
+}
+
+static void
+remove_member(struct supervisor *sv, struct managed *m)
+{
+	unlink_managed(sv->members, &sv->nr_members, m);
+	free_managed(m);
+}
+
+/*
+ * Prepares one more sandbox of the pool. The init is held just before the
+ * exec until a start request claims it.
+ */
+static void
+pool_spawn(struct supervisor *sv, struct pool *pool)
+{
+	struct managed *m = xcalloc(1, sizeof(*m));
+
+	m->in.sock = m->in.fd_timer = -1;
+
+	if (load_container(sv, sv->configfile, pool->name, &m->data, &m->config_hash) < 0) {
+		pool->failures++;
+		free_managed(m);
+		return;
+	}
+
+	if (m->data.warm_pool <= 0 || !m->data.root || access(m->data.root, R_OK | X_OK) < 0 ||
+	    (m->data.root_image && access(m->data.root_image, R_OK) < 0)) {
+		// The section no longer asks for a pool or can not start.
+		pool->size = 0;
+		free_managed(m);
+		return;
+	}
+
+	if (m->data.overlay && m->data.overlay_keep) {
+		// A kept layer carries the state of the container from one run to
+		// the next, a sandbox prepared in advance would start without it.
+		info("%s: warm pool is not used with overlay-keep", pool->name);
+		pool->size = 0;
+		free_managed(m);
+		return;
+	}
+
+	pool->size = m->data.warm_pool;
+
+	xasprintf(&m->cgname, "%s.pool-%lu", pool->name, ++sv->pool_seq);
+	m->data.cgroups->name = m->cgname;
+
+	sv->members = xrealloc(sv->members, sv->nr_members + 1, sizeof(m));
+	sv->members[sv->nr_members++] = m;
+
+	if (verbose > 1)
+		info("%s: preparing sandbox %s", pool->name, m->cgname);
+
+	m->in.hold = 1;
+
+	if (instance_spawn(&m->in, &m->data, &sv->reaper, sv->fd_ep) < 0) {
+		instance_stop(&m->in, sv->fd_ep);
+		pool->failures++;
+		remove_member(sv, m);
+	}
+}
+
+/*
+ * Tops up the pools in the background. The real start requests go first and
+ * every pool prepares only one sandbox at a time.
+ */
+static void
+pool_refill(struct supervisor *sv)
+{
+	size_t i, j;
+
+	if (sv->quit)
+		return;
+
+	for (i = 0; i < sv->nr_containers; i++) {
+		if (sv->containers[i]->queued)
+			return;
+	}
+
+	for (i = 0; i < sv->nr_pools; i++) {
+		struct pool *pool = sv->pools[i];
+		int nr_live = 0, preparing = 0;
+
+		if (pool->failures >= POOL_MAX_FAILURES)
+			continue;
+
+		for (j = 0; j < sv->nr_members; j++) {
+			struct managed *m = sv->members[j];
+
+			if (strcmp(m->data.name, pool->name) || m->in.done)
+				continue;
+
+			nr_live++;
+
+			if (!m->in.ready)
+				preparing = 1;
+		}
+
+		if (!preparing && nr_live < pool->size)
+			pool_spawn(sv, pool);
+
+		if (pool->failures >= POOL_MAX_FAILURES)
+			info("%s: unable to prepare sandboxes, warm pool disabled", pool->name);
+	}
+}
+
+static void
+update_members(struct supervisor *sv)
+{
+	size_t i = 0;
+
+	while (i < sv->nr_members) {
+		struct managed *m = sv->members[i];
+		struct pool *pool;
+
+		instance_update(&m->in, sv->fd_ep);
+
+		if (!m->in.done) {
+			if (m->in.ready && (pool = find_pool(sv, m->data.name)))
+				pool->failures = 0;
+			i++;
+			continue;
+		}
+
+		if (!m->in.ready && (pool = find_pool(sv, m->data.name)))
+			pool->failures++;
+
+		instance_stop(&m->in, sv->fd_ep);
+		remove_member(sv, m);
+	}
+}
+
+/*
+ * Hands a prepared sandbox over to the queued container. The sandbox must have
+ * been built from the same configuration.
+ */
+static int
+pool_claim(struct supervisor *sv, struct managed *m)
+{
+	size_t i;
+	struct pool *pool;
+	struct managed *p = NULL;
+
+	if (!(pool = find_pool(sv, m->data.name)))
+		return -1;
+
+	i = 0;
+	while (i < sv->nr_members) {
+		struct managed *c = sv->members[i];
+
+		if (strcmp(c->data.name, m->data.name) || c->in.done) {
+			i++;
+			continue;
+		}
+
+		if (c->config_hash != m->config_hash) {
+			// Built from an outdated configuration.
+			instance_stop(&c->in, sv->fd_ep);
+			remove_member(sv, c);
+			continue;
+		}
+
+		if (!p || (c->in.ready && !p->in.ready))
+			p = c;
+		i++;
+	}
+
+	if (!p) {
+		pool->nr_misses++;
+		return -1;
+	}
+
+	pool->nr_hits++;
+
+	unlink_managed(sv->members, &sv->nr_members, p);
+
+	free_data(&m->data);
+
+	m->data    = p->data;
+	m->in      = p->in;
+	m->in.data = &m->data;
+	m->cgname  = p->cgname;
+
+	xfree(p);
+
+	if (!cgroup_rename(m->data.cgroups, m->data.name)) {
+		m->data.cgroups->name = m->data.name;
+		m->cgname = xfree(m->cgname);
+	}
+
+	if (verbose)
+		info("%s: using a prepared sandbox", m->data.name);
+
+	instance_release(&m->in);
+
+	return 0;
+}
+
+static void
+do_pool(struct supervisor *sv, struct client *cl)
+{
+	size_t i, j;
+	char *msg = NULL;
+
+	for (i = 0; i < sv->nr_pools; i++) {
+		struct pool *pool = sv->pools[i];
+		size_t nr_ready = 0;
+
+		for (j = 0; j < sv->nr_members; j++) {
+			if (!strcmp(sv->members[j]->data.name, pool->name) && sv->members[j]->in.ready)
+				nr_ready++;
+		}
+
+		xasprintf(&msg, "size=%d ready=%zu hits=%zu misses=%zu%s",
+		          pool->size, nr_ready, pool->nr_hits, pool->nr_misses,
+		          pool->failures >= POOL_MAX_FAILURES ? " disabled" : "");
+
+		reply(cl, EXIT_SUCCESS, pool->name, msg);
+		msg = xfree(msg);
+	}
+}
+
+/*
+ * Finds the sections that ask for a warm pool.
+ */
+static void
+pool_init(struct supervisor *sv)
+{
+	size_t i;
+	char **names;
+
+	if (access(sv->configfile, R_OK) < 0 || !(names = read_config_sections(sv->configfile)))
+		return;
+
+	for (i = 0; names[i]; i++) {
+		struct container data = {};
+
+		if (!load_container(sv, sv->configfile, names[i], &data, NULL) && data.warm_pool > 0)
+			pool_add(sv, names[i], data.warm_pool);
+
+		free_data(&data);
+		xfree(names[i]);
+	}
+	xfree(names);
+}
+
+static void
+pool_free(struct supervisor *sv)
+{
+	size_t i;
+
+	while (sv->nr_members > 0) {
+		struct managed *m = sv->members[0];
+
+		instance_stop(&m->in, sv->fd_ep);
+		remove_member(sv, m);
+	}
+
+	for (i = 0; i < sv->nr_pools; i++) {
+		xfree(sv->pools[i]->name);
+		xfree(sv->pools[i]);
+	}
+
+	sv->pools = xfree(sv->pools);
+	sv->members = xfree(sv->members);
+	sv->nr_pools = 0;
+}
+
+/*
+ * The config of the client if it has passed one.
+ */
+static const char *
+client_config(struct supervisor *sv, struct client *cl)
+{
+	return (cl && cl->config) ? cl->config : sv->configfile;
+}
+
+/*
+ * Queues the container. It is spawned by schedule() once its dependencies
+ * have started and the rate limit allows it.
+ */
+static void
+do_start(struct supervisor *sv, struct client *cl, char *name, int quiet)
+{
+	const char *filename = client_config(sv, cl);
+	struct managed *m;
+
+	if (sv->quit) {
+		reply(cl, EXIT_FAILURE, name, "supervisor is shutting down");
+		return;
+	}
+
+	if (find_container(sv, name)) {
+		if (!quiet)
+			reply(cl, EXIT_FAILURE, name, "container is already running");
+		return;
+	}
+
+	m = xcalloc(1, sizeof(*m));
+	m->in.sock = m->in.fd_timer = -1;
+
+	if (load_container(sv, filename, name, &m->data, &m->config_hash) < 0) {
+		reply(cl, EXIT_FAILURE, name, "unable to load config");
+		goto fail;
+	}
+
+	if (!m->data.root || access(m->data.root, R_OK | X_OK) < 0) {
+		if (m->data.root)
+			errmsg("access: %s", m->data.root);
+		reply(cl, EXIT_FAILURE, name, "root directory is not accessible");
+		goto fail;
+	}
+
+	if (m->data.root_image && access(m->data.root_image, R_OK) < 0) {
+		errmsg("access: %s", m->data.root_image);
+		reply(cl, EXIT_FAILURE, name, "root image is not accessible");
+		goto fail;
+	}
+
+	// The pool is refilled from the config of the supervisor.
+	if (m->data.warm_pool > 0 && filename == sv->configfile)
+		pool_add(sv, name, m->data.warm_pool);
+
+	sv->containers = xrealloc(sv->containers, sv->nr_containers + 1, sizeof(m));
+	sv->containers[sv->nr_containers++] = m;
+
+	// The reply is deferred until the container has executed its init.
+	m->queued = 1;
+	m->waiter = cl;
+	cl->pending++;
+	return;
+fail:
+	free_data(&m->data);
+	xfree(m);
+}
+
+static void
+do_start_all(struct supervisor *sv, struct client *cl)
+{
+	const char *filename = client_config(sv, cl);
+	size_t i;
+	char **names;
+
+	if (access(filename, R_OK) < 0) {
+		errmsg("access: %s", filename);
+		reply(cl, EXIT_FAILURE, "-", "unable to read config");
+		return;
+	}
+
+	if (!(names = read_config_sections(filename)))
+		return;
+
+	for (i = 0; names[i]; i++) {
+		do_start(sv, cl, names[i], 1);
+		xfree(names[i]);
+	}
+	xfree(names);
+}
+
+/*
+ * Sends the stop signals of the container. Whatever is left of it at the
+ * deadline is killed by update_containers().
+ */
+static void
+begin_stop(struct supervisor *sv, struct managed *m, struct client *cl, uint64_t deadline)
+{
+	if (m->queued) {
+		release_waiter(m, EXIT_FAILURE, "container was stopped");
+		reply(cl, EXIT_SUCCESS, m->data.name, "container stopped");
+		remove_container(sv, m);
+		return;
+	}
+
+	if (m->stop_deadline) {
+		reply(cl, EXIT_SUCCESS, m->data.name, "container is already stopping");
+		return;
+	}
+
+	if (verbose)
+		info("%s: stopping container", m->data.name);
+
+	m->stop_deadline = deadline;
+	m->in.done = 1;
+
+	instance_teardown(&m->in, sv->fd_ep);
+
+	if (cl) {
+		m->stop_waiter = cl;
+		cl->pending++;
+	}
+}
+
+static void
+do_stop(struct supervisor *sv, struct client *cl, char *name)
+{
+	struct managed *m;
+
+	if (!(m = find_container(sv, name))) {
+		reply(cl, CONTROL_UNMANAGED, name, "container is not managed by the supervisor");
+		return;
+	}
+
+	begin_stop(sv, m, cl, timing_now() + (uint64_t) stop_timeout * 1000000);
+}
+
+/*
+ * All containers share the same deadline, so the shutdown takes no longer than
+ * the slowest of them.
+ */
+static void
+do_stop_all(struct supervisor *sv, struct client *cl)
+{
+	uint64_t deadline = timing_now() + (uint64_t) stop_timeout * 1000000;
+	size_t i = 0;
+
+	while (i < sv->nr_containers) {
+		struct managed *m = sv->containers[i];
+
+		if (!m->queued)
+			i++;
+
+		begin_stop(sv, m, cl, deadline);
+	}
+}
+
+static const char *
+state_name(struct managed *m)
+{
+	if (m->stop_deadline)
+		return "stopping";
+	if (m->queued)
+		return "queued";
+	if (!m->in.running)
+		return "starting";
+	return "running";
+}
+
+static void
+do_status(struct supervisor *sv, struct client *cl, char *name)
+{
+	struct managed *m;
+
+	char *msg = NULL;
+
+	if (!(m = find_container(sv, name))) {
+		reply(cl, CONTROL_UNMANAGED, name, "container is not managed by the supervisor");
+		return;
+	}
+
+	xasprintf(&msg, "container is %s", state_name(m));
+	reply(cl, EXIT_SUCCESS, name, msg);
+	xfree(msg);
+}
+
+static void
+do_list(struct supervisor *sv, struct client *cl)
+{
+	size_t i;
+
+	for (i = 0; i < sv->nr_containers; i++) {
+		struct managed *m = sv->containers[i];
+		reply(cl, EXIT_SUCCESS, m->data.name, state_name(m));
+	}
+}
+
+static void
+handle_request(struct supervisor *sv, struct client *cl, char *line)
+{
+	char *verb, *name, *saveptr = NULL;
+
+	// The path may contain spaces, it takes the rest of the line.
+	if (!strncmp(line, "config ", 7)) {
+		xfree(cl->config);
+		cl->config = xstrdup(line + 7);
+		return;
+	}
+
+	if (!(verb = strtok_r(line, " \t", &saveptr)))
+		return;
+
+	name = strtok_r(NULL, " \t", &saveptr);
+
+	if (verbose > 1)
+		info("request: %s %s", verb, name ? name : "");
+
+	if (!strcmp(verb, "list")) {
+		do_list(sv, cl);
+		return;
+	}
+
+	if (!strcmp(verb, "start-all")) {
+		do_start_all(sv, cl);
+		return;
+	}
+
+	if (!strcmp(verb, "stop-all")) {
+		do_stop_all(sv, cl);
+		return;
+	}
+
+	if (!strcmp(verb, "pool")) {
+		do_pool(sv, cl);
+		return;
+	}
+
+	if (!name) {
+		reply(cl, EXIT_FAILURE, "-", "container name required");
+		return;
+	}
+
+	if (!strcmp(verb, "start"))
+		do_start(sv, cl, name, 0);
+	else if (!strcmp(verb, "stop"))
+		do_stop(sv, cl, name);
+	else if (!strcmp(verb, "status"))
+		do_status(sv, cl, name);
+	else
+		reply(cl, EXIT_FAILURE, name, "unknown command");
+}
+
+static void
+client_accept(struct supervisor *sv)
+{
+	int fd;
+	struct client *cl;
+
+	if ((fd = accept4(sv->fd_listen, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			errmsg("accept4");
+		return;
+	}
+
+	cl = xcalloc(1, sizeof(*cl));
+	cl->fd = fd;
+
+	sv->clients = xrealloc(sv->clients, sv->nr_clients + 1, sizeof(cl));
+	sv->clients[sv->nr_clients++] = cl;
+
+	epollin_add(sv->fd_ep, fd);
+}
+
+/*
+ * The client has sent all its requests. Stop polling the descriptor but keep
+ * it open for the pending replies.
+ */
+static void
+client_eof(struct supervisor *sv, struct client *cl)
+{
+	if (cl->eof || cl->fd < 0)
+		return;
+
+	if (epoll_ctl(sv->fd_ep, EPOLL_CTL_DEL, cl->fd, NULL) < 0)
+		myerror(EXIT_FAILURE, errno, "epoll_ctl");
+
+	cl->eof = 1;
+}
+
+static void
+client_read(struct supervisor *sv, struct client *cl)
+{
+	ssize_t n;
+	char *p, *line;
+
+	n = TEMP_FAILURE_RETRY(read(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - cl->len - 1));
+
+	if (n <= 0) {
+		client_eof(sv, cl);
+		return;
+	}
+
+	cl->len += (size_t) n;
+	cl->buf[cl->len] = '\0';
+
+	line = cl->buf;
+
+	while ((p = strchr(line, '\n'))) {
+		*p = '\0';
+		handle_request(sv, cl, line);
+		line = p + 1;
+	}
+
+	cl->len -= (size_t) (line - cl->buf);
+	memmove(cl->buf, line, cl->len);
+
+	if (cl->len == sizeof(cl->buf) - 1) {
+		info("control: request is too long");
+		client_eof(sv, cl);
+	}
+}
+
+static void
+client_close(struct supervisor *sv, struct client *cl)
+{
+	size_t i;
+
+	for (i = 0; i < sv->nr_containers; i++) {
+		if (sv->containers[i]->waiter == cl)
+			sv->containers[i]->waiter = NULL;
+		if (sv->containers[i]->stop_waiter == cl)
+			sv->containers[i]->stop_waiter = NULL;
+	}
+
+	for (i = 0; i < sv->nr_clients; i++) {
+		if (sv->clients[i] != cl)
+			continue;
+		sv->clients[i] = sv->clients[--sv->nr_clients];
+		break;
+	}
+
+	if (cl->fd >= 0) {
+		if (cl->eof)
+			close(cl->fd);
+		else
+			epollin_remove(sv->fd_ep, cl->fd);
+	}
+
+	xfree(cl->config);
+	xfree(cl);
+}
+
+static int
+handle_event(struct supervisor *sv, int fd)
+{
+	size_t i;
+
+	if (fd == sv->fd_listen) {
+		client_accept(sv);
+		return 1;
+	}
+
+	if (fd == sv->fd_timer) {
+		timerfd_ack(fd);
+		return 1;
+	}
+
+	for (i = 0; i < sv->nr_clients; i++) {
+		if (sv->clients[i]->fd == fd) {
+			client_read(sv, sv->clients[i]);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < sv->nr_containers; i++) {
+		if (instance_event(&sv->containers[i]->in, sv->fd_ep, fd))
+			return 1;
+	}
+
+	for (i = 0; i < sv->nr_members; i++) {
+		if (instance_event(&sv->members[i]->in, sv->fd_ep, fd))
+			return 1;
+	}
+
+	// Other descriptors are pidfds. They only wake us up.
+	return 0;
+}
+
+static void
+update_containers(struct supervisor *sv)
+{
+	size_t i = 0;
+	uint64_t now = timing_now();
+
+	while (i < sv->nr_containers) {
+		struct managed *m = sv->containers[i];
+		char *msg = NULL;
+
+		if (m->queued) {
+			i++;
+			continue;
+		}
+
+		instance_update(&m->in, sv->fd_ep);
+
+		if (m->in.running)
+			release_waiter(m, EXIT_SUCCESS, "container started");
+
+		if (m->stop_deadline && now >= m->stop_deadline && teardown_kill(&m->in.td)) {
+			if (verbose)
+				info("%s: container did not stop in time", m->data.name);
+		}
+
+		// The processes get their grace time without blocking the others.
+		if (!m->in.done || instance_teardown(&m->in, sv->fd_ep)) {
+			i++;
+			continue;
+		}
+
+		// The monitor asked for a fresh container, it waits for its turn.
+		if (m->in.restart && !m->stop_deadline && !sv->quit && restart_allowed(&m->restarts, m->data.name)) {
+			instance_restart(&m->in, sv->fd_ep);
+			m->restart_at = now + (uint64_t) RESTART_DELAY * 1000000;
+			m->queued = 1;
+			i++;
+			continue;
+		}
+
+		instance_stop(&m->in, sv->fd_ep);
+
+		if (m->stop_deadline) {
+			release(&m->stop_waiter, m->data.name, EXIT_SUCCESS, "container stopped");
+			release_waiter(m, EXIT_FAILURE, "container was stopped");
+		} else {
+			xasprintf(&msg, "container exited (rc=%d)", m->in.rc);
+
+			if (verbose || !m->waiter)
+				info("%s: %s", m->data.name, msg);
+
+			release_waiter(m, EXIT_FAILURE, msg);
+			xfree(msg);
+		}
+
+		remove_container(sv, m);
+	}
+}
+
+/*
+ * Returns non-zero if every container listed in the `after' option has either
+ * started or is not going to be started at all.
+ */
+static int
+dependencies_ready(struct supervisor *sv, struct managed *m)
+{
+	size_t i;
+	struct managed *dep;
+
+	for (i = 0; m->data.after && m->data.after[i]; i++) {
+		if ((dep = find_container(sv, m->data.after[i])) && (dep->queued || !dep->in.running))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+refill_tokens(struct supervisor *sv, uint64_t now)
+{
+	uint64_t interval;
+
+	if (start_rate <= 0)
+		return;
+
+	interval = 1000000000 / (uint64_t) start_rate;
+
+	while (sv->tokens < start_burst && now >= sv->refill_ns + interval) {
+		sv->tokens++;
+		sv->refill_ns += interval;
+	}
+
+	if (sv->tokens >= start_burst)
+		sv->refill_ns = now;
+}
+
+static int
+spawn_container(struct supervisor *sv, struct managed *m)
+{
+	m->queued = 0;
+
+	if (!pool_claim(sv, m))
+		return 0;
+
+	if (verbose)
+		info("%s: starting container", m->data.name);
+
+	if (instance_spawn(&m->in, &m->data, &sv->reaper, sv->fd_ep) < 0) {
+		instance_stop(&m->in, sv->fd_ep);
+		release_waiter(m, EXIT_FAILURE, "unable to spawn container");
+		remove_container(sv, m);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Spawns the queued containers in order, limited by the number of containers
+ * that are starting at the same time and by a token bucket.
+ */
+static void
+schedule(struct supervisor *sv, uint64_t now)
+{
+	size_t i, nr_starting, nr_queued, nr_blocked;
+	int throttled, spawned, delayed;
+
+	refill_tokens(sv, now);
+again:
+	nr_starting = nr_queued = nr_blocked = 0;
+	throttled = spawned = delayed = 0;
+
+	for (i = 0; i < sv->nr_containers; i++) {
+		struct managed *m = sv->containers[i];
+
+		if (m->queued)
+			nr_queued++;
+		else if (!m->in.running && !m->in.done)
+			nr_starting++;
+	}
+
+	i = 0;
+	while (i < sv->nr_containers && nr_queued > 0) {
+		struct managed *m = sv->containers[i];
+
+		if (!m->queued) {
+			i++;
+			continue;
+		}
+
+		// A restarted container waits out its delay.
+		if (m->restart_at > now) {
+			delayed = 1;
+			i++;
+			continue;
+		}
+
+		if (!dependencies_ready(sv, m)) {
+			nr_blocked++;
+			i++;
+			continue;
+		}
+
+		if (start_jobs > 0 && nr_starting >= (size_t) start_jobs)
+			return;
+
+		if (start_rate > 0) {
+			if (sv->tokens <= 0) {
+				throttled = 1;
+				break;
+			}
+			sv->tokens--;
+		}
+
+		nr_queued--;
+		spawned = 1;
+
+		if (spawn_container(sv, m) < 0)
+			continue;
+
+		nr_starting++;
+		i++;
+	}
+
+	if (!nr_starting && !throttled && !delayed && nr_blocked) {
+		// The failed containers no longer block anyone.
+		if (spawned)
+			goto again;
+
+		// Nothing is going to satisfy the remaining dependencies.
+		i = 0;
+		while (i < sv->nr_containers) {
+			struct managed *m = sv->containers[i];
+
+			if (!m->queued) {
+				i++;
+				continue;
+			}
+
+			info("%s: dependency cycle", m->data.name);
+			release_waiter(m, EXIT_FAILURE, "dependency cycle");
+			remove_container(sv, m);
+		}
+	}
+}
+
+/*
+ * Wakes up the loop at the nearest stop deadline, at the end of a restart delay
+ * or when the next token becomes available.
+ */
+static void
+arm_timer(struct supervisor *sv, uint64_t now)
+{
+	size_t i;
+	uint64_t next = 0;
+	int queued = 0;
+
+	for (i = 0; i < sv->nr_containers; i++) {
+		struct managed *m = sv->containers[i];
+
+		if (m->queued)
+			queued = 1;
+
+		if (m->stop_deadline > now && (!next || m->stop_deadline < next))
+			next = m->stop_deadline;
+
+		if (m->queued && m->restart_at > now && (!next || m->restart_at < next))
+			next = m->restart_at;
+	}
+
+	if (queued && start_rate > 0 && sv->tokens <= 0) {
+		uint64_t refill = sv->refill_ns + 1000000000 / (uint64_t) start_rate;
+
+		if (!next || refill < next)
+			next = refill;
+	}
+
+	if (!next) {
+		timerfd_disarm(sv->fd_timer);
+		return;
+	}
+
+	// Round up so that the deadline has passed when the timer fires.
+	timerfd_arm(sv->fd_timer, next > now ? (long) ((next - now + 999999) / 1000000) : 1);
+}
+
+static void
+update_clients(struct supervisor *sv)
+{
+	size_t i = 0;
+
+	while (i < sv->nr_clients) {
+		struct client *cl = sv->clients[i];
+
+		if (cl->fd >= 0 && !(cl->eof && !cl->pending)) {
+			i++;
+			continue;
+		}
+
+		client_close(sv, cl);
+	}
+}
+
+static int
+read_signals(struct supervisor *sv)
+{
+	struct signalfd_siginfo fdsi;
+	ssize_t size;
+	int quit = 0;
+
+	while ((size = TEMP_FAILURE_RETRY(read(sv->fd_signal, &fdsi, sizeof(fdsi)))) > 0) {
+		if (size != sizeof(fdsi)) {
+			info("unable to read signal info");
+			break;
+		}
+
+		if (fdsi.ssi_signo != SIGCHLD)
+			quit = 1;
+	}
+
+	return quit;
+}
+
+int
+cmd_daemon(struct container *defaults)
+{
+	int i, ep_timeout = 0;
+	sigset_t mask;
+	uint64_t now;
+	struct supervisor sv = {};
+
+	if (sanitize_fds() < 0)
+		return EXIT_FAILURE;
+
+	if ((sv.fd_listen = control_listen(control_socket)) < 0)
+		return EXIT_FAILURE;
+
+	if (background) {
+		if (daemon(1, 1) < 0) {
+			errmsg("daemon");
+			return EXIT_FAILURE;
+		}
+
+		openlog(program_invocation_short_name, LOG_PID | LOG_NDELAY, LOG_DAEMON);
+		use_syslog = 1;
+	}
+
+	program_subname = "daemon";
+	myerror_progname = myerror_progname_subname;
+
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0) < 0)
+		myerror(EXIT_FAILURE, errno, "prctl(PR_SET_CHILD_SUBREAPER)");
+
+	sigfillset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	sigdelset(&mask, SIGABRT);
+	sigdelset(&mask, SIGSEGV);
+
+	if ((sv.fd_signal = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "signalfd");
+
+	// The clients pass the absolute path, the same config must look the same.
+	if (!(sv.configfile = realpath(configfile, NULL)))
+		sv.configfile = xstrdup(configfile);
+
+	sv.defaults = defaults;
+	sv.fd_ep = epollin_init();
+	sv.fd_timer = timerfd_init();
+	sv.tokens = start_burst;
+	sv.refill_ns = timing_now();
+
+	epollin_add(sv.fd_ep, sv.fd_signal);
+	epollin_add(sv.fd_ep, sv.fd_listen);
+	epollin_add(sv.fd_ep, sv.fd_timer);
+
+	if (verbose)
+		info("listening on %s", control_socket);
+
+	pool_init(&sv);
+
+	while (!sv.quit || sv.nr_containers > 0) {
+		struct epoll_event ev[42];
+		int fdcount;
+
+		errno = 0;
+		if ((fdcount = epoll_wait(sv.fd_ep, ev, ARRAY_SIZE(ev), ep_timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			myerror(EXIT_FAILURE, errno, "epoll_wait");
+		}
+
+		for (i = 0; i < fdcount; i++) {
+			if (!(ev[i].events & (EPOLLIN | EPOLLPRI | EPOLLHUP)))
+				continue;
+
+			if (ev[i].data.fd == sv.fd_signal) {
+				if (read_signals(&sv) && !sv.quit) {
+					if (verbose)
+						info("shutting down");
+					sv.quit = 1;
+					pool_free(&sv);
+					do_stop_all(&sv, NULL);
+				}
+				continue;
+			}
+
+			handle_event(&sv, ev[i].data.fd);
+		}
+
+		ep_timeout = reaper_drain(&sv.reaper) ? 0 : -1;
+
+		update_containers(&sv);
+		update_members(&sv);
+
+		now = timing_now();
+
+		schedule(&sv, now);
+		arm_timer(&sv, now);
+
+		pool_refill(&sv);
+
+		update_clients(&sv);
+	}
+
+	pool_free(&sv);
+
+	while (sv.nr_clients > 0)
+		client_close(&sv, sv.clients[0]);
+
+	reaper_free(&sv.reaper, sv.fd_ep);
+
+	epollin_remove(sv.fd_ep, sv.fd_listen);
+	epollin_remove(sv.fd_ep, sv.fd_timer);
+	epollin_remove(sv.fd_ep, sv.fd_signal);
+	close(sv.fd_ep);
+
+	unlink(control_socket);
+
+	xfree(sv.containers);
+	xfree(sv.clients);
+	xfree(sv.configfile);
+
+	return EXIT_SUCCESS;
+}
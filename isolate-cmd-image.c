@@ -0,0 +1,1299 @@
+#include <linux/fs.h>
+#include <linux/openat2.h>
+
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+/*
+ * The image store keeps every regular file of the imported archives once, in
+ * store/objects/XX/HASH-SIZE, where the hash covers the content, the mode and
+ * the owner. An image is a manifest (store/NAME.manifest) that lists the tree
+ * and refers to the objects. A root is materialised from the manifest with
+ * reflinks where the filesystem supports them and with hardlinks otherwise.
+ * Hardlinked objects are shared, so such roots must be used read-only or with
+ * an overlay on top.
+ */
+#define MANIFEST_MAGIC "IMGSTORE"
+#define MANIFEST_VERSION 1
+
+#define CHECKOUT_RESOLVE (RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS)
+
+#define TAR_BLOCK 512
+#define PAX_MAX_SIZE (1024 * 1024)
+
+extern int verbose;
+
+enum image_kind {
+	IMAGE_DIR = 1,
+	IMAGE_FILE,
+	IMAGE_SYMLINK,
+	IMAGE_HARDLINK,
+	IMAGE_NODE,
+};
+
+struct manifest_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_entries;
+};
+
+/* Followed by path\0 and target\0, the record is padded to 8 bytes. */
+struct image_entry {
+	uint32_t kind;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	int64_t mtime;
+	uint64_t rdev;
+	uint64_t size;
+	uint64_t hash;
+	uint32_t path_len;
+	uint32_t target_len;
+};
+
+struct manifest {
+	char *buf;
+	size_t len;
+	size_t size;
+	uint32_t nr_entries;
+};
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+struct tar_entry {
+	char *path;
+	char *target;
+	uint64_t size;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	int64_t mtime;
+	uint64_t rdev;
+	char type;
+};
+
+/* Values of the pax and GNU extended headers for the next entry. */
+struct tar_override {
+	char *path;
+	char *target;
+	uint64_t size;
+	int has_size;
+};
+
+struct image_store {
+	char *dir;
+	char *objects;
+	size_t nr_entries;
+	size_t nr_files;
+	size_t nr_objects;
+	uint64_t new_bytes;
+	uint64_t dedup_bytes;
+};
+
+struct checkout {
+	struct image_store *store;
+	int rootfd;
+	int parentfd;
+	char *parent;
+	int reflink;
+	size_t nr_reflinks;
+	size_t nr_hardlinks;
+	size_t nr_copies;
+};
+
+static char iobuf[128 * 1024];
+static char cmpbuf[sizeof(iobuf)];
+
+static int
+make_dir(const char *dir)
+{
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		errmsg("mkdir: %s", dir);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+store_open(struct image_store *st, const char *statedir)
+{
+	memset(st, 0, sizeof(*st));
+
+	if (!statedir) {
+		info("image store requires the state directory");
+		return -1;
+	}
+
+	xasprintf(&st->dir, "%s/store", statedir);
+	xasprintf(&st->objects, "%s/objects", st->dir);
+
+	if (make_dir(statedir) < 0 || make_dir(st->dir) < 0 || make_dir(st->objects) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void
+store_close(struct image_store *st)
+{
+	st->objects = xfree(st->objects);
+	st->dir = xfree(st->dir);
+}
+
+static int
+object_path(struct image_store *st, uint64_t hash, uint64_t size, char *buf, size_t bufsz)
+{
+	if ((size_t) snprintf(buf, bufsz, "%s/%02x/%016llx-%llx", st->objects,
+	                      (unsigned) (hash >> 56), (unsigned long long) hash,
+	                      (unsigned long long) size) >= bufsz) {
+		info("object name too long");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = TEMP_FAILURE_RETRY(read(fd, p, len));
+
+		if (n < 0) {
+			errmsg("read");
+			return -1;
+		}
+
+		if (!n) {
+			info("unexpected end of archive");
+			return -1;
+		}
+
+		p += n;
+		len -= (size_t) n;
+	}
+	return 0;
+}
+
+static int
+skip_data(int fd, uint64_t len)
+{
+	while (len > 0) {
+		size_t n = (size_t) MIN(len, sizeof(iobuf));
+
+		if (read_full(fd, iobuf, n) < 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static uint64_t
+padded(uint64_t size)
+{
+	return (size + TAR_BLOCK - 1) & ~((uint64_t) TAR_BLOCK - 1);
+}
+
+static int
+tar_number(const char *p, size_t len, uint64_t *value)
+{
+	uint64_t v = 0;
+	size_t i = 0;
+
+	// GNU base-256 encoding for values that do not fit the octal field.
+	if ((unsigned char) p[0] & 0x80) {
+		v = (unsigned char) p[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			v = (v << 8) | (unsigned char) p[i];
+		*value = v;
+		return 0;
+	}
+
+	while (i < len && p[i] == ' ')
+		i++;
+
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+		v = (v << 3) | (uint64_t) (p[i] - '0');
+
+	if (i < len && p[i] != '\0' && p[i] != ' ')
+		return -1;
+
+	*value = v;
+	return 0;
+}
+
+static int
+tar_checksum(struct tar_header *h)
+{
+	const unsigned char *p = (const unsigned char *) h;
+	uint64_t want, sum = 0;
+
+	if (tar_number(h->chksum, sizeof(h->chksum), &want) < 0)
+		return -1;
+
+	for (size_t i = 0; i < TAR_BLOCK; i++) {
+		if (i >= offsetof(struct tar_header, chksum) &&
+		    i < offsetof(struct tar_header, chksum) + sizeof(h->chksum))
+			sum += ' ';
+		else
+			sum += p[i];
+	}
+
+	return sum == want ? 0 : -1;
+}
+
+static char *
+tar_string(const char *p, size_t len)
+{
+	char *s = xmalloc(len + 1);
+
+	memcpy(s, p, len);
+	s[len] = '\0';
+
+	return s;
+}
+
+/*
+ * Makes the archive path relative to the root. Paths that may lead out of the
+ * root are rejected.
+ */
+static char *
+clean_path(char *path)
+{
+	char *s = path, *p;
+	size_t len;
+
+	while (*s == '/' || (s[0] == '.' && s[1] == '/'))
+		s += (*s == '/') ? 1 : 2;
+
+	len = strlen(s);
+	while (len > 0 && s[len - 1] == '/')
+		s[--len] = '\0';
+
+	if (!len || !strcmp(s, "."))
+		return NULL;
+
+	for (p = s; p;) {
+		char *next = strchr(p, '/');
+		size_t n = next ? (size_t) (next - p) : strlen(p);
+
+		if (!n || (n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.'))
+			return NULL;
+
+		p = next ? next + 1 : NULL;
+	}
+
+	return s;
+}
+
+static int
+read_long_value(int fd, uint64_t size, char **value)
+{
+	if (size > PAX_MAX_SIZE) {
+		info("extended header is too big: %llu", (unsigned long long) size);
+		return -1;
+	}
+
+	*value = xfree(*value);
+	*value = xmalloc((size_t) padded(size) + 1);
+
+	if (read_full(fd, *value, (size_t) padded(size)) < 0)
+		return -1;
+
+	(*value)[size] = '\0';
+	return 0;
+}
+
+static int
+parse_pax(int fd, uint64_t size, struct tar_override *ov)
+{
+	char *buf = NULL, *p, *end;
+
+	if (read_long_value(fd, size, &buf) < 0) {
+		xfree(buf);
+		return -1;
+	}
+
+	p = buf;
+	end = buf + size;
+
+	while (p < end) {
+		char *key, *val, *eq, *rec_end;
+		unsigned long reclen;
+
+		errno = 0;
+		reclen = strtoul(p, &key, 10);
+
+		if (errno || *key != ' ' || !reclen || reclen > (unsigned long) (end - p))
+			goto bad;
+
+		rec_end = p + reclen - 1;
+		key++;
+
+		if (*rec_end != '\n' || !(eq = memchr(key, '=', (size_t) (rec_end - key))))
+			goto bad;
+
+		*eq = *rec_end = '\0';
+		val = eq + 1;
+
+		if (!strcmp(key, "path")) {
+			xfree(ov->path);
+			ov->path = xstrdup(val);
+		} else if (!strcmp(key, "linkpath")) {
+			xfree(ov->target);
+			ov->target = xstrdup(val);
+		} else if (!strcmp(key, "size")) {
+			ov->size = strtoull(val, NULL, 10);
+			ov->has_size = 1;
+		}
+
+		p = rec_end + 1;
+	}
+
+	xfree(buf);
+	return 0;
+bad:
+	info("bad pax header");
+	xfree(buf);
+	return -1;
+}
+
+static void
+manifest_add(struct manifest *m, struct image_entry *ent, const char *path, const char *target)
+{
+	size_t reclen;
+	char *p;
+
+	ent->path_len   = (uint32_t) strlen(path);
+	ent->target_len = target ? (uint32_t) strlen(target) : 0;
+
+	reclen = sizeof(*ent) + ent->path_len + 1 + ent->target_len + 1;
+	reclen = (reclen + 7) & ~(size_t) 7;
+
+	if (m->len + reclen > m->size) {
+		m->size = MAX(m->size * 2, m->len + reclen);
+		m->buf = xrealloc(m->buf, m->size, 1);
+	}
+
+	p = m->buf + m->len;
+	memset(p, 0, reclen);
+	memcpy(p, ent, sizeof(*ent));
+	memcpy(p + sizeof(*ent), path, ent->path_len);
+	if (target)
+		memcpy(p + sizeof(*ent) + ent->path_len + 1, target, ent->target_len);
+
+	m->len += reclen;
+	m->nr_entries++;
+}
+
+/*
+ * The name of an object is only a 64-bit hash, so a file can be crafted to get
+ * the name of another one. The object found under the name is used only if it
+ * has the content and the attributes of the new file. Without root the owner
+ * of every object is the one who imports it.
+ */
+static int
+same_object(int fd, const char *objpath, struct tar_entry *te)
+{
+	int objfd, rc = 0;
+	uint64_t off = 0;
+	struct stat sb;
+
+	if ((objfd = open(objpath, O_RDONLY | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", objpath);
+		return -1;
+	}
+
+	if (fstat(objfd, &sb) < 0) {
+		errmsg("fstat: %s", objpath);
+		rc = -1;
+		goto out;
+	}
+
+	if ((uint64_t) sb.st_size != te->size || (sb.st_mode & 07777) != (te->mode & 07777) ||
+	    (!geteuid() && (sb.st_uid != te->uid || sb.st_gid != te->gid)))
+		goto out;
+
+	while (off < te->size) {
+		size_t n = (size_t) MIN(te->size - off, sizeof(iobuf));
+
+		if (pread(fd, iobuf, n, (off_t) off) != (ssize_t) n ||
+		    pread(objfd, cmpbuf, n, (off_t) off) != (ssize_t) n) {
+			errmsg("read: %s", objpath);
+			rc = -1;
+			goto out;
+		}
+
+		if (memcmp(iobuf, cmpbuf, n))
+			goto out;
+
+		off += n;
+	}
+
+	rc = 1;
+out:
+	close(objfd);
+	return rc;
+}
+
+/*
+ * Streams the file content into the store while hashing it. A file that is
+ * already there is dropped and the existing object is used instead.
+ */
+static int
+store_object(struct image_store *st, int fd, struct tar_entry *te, struct image_entry *ent)
+{
+	int objfd, rc;
+	uint64_t hash = FNV1A_INIT, left = te->size;
+	char *tmpfile = NULL;
+	char objpath[MAXPATHLEN];
+	struct timespec ts[2];
+	struct {
+		uint64_t size;
+		uint32_t mode;
+		uint32_t uid;
+		uint32_t gid;
+	} meta = { te->size, te->mode & 07777, te->uid, te->gid };
+
+	xasprintf(&tmpfile, "%s/.tmp.XXXXXX", st->objects);
+
+	if ((objfd = mkostemp(tmpfile, O_CLOEXEC)) < 0) {
+		errmsg("mkstemp: %s", tmpfile);
+		xfree(tmpfile);
+		return -1;
+	}
+
+	while (left > 0) {
+		size_t n = (size_t) MIN(left, sizeof(iobuf));
+
+		if (read_full(fd, iobuf, n) < 0)
+			goto fail;
+
+		hash = fnv1a(hash, iobuf, n);
+
+		if (TEMP_FAILURE_RETRY(write(objfd, iobuf, n)) != (ssize_t) n) {
+			errmsg("write: %s", tmpfile);
+			goto fail;
+		}
+
+		left -= n;
+	}
+
+	if (skip_data(fd, padded(te->size) - te->size) < 0)
+		goto fail;
+
+	hash = fnv1a(hash, &meta, sizeof(meta));
+
+	ent->hash = hash;
+	ent->size = te->size;
+
+	if (object_path(st, hash, te->size, objpath, sizeof(objpath)) < 0)
+		goto fail;
+
+	if (!access(objpath, F_OK))
+		goto exists;
+
+	if (fchown(objfd, te->uid, te->gid) < 0 && errno != EPERM)
+		errmsg("fchown: %s", te->path);
+
+	ts[0].tv_sec  = ts[1].tv_sec = te->mtime;
+	ts[0].tv_nsec = ts[1].tv_nsec = 0;
+
+	if (fchmod(objfd, te->mode & 07777) < 0 || futimens(objfd, ts) < 0) {
+		errmsg("unable to set attributes: %s", te->path);
+		goto fail;
+	}
+
+	*strrchr(objpath, '/') = '\0';
+	if (make_dir(objpath) < 0)
+		goto fail;
+	objpath[strlen(objpath)] = '/';
+
+	// The content is already in the store if another import has won the race.
+	if (link(tmpfile, objpath) < 0) {
+		if (errno != EEXIST) {
+			errmsg("link: %s", objpath);
+			goto fail;
+		}
+		goto exists;
+	}
+
+	st->nr_objects++;
+	st->new_bytes += te->size;
+	goto done;
+exists:
+	if ((rc = same_object(objfd, objpath, te)) <= 0) {
+		if (!rc)
+			info("%s: another object has the same name in the store: %s", te->path, objpath);
+		goto fail;
+	}
+
+	st->dedup_bytes += te->size;
+done:
+	close(objfd);
+	unlink(tmpfile);
+	xfree(tmpfile);
+
+	return 0;
+fail:
+	close(objfd);
+	unlink(tmpfile);
+	xfree(tmpfile);
+
+	return -1;
+}
+
+static int
+import_entry(struct image_store *st, int fd, struct tar_entry *te, struct manifest *m)
+{
+	struct image_entry ent;
+	char *path, *target = NULL;
+
+	memset(&ent, 0, sizeof(ent));
+
+	ent.mode  = te->mode & 07777;
+	ent.uid   = te->uid;
+	ent.gid   = te->gid;
+	ent.mtime = te->mtime;
+
+	switch (te->type) {
+		case '0':
+		case '\0':
+		case '7':
+			ent.kind = IMAGE_FILE;
+			ent.mode |= S_IFREG;
+			break;
+		case '1':
+			ent.kind = IMAGE_HARDLINK;
+			if (!(target = clean_path(te->target))) {
+				info("bad hardlink target: %s", te->target);
+				return -1;
+			}
+			break;
+		case '2':
+			ent.kind = IMAGE_SYMLINK;
+			ent.mode |= S_IFLNK;
+			target = te->target;
+			break;
+		case '3':
+		case '4':
+		case '6':
+			ent.kind = IMAGE_NODE;
+			ent.mode |= (te->type == '3') ? S_IFCHR : (te->type == '4') ? S_IFBLK : S_IFIFO;
+			ent.rdev = te->rdev;
+			break;
+		case '5':
+			ent.kind = IMAGE_DIR;
+			ent.mode |= S_IFDIR;
+			break;
+		default:
+			if (verbose)
+				info("skipping unsupported entry (type %c): %s", te->type, te->path);
+			return skip_data(fd, padded(te->size));
+	}
+
+	if (!(path = clean_path(te->path))) {
+		if (verbose > 1)
+			info("skipping entry: %s", te->path);
+		return skip_data(fd, padded(te->size));
+	}
+
+	if (ent.kind == IMAGE_FILE) {
+		if (store_object(st, fd, te, &ent) < 0)
+			return -1;
+		st->nr_files++;
+	} else if (skip_data(fd, padded(te->size)) < 0) {
+		return -1;
+	}
+
+	manifest_add(m, &ent, path, target);
+	st->nr_entries++;
+
+	return 0;
+}
+
+static int
+import_tar(struct image_store *st, int fd, struct manifest *m)
+{
+	struct tar_header h;
+	struct tar_override ov;
+	struct tar_entry te;
+	int rc = -1;
+
+	memset(&ov, 0, sizeof(ov));
+	memset(&te, 0, sizeof(te));
+
+	while (1) {
+		uint64_t value;
+		int zero = 1;
+
+		if (read_full(fd, &h, sizeof(h)) < 0)
+			goto out;
+
+		for (size_t i = 0; zero && i < sizeof(h); i++)
+			zero = !((char *) &h)[i];
+
+		if (zero)
+			break;
+
+		if (tar_checksum(&h) < 0 || tar_number(h.size, sizeof(h.size), &te.size) < 0) {
+			info("bad tar header");
+			goto out;
+		}
+
+		switch (h.typeflag) {
+			case 'L':
+				if (read_long_value(fd, te.size, &ov.path) < 0)
+					goto out;
+				continue;
+			case 'K':
+				if (read_long_value(fd, te.size, &ov.target) < 0)
+					goto out;
+				continue;
+			case 'x':
+				if (parse_pax(fd, te.size, &ov) < 0)
+					goto out;
+				continue;
+			case 'g':
+				if (skip_data(fd, padded(te.size)) < 0)
+					goto out;
+				continue;
+		}
+
+		te.type = h.typeflag;
+
+		if (ov.has_size)
+			te.size = ov.size;
+
+		if (ov.path) {
+			te.path = ov.path;
+			ov.path = NULL;
+		} else if (!memcmp(h.magic, "ustar", 5) && h.prefix[0]) {
+			char *prefix = tar_string(h.prefix, sizeof(h.prefix));
+			char *name = tar_string(h.name, sizeof(h.name));
+
+			xasprintf(&te.path, "%s/%s", prefix, name);
+			xfree(prefix);
+			xfree(name);
+		} else {
+			te.path = tar_string(h.name, sizeof(h.name));
+		}
+
+		if (ov.target) {
+			te.target = ov.target;
+			ov.target = NULL;
+		} else {
+			te.target = tar_string(h.linkname, sizeof(h.linkname));
+		}
+
+		tar_number(h.mode, sizeof(h.mode), &value);
+		te.mode = (uint32_t) value;
+		tar_number(h.uid, sizeof(h.uid), &value);
+		te.uid = (uint32_t) value;
+		tar_number(h.gid, sizeof(h.gid), &value);
+		te.gid = (uint32_t) value;
+		tar_number(h.mtime, sizeof(h.mtime), &value);
+		te.mtime = (int64_t) value;
+
+		te.rdev = 0;
+		if (te.type == '3' || te.type == '4') {
+			uint64_t major, minor;
+
+			tar_number(h.devmajor, sizeof(h.devmajor), &major);
+			tar_number(h.devminor, sizeof(h.devminor), &minor);
+			te.rdev = makedev((unsigned) major, (unsigned) minor);
+		}
+
+		ov.has_size = 0;
+
+		if (import_entry(st, fd, &te, m) < 0)
+			goto out;
+
+		te.path = xfree(te.path);
+		te.target = xfree(te.target);
+	}
+
+	// Drain the trailing blocks so that the decompressor exits normally.
+	while (TEMP_FAILURE_RETRY(read(fd, iobuf, sizeof(iobuf))) > 0)
+		;
+
+	rc = 0;
+out:
+	xfree(te.path);
+	xfree(te.target);
+	xfree(ov.path);
+	xfree(ov.target);
+
+	return rc;
+}
+
+/*
+ * Compressed archives are unpacked by an external tool running in parallel
+ * with the import. Multi-threaded mode is requested where the tool has one.
+ */
+static pid_t
+open_decompressor(int fd, const char *archive, int *outfd)
+{
+	static const char *const zstd_argv[] = { "zstd", "-d", "-c", "-q", "-T0", NULL };
+	static const char *const gzip_argv[] = { "gzip", "-d", "-c", NULL };
+	static const char *const xz_argv[] = { "xz", "-d", "-c", "-T0", NULL };
+	const char *const *argv = NULL;
+	unsigned char magic[6] = {};
+	int pipefd[2];
+	pid_t pid;
+
+	if (TEMP_FAILURE_RETRY(pread(fd, magic, sizeof(magic), 0)) < 0)
+		myerror(EXIT_FAILURE, errno, "read: %s", archive);
+
+	if (!memcmp(magic, "\x28\xb5\x2f\xfd", 4))
+		argv = zstd_argv;
+	else if (!memcmp(magic, "\x1f\x8b", 2))
+		argv = gzip_argv;
+	else if (!memcmp(magic, "\xfd" "7zXZ\0", 6))
+		argv = xz_argv;
+
+	if (!argv) {
+		*outfd = fd;
+		return 0;
+	}
+
+	if (pipe2(pipefd, O_CLOEXEC) < 0)
+		myerror(EXIT_FAILURE, errno, "pipe2");
+
+	if ((pid = fork()) < 0)
+		myerror(EXIT_FAILURE, errno, "fork");
+
+	if (!pid) {
+		if (dup2(fd, STDIN_FILENO) < 0 || dup2(pipefd[1], STDOUT_FILENO) < 0) {
+			errmsg("dup2");
+			_exit(EXIT_FAILURE);
+		}
+
+		execvp(argv[0], (char *const *) argv);
+		errmsg("execvp: %s", argv[0]);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(pipefd[1]);
+	*outfd = pipefd[0];
+
+	return pid;
+}
+
+static int
+cmd_image_import(const char *statedir, const char *archive, const char *name)
+{
+	int fd, infd, status, rc = EXIT_FAILURE;
+	pid_t pid;
+	char *filename = NULL;
+	struct image_store st;
+	struct manifest m;
+	struct manifest_hdr hdr;
+	struct iovec iov[2];
+
+	if (strchr(name, '/') || name[0] == '.') {
+		info("bad image name: %s", name);
+		return EXIT_FAILURE;
+	}
+
+	if (store_open(&st, statedir) < 0) {
+		store_close(&st);
+		return EXIT_FAILURE;
+	}
+
+	if ((fd = open(archive, O_RDONLY | O_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: %s", archive);
+
+	memset(&m, 0, sizeof(m));
+
+	pid = open_decompressor(fd, archive, &infd);
+
+	if (import_tar(&st, infd, &m) < 0)
+		info("%s: import failed", archive);
+	else
+		rc = EXIT_SUCCESS;
+
+	if (pid) {
+		close(infd);
+
+		if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) < 0)
+			myerror(EXIT_FAILURE, errno, "waitpid");
+
+		if (rc == EXIT_SUCCESS && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+			info("%s: decompression failed", archive);
+			rc = EXIT_FAILURE;
+		}
+	}
+
+	close(fd);
+
+	if (rc == EXIT_SUCCESS) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+		hdr.version    = MANIFEST_VERSION;
+		hdr.nr_entries = m.nr_entries;
+
+		iov[0].iov_base = &hdr;
+		iov[0].iov_len  = sizeof(hdr);
+		iov[1].iov_base = m.buf;
+		iov[1].iov_len  = m.len;
+
+		xasprintf(&filename, "%s.manifest", name);
+
+		if (store_file(st.dir, filename, iov, 2) < 0) {
+			info("%s: unable to store the manifest", name);
+			rc = EXIT_FAILURE;
+		}
+
+		xfree(filename);
+	}
+
+	if (rc == EXIT_SUCCESS && verbose)
+		info("%s: %zu entries, %zu files, %zu new objects (%llu bytes), %llu bytes deduplicated",
+		     name, st.nr_entries, st.nr_files, st.nr_objects,
+		     (unsigned long long) st.new_bytes, (unsigned long long) st.dedup_bytes);
+
+	xfree(m.buf);
+	store_close(&st);
+
+	return rc;
+}
+
+/*
+ * Opens the parent directory of the path without following symlinks, so an
+ * entry can not be placed outside of the root. The last parent is cached
+ * because archives keep the entries of a directory together.
+ */
+static int
+checkout_parent(struct checkout *co, const char *path, const char **base)
+{
+	const char *slash = strrchr(path, '/');
+	size_t len;
+
+	if (!slash) {
+		*base = path;
+		return co->rootfd;
+	}
+
+	*base = slash + 1;
+	len = (size_t) (slash - path);
+
+	if (co->parent && strlen(co->parent) == len && !strncmp(co->parent, path, len))
+		return co->parentfd;
+
+	if (co->parentfd >= 0)
+		close(co->parentfd);
+
+	co->parent = xfree(co->parent);
+	co->parent = xmalloc(len + 1);
+	memcpy(co->parent, path, len);
+	co->parent[len] = '\0';
+
+	co->parentfd = openat_resolve(co->rootfd, co->parent, O_PATH | O_DIRECTORY, CHECKOUT_RESOLVE);
+
+	if (co->parentfd < 0) {
+		errmsg("open: %s", co->parent);
+		co->parent = xfree(co->parent);
+	}
+
+	return co->parentfd;
+}
+
+static int
+set_attrs(int fd, const char *path, struct image_entry *ent)
+{
+	struct timespec ts[2];
+
+	ts[0].tv_sec  = ts[1].tv_sec = ent->mtime;
+	ts[0].tv_nsec = ts[1].tv_nsec = 0;
+
+	if (fchown(fd, ent->uid, ent->gid) < 0 && errno != EPERM)
+		errmsg("fchown: %s", path);
+
+	if (fchmod(fd, ent->mode & 07777) < 0 || futimens(fd, ts) < 0) {
+		errmsg("unable to set attributes: %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Attributes of the entries that can not be opened: symlinks and device nodes.
+ */
+static void
+set_path_attrs(int dirfd, const char *base, const char *path, struct image_entry *ent)
+{
+	struct timespec ts[2];
+
+	ts[0].tv_sec  = ts[1].tv_sec = ent->mtime;
+	ts[0].tv_nsec = ts[1].tv_nsec = 0;
+
+	if (fchownat(dirfd, base, ent->uid, ent->gid, AT_SYMLINK_NOFOLLOW) < 0 && errno != EPERM)
+		errmsg("lchown: %s", path);
+
+	if (ent->kind != IMAGE_SYMLINK && fchmodat(dirfd, base, ent->mode & 07777, 0) < 0)
+		errmsg("chmod: %s", path);
+
+	if (utimensat(dirfd, base, ts, AT_SYMLINK_NOFOLLOW) < 0)
+		errmsg("utimensat: %s", path);
+}
+
+static int
+copy_object(int src, int dst, uint64_t size)
+{
+	ssize_t n;
+
+	while (size > 0) {
+		if ((n = copy_file_range(src, NULL, dst, NULL, (size_t) MIN(size, SSIZE_MAX), 0)) <= 0)
+			break;
+		size -= (uint64_t) n;
+	}
+
+	// Newer kernels refuse to copy between different filesystem types.
+	while (size > 0) {
+		if ((n = TEMP_FAILURE_RETRY(read(src, iobuf, (size_t) MIN(size, sizeof(iobuf))))) <= 0)
+			return -1;
+
+		if (TEMP_FAILURE_RETRY(write(dst, iobuf, (size_t) n)) != n)
+			return -1;
+
+		size -= (uint64_t) n;
+	}
+	return 0;
+}
+
+static int
+checkout_file(struct checkout *co, int dirfd, const char *base, const char *path, struct image_entry *ent)
+{
+	int src, dst, err;
+	char objpath[MAXPATHLEN];
+
+	if (object_path(co->store, ent->hash, ent->size, objpath, sizeof(objpath)) < 0)
+		return -1;
+
+	if (!co->reflink) {
+		if (!linkat(AT_FDCWD, objpath, dirfd, base, 0)) {
+			co->nr_hardlinks++;
+			return 0;
+		}
+
+		if (errno != EXDEV) {
+			errmsg("link: %s", path);
+			return -1;
+		}
+	}
+
+	if ((src = open(objpath, O_RDONLY | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", objpath);
+		return -1;
+	}
+
+	if ((dst = openat(dirfd, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0) {
+		errmsg("open: %s", path);
+		close(src);
+		return -1;
+	}
+
+	if (co->reflink && !ioctl(dst, FICLONE, src)) {
+		co->nr_reflinks++;
+		goto done;
+	}
+
+	err = errno;
+
+	if (co->reflink) {
+		if (err != EOPNOTSUPP && err != ENOTTY && err != EINVAL && err != EXDEV) {
+			errno = err;
+			errmsg("ioctl(FICLONE): %s", path);
+			goto fail;
+		}
+
+		if (verbose > 1)
+			info("reflinks are not supported, using hardlinks");
+
+		co->reflink = 0;
+
+		if (err != EXDEV) {
+			close(dst);
+			close(src);
+			unlinkat(dirfd, base, 0);
+			return checkout_file(co, dirfd, base, path, ent);
+		}
+	}
+
+	// The store is on another filesystem.
+	if (copy_object(src, dst, ent->size) < 0) {
+		errmsg("copy: %s", path);
+		goto fail;
+	}
+
+	co->nr_copies++;
+done:
+	if (set_attrs(dst, path, ent) < 0)
+		goto fail;
+
+	close(dst);
+	close(src);
+	return 0;
+fail:
+	close(dst);
+	close(src);
+	return -1;
+}
+
+static int
+checkout_entry(struct checkout *co, struct image_entry *ent, const char *path, const char *target)
+{
+	const char *base;
+	int dirfd, linkdir;
+	struct stat sb;
+
+	if ((dirfd = checkout_parent(co, path, &base)) < 0)
+		return -1;
+
+	switch (ent->kind) {
+		case IMAGE_DIR:
+			if (mkdirat(dirfd, base, 0700) < 0) {
+				if (errno != EEXIST ||
+				    fstatat(dirfd, base, &sb, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(sb.st_mode)) {
+					errmsg("mkdir: %s", path);
+					return -1;
+				}
+			}
+			return 0;
+
+		case IMAGE_FILE:
+			return checkout_file(co, dirfd, base, path, ent);
+
+		case IMAGE_SYMLINK:
+			if (symlinkat(target, dirfd, base) < 0) {
+				errmsg("symlink: %s", path);
+				return -1;
+			}
+
+			set_path_attrs(dirfd, base, path, ent);
+			return 0;
+
+		case IMAGE_HARDLINK:
+			if (!strchr(target, '/')) {
+				linkdir = co->rootfd;
+			} else {
+				char *dir = xstrdup(target);
+
+				*strrchr(dir, '/') = '\0';
+
+				linkdir = openat_resolve(co->rootfd, dir, O_PATH | O_DIRECTORY, CHECKOUT_RESOLVE);
+				xfree(dir);
+
+				if (linkdir < 0) {
+					errmsg("open: %s", target);
+					return -1;
+				}
+			}
+
+			if (linkat(linkdir, strrchr(target, '/') ? strrchr(target, '/') + 1 : target, dirfd, base, 0) < 0) {
+				errmsg("link: %s", path);
+				if (linkdir != co->rootfd)
+					close(linkdir);
+				return -1;
+			}
+
+			if (linkdir != co->rootfd)
+				close(linkdir);
+			return 0;
+
+		case IMAGE_NODE:
+			if (mknodat(dirfd, base, ent->mode, (dev_t) ent->rdev) < 0) {
+				// Unprivileged checkouts can not make devices.
+				if (errno == EPERM) {
+					if (verbose)
+						errmsg("mknod: %s", path);
+					return 0;
+				}
+				errmsg("mknod: %s", path);
+				return -1;
+			}
+
+			set_path_attrs(dirfd, base, path, ent);
+			return 0;
+	}
+
+	info("unknown manifest entry: %s", path);
+	return -1;
+}
+
+/*
+ * Directory attributes are set last, when nothing more is created inside.
+ */
+static int
+checkout_dir_attrs(struct checkout *co, struct image_entry *ent, const char *path)
+{
+	const char *base;
+	int dirfd, fd, rc;
+
+	if ((dirfd = checkout_parent(co, path, &base)) < 0)
+		return -1;
+
+	if ((fd = openat(dirfd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", path);
+		return -1;
+	}
+
+	rc = set_attrs(fd, path, ent);
+	close(fd);
+
+	return rc;
+}
+
+static int
+walk_manifest(struct checkout *co, struct mapfile *mf, int attrs)
+{
+	struct manifest_hdr *hdr = (struct manifest_hdr *) mf->map;
+	char *p = mf->map + sizeof(*hdr);
+	char *end = mf->map + mf->size;
+
+	for (uint32_t i = 0; i < hdr->nr_entries; i++) {
+		struct image_entry *ent = (struct image_entry *) p;
+		const char *path, *target;
+		size_t reclen;
+
+		if ((size_t) (end - p) < sizeof(*ent))
+			goto bad;
+
+		reclen = sizeof(*ent) + ent->path_len + 1 + ent->target_len + 1;
+		reclen = (reclen + 7) & ~(size_t) 7;
+
+		if ((size_t) (end - p) < reclen)
+			goto bad;
+
+		path = p + sizeof(*ent);
+		target = path + ent->path_len + 1;
+		p += reclen;
+
+		if (attrs) {
+			if (ent->kind == IMAGE_DIR && checkout_dir_attrs(co, ent, path) < 0)
+				return -1;
+			continue;
+		}
+
+		if (checkout_entry(co, ent, path, target) < 0)
+			return -1;
+	}
+
+	return 0;
+bad:
+	info("%s: manifest is corrupted", mf->filename);
+	return -1;
+}
+
+static int
+cmd_image_checkout(const char *statedir, const char *name, const char *dir)
+{
+	int rc = EXIT_FAILURE;
+	char *filename = NULL;
+	struct image_store st;
+	struct checkout co;
+	struct mapfile mf = {};
+	struct manifest_hdr *hdr;
+
+	if (store_open(&st, statedir) < 0) {
+		store_close(&st);
+		return EXIT_FAILURE;
+	}
+
+	xasprintf(&filename, "%s/%s.manifest", st.dir, name);
+
+	if (open_map(filename, &mf, 0) < 0 || !mf.filename)
+		goto out;
+
+	hdr = (struct manifest_hdr *) mf.map;
+
+	if (mf.size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != MANIFEST_VERSION) {
+		info("%s: unsupported manifest", filename);
+		goto out;
+	}
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		errmsg("mkdir: %s", dir);
+		goto out;
+	}
+
+	memset(&co, 0, sizeof(co));
+	co.store = &st;
+	co.parentfd = -1;
+	co.reflink = 1;
+
+	if ((co.rootfd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", dir);
+		goto out;
+	}
+
+	if (!walk_manifest(&co, &mf, 0) && !walk_manifest(&co, &mf, 1))
+		rc = EXIT_SUCCESS;
+
+	if (rc == EXIT_SUCCESS && verbose)
+		info("%s: %u entries, %zu reflinks, %zu hardlinks, %zu copies",
+		     dir, hdr->nr_entries, co.nr_reflinks, co.nr_hardlinks, co.nr_copies);
+
+	if (co.parentfd >= 0)
+		close(co.parentfd);
+	close(co.rootfd);
+	xfree(co.parent);
+out:
+	close_map(&mf);
+	xfree(filename);
+	store_close(&st);
+
+	return rc;
+}
+
+int
+cmd_image(const char *statedir, int argc, char **argv)
+{
+	if (argc == 3 && !strcmp(argv[0], "import"))
+		return cmd_image_import(statedir, argv[1], argv[2]);
+
+	if (argc == 3 && !strcmp(argv[0], "checkout"))
+		return cmd_image_checkout(statedir, argv[1], argv[2]);
+
+	info("usage: image import ARCHIVE NAME | image checkout NAME DIR");
+	return EXIT_FAILURE;
+}
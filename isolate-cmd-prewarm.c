@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "isolate.h"
+
+extern int verbose;
+
+int
+cmd_prewarm(struct container *data)
+{
+	struct seccomp_filter filter;
+
+	if (!data->seccomp) {
+		if (verbose)
+			info("%s: no seccomp-filter", data->name);
+		return EXIT_SUCCESS;
+	}
+
+	if (!data->statedir) {
+		info("%s: state-dir is not set, nothing to cache", data->name);
+		return EXIT_FAILURE;
+	}
+
+	seccomp_prepare(&filter, data->seccomp, data->statedir);
+
+	if (verbose)
+		info("%s: seccomp-filter %s", data->name, (filter.compiled ? "compiled" : "is up to date"));
+
+	seccomp_release(&filter);
+
+	return EXIT_SUCCESS;
+}
+
+int
+cmd_prewarm_all(const char *filename, char *statedir)
+{
+	char **sections;
+	int rc = EXIT_SUCCESS;
+
+	sections = read_config_sections(filename);
+
+	for (size_t i = 0; sections && sections[i]; i++) {
+		struct container data = {};
+
+		data.cgroups = xcalloc(1, sizeof(struct cgroups));
+
+		if (statedir)
+			set_state_dir(&data, statedir);
+
+		load_config(filename, sections[i], &data);
+
+		if (cmd_prewarm(&data) != EXIT_SUCCESS)
+			rc = EXIT_FAILURE;
+
+		free_data(&data);
+		xfree(sections[i]);
+	}
+	xfree(sections);
+
+	return rc;
+}
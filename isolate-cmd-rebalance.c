@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "isolate.h"
+
+extern int verbose;
+
+struct rebalance_target {
+	struct container data;
+	uint64_t weight;
+};
+
+static void
+rebalance_load(struct rebalance_target *t, const char *filename, struct container *defaults, char *name)
+{
+	memset(t, 0, sizeof(*t));
+
+	t->data.cgroups = xcalloc(1, sizeof(struct cgroups));
+
+	set_cgroups_group(&t->data, (char *) "");
+	set_cgroups_dir(&t->data, defaults->cgroups->rootdir);
+	cgroup_controller(t->data.cgroups, "freezer", CGROUP_FREEZER);
+
+	if (defaults->statedir)
+		set_state_dir(&t->data, defaults->statedir);
+
+	load_config(filename, name, &t->data);
+}
+
+static int
+by_weight(const void *a, const void *b)
+{
+	const struct rebalance_target *x = *(struct rebalance_target *const *) a;
+	const struct rebalance_target *y = *(struct rebalance_target *const *) b;
+
+	if (x->weight != y->weight)
+		return x->weight < y->weight ? 1 : -1;
+
+	return strcmp(x->data.name, y->data.name);
+}
+
+/*
+ * Places the running containers with automatic placement again, the heaviest
+ * first. Without names all the containers of the config are placed. The other
+ * containers of the group stay where they are and only count as load.
+ */
+int
+cmd_rebalance(const char *filename, struct container *defaults, int argc, char **argv)
+{
+	struct rebalance_target *targets, **movable;
+	struct topology topo;
+	char **sections = NULL, **skip;
+	size_t i, nr, nr_movable = 0;
+	int rc = EXIT_SUCCESS;
+
+	if (argc > 0) {
+		nr = (size_t) argc;
+	} else {
+		sections = read_config_sections(filename);
+		argv = sections;
+		for (nr = 0; sections && sections[nr]; nr++);
+	}
+
+	targets = xcalloc(nr, sizeof(*targets));
+	movable = xcalloc(nr + 1, sizeof(*movable));
+	skip = xcalloc(nr + 1, sizeof(char *));
+
+	for (i = 0; i < nr; i++) {
+		rebalance_load(&targets[i], filename, defaults, argv[i]);
+
+		if (targets[i].data.placement != PLACEMENT_AUTO || !cgroup_populated(targets[i].data.cgroups))
+			continue;
+
+		targets[i].weight = placement_weight(targets[i].data.cgroups);
+
+		skip[nr_movable] = targets[i].data.name;
+		movable[nr_movable++] = &targets[i];
+	}
+
+	if (!nr_movable) {
+		if (verbose)
+			info("no running containers with automatic placement");
+		goto out;
+	}
+
+	if (topology_load(&topo) < 0) {
+		rc = EXIT_FAILURE;
+		goto out;
+	}
+
+	topology_account(&topo, movable[0]->data.cgroups, skip);
+
+	qsort(movable, nr_movable, sizeof(*movable), by_weight);
+
+	for (i = 0; i < nr_movable; i++) {
+		struct container *data = &movable[i]->data;
+		struct numa_node *node;
+		int moved;
+
+		if (!(node = topology_pick(&topo, movable[i]->weight))) {
+			info("no node with cpus to place the containers");
+			rc = EXIT_FAILURE;
+			break;
+		}
+
+		if ((moved = placement_move(data->cgroups, node)) < 0) {
+			info("%s: unable to move the container to node %d", data->name, node->id);
+			rc = EXIT_FAILURE;
+			continue;
+		}
+
+		if (moved || verbose)
+			info("%s: %s node %d, cpus %s", data->name, (moved ? "moved to" : "stays on"),
+			     node->id, node->cpus);
+	}
+
+	topology_free(&topo);
+out:
+	for (i = 0; i < nr; i++)
+		free_data(&targets[i].data);
+	xfree(targets);
+	xfree(movable);
+	xfree(skip);
+
+	for (i = 0; sections && sections[i]; i++)
+		xfree(sections[i]);
+	xfree(sections);
+
+	return rc;
+}
@@ -6,7 +6,9 @@
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/file.h>
+#include <sys/uio.h>
 
+#include <poll.h>
 #include <sched.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -21,6 +23,8 @@
 
 #include "isolate.h"
 
+#define INIT_EXIT_TIMEOUT 1000
+
 extern int verbose;
 extern int background;
 extern int use_syslog;
@@ -35,7 +39,8 @@ typedef enum {
 	CMD_CLIENT_PID,
 	CMD_CLIENT_REPARENT,
 	CMD_CLIENT_READY,
-	CMD_CLIENT_EXEC
+	CMD_CLIENT_EXEC,
+	CMD_CLIENT_TIMING
 } cmd_t;
 
 struct cmd {
@@ -81,6 +86,8 @@ print_cmd(struct cmd *hdr)
 			return "CMD_CLIENT_READY";
 		case CMD_CLIENT_EXEC:
 			return "CMD_CLIENT_EXEC";
+		case CMD_CLIENT_TIMING:
+			return "CMD_CLIENT_TIMING";
 	}
 	return "UNKNOWN";
 }
@@ -131,220 +138,81 @@ recv_cmd(int fd, cmd_t cmd)
 }
 
 static int
-get_pid_rc(int status)
+send_timing(int fd)
 {
-	if (WIFEXITED(status)) {
-		if (WEXITSTATUS(status))
-			return WEXITSTATUS(status);
-	} else if (WIFSIGNALED(status)) {
-		return 128 + WTERMSIG(status);
-	} else {
-		return 255;
-	}
-	return EXIT_SUCCESS;
-}
+	struct timing *t = timing_get();
+	struct cmd hdr = { 0 };
+	struct iovec iov[2];
 
-static int
-container_parent(struct container *data, int child_sock, pid_t temp_pid)
-{
-	int i, rc, init_finished;
-	pid_t init_pid;
-	sigset_t mask;
-	int fd_ep, fd_signal;
-	int ep_timeout = 0;
+	hdr.type = CMD_CLIENT_TIMING;
+	hdr.datalen = t->nr_phases * sizeof(struct timing_phase);
 
-	program_subname = "parent";
-	myerror_progname = myerror_progname_subname;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = t->phases;
+	iov[1].iov_len = hdr.datalen;
 
 	if (verbose > 2)
-		info("started");
-
-	cgroup_create(data->cgroups);
-
-	if (prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0) < 0)
-		myerror(EXIT_FAILURE, errno, "prctl(PR_SET_CHILD_SUBREAPER)");
-
-	init_pid = init_finished = 0;
-
-	sigfillset(&mask);
-	sigprocmask(SIG_SETMASK, &mask, NULL);
-
-	sigdelset(&mask, SIGABRT);
-	sigdelset(&mask, SIGSEGV);
-
-	if ((fd_signal = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
-		myerror(EXIT_FAILURE, errno, "signalfd");
-
-	fd_ep = epollin_init();
-	epollin_add(fd_ep, fd_signal);
-	epollin_add(fd_ep, child_sock);
-
-	rc = EXIT_SUCCESS;
-
-	while (1) {
-		struct epoll_event ev[42];
-		int fdcount;
-		ssize_t size;
-
-		errno = 0;
-		if ((fdcount = epoll_wait(fd_ep, ev, ARRAY_SIZE(ev), ep_timeout)) < 0) {
-			if (errno == EINTR)
-				continue;
-			myerror(EXIT_FAILURE, errno, "epoll_wait");
-		}
-
-		if (!fdcount) {
-			if (!init_finished) {
-				if (!init_pid) {
-					if (send_cmd(child_sock, CMD_FORK_CLIENT, NULL, 0) < 0) {
-						rc = EXIT_FAILURE;
-						goto done;
-					}
-					init_pid = -1;
-				} else if (init_pid < 0) {
-					if (init_pid < -5) {
-						info("waiting for client's pid for too long");
-						rc = EXIT_FAILURE;
-						goto done;
-					}
-					init_pid--;
-				}
-			}
-
-			ep_timeout = 1000;
-			continue;
-		}
-
-		for (i = 0; i < fdcount; i++) {
-			if (!(ev[i].events & EPOLLIN)) {
-				continue;
-			}
-
-			if (ev[i].data.fd == fd_signal) {
-				pid_t pid;
-				struct signalfd_siginfo fdsi;
-				int status = 0;
-
-				size = TEMP_FAILURE_RETRY(read(fd_signal, &fdsi, sizeof(struct signalfd_siginfo)));
-
-				if (size != sizeof(struct signalfd_siginfo)) {
-					info("unable to read signal info");
-					continue;
-				}
-
-				if (fdsi.ssi_signo != SIGCHLD)
-					goto done;
-
-				if ((pid = waitpid(-1, &status, 0)) < 0) {
-					errmsg("waitpid");
-					rc = EXIT_FAILURE;
-					goto done;
-				}
-
-				rc = get_pid_rc(status);
-
-				if (pid == temp_pid) {
-					if (rc != EXIT_SUCCESS) {
-						info("temp pid ended unexpectedly (rc=%d)", rc);
-						goto done;
-					}
-
-					temp_pid = 0;
-					if (send_cmd(child_sock, CMD_CLIENT_REPARENT, NULL, 0) < 0) {
-						rc = EXIT_FAILURE;
-						goto done;
-					}
-
-					continue;
-				}
-
-				if (pid != init_pid)
-					continue;
-
-				init_finished = 1;
-				init_pid = 0;
-
-				if (verbose) {
-					if (rc < 128)
-						info("client process exit rc=%d", rc);
-					if (rc > 128 && rc < 255)
-						info("child process was terminated by a signal %d", rc - 128);
-				}
-
-				goto done;
-			}
+		info("sending message: %s", print_cmd(&hdr));
 
-			if (ev[i].data.fd == child_sock) {
-				struct cmd hdr = { 0 };
+	if (TEMP_FAILURE_RETRY(writev(fd, iov, ARRAY_SIZE(iov))) < 0) {
+		errmsg("send_timing: writev");
+		return -1;
+	}
 
-				if (TEMP_FAILURE_RETRY(read(child_sock, &hdr, sizeof(hdr))) < 0) {
-					errmsg("read header");
-					rc = EXIT_FAILURE;
-					goto done;
-				}
+	return 0;
+}
 
-				if (verbose > 2)
-					info("received message: %s", print_cmd(&hdr));
-
-				switch (hdr.type) {
-					case CMD_CLIENT_PID:
-						if (hdr.datalen != sizeof(init_pid)) {
-							info("unexpected data length");
-							rc = EXIT_FAILURE;
-							goto done;
-						}
-						if (TEMP_FAILURE_RETRY(read(child_sock, &init_pid, hdr.datalen)) < 0) {
-							errmsg("unable to read client pid");
-							rc = EXIT_FAILURE;
-							goto done;
-						}
-						break;
-					case CMD_CLIENT_READY:
-						cgroup_add(data->cgroups, init_pid);
+static int
+recv_timing(int fd, uint64_t datalen)
+{
+	struct timing_phase phases[ARRAY_SIZE(((struct timing *) 0)->phases)];
 
-						if (send_cmd(child_sock, CMD_CLIENT_EXEC, NULL, 0) < 0) {
-							rc = EXIT_FAILURE;
-							goto done;
-						}
-						break;
-					default:
-						rc = EXIT_FAILURE;
-						goto done;
-				}
-			}
-		}
-	}
-done:
-	if (fd_ep >= 0) {
-		epollin_remove(fd_ep, fd_signal);
-		epollin_remove(fd_ep, child_sock);
-		close(fd_ep);
+	if (datalen > sizeof(phases) || datalen % sizeof(struct timing_phase)) {
+		info("unexpected data length");
+		return -1;
 	}
 
-	kill_container(data);
+	if (datalen > 0 && TEMP_FAILURE_RETRY(read(fd, phases, datalen)) != (ssize_t) datalen) {
+		errmsg("unable to read client timing");
+		return -1;
+	}
 
-	cgroup_destroy(data->cgroups);
-	free_data(data);
+	timing_merge(phases, datalen / sizeof(struct timing_phase), "parent");
+	return 0;
+}
 
-	unlink(pidfile);
-	pidfile[0] = '\0';
+static void
+write_timing(struct container *data)
+{
+	if (data->timing_file)
+		timing_write_json(data->timing_file, data->name);
 
-	return rc;
+	if (data->trace_file)
+		timing_write_trace(data->trace_file, data->name);
 }
 
 static int
 conatainer_child(struct container *data, int parent_sock)
 {
-	FILE *seccomp_fd = NULL;
-	struct mapfile envs = {};
-	struct mapfile devs = {};
+	int rootfd = -1;
+	sigset_t mask;
+	struct seccomp_filter filter = {};
 
 	program_subname = "child";
 	myerror_progname = myerror_progname_subname;
 
+	// The parent blocks every signal for its signalfd, the init must not
+	// inherit that or it will never see the stop signals.
+	sigemptyset(&mask);
+	if (sigprocmask(SIG_SETMASK, &mask, NULL) < 0)
+		myerror(EXIT_FAILURE, errno, "sigprocmask");
+
 	if (recv_cmd(parent_sock, CMD_CLIENT_REPARENT) < 0)
 		return EXIT_FAILURE;
 
+	close_fds(parent_sock);
+
 	if (prctl(PR_SET_PDEATHSIG, SIGKILL) < 0)
 		myerror(EXIT_FAILURE, errno, "prctl(PR_SET_PDEATHSIG)");
 
@@ -356,30 +224,75 @@ conatainer_child(struct container *data, int parent_sock)
 		reopen_fd(data->output, STDERR_FILENO);
 	}
 
-	if (data->devfile && open_map(data->devfile, &devs, 0) < 0)
-		return EXIT_FAILURE;
+	if (data->pivot_root && !(data->unshare_flags & CLONE_NEWNS))
+		myerror(EXIT_FAILURE, 0, "pivot-root requires the mount namespace");
 
-	if (data->envfile && open_map(data->envfile, &envs, 0) < 0)
-		return EXIT_FAILURE;
+	if (has_device_binds(data->devices) && !(data->unshare_flags & CLONE_NEWNS))
+		myerror(EXIT_FAILURE, 0, "device binds require the mount namespace");
 
-	if (data->seccomp && !(seccomp_fd = fopen(data->seccomp, "r")))
-		myerror(EXIT_FAILURE, errno, "fopen: %s", data->seccomp);
+	if (data->devices_tmpfs && !(data->unshare_flags & CLONE_NEWNS))
+		myerror(EXIT_FAILURE, 0, "devices-tmpfs requires the mount namespace");
+
+	if (data->seccomp) {
+		timing_begin("seccomp_prepare");
+		seccomp_prepare(&filter, data->seccomp, data->statedir);
+		timing_end("seccomp_prepare");
+	}
 
 	if (data->unshare_flags & CLONE_NEWNS) {
 		if (mount("/", "/", "none", MS_PRIVATE | MS_REC, NULL) < 0 && errno != EINVAL)
 			myerror(EXIT_FAILURE, errno, "mount(MS_PRIVATE): %s", data->root);
 
-		if (data->mounts) {
-			do_mount(data->root, data->mounts);
-			free(data->mounts);
+		if (data->root_image) {
+			timing_begin("mount_image");
+			mount_image(data->root_image, data->root, data->statedir);
+			timing_end("mount_image");
+		}
+
+		if (data->overlay) {
+			timing_begin("mount_overlay");
+			mount_overlay(data->root, data->overlay_dir, !strcmp(data->overlay, "tmpfs"));
+			timing_end("mount_overlay");
 		}
+
+		// pivot_root(2) needs the new root to be a mount point.
+		if (data->pivot_root && mount(data->root, data->root, "none", MS_BIND | MS_REC, NULL) < 0)
+			myerror(EXIT_FAILURE, errno, "mount(bind): %s", data->root);
 	}
 
-	if (data->devfile)
-		make_devices(data->root, &devs);
+	// Opened after the mounts on top of the root itself, so it sees them.
+	if ((data->mounts || data->devices || data->devices_tmpfs) &&
+	    (rootfd = open(data->root, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: %s", data->root);
 
-	if (data->unshare_flags & CLONE_NEWNET)
+	// The fresh /dev is there before the fstab, so it can mount into it.
+	if (data->devices_tmpfs) {
+		timing_begin("make_devices");
+		make_devices(rootfd, data->devices, 1);
+		timing_end("make_devices");
+	}
+
+	if ((data->unshare_flags & CLONE_NEWNS) && data->mounts) {
+		timing_begin("do_mount");
+		do_mount(rootfd, data->statedir, data->mounts);
+		free(data->mounts);
+		timing_end("do_mount");
+	}
+
+	if (data->devices && !data->devices_tmpfs) {
+		timing_begin("make_devices");
+		make_devices(rootfd, data->devices, 0);
+		timing_end("make_devices");
+	}
+
+	if (rootfd >= 0)
+		close(rootfd);
+
+	if (data->unshare_flags & CLONE_NEWNET) {
+		timing_begin("setup_network");
 		setup_network();
+		timing_end("setup_network");
+	}
 
 	if (data->hostname && sethostname(data->hostname, strlen(data->hostname)) < 0)
 		myerror(EXIT_FAILURE, errno, "sethostname");
@@ -387,11 +300,28 @@ conatainer_child(struct container *data, int parent_sock)
 	if (nice(data->nice) < 0)
 		myerror(EXIT_FAILURE, errno, "nice: %d", data->nice);
 
-	if (chroot(data->root) < 0)
-		myerror(EXIT_FAILURE, errno, "chroot");
+	// Before the root changes, there may be no sysfs in the new one.
+	if (data->mempolicy != MEMPOLICY_NONE)
+		apply_mempolicy(data);
+
+	if (data->pivot_root) {
+		timing_begin("pivot_root");
+		do_pivot_root(data->root);
+		timing_end("pivot_root");
 
-	if (verbose > 1)
-		info("chrooted: %s", data->root);
+		if (verbose > 1)
+			info("pivoted root: %s", data->root);
+	} else {
+		timing_begin("chroot");
+
+		if (chroot(data->root) < 0)
+			myerror(EXIT_FAILURE, errno, "chroot");
+
+		timing_end("chroot");
+
+		if (verbose > 1)
+			info("chrooted: %s", data->root);
+	}
 
 	if (chdir("/") < 0)
 		myerror(EXIT_FAILURE, errno, "chdir");
@@ -401,8 +331,16 @@ conatainer_child(struct container *data, int parent_sock)
 
 	clearenv();
 
-	if (data->envfile)
-		load_environ(&envs);
+	if (data->envs) {
+		timing_begin("load_environ");
+		load_environ(data->envs);
+		timing_end("load_environ");
+	}
+
+	// The phases are sent while nothing restricts the writes yet, the
+	// parent records the rest up to the exec itself.
+	if ((data->timing_file || data->trace_file) && send_timing(parent_sock) < 0)
+		return EXIT_FAILURE;
 
 	if (send_cmd(parent_sock, CMD_CLIENT_READY, NULL, 0) < 0 ||
 	    recv_cmd(parent_sock, CMD_CLIENT_EXEC) < 0)
@@ -419,7 +357,7 @@ conatainer_child(struct container *data, int parent_sock)
 		apply_caps(data->caps);
 
 	if (data->seccomp)
-		load_seccomp(seccomp_fd, data->seccomp);
+		load_seccomp(&filter, data->seccomp);
 
 	if (setregid(data->gid, data->gid) < 0)
 		myerror(EXIT_FAILURE, errno, "setregid");
@@ -438,54 +376,539 @@ conatainer_child(struct container *data, int parent_sock)
 	return EXIT_FAILURE;
 }
 
+static void
+parent_prepare(void)
+{
+	program_subname = "parent";
+	myerror_progname = myerror_progname_subname;
+
+	if (verbose > 2)
+		info("started");
+
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0) < 0)
+		myerror(EXIT_FAILURE, errno, "prctl(PR_SET_CHILD_SUBREAPER)");
+}
+
+static void
+instance_fail(struct instance *in)
+{
+	in->rc = EXIT_FAILURE;
+	in->done = 1;
+}
+
+/*
+ * Handles an event on one of the instance descriptors. Returns zero if the
+ * descriptor does not belong to the instance.
+ */
 int
-cmd_start(struct container *data)
+instance_event(struct instance *in, int fd_ep, int fd)
 {
+	struct cmd hdr = { 0 };
+	ssize_t size;
 	pid_t pid;
-	int sv[2];
 
-	if (access(data->root, R_OK | X_OK) < 0) {
-		errmsg("access: %s", data->root);
-		return EXIT_FAILURE;
+	if (teardown_event(&in->td, fd))
+		return 1;
+
+	if (monitor_event(&in->mon, fd)) {
+		if (in->mon.restart && !in->done) {
+			info("%s: monitor requested a restart", in->data->name);
+			in->restart = 1;
+			in->done = 1;
+		}
+		return 1;
 	}
 
-	if (setgroups((size_t) 0, NULL) < 0) {
-		errmsg("setgroups");
-		return EXIT_FAILURE;
+	if (fd == in->fd_timer) {
+		timerfd_ack(in->fd_timer);
+		info("%s: container has not started in %d ms", in->data->name, in->data->start_timeout);
+		instance_fail(in);
+		return 1;
 	}
 
-	if (sanitize_fds() < 0)
-		return EXIT_FAILURE;
+	if (fd != in->sock || fd < 0)
+		return 0;
 
-	if (background) {
-		if (daemon(1, 1) < 0) {
-			errmsg("daemon");
-			return EXIT_FAILURE;
+	if ((size = TEMP_FAILURE_RETRY(read(in->sock, &hdr, sizeof(hdr)))) < 0) {
+		errmsg("read header");
+		instance_fail(in);
+		return 1;
+	}
+
+	if (!size) {
+		// The socket is close-on-exec, so EOF after CMD_CLIENT_EXEC
+		// means that the init has been executed.
+		if (!in->exec_sent) {
+			info("%s: client closed connection unexpectedly", in->data->name);
+			instance_fail(in);
+			return 1;
 		}
 
-		openlog(program_invocation_short_name, LOG_PID | LOG_NDELAY, LOG_DAEMON);
-		use_syslog = 1;
+		timerfd_disarm(in->fd_timer);
+
+		timing_end("exec");
+		timing_end("start");
+
+		epollin_remove(fd_ep, in->sock);
+		in->sock = -1;
+		in->running = 1;
+
+		monitor_start(&in->mon, in->data, fd_ep);
+
+		if (verbose > 2)
+			info("client executed");
+		return 1;
 	}
 
-	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
-		myerror(EXIT_FAILURE, errno, "socketpair");
+	if (verbose > 2)
+		info("received message: %s", print_cmd(&hdr));
 
-	if ((pid = fork()) < 0)
-		myerror(EXIT_FAILURE, errno, "fork");
+	switch (hdr.type) {
+		case CMD_CLIENT_PID:
+			if (hdr.datalen != sizeof(pid)) {
+				info("unexpected data length");
+				instance_fail(in);
+				break;
+			}
+			if (TEMP_FAILURE_RETRY(read(in->sock, &pid, hdr.datalen)) < 0) {
+				errmsg("unable to read client pid");
+				instance_fail(in);
+				break;
+			}
+			in->init = reaper_track(in->reaper, fd_ep, pid, -1);
+
+			timing_begin("cgroup_add");
+			cgroup_add(in->data->cgroups, pid);
+			timing_end("cgroup_add");
+			break;
+		case CMD_CLIENT_TIMING:
+			if (recv_timing(in->sock, hdr.datalen) < 0)
+				instance_fail(in);
+			break;
+		case CMD_CLIENT_READY:
+			in->ready = 1;
+			if (in->hold) {
+				// The sandbox is complete, only the exec is left.
+				timerfd_disarm(in->fd_timer);
+				break;
+			}
+			timing_begin("exec");
+			if (send_cmd(in->sock, CMD_CLIENT_EXEC, NULL, 0) < 0) {
+				instance_fail(in);
+				break;
+			}
+			in->exec_sent = 1;
+			break;
+		default:
+			instance_fail(in);
+			break;
+	}
 
-	if (pid > 0) {
-		append_pid(getpid());
-		return container_parent(data, sv[0], pid);
+	return 1;
+}
+
+/*
+ * Lets an instance spawned with the hold flag proceed to the exec.
+ */
+int
+instance_release(struct instance *in)
+{
+	in->hold = 0;
+
+	if (!in->ready || in->done)
+		return 0;
+
+	timing_begin("exec");
+	if (send_cmd(in->sock, CMD_CLIENT_EXEC, NULL, 0) < 0) {
+		instance_fail(in);
+		return -1;
+	}
+
+	in->exec_sent = 1;
+	return 0;
+}
+
+/*
+ * Must be called after reaper_drain() to advance the instance when one of its
+ * processes has exited.
+ */
+void
+instance_update(struct instance *in, int fd_ep)
+{
+	if (in->done)
+		return;
+
+	if (in->temp && in->temp->exited) {
+		if (in->temp->rc != EXIT_SUCCESS) {
+			info("%s: temp pid ended unexpectedly (rc=%d)", in->data->name, in->temp->rc);
+			in->rc = in->temp->rc;
+			in->done = 1;
+			return;
+		}
+
+		reaper_untrack(in->reaper, fd_ep, in->temp);
+		in->temp = NULL;
+
+		if (send_cmd(in->sock, CMD_CLIENT_REPARENT, NULL, 0) < 0) {
+			instance_fail(in);
+			return;
+		}
+	}
+
+	if (in->init && in->init->exited) {
+		in->rc = in->init->rc;
+		in->done = 1;
+
+		if (verbose) {
+			if (in->rc < 128)
+				info("client process exit rc=%d", in->rc);
+			if (in->rc > 128 && in->rc < 255)
+				info("child process was terminated by a signal %d", in->rc - 128);
+		}
+	}
+}
+
+/*
+ * Stops the processes of a finished instance without waiting for them. Returns
+ * non-zero while they are still being stopped.
+ */
+int
+instance_teardown(struct instance *in, int fd_ep)
+{
+	monitor_stop(&in->mon);
+
+	if (in->td.state == TEARDOWN_IDLE)
+		teardown_start(&in->td, in->data->cgroups, in->data->stop_signals, fd_ep);
+
+	return in->td.state != TEARDOWN_DONE;
+}
+
+void
+instance_stop(struct instance *in, int fd_ep)
+{
+	monitor_stop(&in->mon);
+
+	timing_begin("kill_container");
+	// Before the exec the container runs only our code, which does not
+	// need the stop signals. A held pool sandbox is killed at once.
+	if (in->td.state != TEARDOWN_DONE) {
+		teardown_cancel(&in->td);
+		kill_container(in->data, !in->running);
 	}
+	in->td.state = TEARDOWN_IDLE;
+
+	// The init of a pid namespace becomes a zombie only after the rest of
+	// the container is gone, so the cgroup may be empty a bit earlier.
+	if (in->init && !in->init->exited) {
+		struct pollfd pfd = { .fd = in->init->pidfd, .events = POLLIN };
+
+		if (TEMP_FAILURE_RETRY(poll(&pfd, 1, INIT_EXIT_TIMEOUT)) < 0)
+			errmsg("poll(pidfd)");
+	}
+
+	reaper_drain(in->reaper);
+	timing_end("kill_container");
+
+	reaper_untrack(in->reaper, fd_ep, in->temp);
+	reaper_untrack(in->reaper, fd_ep, in->init);
+	in->temp = in->init = NULL;
+
+	epollin_remove(fd_ep, in->sock);
+	epollin_remove(fd_ep, in->fd_timer);
+	in->sock = in->fd_timer = -1;
+
+	timing_begin("cgroup_destroy");
+	cgroup_destroy(in->data->cgroups);
+	timing_end("cgroup_destroy");
+
+	if (in->data->overlay_dir) {
+		remove_overlay(in->data->overlay_dir, !strcmp(in->data->overlay, "tmpfs"), in->data->overlay_keep);
+		in->data->overlay_dir = xfree(in->data->overlay_dir);
+	}
+}
+
+/*
+ * Stops the instance so that it can be spawned again. The new cgroup gets the
+ * controllers of the old one.
+ */
+void
+instance_restart(struct instance *in, int fd_ep)
+{
+	struct container *data = in->data;
+	struct cgroups saved = { 0 };
+
+	cgroup_copy_controllers(&saved, data->cgroups);
+	instance_stop(in, fd_ep);
+	cgroup_copy_controllers(data->cgroups, &saved);
+	cgroup_free_controllers(&saved);
+
+	memset(in, 0, sizeof(*in));
+	in->sock = in->fd_timer = -1;
+}
+
+/*
+ * Counts the restarts of a container. Returns zero if it has been restarted too
+ * often lately and has to stay stopped.
+ */
+int
+restart_allowed(struct restarts *rs, const char *name)
+{
+	uint64_t now = timing_now();
+
+	if (!rs->count || now - rs->since >= (uint64_t) RESTART_INTERVAL * 1000000) {
+		rs->since = now;
+		rs->count = 0;
+	}
+
+	if (rs->count >= RESTART_BURST) {
+		info("%s: restarted %u times in %d ms, giving up restarts", name, rs->count, RESTART_INTERVAL);
+		return 0;
+	}
+
+	rs->count++;
+	return 1;
+}
+
+/*
+ * Waits out the delay before a restart. Returns non-zero if a signal asked to
+ * stop meanwhile.
+ */
+static int
+restart_wait(int fd_signal, struct reaper *reaper)
+{
+	struct pollfd pfd = { .fd = fd_signal, .events = POLLIN };
+	uint64_t now, deadline = timing_now() + (uint64_t) RESTART_DELAY * 1000000;
+
+	while ((now = timing_now()) < deadline) {
+		struct signalfd_siginfo fdsi;
+
+		if (TEMP_FAILURE_RETRY(poll(&pfd, 1, (int) ((deadline - now + 999999) / 1000000))) < 0)
+			myerror(EXIT_FAILURE, errno, "poll");
+
+		while (TEMP_FAILURE_RETRY(read(fd_signal, &fdsi, sizeof(fdsi))) == sizeof(fdsi)) {
+			if (fdsi.ssi_signo != SIGCHLD)
+				return 1;
+		}
+
+		reaper_drain(reaper);
+	}
+
+	return 0;
+}
+
+/*
+ * Picks the directory for the writable layer of this instance. Pool members
+ * get their own layer because the directory follows the cgroup name, so the
+ * supervisor does not pool the sections that keep their layer.
+ */
+static int
+prepare_overlay(struct container *data)
+{
+	int tmpfs = !strcmp(data->overlay, "tmpfs");
+	char *base = NULL;
+
+	if (tmpfs) {
+		if (!data->statedir) {
+			info("%s: overlay in tmpfs requires the state directory", data->name);
+			return -1;
+		}
+		xasprintf(&base, "%s/overlay", data->statedir);
+	} else {
+		base = xstrdup(data->overlay);
+	}
+
+	if (mkdir(base, 0700) < 0 && errno != EEXIST) {
+		errmsg("mkdir: %s", base);
+		xfree(base);
+		return -1;
+	}
+
+	xfree(data->overlay_dir);
+	xasprintf(&data->overlay_dir, "%s/%s", base, data->cgroups->name);
+	xfree(base);
+
+	// A layer left behind by a crashed instance must not leak into this one.
+	return remove_overlay(data->overlay_dir, tmpfs, data->overlay_keep);
+}
+
+static int
+container_parent(struct container *data)
+{
+	int i, rc, ep_timeout;
+	sigset_t mask;
+	int fd_ep, fd_signal;
+	struct reaper reaper = {};
+	struct restarts restarts = {};
+	struct instance in = {};
+
+	ep_timeout = 0;
+
+	sigfillset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	sigdelset(&mask, SIGABRT);
+	sigdelset(&mask, SIGSEGV);
+
+	if ((fd_signal = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "signalfd");
+
+	fd_ep = epollin_init();
+	epollin_add(fd_ep, fd_signal);
+
+spawn:
+	if (instance_spawn(&in, data, &reaper, fd_ep) < 0) {
+		rc = EXIT_FAILURE;
+		goto done;
+	}
+
+	while (!in.done) {
+		struct epoll_event ev[42];
+		int fdcount;
+		ssize_t size;
+
+		errno = 0;
+		if ((fdcount = epoll_wait(fd_ep, ev, ARRAY_SIZE(ev), ep_timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			myerror(EXIT_FAILURE, errno, "epoll_wait");
+		}
+
+		for (i = 0; i < fdcount && !in.done; i++) {
+			if (!(ev[i].events & (EPOLLIN | EPOLLPRI | EPOLLHUP))) {
+				continue;
+			}
+
+			if (ev[i].data.fd == fd_signal) {
+				struct signalfd_siginfo fdsi;
+
+				while ((size = TEMP_FAILURE_RETRY(read(fd_signal, &fdsi, sizeof(struct signalfd_siginfo)))) > 0) {
+					if (size != sizeof(struct signalfd_siginfo)) {
+						info("unable to read signal info");
+						break;
+					}
+
+					if (fdsi.ssi_signo != SIGCHLD)
+						in.done = 1;
+				}
+
+				continue;
+			}
+
+			// Other descriptors are pidfds. They only wake us up.
+			instance_event(&in, fd_ep, ev[i].data.fd);
+		}
+
+		// Collect every exited child, including the reparented ones,
+		// regardless of how many SIGCHLD were coalesced.
+		ep_timeout = reaper_drain(&reaper) ? 0 : -1;
+
+		instance_update(&in, fd_ep);
+	}
+
+	// The monitor asked for a fresh container in the same cgroup.
+	if (in.restart && restart_allowed(&restarts, data->name)) {
+		rc = in.rc;
+		instance_restart(&in, fd_ep);
+
+		if (!restart_wait(fd_signal, &reaper))
+			goto spawn;
+
+		// Stopped between the two containers, nothing is running.
+		goto stopped;
+	}
+
+	rc = in.rc;
+done:
+	instance_stop(&in, fd_ep);
+stopped:
+
+	reaper_free(&reaper, fd_ep);
+	epollin_remove(fd_ep, fd_signal);
+	close(fd_ep);
+
+	write_timing(data);
+	free_data(data);
+
+	unlink(pidfile);
+	pidfile[0] = '\0';
+
+	return rc;
+}
+
+static pid_t
+spawn_clone3(struct container *data, int sv[2], int *fd_init)
+{
+	pid_t pid;
+	int fd_cgroup;
+
+	timing_begin("clone3");
+
+	fd_cgroup = cgroup_open_unified(data->cgroups);
+
+	if ((pid = clone3_flags(data->unshare_flags, fd_cgroup, fd_init)) < 0 &&
+	    fd_cgroup >= 0 && (errno == EINVAL || errno == E2BIG)) {
+		// CLONE_INTO_CGROUP requires Linux 5.7.
+		close(fd_cgroup);
+		fd_cgroup = -1;
+
+		pid = clone3_flags(data->unshare_flags, fd_cgroup, fd_init);
+	}
+
+	if (pid < 0) {
+		if (errno != ENOSYS)
+			myerror(EXIT_FAILURE, errno, "clone3");
+
+		if (fd_cgroup >= 0)
+			close(fd_cgroup);
+
+		timing_end("clone3");
+
+		if (verbose > 1)
+			info("clone3 is not supported, fallback to fork");
+
+		return -1;
+	}
+
+	if (!pid) {
+		close(sv[0]);
+
+		// pid == 1 if pid namespace
+		exit(conatainer_child(data, sv[1]));
+	}
+
+	timing_end("clone3");
+
+	if (fd_cgroup >= 0) {
+		close(fd_cgroup);
+	} else {
+		timing_begin("cgroup_add");
+		cgroup_add(data->cgroups, pid);
+		timing_end("cgroup_add");
+	}
+
+	if (verbose > 2)
+		info("client cloned (pid=%d)", pid);
+
+	return pid;
+}
+
+static int
+container_client(struct container *data, int parent_sock)
+{
+	pid_t pid;
+
+	program_subname = "client";
 
 	if (prctl(PR_SET_PDEATHSIG, SIGKILL) < 0)
 		myerror(EXIT_FAILURE, errno, "prctl(PR_SET_PDEATHSIG)");
 
-	if (recv_cmd(sv[1], CMD_FORK_CLIENT) < 0)
+	if (recv_cmd(parent_sock, CMD_FORK_CLIENT) < 0)
 		return EXIT_FAILURE;
 
 	// unshare namespaces
+	timing_begin("unshare_flags");
 	unshare_flags(data->unshare_flags);
+	timing_end("unshare_flags");
 
 	// fork to switch to new pid namespace
 	if ((pid = fork()) < 0)
@@ -497,12 +920,133 @@ cmd_start(struct container *data)
 
 		free_data(data);
 
-		if (send_cmd(sv[1], CMD_CLIENT_PID, &pid, sizeof(pid)) < 0)
+		if (send_cmd(parent_sock, CMD_CLIENT_PID, &pid, sizeof(pid)) < 0)
 			myerror(EXIT_FAILURE, errno, "unable to transfer pid");
 
 		return EXIT_SUCCESS;
 	}
 
 	// pid == 1 if pid namespace
-	return conatainer_child(data, sv[1]);
+	return conatainer_child(data, parent_sock);
+}
+
+/*
+ * Creates the cgroup and spawns the container processes. The caller owns the
+ * epoll loop and must feed the events to instance_event().
+ */
+int
+instance_spawn(struct instance *in, struct container *data, struct reaper *reaper, int fd_ep)
+{
+	int sv[2], fd_init = -1;
+	pid_t pid = -1;
+	cmd_t cmd;
+
+	in->data = data;
+	in->reaper = reaper;
+	in->sock = in->fd_timer = -1;
+	in->rc = EXIT_SUCCESS;
+
+	if (data->overlay && prepare_overlay(data) < 0)
+		return -1;
+
+	if ((data->unshare_flags & CLONE_NEWNS) && data->mounts) {
+		int ret;
+
+		timing_begin("check_mounts");
+		ret = check_mounts(data->root_image ? NULL : data->root,
+		                   data->devices_tmpfs ? "/dev" : NULL, data->mounts);
+		timing_end("check_mounts");
+
+		if (ret < 0)
+			return -1;
+	}
+
+	if (data->placement == PLACEMENT_AUTO && placement_assign(data) < 0)
+		return -1;
+
+	timing_begin("cgroup_create");
+	if (cgroup_create(data->cgroups) < 0) {
+		timing_end("cgroup_create");
+		return -1;
+	}
+	timing_end("cgroup_create");
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		errmsg("socketpair");
+		return -1;
+	}
+
+	if (data->spawn == SPAWN_CLONE3)
+		pid = spawn_clone3(data, sv, &fd_init);
+
+	if (pid > 0) {
+		// The init was cloned directly into the new namespaces.
+		in->init = reaper_track(reaper, fd_ep, pid, fd_init);
+		cmd = CMD_CLIENT_REPARENT;
+	} else {
+		if ((pid = fork()) < 0)
+			myerror(EXIT_FAILURE, errno, "fork");
+
+		if (!pid) {
+			close(sv[0]);
+			exit(container_client(data, sv[1]));
+		}
+
+		in->temp = reaper_track(reaper, fd_ep, pid, -1);
+		cmd = CMD_FORK_CLIENT;
+	}
+
+	// Only the client side keeps sv[1] so that its exec closes the channel.
+	close(sv[1]);
+
+	in->sock = sv[0];
+	in->fd_timer = timerfd_init();
+
+	epollin_add(fd_ep, in->sock);
+	epollin_add(fd_ep, in->fd_timer);
+
+	if (data->start_timeout > 0)
+		timerfd_arm(in->fd_timer, data->start_timeout);
+
+	return send_cmd(in->sock, cmd, NULL, 0);
+}
+
+int
+cmd_start(struct container *data)
+{
+	if (access(data->root, R_OK | X_OK) < 0) {
+		errmsg("access: %s", data->root);
+		return EXIT_FAILURE;
+	}
+
+	if (data->root_image && access(data->root_image, R_OK) < 0) {
+		errmsg("access: %s", data->root_image);
+		return EXIT_FAILURE;
+	}
+
+	// In a user namespace with setgroups denied there is nothing to drop.
+	if (setgroups((size_t) 0, NULL) < 0 && !(errno == EPERM && setgroups_denied())) {
+		errmsg("setgroups");
+		return EXIT_FAILURE;
+	}
+
+	if (sanitize_fds() < 0)
+		return EXIT_FAILURE;
+
+	if (background) {
+		if (daemon(1, 1) < 0) {
+			errmsg("daemon");
+			return EXIT_FAILURE;
+		}
+
+		openlog(program_invocation_short_name, LOG_PID | LOG_NDELAY, LOG_DAEMON);
+		use_syslog = 1;
+	}
+
+	timing_begin("start");
+
+	append_pid(getpid());
+	parent_prepare();
+
+	return container_parent(data);
 }
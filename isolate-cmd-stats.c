@@ -0,0 +1,578 @@
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+#define STATS_BUFSIZ 8192
+
+int stats_watch = 0;
+int stats_json = 0;
+
+enum {
+	STATS_PROCS = 0,
+	STATS_CPU,
+	STATS_CPUACCT,
+	STATS_MEMORY,
+	STATS_MEMORY_PEAK,
+	STATS_MEMORY_STAT,
+	STATS_IO,
+	STATS_IO_OPS,
+	STATS_PIDS,
+	STATS_PSI_CPU,
+	STATS_PSI_MEMORY,
+	STATS_PSI_IO,
+	STATS_MAX,
+};
+
+/*
+ * The files of one sample. A NULL name means the hierarchy has no such file.
+ * In cgroup v2 the cpu usage is in cpu.stat and the io operations are in
+ * io.stat, v1 has no pressure files. The processes are always there, because
+ * the freezer is.
+ */
+static const struct {
+	const char *controller;
+	const char *v2;
+	const char *v1;
+} stats_files[STATS_MAX] = {
+	[STATS_PROCS]       = { "freezer", "cgroup.procs",    "cgroup.procs"                             },
+	[STATS_CPU]         = { "cpu",     "cpu.stat",        "cpu.stat"                                 },
+	[STATS_CPUACCT]     = { "cpuacct", NULL,              "cpuacct.usage"                            },
+	[STATS_MEMORY]      = { "memory",  "memory.current",  "memory.usage_in_bytes"                    },
+	[STATS_MEMORY_PEAK] = { "memory",  "memory.peak",     "memory.max_usage_in_bytes"                },
+	[STATS_MEMORY_STAT] = { "memory",  "memory.stat",     "memory.stat"                              },
+	[STATS_IO]          = { "blkio",   "io.stat",         "blkio.throttle.io_service_bytes_recursive" },
+	[STATS_IO_OPS]      = { "blkio",   NULL,              "blkio.throttle.io_serviced_recursive"     },
+	[STATS_PIDS]        = { "pids",    "pids.current",    "pids.current"                             },
+	[STATS_PSI_CPU]     = { NULL,      "cpu.pressure",    NULL                                       },
+	[STATS_PSI_MEMORY]  = { NULL,      "memory.pressure", NULL                                       },
+	[STATS_PSI_IO]      = { NULL,      "io.pressure",     NULL                                       },
+};
+
+static const char *const psi_names[] = { "cpu", "memory", "io" };
+
+/*
+ * Missing values are negative.
+ */
+struct stats_sample {
+	uint64_t time;
+	int64_t cpu_usec;
+	int64_t nr_periods;
+	int64_t nr_throttled;
+	int64_t throttled_usec;
+	int64_t memory;
+	int64_t memory_peak;
+	int64_t anon;
+	int64_t file;
+	int64_t rbytes;
+	int64_t wbytes;
+	int64_t rios;
+	int64_t wios;
+	int64_t pids;
+	double psi_some[3];
+	double psi_full[3];
+	double cpu_percent;
+};
+
+struct stats_target {
+	struct container data;
+	int fds[STATS_MAX];
+	int running;
+	struct stats_sample prev;
+	char memory_stat[STATS_BUFSIZ];
+};
+
+static uint64_t
+monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void
+stats_close(struct stats_target *t)
+{
+	for (size_t i = 0; i < STATS_MAX; i++) {
+		if (t->fds[i] >= 0)
+			close(t->fds[i]);
+		t->fds[i] = -1;
+	}
+	t->running = 0;
+}
+
+/*
+ * The descriptors stay open between the samples. They are opened again only
+ * after the container has been restarted.
+ */
+static void
+stats_open(struct stats_target *t)
+{
+	struct cgroups *cg = t->data.cgroups;
+	int v2 = (cgroup_version(cg) == CGROUP_V2);
+
+	for (size_t i = 0; i < STATS_MAX; i++) {
+		const char *file = v2 ? stats_files[i].v2 : stats_files[i].v1;
+
+		if (file && (t->fds[i] = cgroup_open(cg, stats_files[i].controller, file)) >= 0)
+			t->running = 1;
+	}
+}
+
+static int
+stats_read(struct stats_target *t, int idx, char *buf, size_t size)
+{
+	ssize_t len;
+
+	if (t->fds[idx] < 0)
+		return -1;
+
+	if ((len = TEMP_FAILURE_RETRY(pread(t->fds[idx], buf, size - 1, 0))) < 0) {
+		// The cgroup has been removed.
+		if (errno != ENODEV)
+			errmsg("read: %s", t->data.name);
+		stats_close(t);
+		return -1;
+	}
+
+	buf[len] = '\0';
+	return 0;
+}
+
+static int64_t
+stats_value(const char *buf)
+{
+	char *end;
+	long long value = strtoll(buf, &end, 10);
+
+	return (end == buf) ? -1 : value;
+}
+
+/*
+ * Returns the value of the "KEY VALUE" line.
+ */
+static int64_t
+stats_key(const char *buf, const char *key)
+{
+	size_t len = strlen(key);
+
+	for (const char *p = buf; (p = strstr(p, key)); p += len) {
+		if ((p == buf || p[-1] == '\n') && p[len] == ' ')
+			return stats_value(p + len + 1);
+	}
+	return -1;
+}
+
+static void
+add_value(int64_t *sum, int64_t value)
+{
+	*sum = (*sum < 0 ? 0 : *sum) + value;
+}
+
+/*
+ * The v2 io.stat has a line per device with "rbytes=N wbytes=N rios=N ...".
+ */
+static void
+parse_io_stat(const char *buf, struct stats_sample *s)
+{
+	static const struct {
+		const char *key;
+		size_t offset;
+	} keys[] = {
+		{ " rbytes=", offsetof(struct stats_sample, rbytes) },
+		{ " wbytes=", offsetof(struct stats_sample, wbytes) },
+		{ " rios=",   offsetof(struct stats_sample, rios)   },
+		{ " wios=",   offsetof(struct stats_sample, wios)   },
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(keys); i++) {
+		int64_t *sum = (int64_t *) ((char *) s + keys[i].offset);
+
+		for (const char *p = buf; (p = strstr(p, keys[i].key)); p++)
+			add_value(sum, stats_value(p + strlen(keys[i].key)));
+	}
+}
+
+/*
+ * The v1 blkio files have "MAJ:MIN Read N" and "MAJ:MIN Write N" lines.
+ */
+static void
+parse_blkio(const char *buf, int64_t *rsum, int64_t *wsum)
+{
+	char op[16];
+	long long value;
+
+	for (const char *p = buf; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+		if (sscanf(p, "%*s %15s %lld", op, &value) != 2)
+			continue;
+		if (!strcmp(op, "Read"))
+			add_value(rsum, value);
+		else if (!strcmp(op, "Write"))
+			add_value(wsum, value);
+	}
+}
+
+static void
+parse_pressure(const char *buf, double *some, double *full)
+{
+	const char *p;
+
+	if ((p = strstr(buf, "some avg10=")))
+		*some = strtod(p + 11, NULL);
+	if ((p = strstr(buf, "full avg10=")))
+		*full = strtod(p + 11, NULL);
+}
+
+static void
+stats_sample(struct stats_target *t, struct stats_sample *s)
+{
+	char buf[STATS_BUFSIZ];
+	int v2;
+
+	*s = (struct stats_sample) {
+		.cpu_usec       = -1,
+		.nr_periods     = -1,
+		.nr_throttled   = -1,
+		.throttled_usec = -1,
+		.memory         = -1,
+		.memory_peak    = -1,
+		.anon           = -1,
+		.file           = -1,
+		.rbytes         = -1,
+		.wbytes         = -1,
+		.rios           = -1,
+		.wios           = -1,
+		.pids           = -1,
+		.psi_some       = { -1, -1, -1 },
+		.psi_full       = { -1, -1, -1 },
+		.cpu_percent    = -1,
+	};
+	t->memory_stat[0] = '\0';
+
+	if (!t->running)
+		stats_open(t);
+
+	if (!t->running)
+		return;
+
+	s->time = monotonic_usec();
+	v2 = (cgroup_version(t->data.cgroups) == CGROUP_V2);
+
+	if (!stats_read(t, STATS_CPU, buf, sizeof(buf))) {
+		s->nr_periods   = stats_key(buf, "nr_periods");
+		s->nr_throttled = stats_key(buf, "nr_throttled");
+
+		if (v2) {
+			s->cpu_usec       = stats_key(buf, "usage_usec");
+			s->throttled_usec = stats_key(buf, "throttled_usec");
+		} else if ((s->throttled_usec = stats_key(buf, "throttled_time")) > 0) {
+			s->throttled_usec /= 1000;
+		}
+	}
+
+	if (!stats_read(t, STATS_CPUACCT, buf, sizeof(buf)) && (s->cpu_usec = stats_value(buf)) > 0)
+		s->cpu_usec /= 1000;
+
+	if (!stats_read(t, STATS_MEMORY, buf, sizeof(buf)))
+		s->memory = stats_value(buf);
+
+	if (!stats_read(t, STATS_MEMORY_PEAK, buf, sizeof(buf)))
+		s->memory_peak = stats_value(buf);
+
+	if (!stats_read(t, STATS_MEMORY_STAT, t->memory_stat, sizeof(t->memory_stat))) {
+		s->anon = stats_key(t->memory_stat, v2 ? "anon" : "total_rss");
+		s->file = stats_key(t->memory_stat, v2 ? "file" : "total_cache");
+	}
+
+	if (!stats_read(t, STATS_IO, buf, sizeof(buf))) {
+		if (v2)
+			parse_io_stat(buf, s);
+		else
+			parse_blkio(buf, &s->rbytes, &s->wbytes);
+	}
+
+	if (!stats_read(t, STATS_IO_OPS, buf, sizeof(buf)))
+		parse_blkio(buf, &s->rios, &s->wios);
+
+	if (!stats_read(t, STATS_PIDS, buf, sizeof(buf))) {
+		s->pids = stats_value(buf);
+
+	} else if (!stats_read(t, STATS_PROCS, buf, sizeof(buf))) {
+		// Without the pids controller the processes are counted.
+		s->pids = 0;
+		for (const char *p = buf; (p = strchr(p, '\n')); p++)
+			s->pids++;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(psi_names); i++) {
+		if (!stats_read(t, STATS_PSI_CPU + (int) i, buf, sizeof(buf)))
+			parse_pressure(buf, &s->psi_some[i], &s->psi_full[i]);
+	}
+
+	// The usage of a restarted container starts from zero.
+	if (t->prev.time && s->cpu_usec >= t->prev.cpu_usec && t->prev.cpu_usec >= 0)
+		s->cpu_percent = (double) (s->cpu_usec - t->prev.cpu_usec) * 100.0 /
+		                 (double) (s->time - t->prev.time);
+}
+
+static void
+format_bytes(char *buf, size_t size, int64_t value)
+{
+	static const char units[] = "KMGTP";
+	double v = (double) value;
+	size_t i = 0;
+
+	if (value < 0) {
+		snprintf(buf, size, "-");
+		return;
+	}
+
+	if (value < 1024) {
+		snprintf(buf, size, "%" PRId64, value);
+		return;
+	}
+
+	while ((v /= 1024) >= 1024 && i < sizeof(units) - 2)
+		i++;
+
+	snprintf(buf, size, "%.1f%c", v, units[i]);
+}
+
+static void
+format_number(char *buf, size_t size, int64_t value)
+{
+	if (value < 0)
+		snprintf(buf, size, "-");
+	else
+		snprintf(buf, size, "%" PRId64, value);
+}
+
+static void
+format_double(char *buf, size_t size, double value)
+{
+	if (value < 0)
+		snprintf(buf, size, "-");
+	else
+		snprintf(buf, size, "%.1f", value);
+}
+
+static void
+print_header(void)
+{
+	printf("%-16s %6s %10s %9s %8s %8s %8s %8s %8s %8s %8s %8s %6s %7s %7s %7s\n",
+	       "NAME", "CPU%", "CPU-TIME", "THROTTLED", "MEM", "PEAK", "ANON", "FILE",
+	       "IO-READ", "IO-WRITE", "RIOS", "WIOS", "PIDS", "PSI-CPU", "PSI-MEM", "PSI-IO");
+}
+
+static void
+print_table(struct stats_target *t, struct stats_sample *s)
+{
+	char cpu[16], usage[32], throttled[32], mem[16], peak[16], anon[16], file[16];
+	char rbytes[16], wbytes[16], rios[32], wios[32], pids[32], psi[3][16];
+
+	format_double(cpu, sizeof(cpu), s->cpu_percent);
+	format_double(usage, sizeof(usage), s->cpu_usec < 0 ? -1 : (double) s->cpu_usec / 1000000);
+	format_number(throttled, sizeof(throttled), s->nr_throttled);
+	format_bytes(mem, sizeof(mem), s->memory);
+	format_bytes(peak, sizeof(peak), s->memory_peak);
+	format_bytes(anon, sizeof(anon), s->anon);
+	format_bytes(file, sizeof(file), s->file);
+	format_bytes(rbytes, sizeof(rbytes), s->rbytes);
+	format_bytes(wbytes, sizeof(wbytes), s->wbytes);
+	format_number(rios, sizeof(rios), s->rios);
+	format_number(wios, sizeof(wios), s->wios);
+	format_number(pids, sizeof(pids), s->pids);
+
+	for (size_t i = 0; i < ARRAY_SIZE(psi_names); i++)
+		format_double(psi[i], sizeof(psi[i]), s->psi_some[i]);
+
+	printf("%-16s %6s %10s %9s %8s %8s %8s %8s %8s %8s %8s %8s %6s %7s %7s %7s\n",
+	       t->data.name, cpu, usage, throttled, mem, peak, anon, file,
+	       rbytes, wbytes, rios, wios, pids, psi[0], psi[1], psi[2]);
+}
+
+static void
+print_json_string(const char *str)
+{
+	putchar('"');
+	for (const char *p = str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			putchar('\\');
+		if ((unsigned char) *p < 0x20)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
+}
+
+static void
+print_json_number(const char *key, int64_t value)
+{
+	if (value >= 0)
+		printf(",\"%s\":%" PRId64, key, value);
+}
+
+/*
+ * One object per line, the missing values are left out.
+ */
+static void
+print_json(struct stats_target *t, struct stats_sample *s)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	printf("{\"name\":");
+	print_json_string(t->data.name);
+	printf(",\"time\":%lld.%03ld,\"running\":%s",
+	       (long long) now.tv_sec, now.tv_nsec / 1000000, (t->running ? "true" : "false"));
+
+	if (!t->running) {
+		printf("}\n");
+		return;
+	}
+
+	print_json_number("cpu_usage_usec", s->cpu_usec);
+	if (s->cpu_percent >= 0)
+		printf(",\"cpu_percent\":%.2f", s->cpu_percent);
+	print_json_number("cpu_nr_periods", s->nr_periods);
+	print_json_number("cpu_nr_throttled", s->nr_throttled);
+	print_json_number("cpu_throttled_usec", s->throttled_usec);
+	print_json_number("memory_current", s->memory);
+	print_json_number("memory_peak", s->memory_peak);
+	print_json_number("io_rbytes", s->rbytes);
+	print_json_number("io_wbytes", s->wbytes);
+	print_json_number("io_rios", s->rios);
+	print_json_number("io_wios", s->wios);
+	print_json_number("pids_current", s->pids);
+
+	if (t->memory_stat[0]) {
+		char key[64];
+		long long value;
+		int n, first = 1;
+
+		printf(",\"memory_stat\":{");
+		for (const char *p = t->memory_stat; sscanf(p, "%63s %lld\n%n", key, &value, &n) == 2; p += n) {
+			printf("%s\"%s\":%lld", (first ? "" : ","), key, value);
+			first = 0;
+		}
+		printf("}");
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(psi_names); i++) {
+		if (s->psi_some[i] < 0)
+			continue;
+		printf(",\"psi_%s\":{\"some_avg10\":%.2f", psi_names[i], s->psi_some[i]);
+		if (s->psi_full[i] >= 0)
+			printf(",\"full_avg10\":%.2f", s->psi_full[i]);
+		printf("}");
+	}
+
+	printf("}\n");
+}
+
+static void
+stats_load(struct stats_target *t, const char *filename, struct container *defaults, char *name)
+{
+	memset(t, 0, sizeof(*t));
+
+	for (size_t i = 0; i < STATS_MAX; i++)
+		t->fds[i] = -1;
+
+	t->data.cgroups = xcalloc(1, sizeof(struct cgroups));
+
+	set_cgroups_group(&t->data, (char *) "");
+	set_cgroups_dir(&t->data, defaults->cgroups->rootdir);
+	cgroup_controller(t->data.cgroups, "freezer", CGROUP_FREEZER);
+
+	if (defaults->statedir)
+		set_state_dir(&t->data, defaults->statedir);
+
+	load_config(filename, name, &t->data);
+}
+
+/*
+ * Prints the resource usage of the containers, or of all of them if no names
+ * are given. With --watch it samples them again every interval.
+ */
+int
+cmd_stats(const char *filename, struct container *defaults, int argc, char **argv)
+{
+	struct stats_target *targets;
+	char **sections = NULL;
+	size_t i, nr;
+	int fd_timer = -1;
+
+	if (argc > 0) {
+		nr = (size_t) argc;
+	} else {
+		sections = read_config_sections(filename);
+		argv = sections;
+		for (nr = 0; sections && sections[nr]; nr++);
+	}
+
+	targets = xcalloc(nr, sizeof(*targets));
+
+	for (i = 0; i < nr; i++)
+		stats_load(&targets[i], filename, defaults, argv[i]);
+
+	if (stats_watch)
+		fd_timer = timerfd_init();
+
+	while (1) {
+		if (fd_timer >= 0)
+			timerfd_arm(fd_timer, stats_watch);
+
+		if (!stats_json)
+			print_header();
+
+		for (i = 0; i < nr; i++) {
+			struct stats_sample s;
+
+			stats_sample(&targets[i], &s);
+
+			if (stats_json)
+				print_json(&targets[i], &s);
+			else
+				print_table(&targets[i], &s);
+
+			targets[i].prev = s;
+		}
+
+		fflush(stdout);
+
+		if (fd_timer < 0)
+			break;
+
+		struct pollfd pfd = { .fd = fd_timer, .events = POLLIN };
+
+		if (TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) < 0)
+			myerror(EXIT_FAILURE, errno, "poll");
+
+		timerfd_ack(fd_timer);
+
+		if (!stats_json)
+			putchar('\n');
+	}
+
+	for (i = 0; i < nr; i++) {
+		stats_close(&targets[i]);
+		free_data(&targets[i].data);
+	}
+	xfree(targets);
+
+	for (i = 0; sections && sections[i]; i++)
+		xfree(sections[i]);
+	xfree(sections);
+
+	return EXIT_SUCCESS;
+}
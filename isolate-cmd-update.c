@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "isolate.h"
+
+extern int verbose;
+
+/*
+ * Changes the resource limits of a running container. Only the given limits
+ * are written, those of the configuration are left as they are.
+ */
+int
+cmd_update(struct container *data, int argc, char **argv)
+{
+	struct cgroups update = {};
+	int rc = EXIT_FAILURE;
+	size_t i;
+
+	if (argc < 1) {
+		info("nothing to update, KEY=VALUE required");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < (size_t) argc; i++) {
+		char *key = xstrdup(argv[i]);
+		char *value = strchr(key, '=');
+		int ret = -1;
+
+		if (!value) {
+			info("KEY=VALUE required: %s", argv[i]);
+		} else {
+			*value++ = '\0';
+			ret = cgroup_limit(&update, key, value);
+		}
+
+		xfree(key);
+
+		if (ret < 0)
+			goto out;
+	}
+
+	if (!cgroup_populated(data->cgroups)) {
+		info("container is not running");
+		goto out;
+	}
+
+	if (cgroup_apply_limits(data->cgroups, update.limits) < 0)
+		goto out;
+
+	if (verbose) {
+		for (i = 0; update.limits[i]; i++)
+			info("%s: %s", data->name, update.limits[i]);
+	}
+
+	rc = EXIT_SUCCESS;
+out:
+	for (i = 0; update.controller && update.controller[i]; i++)
+		xfree(update.controller[i]);
+	for (i = 0; update.limits && update.limits[i]; i++)
+		xfree(update.limits[i]);
+
+	xfree(update.controller);
+	xfree(update.dirname);
+	xfree(update.limits);
+
+	return rc;
+}
@@ -19,6 +19,11 @@ myerror_default_progname(char **out)
 	xasprintf(out, "%s: ", program_invocation_short_name);
 }
 
+/*
+ * Prints the message with the description of errnum if it is not zero. The
+ * process exits with exitnum unless it is EXIT_SUCCESS, so errmsg() and info()
+ * return to the caller.
+ */
 void
     __attribute__((format(printf, 3, 4)))
     myerror(const int exitnum, const int errnum, const char *fmt, ...)
@@ -61,8 +66,6 @@ void
 		strcpy(msg + msgsz - 1 + 2, s);
 
 		msgsz += sz + 2;
-
-		msg[msgsz] = '\0';
 	}
 
 	if (use_syslog)
@@ -72,7 +75,7 @@ void
 
 	xfree(msg);
 
-	if (errnum > 0)
+	if (exitnum != EXIT_SUCCESS)
 		exit(exitnum);
 }
 
@@ -145,3 +148,16 @@ xfree(void *ptr)
 		free(ptr);
 	return NULL;
 }
+
+uint64_t
+fnv1a(uint64_t hash, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len-- > 0) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
@@ -15,13 +15,13 @@
 extern int verbose;
 extern char pidfile[MAXPATHLEN];
 
-static int
-is_isolate_section(char *name, const char *searchname)
+static char *
+isolate_section_name(char *name, size_t *len)
 {
 	int loop = 0, quote = 0;
 
 	if (strncmp(name, "isolate", 7)) {
-		return 0;
+		return NULL;
 	}
 
 	char *ss = NULL;
@@ -31,7 +31,7 @@ is_isolate_section(char *name, const char *searchname)
 		char *n = name + 7;
 
 		if (!*n || !isspace(*n))
-			return 0;
+			return NULL;
 
 		while (*n && isspace(*n))
 			n++;
@@ -58,14 +58,23 @@ is_isolate_section(char *name, const char *searchname)
 			break;
 	}
 
-	return strlen(searchname) == sz && !strncmp(ss, searchname, sz);
+	*len = sz;
+	return ss;
+}
+
+static int
+is_isolate_section(char *name, const char *searchname)
+{
+	size_t sz = 0;
+	char *ss = isolate_section_name(name, &sz);
+
+	return ss && strlen(searchname) == sz && !strncmp(ss, searchname, sz);
 }
 
 static char **
-split_argv(char *str)
+split_argv(char *str, const char *seps)
 {
 	char *token;
-	char seps[] = " \t";
 	char **res = NULL;
 	size_t n_spaces = 0;
 
@@ -138,6 +147,7 @@ void
 set_cgroups_dir(struct container *data, char *arg)
 {
 	data->cgroups->rootdir = xfree(data->cgroups->rootdir);
+	data->cgroups->version = CGROUP_UNKNOWN;
 	if (strlen(arg) > 0)
 		data->cgroups->rootdir = xstrdup(arg);
 	else
@@ -147,7 +157,7 @@ set_cgroups_dir(struct container *data, char *arg)
 void
 set_cgroups_group(struct container *data, char *arg)
 {
-	data->cgroups->rootdir = xfree(data->cgroups->rootdir);
+	data->cgroups->group = xfree(data->cgroups->group);
 	if (strlen(arg) > 0)
 		data->cgroups->group = xstrdup(arg);
 	else
@@ -204,22 +214,36 @@ set_output(struct container *data, char *arg)
 void
 set_devices_file(struct container *data, char *arg)
 {
+	size_t i;
+
+	for (i = 0; data->devices && data->devices[i]; i++)
+		free_devnode(data->devices[i]);
+	data->devices = xfree(data->devices);
+
 	data->devfile = xfree(data->devfile);
 	if (strlen(arg) > 0) {
 		if (access(arg, R_OK) < 0)
 			myerror(EXIT_FAILURE, errno, "access: %s", arg);
 		data->devfile = xstrdup(arg);
+		data->devices = parse_devices(data->devfile);
 	}
 }
 
 void
 set_environ_file(struct container *data, char *arg)
 {
+	size_t i;
+
+	for (i = 0; data->envs && data->envs[i]; i++)
+		xfree(data->envs[i]);
+	data->envs = xfree(data->envs);
+
 	data->envfile = xfree(data->envfile);
 	if (strlen(arg) > 0) {
 		if (access(arg, R_OK) < 0)
 			myerror(EXIT_FAILURE, errno, "access: %s", arg);
 		data->envfile = xstrdup(arg);
+		data->envs = parse_environ(data->envfile);
 	}
 }
 
@@ -259,25 +283,80 @@ set_seccomp_file(struct container *data, char *arg)
 	data->seccomp = arg;
 }
 
+void
+set_state_dir(struct container *data, char *arg)
+{
+	// arg may be the current value when it comes as a config default.
+	char *dir = (strlen(arg) > 0) ? xstrdup(arg) : NULL;
+
+	xfree(data->statedir);
+	data->statedir = dir;
+}
+
 void
 set_fstab_file(struct container *data, char *arg)
 {
 	int i;
 
 	for (i = 0; data->mounts && data->mounts[i]; i++)
-		free_mntent(data->mounts[i]);
+		free_mountspec(data->mounts[i]);
 	data->mounts = xfree(data->mounts);
 
+	data->fstabfile = xfree(data->fstabfile);
 	if (strlen(arg) > 0) {
 		if (access(arg, R_OK) < 0)
 			myerror(EXIT_FAILURE, errno, "access: %s", arg);
+		data->fstabfile = xstrdup(arg);
 		data->mounts = parse_fstab(arg);
 		data->unshare_flags |= CLONE_NEWNS;
-	} else {
+	} else if (!data->devices_tmpfs && !data->root_image && !data->overlay) {
+		// Other keys may need the mount namespace without an fstab.
 		data->unshare_flags &= ~CLONE_NEWNS;
 	}
 }
 
+void
+set_root_image(struct container *data, char *arg)
+{
+	data->root_image = xfree(data->root_image);
+
+	if (!strlen(arg))
+		return;
+
+	data->root_image = xstrdup(arg);
+	data->unshare_flags |= CLONE_NEWNS;
+}
+
+void
+set_overlay(struct container *data, char *arg)
+{
+	data->overlay = xfree(data->overlay);
+
+	if (!strlen(arg))
+		return;
+
+	if (strcmp(arg, "tmpfs") && (arg[0] != '/' || strpbrk(arg, ",:")))
+		myerror(EXIT_FAILURE, 0, "overlay must be tmpfs or an absolute path without ',' and ':': %s", arg);
+
+	data->overlay = xstrdup(arg);
+	data->unshare_flags |= CLONE_NEWNS;
+}
+
+void
+set_overlay_keep(struct container *data, int arg)
+{
+	data->overlay_keep = arg > 0;
+}
+
+void
+set_devices_tmpfs(struct container *data, int arg)
+{
+	data->devices_tmpfs = arg > 0;
+
+	if (data->devices_tmpfs)
+		data->unshare_flags |= CLONE_NEWNS;
+}
+
 void
 set_cap_add(struct container *data, char *arg)
 {
@@ -338,6 +417,15 @@ set_cgroups(struct container *data, char *arg)
 	cgroup_split_controllers(data->cgroups, arg);
 }
 
+void
+set_limit(struct container *data, const char *key, char *arg)
+{
+	if (!strlen(arg))
+		return;
+	if (cgroup_limit(data->cgroups, key, arg) < 0)
+		myerror(EXIT_FAILURE, 0, "bad resource limit: %s = %s", key, arg);
+}
+
 void
 set_nice(struct container *data, int arg)
 {
@@ -350,6 +438,145 @@ set_no_new_privs(struct container *data, int arg)
 	data->no_new_privs = arg > 0;
 }
 
+void
+set_pivot_root(struct container *data, int arg)
+{
+	data->pivot_root = arg > 0;
+}
+
+void
+set_stop_signals(struct container *data, char *arg)
+{
+	data->stop_signals = xfree(data->stop_signals);
+
+	if (strlen(arg) > 0)
+		data->stop_signals = parse_stop_signals(arg);
+}
+
+void
+set_pressure(struct container *data, pressure_t type, char *arg)
+{
+	memset(&data->pressure[type], 0, sizeof(data->pressure[type]));
+
+	if (strlen(arg) > 0)
+		parse_pressure_trigger(arg, &data->pressure[type]);
+}
+
+void
+set_pressure_action(struct container *data, char *arg)
+{
+	if (!strlen(arg))
+		return;
+
+	parse_monitor_action(arg, &data->pressure_action);
+
+	if (data->pressure_action.flags & MONITOR_WEIGHT)
+		cgroup_controller(data->cgroups, "cpu", NULL);
+	if (data->pressure_action.flags & MONITOR_RECLAIM)
+		cgroup_controller(data->cgroups, "memory", NULL);
+}
+
+void
+set_oom_action(struct container *data, char *arg)
+{
+	if (!strlen(arg))
+		return;
+
+	parse_monitor_action(arg, &data->oom_action);
+
+	// The OOM events come from the memory controller.
+	cgroup_controller(data->cgroups, "memory", NULL);
+
+	if (data->oom_action.flags & MONITOR_WEIGHT)
+		cgroup_controller(data->cgroups, "cpu", NULL);
+}
+
+void
+set_start_timeout(struct container *data, int arg)
+{
+	data->start_timeout = (arg > 0) ? arg : 0;
+}
+
+void
+set_warm_pool(struct container *data, int arg)
+{
+	data->warm_pool = (arg > 0) ? arg : 0;
+}
+
+void
+set_spawn(struct container *data, char *arg)
+{
+	if (!strlen(arg))
+		return;
+
+	if (!strcasecmp(arg, "clone3"))
+		data->spawn = SPAWN_CLONE3;
+	else if (!strcasecmp(arg, "fork"))
+		data->spawn = SPAWN_FORK;
+	else
+		myerror(EXIT_FAILURE, 0, "unknown spawn mode: %s", arg);
+}
+
+/*
+ * The automatic placement picks the cpus and mems itself, so they can not be
+ * given as well.
+ */
+void
+set_placement(struct container *data, char *arg)
+{
+	if (!strlen(arg))
+		return;
+
+	if (!strcasecmp(arg, "auto"))
+		data->placement = PLACEMENT_AUTO;
+	else if (!strcasecmp(arg, "none"))
+		data->placement = PLACEMENT_NONE;
+	else
+		myerror(EXIT_FAILURE, 0, "unknown placement: %s", arg);
+
+	if (data->placement == PLACEMENT_AUTO) {
+		if (cgroup_limit_value(data->cgroups, "cpus") || cgroup_limit_value(data->cgroups, "mems"))
+			myerror(EXIT_FAILURE, 0, "automatic placement conflicts with cpus and mems");
+		cgroup_controller(data->cgroups, "cpuset", NULL);
+	}
+}
+
+void
+set_mempolicy(struct container *data, char *arg)
+{
+	if (!strlen(arg))
+		return;
+
+	if (!strcasecmp(arg, "bind"))
+		data->mempolicy = MEMPOLICY_BIND;
+	else if (!strcasecmp(arg, "preferred"))
+		data->mempolicy = MEMPOLICY_PREFERRED;
+	else if (!strcasecmp(arg, "interleave"))
+		data->mempolicy = MEMPOLICY_INTERLEAVE;
+	else if (!strcasecmp(arg, "local"))
+		data->mempolicy = MEMPOLICY_LOCAL;
+	else if (!strcasecmp(arg, "none"))
+		data->mempolicy = MEMPOLICY_NONE;
+	else
+		myerror(EXIT_FAILURE, 0, "unknown memory policy: %s", arg);
+}
+
+void
+set_timing_file(struct container *data, char *arg)
+{
+	data->timing_file = xfree(data->timing_file);
+	if (strlen(arg) > 0)
+		data->timing_file = xstrdup(arg);
+}
+
+void
+set_trace_file(struct container *data, char *arg)
+{
+	data->trace_file = xfree(data->trace_file);
+	if (strlen(arg) > 0)
+		data->trace_file = xstrdup(arg);
+}
+
 void
 set_argv(struct container *data, char *arg)
 {
@@ -360,7 +587,52 @@ set_argv(struct container *data, char *arg)
 	data->argv = xfree(data->argv);
 
 	if (strlen(arg) > 0)
-		data->argv = split_argv(arg);
+		data->argv = split_argv(arg, " \t");
+}
+
+void
+set_after(struct container *data, char *arg)
+{
+	int i;
+
+	for (i = 0; data->after && data->after[i]; i++)
+		xfree(data->after[i]);
+	data->after = xfree(data->after);
+
+	if (strlen(arg) > 0)
+		data->after = split_argv(arg, " \t,");
+}
+
+char **
+read_config_sections(const char *filename)
+{
+	char **res = NULL;
+	size_t nr = 0;
+
+	if (access(filename, R_OK) < 0)
+		myerror(EXIT_FAILURE, errno, "access: %s", filename);
+
+	dictionary *config = iniparser_load(filename);
+	int n = iniparser_getnsec(config);
+
+	for (int i = 0; i < n; i++) {
+		size_t sz = 0;
+		char *ss = isolate_section_name(iniparser_getsecname(config, i), &sz);
+
+		if (!ss || !sz)
+			continue;
+
+		res = xrealloc(res, nr + 2, sizeof(char *));
+		res[nr++] = strndup(ss, sz);
+		res[nr] = NULL;
+
+		if (!res[nr - 1])
+			myerror(EXIT_FAILURE, errno, "strndup");
+	}
+
+	iniparser_freedict(config);
+
+	return res;
 }
 
 void
@@ -385,6 +657,7 @@ read_config(const char *filename, char *section, struct container *data)
 		if (!strcasecmp(name, "global")) {
 			verbose = iniparser_getint(config, "global:verbose", 0);
 			set_cgroups_dir(data, iniparser_getstring(config, "global:cgroups-dir", empty));
+			set_state_dir(data, iniparser_getstring(config, "global:state-dir", data->statedir));
 
 			arg = iniparser_getstring(config, "global:pid-dir", (char *) "/var/run/isolate");
 			snprintf(pidfile, MAXPATHLEN - 1, "%s/isolate-%s.pid", arg, section);
@@ -410,6 +683,9 @@ read_config(const char *filename, char *section, struct container *data)
 			snprintf(key, sizeof(key), "%s:devices-file", name);
 			set_devices_file(data, iniparser_getstring(config, (const char *) key, empty));
 
+			snprintf(key, sizeof(key), "%s:devices-tmpfs", name);
+			set_devices_tmpfs(data, iniparser_getboolean(config, (const char *) key, 0));
+
 			snprintf(key, sizeof(key), "%s:environ-file", name);
 			set_environ_file(data, iniparser_getstring(config, (const char *) key, empty));
 
@@ -419,6 +695,15 @@ read_config(const char *filename, char *section, struct container *data)
 			snprintf(key, sizeof(key), "%s:fstab-file", name);
 			set_fstab_file(data, iniparser_getstring(config, (const char *) key, empty));
 
+			snprintf(key, sizeof(key), "%s:root-image", name);
+			set_root_image(data, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:overlay", name);
+			set_overlay(data, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:overlay-keep", name);
+			set_overlay_keep(data, iniparser_getboolean(config, (const char *) key, 0));
+
 			snprintf(key, sizeof(key), "%s:caps", name);
 			set_cap_caps(data, iniparser_getstring(config, (const char *) key, empty));
 
@@ -434,12 +719,62 @@ read_config(const char *filename, char *section, struct container *data)
 			snprintf(key, sizeof(key), "%s:cgroups", name);
 			set_cgroups(data, iniparser_getstring(config, (const char *) key, empty));
 
+			for (size_t k = 0; limit_key(k); k++) {
+				snprintf(key, sizeof(key), "%s:%s", name, limit_key(k));
+				set_limit(data, limit_key(k), iniparser_getstring(config, (const char *) key, empty));
+			}
+
+			snprintf(key, sizeof(key), "%s:placement", name);
+			set_placement(data, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:mempolicy", name);
+			set_mempolicy(data, iniparser_getstring(config, (const char *) key, empty));
+
 			snprintf(key, sizeof(key), "%s:nice", name);
 			set_nice(data, iniparser_getint(config, (const char *) key, 0));
 
 			snprintf(key, sizeof(key), "%s:no-new-privs", name);
 			set_no_new_privs(data, iniparser_getboolean(config, (const char *) key, 0));
 
+			snprintf(key, sizeof(key), "%s:pivot-root", name);
+			set_pivot_root(data, iniparser_getboolean(config, (const char *) key, 0));
+
+			snprintf(key, sizeof(key), "%s:start-timeout", name);
+			set_start_timeout(data, iniparser_getint(config, (const char *) key, data->start_timeout));
+
+			snprintf(key, sizeof(key), "%s:stop-signals", name);
+			set_stop_signals(data, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:cpu-pressure", name);
+			set_pressure(data, PRESSURE_CPU, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:memory-pressure", name);
+			set_pressure(data, PRESSURE_MEMORY, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:io-pressure", name);
+			set_pressure(data, PRESSURE_IO, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:pressure-action", name);
+			set_pressure_action(data, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:oom-action", name);
+			set_oom_action(data, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:warm-pool", name);
+			set_warm_pool(data, iniparser_getint(config, (const char *) key, 0));
+
+			snprintf(key, sizeof(key), "%s:spawn", name);
+			set_spawn(data, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:timing-file", name);
+			set_timing_file(data, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:trace-file", name);
+			set_trace_file(data, iniparser_getstring(config, (const char *) key, empty));
+
+			snprintf(key, sizeof(key), "%s:after", name);
+			set_after(data, iniparser_getstring(config, (const char *) key, empty));
+
 			snprintf(key, sizeof(key), "%s:init", name);
 			set_argv(data, iniparser_getstring(config, (const char *) key, (char *) "/bin/sh"));
 		}
@@ -449,4 +784,15 @@ read_config(const char *filename, char *section, struct container *data)
 
 	if (!found)
 		myerror(EXIT_FAILURE, 0, "section `%s' not found in %s", section, filename);
+
+	// The image is mounted read-only, the device nodes can not be created in it.
+	if (data->root_image && data->devices && !data->overlay && !data->devices_tmpfs)
+		myerror(EXIT_FAILURE, 0, "%s: root-image with devices-file requires overlay or devices-tmpfs",
+		        section);
+
+	// The v1 memory controller has no memory.reclaim. The hierarchy is known
+	// only once the global section has been read.
+	if (((data->pressure_action.flags | data->oom_action.flags) & MONITOR_RECLAIM) &&
+	    cgroup_version(data->cgroups) != CGROUP_V2)
+		myerror(EXIT_FAILURE, 0, "%s: the reclaim action requires cgroup v2", section);
 }
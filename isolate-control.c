@@ -0,0 +1,277 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+extern char *configfile;
+extern char *control_socket;
+
+/*
+ * The control protocol is line based. The client sends one request per line
+ * ("start NAME", "stop NAME", "status NAME" or "list") and shuts down its side
+ * of the connection. The first line "config PATH" passes the config of the
+ * client. The daemon answers each request with "RC NAME MESSAGE"
+ * lines and closes the connection when all requests are done. The code
+ * CONTROL_UNMANAGED means that the supervisor does not know the container, it
+ * may have been started without it.
+ */
+
+static int
+control_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		info("control socket path is too long: %s", path);
+		return -1;
+	}
+
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int
+control_listen(const char *path)
+{
+	int fd;
+	struct sockaddr_un addr;
+
+	if (control_address(path, &addr) < 0)
+		return -1;
+
+	if ((fd = control_connect(path)) >= 0) {
+		close(fd);
+		info("supervisor is already running: %s", path);
+		return -1;
+	}
+
+	if (unlink(path) < 0 && errno != ENOENT) {
+		errmsg("unlink: %s", path);
+		return -1;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) {
+		errmsg("socket");
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		errmsg("bind: %s", path);
+		goto fail;
+	}
+
+	if (chmod(path, 0600) < 0) {
+		errmsg("chmod: %s", path);
+		goto fail;
+	}
+
+	if (listen(fd, SOMAXCONN) < 0) {
+		errmsg("listen: %s", path);
+		goto fail;
+	}
+
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+int
+control_connect(const char *path)
+{
+	int fd;
+	struct sockaddr_un addr;
+
+	if (control_address(path, &addr) < 0)
+		return -1;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		errmsg("socket");
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = TEMP_FAILURE_RETRY(write(fd, buf, len));
+
+		if (n < 0)
+			return -1;
+
+		buf += n;
+		len -= (size_t) n;
+	}
+	return 0;
+}
+
+int
+control_send(int fd, const char *buf, size_t len)
+{
+	if (write_all(fd, buf, len) < 0) {
+		errmsg("control: write");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sends a batch of requests to the supervisor and prints the replies. The names
+ * of the containers the supervisor does not manage are added to unmanaged.
+ */
+int
+control_request(int fd, char **requests, size_t nr_requests, char ***unmanaged)
+{
+	int rc = EXIT_SUCCESS;
+	char *buf = NULL;
+	size_t i, len = 0, nr_replies = 0, nr_unmanaged = 0;
+	FILE *replies;
+	char *line = NULL;
+	size_t linesz = 0;
+
+	for (i = 0; i < nr_requests; i++) {
+		size_t n = strlen(requests[i]);
+
+		buf = xrealloc(buf, len + n + 1, 1);
+		memcpy(buf + len, requests[i], n);
+		len += n;
+		buf[len++] = '\n';
+	}
+
+	if (control_send(fd, buf, len) < 0 || shutdown(fd, SHUT_WR) < 0) {
+		xfree(buf);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	xfree(buf);
+
+	if (!(replies = fdopen(fd, "r")))
+		myerror(EXIT_FAILURE, errno, "fdopen");
+
+	while (getline(&line, &linesz, replies) > 0) {
+		int code, off = 0;
+		char name[256];
+
+		line[strcspn(line, "\n")] = '\0';
+
+		if (sscanf(line, "%d %255s %n", &code, name, &off) < 2 || !off) {
+			info("control: bad reply: %s", line);
+			rc = EXIT_FAILURE;
+			continue;
+		}
+
+		nr_replies++;
+
+		if (code == CONTROL_UNMANAGED && unmanaged) {
+			*unmanaged = xrealloc(*unmanaged, nr_unmanaged + 2, sizeof(char *));
+			(*unmanaged)[nr_unmanaged++] = xstrdup(name);
+			(*unmanaged)[nr_unmanaged] = NULL;
+			continue;
+		}
+
+		if (code != EXIT_SUCCESS)
+			rc = EXIT_FAILURE;
+
+		if (nr_requests > 1 || !strchr(requests[0], ' '))
+			info("%s: %s", name, line + off);
+		else
+			info("%s", line + off);
+	}
+
+	xfree(line);
+	fclose(replies);
+
+	if (!nr_replies && strchr(requests[0], ' ')) {
+		info("control: no reply from supervisor");
+		rc = EXIT_FAILURE;
+	}
+
+	return rc;
+}
+
+/*
+ * Hands the command over to the supervisor if it is running. Returns -1 if the
+ * command must be handled by this process. The containers which the supervisor
+ * does not manage are returned in unmanaged and must be handled locally too.
+ */
+int
+control_forward(const char *cmd, char **names, size_t nr_names, int has_options, char ***unmanaged)
+{
+	int fd, rc, len, whole_set;
+	char **requests, *path, *line = NULL;
+	size_t i, nr_requests;
+
+	// These commands apply to the whole set of containers.
+	whole_set = !strcmp(cmd, "list") || !strcmp(cmd, "pool") ||
+	            !strcmp(cmd, "start-all") || !strcmp(cmd, "stop-all");
+
+	if (!whole_set && strcmp(cmd, "start") && strcmp(cmd, "stop") && strcmp(cmd, "status"))
+		return -1;
+
+	if (whole_set ? nr_names > 0 : nr_names == 0)
+		return -1;
+
+	if ((fd = control_connect(control_socket)) < 0) {
+		if (!whole_set && nr_names == 1)
+			return -1;
+
+		info("supervisor is not running");
+		return EXIT_FAILURE;
+	}
+
+	if (has_options && !strcmp(cmd, "start")) {
+		info("container options can not be passed to the supervisor");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	if (!(path = realpath(configfile, NULL)))
+		path = xstrdup(configfile);
+
+	len = xasprintf(&line, "config %s\n", path);
+	rc = control_send(fd, line, (size_t) len);
+
+	xfree(line);
+	xfree(path);
+
+	if (rc < 0) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	nr_requests = whole_set ? 1 : nr_names;
+	requests = xcalloc(nr_requests, sizeof(char *));
+
+	if (whole_set) {
+		requests[0] = xstrdup(cmd);
+	} else {
+		for (i = 0; i < nr_names; i++)
+			xasprintf(&requests[i], "%s %s", cmd, names[i]);
+	}
+
+	rc = control_request(fd, requests, nr_requests, unmanaged);
+
+	for (i = 0; i < nr_requests; i++)
+		xfree(requests[i]);
+	xfree(requests);
+
+	return rc;
+}
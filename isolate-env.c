@@ -15,17 +15,18 @@
 
 extern int verbose;
 
-void
-load_environ(struct mapfile *envs)
+char **
+parse_environ(char *filename)
 {
-	size_t i;
+	size_t n_envs = 0;
 	char *nline, *a, *s, *eq;
+	struct mapfile envs = {};
+	char **result = NULL;
 
-	if (verbose)
-		info("loading environment: %s", envs->filename);
+	if (open_map(filename, &envs, 0) < 0)
+		myerror(EXIT_FAILURE, 0, "unable to read environment: %s", filename);
 
-	i = 1;
-	a = envs->map;
+	a = envs.map;
 
 	while (a && a[0]) {
 		nline = strchr(a, '\n');
@@ -35,7 +36,6 @@ load_environ(struct mapfile *envs)
 
 		if (a[0] == '#') {
 			a = (nline) ? nline + 1 : NULL;
-			i++;
 			continue;
 		}
 
@@ -43,15 +43,37 @@ load_environ(struct mapfile *envs)
 			nline = a + strlen(a);
 
 		s = strndup(a, (size_t)(nline - a));
-		a = nline + 1;
+		a = (*nline) ? nline + 1 : NULL;
 
-		if ((eq = strchr(s, '=')) && s < eq)
-			putenv(s);
-		else
-			xfree(s);
+		if (!s)
+			myerror(EXIT_FAILURE, errno, "strndup");
 
-		i++;
+		if ((eq = strchr(s, '=')) && s < eq) {
+			result = xrealloc(result, (n_envs + 1), sizeof(char *));
+			result[n_envs++] = s;
+		} else {
+			xfree(s);
+		}
 	}
 
-	close_map(envs);
+	result = xrealloc(result, (n_envs + 1), sizeof(char *));
+	result[n_envs] = NULL;
+
+	close_map(&envs);
+
+	return result;
+}
+
+void
+load_environ(char **envs)
+{
+	size_t i;
+
+	if (verbose)
+		info("loading environment");
+
+	for (i = 0; envs[i]; i++) {
+		if (putenv(envs[i]))
+			myerror(EXIT_FAILURE, errno, "putenv: %s", envs[i]);
+	}
 }
@@ -29,6 +29,21 @@ epollin_add(int fd_ep, int fd)
 		myerror(EXIT_FAILURE, errno, "epoll_ctl");
 }
 
+/*
+ * For the files that report their events as POLLPRI, like the PSI triggers.
+ */
+void
+epollpri_add(int fd_ep, int fd)
+{
+	struct epoll_event ev = {};
+
+	ev.events = EPOLLPRI;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(fd_ep, EPOLL_CTL_ADD, fd, &ev) < 0)
+		myerror(EXIT_FAILURE, errno, "epoll_ctl");
+}
+
 void
 epollin_remove(int fd_ep, int fd)
 {
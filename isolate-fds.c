@@ -1,17 +1,27 @@
 #include <linux/limits.h>
+#include <linux/openat2.h>
 
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <errno.h>
 
 #include "isolate.h"
 
+#ifndef __NR_openat2
+#define __NR_openat2 437
+#endif
+
 extern int verbose;
 
 static int
@@ -51,6 +61,39 @@ sanitize_fds(void)
 	return 0;
 }
 
+/*
+ * Closes the descriptors inherited from the supervisor. A child that is held
+ * before the exec must not keep the connections of other containers and
+ * clients open.
+ */
+void
+close_fds(int keep)
+{
+	DIR *dir;
+	struct dirent *ent;
+	int fd, max_fd;
+
+	if ((dir = opendir("/proc/self/fd"))) {
+		while ((ent = readdir(dir))) {
+			fd = atoi(ent->d_name);
+
+			if (fd > STDERR_FILENO && fd != keep && fd != dirfd(dir))
+				(void) close(fd);
+		}
+		closedir(dir);
+		return;
+	}
+
+	max_fd = get_open_max();
+
+	for (fd = STDERR_FILENO + 1; fd < max_fd; ++fd) {
+		if (fd != keep)
+			(void) close(fd);
+	}
+
+	errno = 0;
+}
+
 void
 cloexec_fds(void)
 {
@@ -103,7 +146,7 @@ open_map(char *filename, struct mapfile *f, int quiet)
 
 	if (fstat(f->fd, &sb) < 0) {
 		errmsg("fstat: %s", filename);
-		return -1;
+		goto fail;
 	}
 
 	f->size = (size_t) sb.st_size;
@@ -118,11 +161,15 @@ open_map(char *filename, struct mapfile *f, int quiet)
 
 	if ((f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, f->fd, 0)) == MAP_FAILED) {
 		errmsg("mmap: %s", filename);
-		return -1;
+		goto fail;
 	}
 
 	f->filename = filename;
 	return 0;
+fail:
+	close(f->fd);
+	f->fd = -1;
+	return -1;
 }
 
 void
@@ -137,3 +184,194 @@ close_map(struct mapfile *f)
 	close(f->fd);
 	f->filename = NULL;
 }
+
+/*
+ * Atomically replace dir/name with the given data. Used for caches, so errors
+ * are reported only in verbose mode.
+ */
+int
+store_file(const char *dir, const char *name, const struct iovec *iov, int iovcnt)
+{
+	int fd, rc = -1;
+	char *filename = NULL, *tmpfile = NULL;
+	ssize_t len, total = 0;
+
+	xasprintf(&filename, "%s/%s", dir, name);
+	xasprintf(&tmpfile, "%s/.tmp.XXXXXX", dir);
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		if (verbose)
+			errmsg("mkdir: %s", dir);
+		goto out;
+	}
+
+	if ((fd = mkostemp(tmpfile, O_CLOEXEC)) < 0) {
+		if (verbose)
+			errmsg("mkstemp: %s", tmpfile);
+		goto out;
+	}
+
+	for (int i = 0; i < iovcnt; i++)
+		total += (ssize_t) iov[i].iov_len;
+
+	len = TEMP_FAILURE_RETRY(writev(fd, iov, iovcnt));
+
+	if (len != total || fsync(fd) < 0) {
+		if (verbose)
+			errmsg("write: %s", tmpfile);
+		close(fd);
+		unlink(tmpfile);
+		goto out;
+	}
+
+	close(fd);
+
+	if (rename(tmpfile, filename) < 0) {
+		if (verbose)
+			errmsg("rename: %s", filename);
+		unlink(tmpfile);
+		goto out;
+	}
+
+	if (verbose > 1)
+		info("stored: %s", filename);
+
+	rc = 0;
+out:
+	xfree(tmpfile);
+	xfree(filename);
+
+	return rc;
+}
+
+int
+openat_resolve(int dirfd, const char *path, int flags, uint64_t resolve)
+{
+	struct open_how how = {};
+
+	how.flags   = (uint64_t) (unsigned int) (flags | O_CLOEXEC);
+	how.resolve = resolve;
+
+	return (int) syscall(__NR_openat2, dirfd, path, &how, sizeof(how));
+}
+
+/*
+ * Walks the path one component at a time without following anything. A symlink
+ * or ".." anywhere in the path fails with ELOOP or EXDEV.
+ */
+static int
+open_nofollow(int rootfd, const char *path, int flags)
+{
+	char name[NAME_MAX + 1];
+	int fd, err, dirfd = -1;
+
+	while (*path == '/')
+		path++;
+
+	if (!*path)
+		return openat(rootfd, ".", flags | O_CLOEXEC);
+
+	while (1) {
+		const char *end = strchrnul(path, '/');
+		size_t len = (size_t) (end - path);
+		int last;
+		struct stat st;
+
+		if (len > NAME_MAX) {
+			errno = ENAMETOOLONG;
+			goto fail;
+		}
+
+		memcpy(name, path, len);
+		name[len] = '\0';
+
+		while (*end == '/')
+			end++;
+		last = !*end;
+
+		if (!strcmp(name, "..")) {
+			errno = EXDEV;
+			goto fail;
+		}
+
+		fd = openat((dirfd < 0 ? rootfd : dirfd), name,
+		            (last ? flags : O_PATH | O_DIRECTORY) | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0)
+			goto fail;
+
+		// O_PATH with O_NOFOLLOW opens the symlink itself.
+		err = (fstat(fd, &st) < 0) ? errno : (S_ISLNK(st.st_mode) ? ELOOP : 0);
+
+		if (err) {
+			close(fd);
+			errno = err;
+			goto fail;
+		}
+
+		if (dirfd >= 0)
+			close(dirfd);
+
+		if (last)
+			return fd;
+
+		dirfd = fd;
+		path = end;
+	}
+fail:
+	if (dirfd >= 0) {
+		int saved = errno;
+		close(dirfd);
+		errno = saved;
+	}
+	return -1;
+}
+
+/*
+ * Opens the path as if rootfd were the root directory: absolute symlinks and
+ * ".." can not lead out of it. Kernels older than 5.6 have no openat2(2), there
+ * the path must not have symlinks or ".." at all.
+ */
+int
+open_in_root(int rootfd, const char *path, int flags)
+{
+	static int warned;
+	int fd = openat_resolve(rootfd, path, flags, RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS);
+
+	if (fd < 0 && errno == ENOSYS) {
+		if (!warned++)
+			info("openat2 is not available, symlinks in the container root are refused");
+		fd = open_nofollow(rootfd, path, flags);
+	}
+
+	return fd;
+}
+
+/*
+ * Opens the directory that holds the last component of the path and points
+ * base to that component.
+ */
+int
+open_parent_in_root(int rootfd, const char *path, const char **base)
+{
+	const char *slash = strrchr(path, '/');
+	char parent[MAXPATHLEN];
+	size_t len;
+
+	if (!slash) {
+		*base = path;
+		return open_in_root(rootfd, "/", O_PATH | O_DIRECTORY);
+	}
+
+	*base = slash + 1;
+	len = (size_t) (slash - path);
+
+	if (len >= sizeof(parent)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memcpy(parent, path, len);
+	parent[len] = '\0';
+
+	return open_in_root(rootfd, len ? parent : "/", O_PATH | O_DIRECTORY);
+}
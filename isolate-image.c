@@ -0,0 +1,260 @@
+#include <linux/loop.h>
+
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+#define IMAGE_CACHE_MAGIC "IMGLOOP"
+#define IMAGE_CACHE_VERSION 1
+
+#define SQUASHFS_MAGIC 0x73717368
+#define EROFS_MAGIC 0xE0F5E1E2
+#define EROFS_SUPER_OFFSET 1024
+
+#define LOOP_ATTACH_RETRIES 8
+
+extern int verbose;
+
+/*
+ * Remembers which loop device carries an image, so containers started from the
+ * same image share one loop device and one filesystem superblock.
+ */
+struct image_cache_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t loop_nr;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+static const char *
+image_fstype(int fd, const char *image)
+{
+	uint32_t magic;
+
+	if (TEMP_FAILURE_RETRY(pread(fd, &magic, sizeof(magic), 0)) == (ssize_t) sizeof(magic) &&
+	    magic == SQUASHFS_MAGIC)
+		return "squashfs";
+
+	if (TEMP_FAILURE_RETRY(pread(fd, &magic, sizeof(magic), EROFS_SUPER_OFFSET)) == (ssize_t) sizeof(magic) &&
+	    magic == EROFS_MAGIC)
+		return "erofs";
+
+	myerror(EXIT_FAILURE, 0, "unknown image format (squashfs or erofs expected): %s", image);
+	return NULL;
+}
+
+static void
+fill_header(struct image_cache_hdr *hdr, struct stat *st)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, IMAGE_CACHE_MAGIC, sizeof(hdr->magic));
+
+	hdr->version    = IMAGE_CACHE_VERSION;
+	hdr->dev        = st->st_dev;
+	hdr->ino        = st->st_ino;
+	hdr->size       = (uint64_t) st->st_size;
+	hdr->mtime_sec  = st->st_mtim.tv_sec;
+	hdr->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static int
+open_loop(uint32_t nr, int flags)
+{
+	char devname[32];
+
+	snprintf(devname, sizeof(devname), "/dev/loop%u", nr);
+	return open(devname, flags | O_CLOEXEC);
+}
+
+/*
+ * The loop device is reused only if it is still bound read-only to the very
+ * same file. An unused device has already been detached by autoclear.
+ */
+static int
+cache_lookup(const char *filename, struct image_cache_hdr *want)
+{
+	int fd, loopfd;
+	struct image_cache_hdr hdr;
+	struct loop_info64 info;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if (TEMP_FAILURE_RETRY(read(fd, &hdr, sizeof(hdr))) != (ssize_t) sizeof(hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	if (memcmp(hdr.magic, want->magic, sizeof(hdr.magic)) ||
+	    hdr.version != want->version ||
+	    hdr.dev != want->dev ||
+	    hdr.ino != want->ino ||
+	    hdr.size != want->size ||
+	    hdr.mtime_sec != want->mtime_sec ||
+	    hdr.mtime_nsec != want->mtime_nsec)
+		return -1;
+
+	if ((loopfd = open_loop(hdr.loop_nr, O_RDONLY)) < 0)
+		return -1;
+
+	if (ioctl(loopfd, LOOP_GET_STATUS64, &info) < 0 ||
+	    info.lo_device != want->dev ||
+	    info.lo_inode != want->ino ||
+	    !(info.lo_flags & LO_FLAGS_READ_ONLY)) {
+		close(loopfd);
+		return -1;
+	}
+
+	want->loop_nr = hdr.loop_nr;
+	return loopfd;
+}
+
+static int
+loop_configure(int loopfd, int imgfd)
+{
+	struct loop_config config;
+	struct loop_info64 info;
+
+	memset(&config, 0, sizeof(config));
+	config.fd = (uint32_t) imgfd;
+	config.info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO;
+
+	if (!ioctl(loopfd, LOOP_CONFIGURE, &config))
+		return 0;
+
+	if (errno != EINVAL && errno != ENOTTY)
+		return -1;
+
+	// Kernels older than 5.8 do not have LOOP_CONFIGURE.
+	if (ioctl(loopfd, LOOP_SET_FD, imgfd) < 0)
+		return -1;
+
+	memset(&info, 0, sizeof(info));
+	info.lo_flags = LO_FLAGS_AUTOCLEAR;
+
+	if (ioctl(loopfd, LOOP_SET_STATUS64, &info) < 0) {
+		ioctl(loopfd, LOOP_CLR_FD, 0);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+loop_attach(int imgfd, const char *image, struct image_cache_hdr *hdr)
+{
+	int ctlfd, loopfd = -1, nr;
+
+	if ((ctlfd = open("/dev/loop-control", O_RDWR | O_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: /dev/loop-control");
+
+	// Another process may grab the free device before us.
+	for (int i = 0; i < LOOP_ATTACH_RETRIES; i++) {
+		if ((nr = ioctl(ctlfd, LOOP_CTL_GET_FREE)) < 0)
+			myerror(EXIT_FAILURE, errno, "ioctl(LOOP_CTL_GET_FREE)");
+
+		if ((loopfd = open_loop((uint32_t) nr, O_RDONLY)) < 0)
+			myerror(EXIT_FAILURE, errno, "open: /dev/loop%d", nr);
+
+		if (!loop_configure(loopfd, imgfd)) {
+			hdr->loop_nr = (uint32_t) nr;
+			break;
+		}
+
+		if (errno != EBUSY)
+			myerror(EXIT_FAILURE, errno, "unable to attach loop device: %s", image);
+
+		close(loopfd);
+		loopfd = -1;
+	}
+
+	close(ctlfd);
+
+	if (loopfd < 0)
+		myerror(EXIT_FAILURE, EBUSY, "unable to attach loop device: %s", image);
+
+	return loopfd;
+}
+
+/*
+ * Mounts a squashfs or erofs image read-only on the target. The loop device is
+ * set to autoclear, so it goes away with the last mount that uses it.
+ */
+void
+mount_image(const char *image, const char *target, const char *statedir)
+{
+	int imgfd, loopfd = -1;
+	struct stat st;
+	struct image_cache_hdr hdr;
+	const char *fstype;
+	char *dir = NULL, *name = NULL, *cachefile = NULL;
+	char devname[32];
+
+	if ((imgfd = open(image, O_RDONLY | O_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: %s", image);
+
+	if (fstat(imgfd, &st) < 0)
+		myerror(EXIT_FAILURE, errno, "fstat: %s", image);
+
+	fstype = image_fstype(imgfd, image);
+	fill_header(&hdr, &st);
+
+	if (statedir) {
+		xasprintf(&dir, "%s/images", statedir);
+		xasprintf(&name, "%016llx.loop", (unsigned long long) fnv1a(FNV1A_INIT, image, strlen(image)));
+		xasprintf(&cachefile, "%s/%s", dir, name);
+
+		if ((loopfd = cache_lookup(cachefile, &hdr)) >= 0 && verbose > 1)
+			info("image cache hit: %s on /dev/loop%u", image, hdr.loop_nr);
+	}
+
+	if (loopfd < 0) {
+		struct iovec iov;
+
+		loopfd = loop_attach(imgfd, image, &hdr);
+
+		if (verbose > 1)
+			info("attached %s to /dev/loop%u", image, hdr.loop_nr);
+
+		if (dir) {
+			iov.iov_base = &hdr;
+			iov.iov_len  = sizeof(hdr);
+			store_file(dir, name, &iov, 1);
+		}
+	}
+
+	snprintf(devname, sizeof(devname), "/dev/loop%u", hdr.loop_nr);
+
+	if (verbose > 2)
+		info("mount(%s) the root image: %s", fstype, devname);
+
+	if (mount(devname, target, fstype, MS_RDONLY, NULL) < 0)
+		myerror(EXIT_FAILURE, errno, "mount(%s): %s", fstype, target);
+
+	// The mount holds the device now.
+	close(loopfd);
+	close(imgfd);
+
+	xfree(cachefile);
+	xfree(name);
+	xfree(dir);
+}
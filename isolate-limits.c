@@ -0,0 +1,590 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+#define CPU_PERIOD_DEFAULT 100000
+
+struct limit_knob {
+	const char *key;
+	const char *controller;
+	char *(*parse)(const char *value);
+	int (*apply)(struct cgroups *cg, const char *value);
+};
+
+/*
+ * Sizes are bytes with an optional binary K, M, G or T suffix.
+ */
+int
+parse_size(const char *value, uint64_t *size)
+{
+	char *end;
+	unsigned long long n;
+	unsigned shift = 0;
+
+	if (*value < '0' || *value > '9')
+		return -1;
+
+	errno = 0;
+	n = strtoull(value, &end, 10);
+
+	if (errno)
+		return -1;
+
+	switch (*end) {
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		case 'g': case 'G': shift = 30; end++; break;
+		case 't': case 'T': shift = 40; end++; break;
+	}
+
+	if (*end || n > (UINT64_MAX >> shift))
+		return -1;
+
+	*size = (uint64_t) n << shift;
+	return 0;
+}
+
+static int
+parse_number(const char *value, uint64_t min, uint64_t max, uint64_t *num)
+{
+	char *end;
+	unsigned long long n;
+
+	if (*value < '0' || *value > '9')
+		return -1;
+
+	errno = 0;
+	n = strtoull(value, &end, 10);
+
+	if (errno || *end || n < min || n > max)
+		return -1;
+
+	*num = n;
+	return 0;
+}
+
+static char *
+parse_bytes(const char *value)
+{
+	char *out = NULL;
+	uint64_t n;
+
+	if (!strcmp(value, "max"))
+		return xstrdup(value);
+
+	if (parse_size(value, &n) < 0)
+		return NULL;
+
+	xasprintf(&out, "%" PRIu64, n);
+	return out;
+}
+
+static char *
+parse_pids(const char *value)
+{
+	char *out = NULL;
+	uint64_t n;
+
+	if (!strcmp(value, "max"))
+		return xstrdup(value);
+
+	if (parse_number(value, 0, INT32_MAX, &n) < 0)
+		return NULL;
+
+	xasprintf(&out, "%" PRIu64, n);
+	return out;
+}
+
+static char *
+parse_weight(const char *value)
+{
+	char *out = NULL;
+	uint64_t n;
+
+	if (parse_number(value, 1, 10000, &n) < 0)
+		return NULL;
+
+	xasprintf(&out, "%" PRIu64, n);
+	return out;
+}
+
+/*
+ * The quota is "max", microseconds or a percentage of one cpu, optionally
+ * followed by the period. The result is always "QUOTA PERIOD".
+ */
+static char *
+parse_cpu_max(const char *value)
+{
+	char *s, *quota, *period, *saveptr, *out = NULL;
+	uint64_t q = 0, p = CPU_PERIOD_DEFAULT;
+	int percent = 0;
+
+	s = xstrdup(value);
+
+	if (!(quota = strtok_r(s, " \t", &saveptr)))
+		goto out;
+
+	if ((period = strtok_r(NULL, " \t", &saveptr)) &&
+	    (strtok_r(NULL, " \t", &saveptr) || parse_number(period, 1000, 1000000, &p) < 0))
+		goto out;
+
+	if (strcmp(quota, "max")) {
+		size_t len = strlen(quota);
+
+		if (len > 1 && quota[len - 1] == '%') {
+			quota[len - 1] = '\0';
+			percent = 1;
+		}
+
+		if (parse_number(quota, 1, UINT32_MAX, &q) < 0)
+			goto out;
+
+		if (percent)
+			q = q * p / 100;
+
+		if (q < 1000)
+			goto out;
+
+		xasprintf(&out, "%" PRIu64 " %" PRIu64, q, p);
+	} else {
+		xasprintf(&out, "max %" PRIu64, p);
+	}
+out:
+	xfree(s);
+	return out;
+}
+
+/*
+ * The cpus and the memory nodes are lists like "0-3,8".
+ */
+static char *
+parse_cpulist(const char *value)
+{
+	if (!*value || strspn(value, "0123456789,-") != strlen(value))
+		return NULL;
+	return xstrdup(value);
+}
+
+/*
+ * The device is a block device node or MAJ:MIN.
+ */
+static int
+parse_device(const char *value, unsigned *major_nr, unsigned *minor_nr)
+{
+	struct stat st;
+	char c;
+
+	if (*value == '/') {
+		if (stat(value, &st) < 0) {
+			errmsg("stat: %s", value);
+			return -1;
+		}
+		if (!S_ISBLK(st.st_mode)) {
+			info("not block device: %s", value);
+			return -1;
+		}
+		*major_nr = major(st.st_rdev);
+		*minor_nr = minor(st.st_rdev);
+		return 0;
+	}
+
+	return sscanf(value, "%u:%u%c", major_nr, minor_nr, &c) == 2 ? 0 : -1;
+}
+
+/*
+ * A comma separated list of "DEVICE rbps=N wbps=N riops=N wiops=N", where every
+ * limit is optional and "max" removes it.
+ */
+static char *
+parse_io_max(const char *value)
+{
+	char *s, *str, *dev, *saveptr, *out = NULL;
+	size_t len = 0;
+
+	s = str = xstrdup(value);
+
+	while ((dev = strtok_r(s, ",", &saveptr))) {
+		char *limit, *devsave, *line = NULL;
+		unsigned major_nr, minor_nr;
+		size_t nr = 0;
+
+		s = NULL;
+
+		if (!(dev = strtok_r(dev, " \t", &devsave)) || parse_device(dev, &major_nr, &minor_nr) < 0)
+			goto fail;
+
+		xasprintf(&line, "%s%u:%u", (len ? "," : ""), major_nr, minor_nr);
+
+		while ((limit = strtok_r(NULL, " \t", &devsave))) {
+			char *eq = strchr(limit, '=');
+			char *next = NULL;
+			uint64_t n;
+
+			if (!eq)
+				goto bad;
+			*eq++ = '\0';
+
+			if (strcmp(limit, "rbps") && strcmp(limit, "wbps") &&
+			    strcmp(limit, "riops") && strcmp(limit, "wiops"))
+				goto bad;
+
+			if (!strcmp(eq, "max"))
+				xasprintf(&next, "%s %s=max", line, limit);
+			else if (parse_size(eq, &n) == 0 && n > 0)
+				xasprintf(&next, "%s %s=%" PRIu64, line, limit, n);
+			else
+				goto bad;
+
+			xfree(line);
+			line = next;
+			nr++;
+		}
+
+		if (!nr)
+			goto bad;
+
+		out = xrealloc(out, len + strlen(line) + 1, 1);
+		strcpy(out + len, line);
+		len += strlen(line);
+
+		xfree(line);
+		continue;
+bad:
+		xfree(line);
+		goto fail;
+	}
+
+	xfree(str);
+	return out;
+fail:
+	xfree(str);
+	return xfree(out);
+}
+
+/*
+ * The v1 fallbacks of some limits depend on the kernel, blkio.bfq.weight is
+ * there only with the BFQ scheduler. Without the file the limit is skipped with
+ * a warning instead of failing the container.
+ */
+static int
+has_v1_file(struct cgroups *cg, const char *controller, const char *file)
+{
+	int fd;
+
+	errno = 0;
+
+	if ((fd = cgroup_open(cg, controller, file)) >= 0) {
+		close(fd);
+		return 1;
+	}
+
+	if (errno != ENOENT)
+		return 1;
+
+	info("%s: %s is not available, the limit is not applied", cg->name, file);
+	return 0;
+}
+
+static int
+apply_memory(struct cgroups *cg, const char *v2file, const char *v1file, const char *value)
+{
+	if (cgroup_version(cg) == CGROUP_V2)
+		return cgroup_write(cg, "memory", v2file, value);
+
+	return cgroup_write(cg, "memory", v1file, strcmp(value, "max") ? value : "-1");
+}
+
+static int
+apply_memory_max(struct cgroups *cg, const char *value)
+{
+	return apply_memory(cg, "memory.max", "memory.limit_in_bytes", value);
+}
+
+static int
+apply_memory_high(struct cgroups *cg, const char *value)
+{
+	if (cgroup_version(cg) != CGROUP_V2 && !has_v1_file(cg, "memory", "memory.soft_limit_in_bytes"))
+		return 0;
+
+	return apply_memory(cg, "memory.high", "memory.soft_limit_in_bytes", value);
+}
+
+static int
+apply_cpu_max(struct cgroups *cg, const char *value)
+{
+	char quota[32];
+	unsigned long period;
+
+	if (cgroup_version(cg) == CGROUP_V2)
+		return cgroup_write(cg, "cpu", "cpu.max", value);
+
+	if (sscanf(value, "%31s %lu", quota, &period) != 2)
+		return -1;
+
+	if (!strcmp(quota, "max"))
+		strcpy(quota, "-1");
+
+	// The quota is checked against the period, so the period goes first.
+	return (cgroup_write(cg, "cpu", "cpu.cfs_quota_us", "-1") < 0 ||
+	        cgroup_printf(cg, "cpu", "cpu.cfs_period_us", "%lu", period) < 0 ||
+	        cgroup_write(cg, "cpu", "cpu.cfs_quota_us", quota) < 0) ? -1 : 0;
+}
+
+/*
+ * The v1 shares and the v2 weight have the same default, 1024 and 100.
+ */
+static int
+apply_cpu_weight(struct cgroups *cg, const char *value)
+{
+	unsigned long weight = strtoul(value, NULL, 10);
+	unsigned long shares;
+
+	if (cgroup_version(cg) == CGROUP_V2)
+		return cgroup_write(cg, "cpu", "cpu.weight", value);
+
+	shares = weight * 1024 / 100;
+	shares = MAX(2, MIN(shares, 262144));
+
+	return cgroup_printf(cg, "cpu", "cpu.shares", "%lu", shares);
+}
+
+static int
+apply_cpus(struct cgroups *cg, const char *value)
+{
+	return cgroup_write(cg, "cpuset", "cpuset.cpus", value);
+}
+
+static int
+apply_mems(struct cgroups *cg, const char *value)
+{
+	// Without it v1 leaves the pages where they are.
+	if (cgroup_version(cg) != CGROUP_V2)
+		cgroup_write(cg, "cpuset", "cpuset.memory_migrate", "1");
+
+	return cgroup_write(cg, "cpuset", "cpuset.mems", value);
+}
+
+/*
+ * Since Linux 5.0 the only v1 weight is that of BFQ, it is 1..1000 with the
+ * same default as in v2.
+ */
+static int
+apply_io_weight(struct cgroups *cg, const char *value)
+{
+	unsigned long weight = strtoul(value, NULL, 10);
+
+	if (cgroup_version(cg) == CGROUP_V2)
+		return cgroup_printf(cg, "io", "io.weight", "default %lu", weight);
+
+	if (!has_v1_file(cg, "blkio", "blkio.bfq.weight"))
+		return 0;
+
+	return cgroup_printf(cg, "blkio", "blkio.bfq.weight", "%lu", MIN(weight, 1000));
+}
+
+static int
+apply_io_max(struct cgroups *cg, const char *value)
+{
+	static const struct {
+		const char *key;
+		const char *file;
+	} throttle[] = {
+		{ "rbps",  "blkio.throttle.read_bps_device"   },
+		{ "wbps",  "blkio.throttle.write_bps_device"  },
+		{ "riops", "blkio.throttle.read_iops_device"  },
+		{ "wiops", "blkio.throttle.write_iops_device" },
+	};
+	char *s, *str, *line, *saveptr;
+	int rc = 0;
+
+	s = str = xstrdup(value);
+
+	while (!rc && (line = strtok_r(s, ",", &saveptr))) {
+		char *dev, *limit, *linesave;
+
+		s = NULL;
+
+		if (cgroup_version(cg) == CGROUP_V2) {
+			rc = cgroup_write(cg, "io", "io.max", line);
+			continue;
+		}
+
+		dev = strtok_r(line, " ", &linesave);
+
+		while (!rc && (limit = strtok_r(NULL, " ", &linesave))) {
+			char *eq = strchr(limit, '=');
+
+			*eq++ = '\0';
+
+			// Zero removes the v1 limit.
+			if (!strcmp(eq, "max"))
+				eq = (char *) "0";
+
+			for (size_t i = 0; i < ARRAY_SIZE(throttle); i++) {
+				if (!strcmp(limit, throttle[i].key))
+					rc = cgroup_printf(cg, "blkio", throttle[i].file, "%s %s", dev, eq);
+			}
+		}
+	}
+
+	xfree(str);
+	return rc;
+}
+
+static int
+apply_pids(struct cgroups *cg, const char *value)
+{
+	return cgroup_write(cg, "pids", "pids.max", value);
+}
+
+/*
+ * The controllers are named as in cgroup v1, the unified hierarchy knows them
+ * under the names of unifiedControllers.
+ */
+static const struct limit_knob knobs[] = {
+	{ "memory-max",  "memory", parse_bytes,   apply_memory_max  },
+	{ "memory-high", "memory", parse_bytes,   apply_memory_high },
+	{ "cpu-max",     "cpu",    parse_cpu_max, apply_cpu_max     },
+	{ "cpu-weight",  "cpu",    parse_weight,  apply_cpu_weight  },
+	{ "cpus",        "cpuset", parse_cpulist, apply_cpus        },
+	{ "mems",        "cpuset", parse_cpulist, apply_mems        },
+	{ "io-max",      "blkio",  parse_io_max,  apply_io_max      },
+	{ "io-weight",   "blkio",  parse_weight,  apply_io_weight   },
+	{ "pids-max",    "pids",   parse_pids,    apply_pids        },
+};
+
+static const struct limit_knob *
+find_knob(const char *key, size_t len)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(knobs); i++) {
+		if (strlen(knobs[i].key) == len && !strncmp(knobs[i].key, key, len))
+			return &knobs[i];
+	}
+	return NULL;
+}
+
+/*
+ * Returns the name of the i-th resource key or NULL after the last one.
+ */
+const char *
+limit_key(size_t i)
+{
+	return i < ARRAY_SIZE(knobs) ? knobs[i].key : NULL;
+}
+
+/*
+ * Checks the value and stores it in the normalized form, replacing the previous
+ * value of the key. The controller of the key is enabled as well.
+ */
+int
+cgroup_limit(struct cgroups *cg, const char *key, const char *value)
+{
+	const struct limit_knob *knob;
+	char *norm;
+	size_t i, len = strlen(key);
+
+	if (!(knob = find_knob(key, len))) {
+		info("unknown resource limit: %s", key);
+		return -1;
+	}
+
+	if (!(norm = knob->parse(value))) {
+		info("bad value of %s: %s", key, value);
+		return -1;
+	}
+
+	for (i = 0; cg->limits && cg->limits[i]; i++) {
+		if (!strncmp(cg->limits[i], key, len) && cg->limits[i][len] == '=')
+			break;
+	}
+
+	if (!cg->limits || !cg->limits[i]) {
+		cg->limits = xrealloc(cg->limits, i + 2, sizeof(char *));
+		cg->limits[i + 1] = NULL;
+	} else {
+		xfree(cg->limits[i]);
+	}
+
+	xasprintf(&cg->limits[i], "%s=%s", key, norm);
+	xfree(norm);
+
+	cgroup_controller(cg, knob->controller, NULL);
+
+	return 0;
+}
+
+/*
+ * Returns the stored value of the key or NULL.
+ */
+const char *
+cgroup_limit_value(struct cgroups *cg, const char *key)
+{
+	size_t len = strlen(key);
+
+	for (size_t i = 0; cg->limits && cg->limits[i]; i++) {
+		if (!strncmp(cg->limits[i], key, len) && cg->limits[i][len] == '=')
+			return cg->limits[i] + len + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Writes the normalized "key=value" limits to the cgroup of the container.
+ */
+int
+cgroup_apply_limits(struct cgroups *cg, char **limits)
+{
+	for (size_t i = 0; limits && limits[i]; i++) {
+		const struct limit_knob *knob;
+		const char *eq = strchr(limits[i], '=');
+
+		if (!eq || !(knob = find_knob(limits[i], (size_t) (eq - limits[i])))) {
+			info("unknown resource limit: %s", limits[i]);
+			return -1;
+		}
+
+		if (knob->apply(cg, eq + 1) < 0) {
+			info("unable to set %s", limits[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Checks and writes one limit without storing it.
+ */
+int
+cgroup_set_limit(struct cgroups *cg, const char *key, const char *value)
+{
+	const struct limit_knob *knob;
+	char *norm;
+	int rc;
+
+	if (!(knob = find_knob(key, strlen(key)))) {
+		info("unknown resource limit: %s", key);
+		return -1;
+	}
+
+	if (!(norm = knob->parse(value))) {
+		info("bad value of %s: %s", key, value);
+		return -1;
+	}
+
+	rc = knob->apply(cg, norm);
+	xfree(norm);
+
+	return rc;
+}
@@ -1,6 +1,8 @@
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 
+#include <limits.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <unistd.h>
@@ -11,89 +13,572 @@
 
 #include "isolate.h"
 
-#define LINESIZ 256
+#define DEV_TMPFS_OPTS "mode=755,size=64k"
+#define SHM_TMPFS_OPTS "mode=1777"
 
 extern int verbose;
 
+/*
+ * Entries that every fresh /dev gets unless the devices file has its own entry
+ * with the same name.
+ */
+static const struct {
+	device_kind_t kind;
+	const char *name;
+	const char *target;
+	mode_t mode;
+} standard_entries[] = {
+	{ DEVICE_DIR, "pts", NULL, 0755 },
+	{ DEVICE_DIR, "shm", NULL, 01777 },
+	{ DEVICE_SYMLINK, "fd", "/proc/self/fd", 0 },
+	{ DEVICE_SYMLINK, "stdin", "/proc/self/fd/0", 0 },
+	{ DEVICE_SYMLINK, "stdout", "/proc/self/fd/1", 0 },
+	{ DEVICE_SYMLINK, "stderr", "/proc/self/fd/2", 0 },
+	{ DEVICE_SYMLINK, "ptmx", "pts/ptmx", 0 },
+};
+
+struct devctx {
+	int rootfd;
+	int devfd;
+	int basefd;
+	int dirfd;
+	size_t dirlen;
+	char dirpath[PATH_MAX];
+	uid_t uid;
+	gid_t gid;
+	size_t nr_syscalls;
+};
+
 void
-make_devices(const char *rootdir, struct mapfile *devs)
+free_devnode(struct devnode *dev)
 {
-	size_t i;
-	char *nline, *a;
-	char s[LINESIZ];
+	xfree(dev->path);
+	xfree(dev->target);
+	xfree(dev);
+}
 
-	if (verbose)
-		info("making devices: %s", devs->filename);
+static char *
+next_field(char **s)
+{
+	char *p = *s, *start;
+
+	while (isblank(*p))
+		p++;
+
+	if (!*p)
+		return NULL;
+
+	start = p;
+
+	while (*p && !isblank(*p))
+		p++;
+
+	if (*p)
+		*p++ = '\0';
 
-	i = 1;
-	a = devs->map;
-	while (a && a[0]) {
-		char *devpath = NULL;
+	*s = p;
+	return start;
+}
+
+static unsigned long
+parse_field(char **s, int base, const char *filename, size_t nline)
+{
+	char *field, *end;
+	unsigned long value;
+
+	if (!(field = next_field(s)))
+		myerror(EXIT_FAILURE, 0, "%s:%zu: bad line format", filename, nline);
+
+	errno = 0;
+	value = strtoul(field, &end, base);
 
-		char *path = NULL;
-		mode_t mode = 0;
-		uid_t uid = (uid_t) -1;
-		gid_t gid = (gid_t) -1;
-		char type;
-		unsigned int major, minor;
+	if (errno || *end)
+		myerror(EXIT_FAILURE, 0, "%s:%zu: bad number: %s", filename, nline, field);
 
-		nline = strchr(a, '\n');
+	return value;
+}
 
-		while (isspace(a[0]))
-			a++;
+static int
+cmp_devnode(const void *a, const void *b)
+{
+	const struct devnode *x = *(struct devnode *const *) a;
+	const struct devnode *y = *(struct devnode *const *) b;
 
-		if (strncmp("nod", a, 3) || a[0] == '#') {
-			a = (nline) ? nline + 1 : NULL;
-			i++;
+	return strcmp(x->path, y->path);
+}
+
+/*
+ * Adds the directories that the entries need inside /dev, such as dev/input
+ * for dev/input/event0.
+ */
+static struct devnode **
+add_parents(struct devnode **devs, size_t *n)
+{
+	size_t nr = *n;
+
+	for (size_t i = 0; i < nr; i++) {
+		char *p = devs[i]->path;
+
+		if (strncmp(p, "dev/", 4))
 			continue;
+
+		for (p = strchr(p + 4, '/'); p; p = strchr(p + 1, '/')) {
+			struct devnode *dir;
+			size_t j, len = (size_t) (p - devs[i]->path);
+
+			for (j = 0; j < *n; j++) {
+				if (!strncmp(devs[j]->path, devs[i]->path, len) && !devs[j]->path[len])
+					break;
+			}
+
+			if (j < *n)
+				continue;
+
+			dir = xcalloc(1, sizeof(*dir));
+			dir->kind = DEVICE_DIR;
+			dir->path = strndup(devs[i]->path, len);
+			dir->mode = 0755;
+			dir->uid  = (uid_t) -1;
+			dir->gid  = (gid_t) -1;
+
+			if (!dir->path)
+				myerror(EXIT_FAILURE, errno, "strndup");
+
+			devs = xrealloc(devs, (*n + 2), sizeof(void *));
+			devs[(*n)++] = dir;
 		}
+	}
+
+	devs[*n] = NULL;
+	return devs;
+}
+
+/*
+ * The list is sorted by path, so a directory always comes before its content
+ * and the entries of one directory are next to each other. An entry given
+ * more than once is taken from the last line.
+ */
+static size_t
+compile_devices(struct devnode **devs, size_t n)
+{
+	size_t i, j;
+
+	qsort(devs, n, sizeof(*devs), cmp_devnode);
+
+	for (i = 0, j = 0; i < n; i++) {
+		if (j > 0 && !strcmp(devs[j - 1]->path, devs[i]->path)) {
+			if (devs[i]->line > devs[j - 1]->line) {
+				free_devnode(devs[j - 1]);
+				devs[j - 1] = devs[i];
+			} else {
+				free_devnode(devs[i]);
+			}
+			continue;
+		}
+		devs[j++] = devs[i];
+	}
+
+	devs[j] = NULL;
+	return j;
+}
+
+/*
+ * The devices file has one entry per line:
+ *
+ *   nod PATH MODE UID GID TYPE MAJOR MINOR
+ *   bind PATH [HOST-PATH]
+ *   sym PATH TARGET
+ *   dir PATH MODE
+ */
+struct devnode **
+parse_devices(char *filename)
+{
+	size_t n_devs = 0, nline = 0;
+	char *buf, *s, *line;
+	struct mapfile devs = {};
+	struct devnode **result = NULL;
+
+	if (open_map(filename, &devs, 0) < 0)
+		myerror(EXIT_FAILURE, 0, "unable to read devices: %s", filename);
+
+	buf = xmalloc(devs.size + 1);
+	memcpy(buf, devs.map, devs.size);
+	buf[devs.size] = '\0';
+
+	close_map(&devs);
+
+	s = buf;
+	while ((line = strsep(&s, "\n")) != NULL) {
+		struct devnode *dev;
+		char *cmd, *path;
+
+		nline++;
+
+		if (!(cmd = next_field(&line)) || cmd[0] == '#')
+			continue;
+
+		if (!(path = next_field(&line)) || path[0] != '/' || !path[1])
+			myerror(EXIT_FAILURE, 0, "%s:%zu: bad path", filename, nline);
+
+		dev = xcalloc(1, sizeof(*dev));
+		dev->uid = (uid_t) -1;
+		dev->gid = (gid_t) -1;
+
+		while (*path == '/')
+			path++;
+
+		dev->path = xstrdup(path);
+
+		if (!strcmp(cmd, "nod")) {
+			char *type;
+			unsigned int major, minor;
+
+			dev->kind = DEVICE_NODE;
+			dev->mode = (mode_t) parse_field(&line, 8, filename, nline);
+			dev->uid  = (uid_t) parse_field(&line, 10, filename, nline);
+			dev->gid  = (gid_t) parse_field(&line, 10, filename, nline);
+
+			if (!(type = next_field(&line)) || type[1])
+				myerror(EXIT_FAILURE, 0, "%s:%zu: bad device type", filename, nline);
+
+			major = (unsigned int) parse_field(&line, 10, filename, nline);
+			minor = (unsigned int) parse_field(&line, 10, filename, nline);
+
+			switch (type[0]) {
+				case 'c':
+					dev->mode |= S_IFCHR;
+					break;
+				case 'b':
+					dev->mode |= S_IFBLK;
+					break;
+				case 'p':
+					dev->mode |= S_IFIFO;
+					break;
+				case 's':
+					dev->mode |= S_IFSOCK;
+					break;
+				default:
+					myerror(EXIT_FAILURE, 0, "%s:%zu: bad device type", filename, nline);
+			}
+
+			dev->dev = makedev(major, minor);
 
-		if (!nline)
-			nline = a + strlen(a);
-
-		if ((nline - a) > LINESIZ)
-			myerror(EXIT_FAILURE, 0, "%s:%lu: string too long", devs->filename, i);
-
-		strncpy(s, a, (size_t)(nline - a));
-		s[nline - a] = '\0';
-
-		a = nline + 1;
-
-		if (sscanf(s, "nod %ms %o %u %u %c %u %u", &path, &mode, &uid, &gid, &type, &major, &minor) != 7)
-			myerror(EXIT_FAILURE, 0, "%s:%lu: bad line format", devs->filename, i);
-
-		switch (type) {
-			case 'c':
-				mode |= S_IFCHR;
-				break;
-			case 'b':
-				mode |= S_IFBLK;
-				break;
-			case 'p':
-				mode |= S_IFIFO;
-				break;
-			case 's':
-				mode |= S_IFSOCK;
-				break;
-			default:
-				myerror(EXIT_FAILURE, 0, "%s:%lu: bad device type", devs->filename, i);
+		} else if (!strcmp(cmd, "bind")) {
+			char *host = next_field(&line);
+
+			dev->kind = DEVICE_BIND;
+
+			if (host)
+				dev->target = xstrdup(host);
+			else
+				xasprintf(&dev->target, "/%s", dev->path);
+
+		} else if (!strcmp(cmd, "sym")) {
+			char *target = next_field(&line);
+
+			if (!target)
+				myerror(EXIT_FAILURE, 0, "%s:%zu: symlink target required", filename, nline);
+
+			dev->kind = DEVICE_SYMLINK;
+			dev->target = xstrdup(target);
+
+		} else if (!strcmp(cmd, "dir")) {
+			dev->kind = DEVICE_DIR;
+			dev->mode = (mode_t) parse_field(&line, 8, filename, nline);
+
+		} else {
+			myerror(EXIT_FAILURE, 0, "%s:%zu: unknown entry: %s", filename, nline, cmd);
 		}
 
-		xasprintf(&devpath, "%s/%s", rootdir, path);
+		if (next_field(&line))
+			myerror(EXIT_FAILURE, 0, "%s:%zu: bad line format", filename, nline);
+
+		dev->line = nline;
+
+		result = xrealloc(result, (n_devs + 2), sizeof(void *));
+		result[n_devs++] = dev;
+	}
 
-		if (unlink(devpath) < 0 && errno != ENOENT)
-			myerror(EXIT_FAILURE, errno, "unlink: %s", devpath);
+	xfree(buf);
 
-		if (mknod(devpath, mode, makedev(major, minor)) < 0)
-			myerror(EXIT_FAILURE, errno, "mknod: %s", devpath);
+	result = xrealloc(result, (n_devs + 1), sizeof(void *));
+	result[n_devs] = NULL;
 
-		if (lchown(devpath, uid, gid) < 0)
-			myerror(EXIT_FAILURE, errno, "lchown: %s", devpath);
+	result = add_parents(result, &n_devs);
+	compile_devices(result, n_devs);
 
-		devpath = xfree(devpath);
-		path = xfree(path);
-		i++;
+	return result;
+}
+
+int
+has_device_binds(struct devnode **devs)
+{
+	for (size_t i = 0; devs && devs[i]; i++) {
+		if (devs[i]->kind == DEVICE_BIND)
+			return 1;
 	}
+	return 0;
+}
+
+/*
+ * Entries below dev/ go into the fresh /dev if there is one, the others are
+ * made in the root.
+ */
+static const char *
+entry_base(struct devctx *ctx, const char *path, int *basefd)
+{
+	if (ctx->devfd >= 0 && !strncmp(path, "dev/", 4)) {
+		*basefd = ctx->devfd;
+		return path + 4;
+	}
+
+	*basefd = ctx->rootfd;
+	return path;
+}
+
+static int
+entry_dir(struct devctx *ctx, const char *path, const char **name)
+{
+	int basefd;
+	const char *rel = entry_base(ctx, path, &basefd);
+	const char *slash = strrchr(rel, '/');
+	size_t len = slash ? (size_t) (slash - rel) : 0;
+
+	*name = slash ? slash + 1 : rel;
+
+	if (ctx->dirfd >= 0 && ctx->basefd == basefd && ctx->dirlen == len &&
+	    !strncmp(ctx->dirpath, rel, len))
+		return ctx->dirfd;
+
+	if (ctx->dirfd >= 0) {
+		close(ctx->dirfd);
+		ctx->nr_syscalls++;
+	}
+
+	if (len >= sizeof(ctx->dirpath))
+		myerror(EXIT_FAILURE, ENAMETOOLONG, "open: /%s", path);
+
+	ctx->basefd = basefd;
+	ctx->dirlen = len;
+	memcpy(ctx->dirpath, rel, len);
+
+	ctx->nr_syscalls++;
+	if ((ctx->dirfd = open_parent_in_root(basefd, rel, name)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: /%s", path);
+
+	return ctx->dirfd;
+}
+
+static void
+entry_owner(struct devctx *ctx, int dirfd, const char *name, struct devnode *dev)
+{
+	if ((dev->uid == (uid_t) -1 || dev->uid == ctx->uid) &&
+	    (dev->gid == (gid_t) -1 || dev->gid == ctx->gid))
+		return;
+
+	ctx->nr_syscalls++;
+	if (fchownat(dirfd, name, dev->uid, dev->gid, AT_SYMLINK_NOFOLLOW) < 0)
+		myerror(EXIT_FAILURE, errno, "lchown: /%s", dev->path);
+}
+
+static void
+bind_device(struct devctx *ctx, int dirfd, const char *name, const char *path, const char *source)
+{
+	int fd;
+
+	ctx->nr_syscalls += 3;
+
+	if ((fd = openat(dirfd, name, O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: /%s", path);
+
+	if (bind_fd(source, fd) < 0)
+		myerror(EXIT_FAILURE, errno, "mount(bind): %s: /%s", source, path);
+
+	close(fd);
+}
+
+/*
+ * Without CAP_MKNOD the same node of the host is used, if there is one.
+ */
+static int
+bind_host_node(struct devctx *ctx, int dirfd, const char *name, struct devnode *dev)
+{
+	struct stat st;
+	char source[PATH_MAX];
+
+	snprintf(source, sizeof(source), "/%s", dev->path);
+
+	ctx->nr_syscalls++;
+	if (stat(source, &st) < 0 || (st.st_mode & S_IFMT) != (dev->mode & S_IFMT) || st.st_rdev != dev->dev)
+		return -1;
+
+	bind_device(ctx, dirfd, name, dev->path, source);
+	return 0;
+}
+
+static void
+make_entry(struct devctx *ctx, struct devnode *dev, int fresh)
+{
+	const char *name;
+	int dirfd = entry_dir(ctx, dev->path, &name);
+
+	// A fresh tmpfs is empty, an old /dev may have anything at the place.
+	if (!fresh && dev->kind != DEVICE_DIR) {
+		ctx->nr_syscalls++;
+		if (unlinkat(dirfd, name, 0) < 0 && errno != ENOENT)
+			myerror(EXIT_FAILURE, errno, "unlink: /%s", dev->path);
+	}
+
+	switch (dev->kind) {
+		case DEVICE_NODE:
+			ctx->nr_syscalls++;
+			if (mknodat(dirfd, name, dev->mode, dev->dev) < 0) {
+				if (errno != EPERM || !(S_ISCHR(dev->mode) || S_ISBLK(dev->mode)) ||
+				    bind_host_node(ctx, dirfd, name, dev) < 0)
+					myerror(EXIT_FAILURE, errno, "mknod: /%s", dev->path);
+				return;
+			}
+			break;
+		case DEVICE_BIND:
+			bind_device(ctx, dirfd, name, dev->path, dev->target);
+			return;
+		case DEVICE_SYMLINK:
+			ctx->nr_syscalls++;
+			if (symlinkat(dev->target, dirfd, name) < 0)
+				myerror(EXIT_FAILURE, errno, "symlink: /%s", dev->path);
+			break;
+		case DEVICE_DIR:
+			ctx->nr_syscalls++;
+			if (mkdirat(dirfd, name, dev->mode) < 0 && errno != EEXIST)
+				myerror(EXIT_FAILURE, errno, "mkdir: /%s", dev->path);
+			break;
+	}
+
+	entry_owner(ctx, dirfd, name, dev);
+}
+
+static int
+has_entry(struct devnode **devs, const char *path)
+{
+	struct devnode key = { .path = (char *) path };
+	struct devnode *pkey = &key;
+	size_t n = 0;
+
+	while (devs[n])
+		n++;
+
+	return bsearch(&pkey, devs, n, sizeof(*devs), cmp_devnode) != NULL;
+}
+
+/*
+ * Mounts a new tmpfs on /dev and returns its root.
+ */
+static int
+mount_dev_tmpfs(struct devctx *ctx)
+{
+	int fd;
+	char mpoint[32];
+
+	ctx->nr_syscalls += 4;
+
+	if ((fd = open_in_root(ctx->rootfd, "/dev", O_PATH | O_DIRECTORY)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: /dev");
+
+	snprintf(mpoint, sizeof(mpoint), "/proc/self/fd/%d", fd);
+
+	if (mount("tmpfs", mpoint, "tmpfs", MS_NOSUID | MS_NOEXEC, DEV_TMPFS_OPTS) < 0)
+		myerror(EXIT_FAILURE, errno, "mount(tmpfs): /dev");
+
+	close(fd);
+
+	if ((fd = open_in_root(ctx->rootfd, "/dev", O_PATH | O_DIRECTORY)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: /dev");
+
+	return fd;
+}
+
+/*
+ * The shared memory gets its own tmpfs, the size limit of /dev is only meant
+ * for the device nodes.
+ */
+static void
+mount_shm_tmpfs(struct devctx *ctx)
+{
+	int fd;
+	char mpoint[32];
+
+	ctx->nr_syscalls += 3;
+
+	if ((fd = openat(ctx->devfd, "shm", O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: /dev/shm");
+
+	snprintf(mpoint, sizeof(mpoint), "/proc/self/fd/%d", fd);
+
+	if (mount("tmpfs", mpoint, "tmpfs", MS_NOSUID | MS_NODEV, SHM_TMPFS_OPTS) < 0)
+		myerror(EXIT_FAILURE, errno, "mount(tmpfs): /dev/shm");
+
+	close(fd);
+}
+
+/*
+ * Populates /dev from the compiled list in one pass. With tmpfs the directory
+ * is a new empty filesystem and gets the standard entries as well.
+ */
+void
+make_devices(int rootfd, struct devnode **devs, int tmpfs)
+{
+	struct devctx ctx = {
+		.rootfd = rootfd,
+		.devfd  = -1,
+		.basefd = -1,
+		.dirfd  = -1,
+		.uid    = geteuid(),
+		.gid    = getegid(),
+	};
+	mode_t mask;
+
+	if (verbose)
+		info("making devices");
+
+	mask = umask(0);
+
+	if (tmpfs) {
+		ctx.devfd = mount_dev_tmpfs(&ctx);
+
+		for (size_t i = 0; i < ARRAY_SIZE(standard_entries); i++) {
+			struct devnode dev = {
+				.kind   = standard_entries[i].kind,
+				.mode   = standard_entries[i].mode,
+				.target = (char *) standard_entries[i].target,
+				.uid    = (uid_t) -1,
+				.gid    = (gid_t) -1,
+			};
+			char path[32];
+
+			snprintf(path, sizeof(path), "dev/%s", standard_entries[i].name);
+
+			if (devs && has_entry(devs, path))
+				continue;
+
+			dev.path = path;
+			make_entry(&ctx, &dev, 1);
+
+			if (!strcmp(standard_entries[i].name, "shm"))
+				mount_shm_tmpfs(&ctx);
+		}
+	}
+
+	for (size_t i = 0; devs && devs[i]; i++)
+		make_entry(&ctx, devs[i], tmpfs && !strncmp(devs[i]->path, "dev/", 4));
+
+	umask(mask);
+
+	if (ctx.dirfd >= 0)
+		close(ctx.dirfd);
+
+	if (ctx.devfd >= 0)
+		close(ctx.devfd);
 
-	close_map(devs);
+	if (verbose > 1)
+		info("devices: %zu syscalls", ctx.nr_syscalls + 2);
 }
@@ -0,0 +1,345 @@
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+#define MONITOR_BUFSIZ 1024
+
+static const char *const pressure_names[PRESSURE_MAX] = {
+	[PRESSURE_CPU]    = "cpu",
+	[PRESSURE_MEMORY] = "memory",
+	[PRESSURE_IO]     = "io",
+};
+
+static int
+parse_int(const char *arg, int min, int max)
+{
+	char *end;
+	long value;
+
+	errno = 0;
+	value = strtol(arg, &end, 10);
+
+	if (errno || !*arg || *end || value < min || value > max)
+		return -1;
+
+	return (int) value;
+}
+
+/*
+ * Parses "[some|full] STALL WINDOW" where both are milliseconds, for example
+ * "some 150 1000". The kernel accepts windows from 500 ms to 10 s.
+ */
+void
+parse_pressure_trigger(const char *arg, struct pressure_trigger *trigger)
+{
+	char *s, *token, *saveptr;
+	char *words[3] = {};
+	size_t n = 0;
+
+	s = xstrdup(arg);
+
+	for (token = strtok_r(s, " \t", &saveptr); token; token = strtok_r(NULL, " \t", &saveptr)) {
+		if (n == ARRAY_SIZE(words))
+			myerror(EXIT_FAILURE, 0, "bad pressure trigger: %s", arg);
+		words[n++] = token;
+	}
+
+	if (n == 2) {
+		words[2] = words[1];
+		words[1] = words[0];
+		words[0] = (char *) "some";
+	} else if (n != 3) {
+		myerror(EXIT_FAILURE, 0, "bad pressure trigger: %s", arg);
+	}
+
+	if (!strcasecmp(words[0], "full"))
+		trigger->full = 1;
+	else if (!strcasecmp(words[0], "some"))
+		trigger->full = 0;
+	else
+		myerror(EXIT_FAILURE, 0, "bad pressure trigger: %s", arg);
+
+	if ((trigger->window = parse_int(words[2], 500, 10000)) < 0 ||
+	    (trigger->threshold = parse_int(words[1], 1, trigger->window)) < 0)
+		myerror(EXIT_FAILURE, 0, "bad pressure trigger: %s", arg);
+
+	xfree(s);
+}
+
+/*
+ * Parses a comma separated list of log, freeze[=MSEC], cpu-weight=N,
+ * reclaim=SIZE and restart.
+ */
+void
+parse_monitor_action(const char *arg, struct monitor_action *action)
+{
+	char *s, *str, *token, *saveptr;
+
+	memset(action, 0, sizeof(*action));
+
+	s = str = xstrdup(arg);
+
+	while ((token = strtok_r(s, ", \t", &saveptr))) {
+		char *value = strchr(token, '=');
+
+		s = NULL;
+
+		if (value)
+			*value++ = '\0';
+
+		if (!strcmp(token, "log") && !value) {
+			action->flags |= MONITOR_LOG;
+
+		} else if (!strcmp(token, "freeze")) {
+			action->freeze_time = MONITOR_FREEZE_TIME;
+			if (value && (action->freeze_time = parse_int(value, 1, INT_MAX)) < 0)
+				myerror(EXIT_FAILURE, 0, "bad freeze time: %s", value);
+			action->flags |= MONITOR_FREEZE;
+
+		} else if (!strcmp(token, "restart") && !value) {
+			action->flags |= MONITOR_RESTART;
+
+		} else if (!strcmp(token, "cpu-weight") && value) {
+			if ((action->cpu_weight = parse_int(value, 1, 10000)) < 0)
+				myerror(EXIT_FAILURE, 0, "bad cpu weight: %s", value);
+			action->flags |= MONITOR_WEIGHT;
+
+		} else if (!strcmp(token, "reclaim") && value) {
+			if (parse_size(value, &action->reclaim) < 0 || !action->reclaim)
+				myerror(EXIT_FAILURE, 0, "bad reclaim size: %s", value);
+			action->flags |= MONITOR_RECLAIM;
+
+		} else {
+			myerror(EXIT_FAILURE, 0, "unknown action: %s", token);
+		}
+	}
+
+	xfree(str);
+}
+
+static int64_t
+read_oom_kills(struct monitor *mon)
+{
+	char buf[MONITOR_BUFSIZ], *p;
+	ssize_t len;
+
+	if ((len = TEMP_FAILURE_RETRY(pread(mon->fd_oom_stat, buf, sizeof(buf) - 1, 0))) < 0)
+		return -1;
+	buf[len] = '\0';
+
+	// Linux < 4.13 does not count the kills in memory.oom_control.
+	if (!(p = strstr(buf, "oom_kill ")))
+		return -1;
+
+	return strtoll(p + 9, NULL, 10);
+}
+
+static void
+unwatch_freeze(struct monitor *mon)
+{
+	epollin_remove(mon->fd_ep, mon->fd_freeze);
+	mon->fd_freeze = -1;
+}
+
+/*
+ * Freezes the container for a while. The loop is not blocked: the end of the
+ * freeze is reported through cgroup.events and a timer thaws the container.
+ */
+static void
+monitor_freeze(struct monitor *mon, int msec)
+{
+	// The watch is set before the write, so the change can not be missed.
+	if ((mon->fd_freeze = cgroup_watch(mon->cg)) >= 0)
+		epollin_add(mon->fd_ep, mon->fd_freeze);
+
+	if (cgroup_set_frozen(mon->cg, 1) < 0) {
+		unwatch_freeze(mon);
+		return;
+	}
+
+	if (mon->fd_thaw < 0) {
+		mon->fd_thaw = timerfd_init();
+		epollin_add(mon->fd_ep, mon->fd_thaw);
+	}
+
+	timerfd_arm(mon->fd_thaw, msec);
+	mon->frozen = 1;
+
+	// The v1 freezer has no notification.
+	if (mon->fd_freeze < 0)
+		info("%s: freezing container", mon->data->name);
+}
+
+static void
+monitor_act(struct monitor *mon, const struct monitor_action *action, const char *what)
+{
+	const char *name = mon->data->name;
+	int flags = action->flags ? action->flags : MONITOR_LOG;
+
+	if (flags & MONITOR_LOG)
+		info("%s: %s", name, what);
+
+	if (flags & MONITOR_RECLAIM)
+		cgroup_printf(mon->cg, "memory", "memory.reclaim", "%" PRIu64, action->reclaim);
+
+	if (flags & MONITOR_WEIGHT) {
+		char weight[16];
+
+		snprintf(weight, sizeof(weight), "%d", action->cpu_weight);
+		cgroup_set_limit(mon->cg, "cpu-weight", weight);
+	}
+
+	if ((flags & MONITOR_FREEZE) && !mon->frozen)
+		monitor_freeze(mon, action->freeze_time);
+
+	if (flags & MONITOR_RESTART)
+		mon->restart = 1;
+}
+
+/*
+ * Registers the PSI triggers and the OOM watch of a running container in fd_ep.
+ * The events for them must be passed to monitor_event().
+ */
+void
+monitor_start(struct monitor *mon, struct container *data, int fd_ep)
+{
+	int fd;
+
+	memset(mon, 0, sizeof(*mon));
+
+	mon->cg = data->cgroups;
+	mon->data = data;
+	mon->fd_ep = fd_ep;
+	mon->fd_oom = mon->fd_oom_stat = -1;
+	mon->fd_freeze = mon->fd_thaw = -1;
+
+	for (size_t i = 0; i < PRESSURE_MAX; i++) {
+		char file[32];
+
+		mon->fd_pressure[i] = -1;
+
+		if (!data->pressure[i].window)
+			continue;
+
+		if (cgroup_version(mon->cg) != CGROUP_V2) {
+			info("%s: %s pressure requires cgroup v2", data->name, pressure_names[i]);
+			continue;
+		}
+
+		snprintf(file, sizeof(file), "%s.pressure", pressure_names[i]);
+
+		if ((fd = cgroup_pressure_trigger(mon->cg, file, &data->pressure[i])) < 0)
+			continue;
+
+		epollpri_add(fd_ep, fd);
+		mon->fd_pressure[i] = fd;
+	}
+
+	if (data->oom_action.flags && (fd = cgroup_oom_watch(mon->cg, &mon->fd_oom_stat)) >= 0) {
+		epollin_add(fd_ep, fd);
+		mon->fd_oom = fd;
+		mon->oom_kills = read_oom_kills(mon);
+	}
+}
+
+/*
+ * Returns zero if the descriptor does not belong to the monitor.
+ */
+int
+monitor_event(struct monitor *mon, int fd)
+{
+	char buf[MONITOR_BUFSIZ], what[MONITOR_BUFSIZ + 32];
+	ssize_t len;
+
+	if (!mon->cg || fd < 0)
+		return 0;
+
+	if (fd == mon->fd_freeze) {
+		while (read(fd, buf, sizeof(buf)) > 0);
+
+		if (cgroup_frozen(mon->cg)) {
+			info("%s: container frozen", mon->data->name);
+			unwatch_freeze(mon);
+		}
+		return 1;
+	}
+
+	if (fd == mon->fd_thaw) {
+		timerfd_ack(fd);
+		unwatch_freeze(mon);
+
+		if (cgroup_set_frozen(mon->cg, 0) == 0)
+			info("%s: container thawed", mon->data->name);
+
+		mon->frozen = 0;
+		return 1;
+	}
+
+	for (size_t i = 0; i < PRESSURE_MAX; i++) {
+		if (fd != mon->fd_pressure[i])
+			continue;
+
+		// The current averages of the file, the first line is enough.
+		if ((len = TEMP_FAILURE_RETRY(pread(fd, buf, sizeof(buf) - 1, 0))) < 0)
+			len = 0;
+		buf[len] = '\0';
+		buf[strcspn(buf, "\n")] = '\0';
+
+		snprintf(what, sizeof(what), "%s pressure: %s", pressure_names[i], buf);
+		monitor_act(mon, &mon->data->pressure_action, what);
+		return 1;
+	}
+
+	if (fd == mon->fd_oom) {
+		int64_t kills;
+
+		while (read(fd, buf, sizeof(buf)) > 0);
+
+		// memory.events also changes for other reasons.
+		kills = read_oom_kills(mon);
+
+		if (kills < 0 || kills > mon->oom_kills) {
+			if (kills < 0)
+				snprintf(what, sizeof(what), "out of memory");
+			else
+				snprintf(what, sizeof(what), "out of memory, %" PRId64 " processes killed",
+				         kills - mon->oom_kills);
+
+			mon->oom_kills = kills;
+			monitor_act(mon, &mon->data->oom_action, what);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+monitor_stop(struct monitor *mon)
+{
+	if (!mon->cg)
+		return;
+
+	for (size_t i = 0; i < PRESSURE_MAX; i++)
+		epollin_remove(mon->fd_ep, mon->fd_pressure[i]);
+
+	epollin_remove(mon->fd_ep, mon->fd_oom);
+	epollin_remove(mon->fd_ep, mon->fd_freeze);
+	epollin_remove(mon->fd_ep, mon->fd_thaw);
+
+	// The stop signals must reach the processes.
+	if (mon->frozen)
+		cgroup_set_frozen(mon->cg, 0);
+
+	if (mon->fd_oom_stat >= 0)
+		close(mon->fd_oom_stat);
+
+	mon->cg = NULL;
+}
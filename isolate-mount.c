@@ -3,8 +3,11 @@
 #include <sys/mount.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+#include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,11 +17,77 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <ftw.h>
 
 #include "isolate.h"
 
 #define MNTBUFSIZ 1024
 
+#define BINDENTS_CACHE_MAGIC "IBINDENT"
+#define BINDENTS_CACHE_VERSION 1
+#define GETDENTS_BUFSIZ 32768
+
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+
+#ifndef __NR_fsopen
+#define __NR_fsopen 430
+#endif
+
+#ifndef __NR_fsconfig
+#define __NR_fsconfig 431
+#endif
+
+#ifndef __NR_fsmount
+#define __NR_fsmount 432
+#endif
+
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#define FSCONFIG_SET_FLAG 0
+#define FSCONFIG_SET_STRING 1
+#define FSCONFIG_CMD_CREATE 6
+#endif
+
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV 0x00000004
+#define MOUNT_ATTR_NOEXEC 0x00000008
+#define MOUNT_ATTR__ATIME 0x00000070
+#define MOUNT_ATTR_RELATIME 0x00000000
+#define MOUNT_ATTR_NOATIME 0x00000010
+#define MOUNT_ATTR_STRICTATIME 0x00000020
+#define MOUNT_ATTR_NODIRATIME 0x00000080
+#endif
+
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+
 extern int verbose;
 
 static const char *const mountflag_names[] = {
@@ -105,21 +174,78 @@ static struct {
 	{ MS_SYNCHRONOUS, ST_SYNCHRONOUS },
 };
 
-struct mountflags {
-	unsigned long vfs_opts;
-	char *data;
-	mode_t mkdir;
+static struct {
+	const unsigned long mount_flag;
+	const unsigned int attr;
+} const mountAttrs[] = {
+	{ MS_RDONLY, MOUNT_ATTR_RDONLY },
+	{ MS_NOSUID, MOUNT_ATTR_NOSUID },
+	{ MS_NODEV, MOUNT_ATTR_NODEV },
+	{ MS_NOEXEC, MOUNT_ATTR_NOEXEC },
+	{ MS_NOATIME, MOUNT_ATTR_NOATIME },
+	{ MS_STRICTATIME, MOUNT_ATTR_STRICTATIME },
+	{ MS_NODIRATIME, MOUNT_ATTR_NODIRATIME },
 };
 
-void
-free_mntent(struct mntent *ent)
-{
-	xfree(ent->mnt_fsname);
-	xfree(ent->mnt_dir);
-	xfree(ent->mnt_type);
-	xfree(ent->mnt_opts);
-	xfree(ent);
-}
+/*
+ * Flags that belong to the superblock rather than to the mount. The new mount
+ * API passes them to the filesystem context as ordinary parameters.
+ */
+static struct {
+	const unsigned long mount_flag;
+	const char *param;
+} const superblockParams[] = {
+	{ MS_RDONLY, "ro" },
+	{ MS_SYNCHRONOUS, "sync" },
+	{ MS_DIRSYNC, "dirsync" },
+	{ MS_LAZYTIME, "lazytime" },
+	{ MS_MANDLOCK, "mand" },
+};
+
+/* Layout of struct mount_attr from linux/mount.h. */
+struct mountattr {
+	uint64_t attr_set;
+	uint64_t attr_clr;
+	uint64_t propagation;
+	uint64_t userns_fd;
+};
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * Directory listing used by _bindents. Each record is the d_type byte followed
+ * by the NUL-terminated name. The same records are stored in the cache.
+ */
+struct dirlist {
+	char *buf;
+	size_t len;
+	size_t size;
+	uint32_t nr;
+};
+
+struct bindents_cache_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr;
+	uint64_t len;
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+};
+
+struct mountop {
+	struct mountspec *spec;
+	int fd;
+};
 
 static mode_t
 str2umask(const char *name, const char *value)
@@ -137,15 +263,35 @@ str2umask(const char *name, const char *value)
 	return (mode_t) n;
 }
 
-static struct mountflags *
-parse_mountopts(const char *opts, struct mountflags *flags)
+static char **
+add_pattern(char **list, const char *pattern)
+{
+	size_t n = 0;
+
+	while (list && list[n])
+		n++;
+
+	list = xrealloc(list, n + 2, sizeof(char *));
+	list[n] = xstrdup(pattern);
+	list[n + 1] = NULL;
+
+	return list;
+}
+
+static void
+free_patterns(char **list)
+{
+	for (size_t i = 0; list && list[i]; i++)
+		xfree(list[i]);
+	xfree(list);
+}
+
+static void
+parse_mountopts(const char *opts, struct mountspec *flags)
 {
 	char *s, *subopts, *value;
 	int i;
 
-	flags->vfs_opts = 0;
-	flags->data = NULL;
-
 	s = subopts = xstrdup(opts);
 
 	while (*subopts != '\0') {
@@ -159,13 +305,25 @@ parse_mountopts(const char *opts, struct mountflags *flags)
 				continue;
 			}
 
+			if (!strncasecmp("x-bindents.include=", value, 19)) {
+				flags->include = add_pattern(flags->include, value + 19);
+				continue;
+			}
+
+			if (!strncasecmp("x-bindents.exclude=", value, 19)) {
+				flags->exclude = add_pattern(flags->exclude, value + 19);
+				continue;
+			}
+
 			if (!strncasecmp("x-", value, 2))
 				continue;
 
 			if (flags->data) {
-				size_t datalen = strlen(flags->data) + strlen(value) + 1;
-				flags->data = xrealloc(flags->data, datalen, 1);
-				snprintf(flags->data, datalen, "%s,%s", flags->data, value);
+				size_t len = strlen(flags->data);
+				size_t vlen = strlen(value);
+				flags->data = xrealloc(flags->data, len + vlen + 2, 1);
+				flags->data[len] = ',';
+				memcpy(flags->data + len + 1, value, vlen + 1);
 			} else {
 				flags->data = xstrdup(value);
 			}
@@ -179,17 +337,139 @@ parse_mountopts(const char *opts, struct mountflags *flags)
 	}
 
 	xfree(s);
-	return flags;
 }
 
-struct mntent **
+void
+free_mountspec(struct mountspec *spec)
+{
+	xfree(spec->source);
+	xfree(spec->target);
+	xfree(spec->fstype);
+	xfree(spec->data);
+	free_patterns(spec->include);
+	free_patterns(spec->exclude);
+	xfree(spec);
+}
+
+struct mountspec *
+compile_mount(const char *source, const char *target, const char *fstype, const char *opts)
+{
+	struct mountspec *spec = xcalloc(1, sizeof(*spec));
+
+	spec->source = xstrdup(source);
+	spec->target = xstrdup(target);
+	spec->fstype = xstrdup(fstype);
+
+	parse_mountopts(opts, spec);
+
+	if (!strncasecmp("_umount", fstype, 7))
+		spec->kind = MOUNT_UMOUNT;
+	else if (!strncasecmp("_bindents", fstype, 9))
+		spec->kind = MOUNT_BINDENTS;
+	else if (spec->vfs_opts & (MS_MOVE | MS_REMOUNT))
+		spec->kind = MOUNT_LEGACY;
+	else if (spec->vfs_opts & MS_BIND)
+		spec->kind = MOUNT_BIND;
+	else if (spec->vfs_opts & (MS_SHARED | MS_SLAVE))
+		spec->kind = MOUNT_LEGACY;
+	else
+		spec->kind = MOUNT_FILESYSTEM;
+
+	return spec;
+}
+
+#define MOUNT_ATTR_FLAGS \
+	(MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC | \
+	 MS_NOATIME | MS_NODIRATIME | MS_RELATIME | MS_STRICTATIME)
+
+/*
+ * A "remount,bind" entry right after the bind of the same target only changes
+ * the mount attributes. These are applied when the bind is created, so the
+ * remount is folded into it.
+ */
+static size_t
+collapse_remounts(struct mountspec **specs, size_t nr)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < nr; i++) {
+		struct mountspec *spec = specs[i];
+
+		if (spec->kind == MOUNT_LEGACY &&
+		    (spec->vfs_opts & (MS_REMOUNT | MS_BIND)) == (MS_REMOUNT | MS_BIND) &&
+		    !(spec->vfs_opts & (MS_MOVE | MS_SHARED | MS_SLAVE)) &&
+		    n > 0 && specs[n - 1]->kind == MOUNT_BIND && !strcmp(specs[n - 1]->target, spec->target)) {
+			struct mountspec *bind = specs[n - 1];
+
+			bind->vfs_opts = (bind->vfs_opts & ~(unsigned long) MOUNT_ATTR_FLAGS) |
+			                 (spec->vfs_opts & MOUNT_ATTR_FLAGS);
+			free_mountspec(spec);
+			continue;
+		}
+
+		specs[n++] = spec;
+	}
+
+	return n;
+}
+
+static size_t
+path_depth(const char *path)
+{
+	size_t depth = 0;
+
+	while (*path) {
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+		depth++;
+		while (*path && *path != '/')
+			path++;
+	}
+	return depth;
+}
+
+/*
+ * Stable insertion sort by mountpoint depth, so every mount is made after the
+ * mounts of its parent directories. Entries of the same depth keep the fstab
+ * order. Remounts, moves and unmounts act on what is mounted before them, so
+ * they stay in place and only the mounts between them are sorted.
+ */
+static void
+sort_by_depth(struct mountspec **specs, size_t nr)
+{
+	size_t i, j, start = 0, *depth = xcalloc(nr, sizeof(size_t));
+
+	for (i = 0; i < nr; i++) {
+		struct mountspec *spec = specs[i];
+		size_t d = path_depth(spec->target);
+
+		if (spec->kind == MOUNT_LEGACY || spec->kind == MOUNT_UMOUNT) {
+			start = i + 1;
+			continue;
+		}
+
+		for (j = i; j > start && depth[j - 1] > d; j--) {
+			specs[j] = specs[j - 1];
+			depth[j] = depth[j - 1];
+		}
+
+		specs[j] = spec;
+		depth[j] = d;
+	}
+
+	xfree(depth);
+}
+
+struct mountspec **
 parse_fstab(const char *fstabname)
 {
 	FILE *fstab;
 	struct mntent mt;
 	char *buf;
 
-	struct mntent **result = NULL;
+	struct mountspec **result = NULL;
 	size_t n_ents = 0;
 
 	fstab = setmntent(fstabname, "r");
@@ -200,186 +480,912 @@ parse_fstab(const char *fstabname)
 
 	while (getmntent_r(fstab, &mt, buf, MNTBUFSIZ)) {
 		result = xrealloc(result, (n_ents + 1), sizeof(void *));
+		result[n_ents++] = compile_mount(mt.mnt_fsname, mt.mnt_dir, mt.mnt_type, mt.mnt_opts);
+	}
 
-		result[n_ents] = xcalloc(1, sizeof(struct mntent));
-		result[n_ents]->mnt_fsname = xstrdup(mt.mnt_fsname);
-		result[n_ents]->mnt_dir = xstrdup(mt.mnt_dir);
-		result[n_ents]->mnt_type = xstrdup(mt.mnt_type);
-		result[n_ents]->mnt_opts = xstrdup(mt.mnt_opts);
-		result[n_ents]->mnt_freq = mt.mnt_freq;
-		result[n_ents]->mnt_passno = mt.mnt_passno;
+	endmntent(fstab);
+	xfree(buf);
 
-		n_ents++;
-	}
+	n_ents = collapse_remounts(result, n_ents);
+	sort_by_depth(result, n_ents);
 
 	result = xrealloc(result, (n_ents + 1), sizeof(void *));
 	result[n_ents] = NULL;
 
-	endmntent(fstab);
-	xfree(buf);
-
 	return result;
 }
 
+/*
+ * Checks the plan against the root before the container is forked. Mountpoints
+ * that come from an earlier entry of the plan or from x-mount.mkdir can only be
+ * checked by the child. Without newroot only the sources are checked, because
+ * the root is not there yet (a root image is mounted by the child). The same
+ * goes for the mountpoints below skipdir, which the child fills itself.
+ */
+int
+check_mounts(const char *newroot, const char *skipdir, struct mountspec **mounts)
+{
+	size_t i, j, skiplen = skipdir ? strlen(skipdir) : 0;
+	int fd, rootfd = -1;
+
+	if (newroot && (rootfd = open(newroot, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", newroot);
+		return -1;
+	}
+
+	for (i = 0; mounts && mounts[i]; i++) {
+		struct mountspec *spec = mounts[i];
+
+		spec->mountpoint = MOUNTPOINT_UNKNOWN;
+
+		if ((spec->kind == MOUNT_BIND || spec->kind == MOUNT_BINDENTS) &&
+		    access(spec->source, F_OK) < 0) {
+			errmsg("mount source not found: %s", spec->source);
+			goto fail;
+		}
+
+		if (spec->mkdir || !newroot)
+			continue;
+
+		if (skipdir && !strncmp(spec->target, skipdir, skiplen) && spec->target[skiplen] == '/')
+			continue;
+
+		for (j = 0; j < i; j++) {
+			size_t len = strlen(mounts[j]->target);
+
+			if (mounts[j]->kind != MOUNT_UMOUNT &&
+			    !strncmp(spec->target, mounts[j]->target, len) &&
+			    (spec->target[len] == '/' || (len > 0 && mounts[j]->target[len - 1] == '/')))
+				break;
+		}
+
+		if (j < i)
+			continue;
+
+		if ((fd = open_in_root(rootfd, spec->target, O_PATH)) < 0) {
+			spec->mountpoint = MOUNTPOINT_MISSING;
+			if (verbose)
+				info("WARNING: mountpoint not found in the isolation: %s", spec->target);
+			continue;
+		}
+
+		close(fd);
+		spec->mountpoint = MOUNTPOINT_FOUND;
+	}
+
+	if (rootfd >= 0)
+		close(rootfd);
+	return 0;
+fail:
+	if (rootfd >= 0)
+		close(rootfd);
+	return -1;
+}
+
+/*
+ * A bind mount(2) ignores the mount attributes, so they are applied by a
+ * second bind remount that keeps the flags the mount already has.
+ */
+static void
+remount_attrs(const char *mpoint, const char *target, unsigned long vfs_opts)
+{
+	struct statfs st;
+	unsigned long old_flags = 0, new_flags;
+
+	if (TEMP_FAILURE_RETRY(statfs(mpoint, &st)) < 0)
+		myerror(EXIT_FAILURE, errno, "statfs: %s", target);
+
+	for (size_t i = 0; i < ARRAY_SIZE(mountPairs); i++) {
+		if (st.f_flags & mountPairs[i].vfs_flag)
+			old_flags |= mountPairs[i].mount_flag;
+	}
+
+	new_flags = old_flags | (vfs_opts & MOUNT_ATTR_FLAGS);
+
+	if (new_flags == old_flags)
+		return;
+
+	if (mount(mpoint, mpoint, "none", MS_REMOUNT | MS_BIND | new_flags, 0) < 0)
+		myerror(EXIT_FAILURE, errno, "mount(remount): %s", target);
+}
+
+static int
+sys_open_tree(int dfd, const char *path, unsigned int flags)
+{
+	return (int) syscall(__NR_open_tree, dfd, path, flags);
+}
+
+static int
+sys_move_mount(int from_dfd, const char *from_path, int to_dfd, const char *to_path, unsigned int flags)
+{
+	return (int) syscall(__NR_move_mount, from_dfd, from_path, to_dfd, to_path, flags);
+}
+
+static int
+sys_fsopen(const char *fstype, unsigned int flags)
+{
+	return (int) syscall(__NR_fsopen, fstype, flags);
+}
+
+static int
+sys_fsconfig(int fd, unsigned int cmd, const char *key, const void *value, int aux)
+{
+	return (int) syscall(__NR_fsconfig, fd, cmd, key, value, aux);
+}
+
+static int
+sys_fsmount(int fd, unsigned int flags, unsigned int attr_flags)
+{
+	return (int) syscall(__NR_fsmount, fd, flags, attr_flags);
+}
+
+static int
+sys_mount_setattr(int dfd, const char *path, unsigned int flags, struct mountattr *attr, size_t size)
+{
+	return (int) syscall(__NR_mount_setattr, dfd, path, flags, attr, size);
+}
+
+/*
+ * mount_setattr() is the most recent of the calls we need, so its presence
+ * means the whole new mount API is there.
+ */
+static int
+mountfd_supported(void)
+{
+	static int supported = -1;
+
+	if (supported < 0)
+		supported = !(sys_mount_setattr(-1, "", ~0U, NULL, 0) < 0 && errno == ENOSYS);
+
+	return supported;
+}
+
+static unsigned int
+mount_attrs(unsigned long vfs_opts)
+{
+	unsigned int attrs = 0;
+
+	for (size_t i = 0; i < ARRAY_SIZE(mountAttrs); i++) {
+		if (vfs_opts & mountAttrs[i].mount_flag)
+			attrs |= mountAttrs[i].attr;
+	}
+	return attrs;
+}
+
+static void
+fsconfig_param(int fd, const char *target, char *param)
+{
+	char *value = strchr(param, '=');
+
+	if (value)
+		*value++ = '\0';
+
+	if (sys_fsconfig(fd, value ? FSCONFIG_SET_STRING : FSCONFIG_SET_FLAG, param, value, 0) < 0)
+		myerror(EXIT_FAILURE, errno, "fsconfig(%s): %s", param, target);
+}
+
+/*
+ * Creates a new detached filesystem mount.
+ */
+static int
+open_filesystem(struct mountop *op, const char *fstype, const char *source)
+{
+	int fsfd, fd;
+
+	if ((fsfd = sys_fsopen(fstype, FSOPEN_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "fsopen(%s): %s", fstype, op->spec->target);
+
+	if (sys_fsconfig(fsfd, FSCONFIG_SET_STRING, "source", source, 0) < 0)
+		myerror(EXIT_FAILURE, errno, "fsconfig(source): %s", op->spec->target);
+
+	for (size_t i = 0; i < ARRAY_SIZE(superblockParams); i++) {
+		if (op->spec->vfs_opts & superblockParams[i].mount_flag &&
+		    sys_fsconfig(fsfd, FSCONFIG_SET_FLAG, superblockParams[i].param, NULL, 0) < 0)
+			myerror(EXIT_FAILURE, errno, "fsconfig(%s): %s", superblockParams[i].param, op->spec->target);
+	}
+
+	if (op->spec->data) {
+		char *s, *param, *data;
+
+		s = data = xstrdup(op->spec->data);
+
+		while ((param = strsep(&data, ",")) != NULL) {
+			if (*param)
+				fsconfig_param(fsfd, op->spec->target, param);
+		}
+
+		xfree(s);
+	}
+
+	if (sys_fsconfig(fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) < 0)
+		myerror(EXIT_FAILURE, errno, "fsconfig(create): %s", op->spec->target);
+
+	if ((fd = sys_fsmount(fsfd, FSMOUNT_CLOEXEC, mount_attrs(op->spec->vfs_opts))) < 0)
+		myerror(EXIT_FAILURE, errno, "fsmount: %s", op->spec->target);
+
+	close(fsfd);
+	return fd;
+}
+
+/*
+ * Clones the source tree and applies the mount attributes to the whole clone
+ * while it is still detached, so no remount is needed afterwards.
+ */
+static int
+open_bind(struct mountop *op)
+{
+	int fd;
+	unsigned int flags = OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC;
+	struct mountattr attr = { 0 };
+
+	if (op->spec->vfs_opts & MS_REC)
+		flags |= AT_RECURSIVE;
+
+	if ((fd = sys_open_tree(AT_FDCWD, op->spec->source, flags)) < 0)
+		myerror(EXIT_FAILURE, errno, "open_tree: %s", op->spec->source);
+
+	attr.attr_set = mount_attrs(op->spec->vfs_opts);
+
+	if (op->spec->vfs_opts & (MS_NOATIME | MS_STRICTATIME | MS_RELATIME))
+		attr.attr_clr = MOUNT_ATTR__ATIME;
+
+	if ((attr.attr_set || attr.attr_clr) &&
+	    sys_mount_setattr(fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof(attr)) < 0)
+		myerror(EXIT_FAILURE, errno, "mount_setattr: %s", op->spec->target);
+
+	return fd;
+}
+
+/*
+ * Binds the source over the file or directory opened as targetfd. Unlike
+ * open_bind() this is not part of the plan, the device nodes use it to bind
+ * the host nodes. Without the new mount API the target is reached through
+ * /proc/self/fd.
+ */
+int
+bind_fd(const char *source, int targetfd)
+{
+	int fd, ret;
+	char mpoint[32];
+
+	if (mountfd_supported()) {
+		if ((fd = sys_open_tree(AT_FDCWD, source, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC)) < 0)
+			return -1;
+
+		ret = sys_move_mount(fd, "", targetfd, "", MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_T_EMPTY_PATH);
+		close(fd);
+
+		return ret;
+	}
+
+	snprintf(mpoint, sizeof(mpoint), "/proc/self/fd/%d", targetfd);
+
+	return mount(source, mpoint, NULL, MS_BIND, NULL);
+}
+
+static void
+dirlist_add(struct dirlist *l, unsigned char type, const char *name)
+{
+	size_t n = strlen(name) + 2;
+
+	if (l->len + n > l->size) {
+		l->size = (l->size + n) * 2;
+		l->buf = xrealloc(l->buf, l->size, 1);
+	}
+
+	l->buf[l->len] = (char) type;
+	memcpy(l->buf + l->len + 1, name, n - 1);
+
+	l->len += n;
+	l->nr++;
+}
+
+static int
+scan_dir(int fd, const char *source, struct dirlist *l)
+{
+	static char buf[GETDENTS_BUFSIZ] __attribute__((aligned(8)));
+	long n;
+
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (long off = 0; off < n;) {
+			struct linux_dirent64 *d = (struct linux_dirent64 *) (buf + off);
+
+			off += d->d_reclen;
+
+			if (!strcmp(".", d->d_name) || !strcmp("..", d->d_name))
+				continue;
+
+			dirlist_add(l, d->d_type, d->d_name);
+		}
+	}
+
+	if (n < 0) {
+		errmsg("getdents64: %s", source);
+		return -1;
+	}
+
+	return 0;
+}
+
+static char *
+bindents_cache_name(const char *source)
+{
+	char *name = NULL;
+
+	xasprintf(&name, "%016llx.list",
+	          (unsigned long long) fnv1a(FNV1A_INIT, source, strlen(source)));
+
+	return name;
+}
+
+static void
+fill_cache_header(struct bindents_cache_hdr *hdr, struct stat *st)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, BINDENTS_CACHE_MAGIC, sizeof(hdr->magic));
+
+	hdr->version    = BINDENTS_CACHE_VERSION;
+	hdr->dev        = st->st_dev;
+	hdr->ino        = st->st_ino;
+	hdr->mtime_sec  = st->st_mtim.tv_sec;
+	hdr->mtime_nsec = st->st_mtim.tv_nsec;
+	hdr->ctime_sec  = st->st_ctim.tv_sec;
+	hdr->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+/*
+ * The listing is valid as long as the source directory has not changed since
+ * it was scanned. Adding, removing or renaming an entry updates the directory
+ * mtime.
+ */
+static int
+cache_load(const char *filename, struct bindents_cache_hdr *want, struct dirlist *l)
+{
+	int fd;
+	struct stat sb;
+	struct bindents_cache_hdr hdr;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT)
+			errmsg("open: %s", filename);
+		return -1;
+	}
+
+	if (fstat(fd, &sb) < 0 ||
+	    TEMP_FAILURE_RETRY(read(fd, &hdr, sizeof(hdr))) != (ssize_t) sizeof(hdr))
+		goto invalid;
+
+	if (memcmp(hdr.magic, want->magic, sizeof(hdr.magic)) ||
+	    hdr.version != want->version ||
+	    hdr.dev != want->dev ||
+	    hdr.ino != want->ino ||
+	    hdr.mtime_sec != want->mtime_sec ||
+	    hdr.mtime_nsec != want->mtime_nsec ||
+	    hdr.ctime_sec != want->ctime_sec ||
+	    hdr.ctime_nsec != want->ctime_nsec ||
+	    (uint64_t) sb.st_size != sizeof(hdr) + hdr.len)
+		goto invalid;
+
+	l->size = l->len = hdr.len;
+	l->nr   = hdr.nr;
+	l->buf  = xmalloc(l->size + 1);
+
+	if (TEMP_FAILURE_RETRY(read(fd, l->buf, l->len)) != (ssize_t) l->len ||
+	    (l->len > 0 && l->buf[l->len - 1] != '\0')) {
+		l->buf = xfree(l->buf);
+		l->size = l->len = l->nr = 0;
+		goto invalid;
+	}
+
+	close(fd);
+
+	if (verbose > 1)
+		info("_bindents cache hit: %s", filename);
+
+	return 0;
+invalid:
+	if (verbose)
+		info("ignoring invalid _bindents cache: %s", filename);
+	close(fd);
+	return -1;
+}
+
+static void
+cache_store(const char *dir, const char *name, struct bindents_cache_hdr *hdr, struct dirlist *l)
+{
+	struct iovec iov[2];
+
+	hdr->nr  = l->nr;
+	hdr->len = l->len;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len  = sizeof(*hdr);
+	iov[1].iov_base = l->buf;
+	iov[1].iov_len  = l->len;
+
+	store_file(dir, name, iov, ARRAY_SIZE(iov));
+}
+
 static int
-_bindents(const char *source, const char *target)
+match_patterns(char **patterns, const char *name)
+{
+	for (size_t i = 0; patterns && patterns[i]; i++) {
+		if (!fnmatch(patterns[i], name, 0))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Reads the listing of the source directory, from the cache if the directory
+ * is unchanged.
+ */
+static int
+read_listing(int fd, const char *source, const char *statedir, struct dirlist *l)
 {
 	int rc = -1;
-	DIR *d;
-	char *spath, *tpath;
+	struct stat st;
+	struct bindents_cache_hdr hdr;
+	char *dir = NULL, *name = NULL, *cachefile = NULL;
 
-	if (!(d = opendir(source))) {
-		errmsg("opendir: %s", source);
-		return rc;
+	if (fstat(fd, &st) < 0) {
+		errmsg("fstat: %s", source);
+		return -1;
 	}
 
-	spath = tpath = NULL;
+	if (statedir) {
+		fill_cache_header(&hdr, &st);
 
-	while (1) {
-		struct dirent *ent;
+		name = bindents_cache_name(source);
+		xasprintf(&dir, "%s/bindents", statedir);
+		xasprintf(&cachefile, "%s/%s", dir, name);
 
-		if (!(ent = readdir(d))) {
-			if (errno) {
-				errmsg("readdir: %s", source);
-				break;
-			}
+		if (!cache_load(cachefile, &hdr, l)) {
 			rc = 0;
-			break;
+			goto out;
 		}
+	}
+
+	if (scan_dir(fd, source, l) < 0)
+		goto out;
+
+	if (dir)
+		cache_store(dir, name, &hdr, l);
+
+	rc = 0;
+out:
+	xfree(cachefile);
+	xfree(name);
+	xfree(dir);
+
+	return rc;
+}
 
-		if (!strcmp(".", ent->d_name) || !strcmp("..", ent->d_name))
+/*
+ * Populates the tmpfs mounted at target with a placeholder for every entry of
+ * the source directory and binds the entry over it. All paths are resolved
+ * relative to the two directory descriptors.
+ */
+static int
+bindents(struct mountop *op, int rootfd, const char *statedir, int mountfd)
+{
+	int rc = -1;
+	int srcfd, dstfd = -1;
+	const char *source = op->spec->source;
+	struct dirlist list = { 0 };
+	char *p, *end;
+
+	if ((srcfd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		errmsg("open: %s", source);
+		return -1;
+	}
+
+	if ((dstfd = open_in_root(rootfd, op->spec->target, O_RDONLY | O_DIRECTORY)) < 0) {
+		errmsg("open: %s", op->spec->target);
+		goto out;
+	}
+
+	if (read_listing(srcfd, source, statedir, &list) < 0)
+		goto out;
+
+	for (p = list.buf, end = list.buf + list.len; p < end; p += strlen(p + 1) + 2) {
+		unsigned char type = (unsigned char) p[0];
+		const char *name = p + 1;
+
+		if (op->spec->include && !match_patterns(op->spec->include, name))
+			continue;
+
+		if (match_patterns(op->spec->exclude, name))
 			continue;
 
-		xasprintf(&spath, "%s/%s", source, ent->d_name);
-		xasprintf(&tpath, "%s/%s", target, ent->d_name);
+		if (type == DT_LNK || type == DT_UNKNOWN) {
+			struct stat st;
 
-		if (ent->d_type == DT_DIR) {
-			if (mkdir(tpath, 0755) < 0) {
-				errmsg("mkdir: %s", tpath);
-				break;
+			if (fstatat(srcfd, name, &st, 0) < 0) {
+				errmsg("stat: %s/%s", source, name);
+				goto out;
+			}
+
+			type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		}
+
+		if (type == DT_DIR) {
+			if (mkdirat(dstfd, name, 0755) < 0) {
+				errmsg("mkdir: %s/%s", op->spec->target, name);
+				goto out;
 			}
 		} else {
-			int fd = creat(tpath, 0644);
+			int fd = openat(dstfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
 			if (fd < 0) {
-				errmsg("open: %s", tpath);
-				break;
+				errmsg("open: %s/%s", op->spec->target, name);
+				goto out;
 			}
 			close(fd);
 		}
 
-		if (mount(spath, tpath, "none", MS_BIND | MS_REC, NULL) < 0) {
-			errmsg("mount: %s", tpath);
-			break;
-		}
+		if (mountfd) {
+			int tree = sys_open_tree(srcfd, name, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
 
-		spath = xfree(spath);
-		tpath = xfree(tpath);
-	}
+			if (tree < 0) {
+				errmsg("open_tree: %s/%s", source, name);
+				goto out;
+			}
 
-	xfree(spath);
-	xfree(tpath);
+			if (sys_move_mount(tree, "", dstfd, name, MOVE_MOUNT_F_EMPTY_PATH) < 0) {
+				errmsg("move_mount: %s/%s", op->spec->target, name);
+				close(tree);
+				goto out;
+			}
 
-	if (closedir(d) < 0) {
-		errmsg("closedir: %s", source);
-		return -1;
+			close(tree);
+		} else {
+			char spath[MAXPATHLEN], tpath[MAXPATHLEN];
+
+			snprintf(spath, sizeof(spath), "%s/%s", source, name);
+			snprintf(tpath, sizeof(tpath), "/proc/self/fd/%d/%s", dstfd, name);
+
+			if (mount(spath, tpath, "none", MS_BIND | MS_REC, NULL) < 0) {
+				errmsg("mount: %s/%s", op->spec->target, name);
+				goto out;
+			}
+		}
 	}
 
+	if (verbose > 2)
+		info("_bindents: %u entries listed in %s", list.nr, source);
+
+	rc = 0;
+out:
+	xfree(list.buf);
+
+	if (dstfd >= 0)
+		close(dstfd);
+	close(srcfd);
+
 	return rc;
 }
 
+/*
+ * Creates the x-mount.mkdir mountpoint. Its parent is resolved inside the root.
+ */
 static void
-remount_ro(const char *mpoint)
+make_mountpoint(int rootfd, struct mountspec *spec)
 {
-	struct statfs st;
+	int dirfd;
+	const char *base;
 
-	if (TEMP_FAILURE_RETRY(statfs(mpoint, &st)) < 0)
-		myerror(EXIT_FAILURE, errno, "statfs: %s", mpoint);
+	if ((dirfd = open_parent_in_root(rootfd, spec->target, &base)) < 0)
+		myerror(EXIT_FAILURE, errno, "open: %s", spec->target);
+
+	if (*base && mkdirat(dirfd, base, spec->mkdir) < 0 && errno != EEXIST)
+		myerror(EXIT_FAILURE, errno, "mkdir: %s", spec->target);
 
-	if (st.f_flags & ST_RDONLY)
+	close(dirfd);
+}
+
+/*
+ * The mountpoint is resolved inside the root once and then used through its
+ * descriptor, so a symlink in the root can not move a mount out of it. The
+ * calls that take only a path get the descriptor as a /proc/self/fd link.
+ */
+static void
+attach_mount(struct mountop *op, int rootfd, const char *statedir, int mountfd)
+{
+	struct mountspec *spec = op->spec;
+	const char *target = spec->target;
+	char mpoint[32];
+	int mpfd;
+
+	if (spec->mkdir)
+		make_mountpoint(rootfd, spec);
+
+	if ((mpfd = open_in_root(rootfd, target, O_PATH)) < 0) {
+		if (errno != ENOENT)
+			myerror(EXIT_FAILURE, errno, "open: %s", target);
+		if (verbose)
+			info("WARNING: mountpoint not found in the isolation: %s", target);
 		return;
+	}
+
+	snprintf(mpoint, sizeof(mpoint), "/proc/self/fd/%d", mpfd);
+
+	if (verbose > 2) {
+		if (spec->kind == MOUNT_BINDENTS)
+			info("mount(bind) content into the isolation: %s", target);
+		else if (spec->kind == MOUNT_UMOUNT)
+			info("umount from the isolation: %s", target);
+		else if (spec->vfs_opts & MS_BIND)
+			info("mount(bind) into the isolation: %s", target);
+		else if (spec->vfs_opts & MS_MOVE)
+			info("mount(move) into the isolation: %s", target);
+		else
+			info("mount into the isolation: %s", target);
+	}
 
-	unsigned long new_flags = MS_REMOUNT | MS_RDONLY | MS_BIND;
+	if (op->fd >= 0) {
+		if (sys_move_mount(op->fd, "", mpfd, "", MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_T_EMPTY_PATH) < 0)
+			myerror(EXIT_FAILURE, errno, "move_mount: %s", target);
 
-	for (size_t i = 0; i < ARRAY_SIZE(mountPairs); i++) {
-		if (st.f_flags & mountPairs[i].vfs_flag)
-			new_flags |= mountPairs[i].mount_flag;
+	} else if (spec->kind == MOUNT_BINDENTS) {
+		if (mount("tmpfs", mpoint, "tmpfs", spec->vfs_opts, spec->data) < 0)
+			myerror(EXIT_FAILURE, errno, "mount(_bindents): %s", target);
+
+	} else if (spec->kind == MOUNT_UMOUNT) {
+		if (umount2(mpoint, MNT_DETACH) < 0)
+			myerror(EXIT_FAILURE, errno, "umount2: %s", target);
+
+	} else {
+		if (mount(spec->source, mpoint, spec->fstype, spec->vfs_opts, spec->data) < 0)
+			myerror(EXIT_FAILURE, errno, "mount: %s", target);
+
+		// The descriptor still points under the new mount.
+		if (spec->kind == MOUNT_BIND) {
+			close(mpfd);
+
+			if ((mpfd = open_in_root(rootfd, target, O_PATH)) < 0)
+				myerror(EXIT_FAILURE, errno, "open: %s", target);
+
+			snprintf(mpoint, sizeof(mpoint), "/proc/self/fd/%d", mpfd);
+			remount_attrs(mpoint, target, spec->vfs_opts);
+		}
 	}
 
-	if (mount(mpoint, mpoint, "none", new_flags, 0) < 0)
-		myerror(EXIT_FAILURE, errno, "mount(remount,ro): %s", mpoint);
+	close(mpfd);
+
+	if (spec->kind == MOUNT_BINDENTS && bindents(op, rootfd, statedir, mountfd) < 0)
+		myerror(EXIT_FAILURE, 0, "_bindents: %s", target);
 }
 
+/*
+ * Layers a writable upper directory over the root. The overlay is mounted on
+ * top of the root itself, so the rest of the setup does not need to know about
+ * it. With tmpfs the upper lives in memory and goes away with the mount
+ * namespace.
+ */
 void
-do_mount(const char *newroot, struct mntent **mounts)
+mount_overlay(const char *newroot, const char *dir, int tmpfs)
 {
-	size_t i = 0;
+	char *upper = NULL, *work = NULL, *opts = NULL;
 
-	if (verbose)
-		info("changing mountpoints");
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		myerror(EXIT_FAILURE, errno, "mkdir: %s", dir);
 
-	while (mounts && mounts[i]) {
-		char *mpoint;
-		struct mountflags mflags = { 0 };
+	if (tmpfs && mount("tmpfs", dir, "tmpfs", MS_NOSUID | MS_NODEV, "mode=0700") < 0)
+		myerror(EXIT_FAILURE, errno, "mount(tmpfs): %s", dir);
 
-		parse_mountopts(mounts[i]->mnt_opts, &mflags);
+	xasprintf(&upper, "%s/upper", dir);
+	xasprintf(&work, "%s/work", dir);
 
-		if ((strlen(newroot) + strlen(mounts[i]->mnt_dir)) > MAXPATHLEN)
-			myerror(EXIT_FAILURE, 0, "mountpoint name too long");
+	if (mkdir(upper, 0755) < 0 && errno != EEXIST)
+		myerror(EXIT_FAILURE, errno, "mkdir: %s", upper);
 
-		xasprintf(&mpoint, "%s%s", newroot, mounts[i]->mnt_dir);
+	if (mkdir(work, 0700) < 0 && errno != EEXIST)
+		myerror(EXIT_FAILURE, errno, "mkdir: %s", work);
 
-		if (mflags.mkdir && mkdir(mpoint, mflags.mkdir) < 0 && errno != EEXIST)
-			myerror(EXIT_FAILURE, errno, "mkdir: %s", mpoint);
+	xasprintf(&opts, "lowerdir=%s,upperdir=%s,workdir=%s", newroot, upper, work);
 
-		if (access(mpoint, F_OK) < 0) {
-			if (verbose)
-				info("WARNING: mountpoint not found in the isolation: %s", mounts[i]->mnt_dir);
-			goto next;
-		}
+	if (verbose > 2)
+		info("mount(overlay) over the root: %s", opts);
 
-		if (!strncasecmp("_bindents", mounts[i]->mnt_type, 9)) {
-			if (verbose > 2)
-				info("mount(bind) content into the isolation: %s", mpoint);
+	if (mount("overlay", newroot, "overlay", 0, opts) < 0)
+		myerror(EXIT_FAILURE, errno, "mount(overlay): %s", newroot);
 
-			if (mount("tmpfs", mpoint, "tmpfs", mflags.vfs_opts, mflags.data) < 0)
-				myerror(EXIT_FAILURE, errno, "mount(_bindents): %s", mpoint);
+	xfree(opts);
+	xfree(work);
+	xfree(upper);
+}
 
-			if (_bindents(mounts[i]->mnt_fsname, mpoint) < 0)
-				myerror(EXIT_FAILURE, 0, "_bindents: %s", mpoint);
+static int
+remove_entry(const char *path, const struct stat *sb __attribute__((unused)),
+             int typeflag __attribute__((unused)), struct FTW *ftwbuf __attribute__((unused)))
+{
+	if (remove(path) < 0) {
+		errmsg("remove: %s", path);
+		return -1;
+	}
+	return 0;
+}
 
-			goto next;
+/*
+ * Removes the writable layer of a stopped container unless it must be kept.
+ * A tmpfs layer has already gone with the container, only its mountpoint is
+ * left.
+ */
+int
+remove_overlay(const char *dir, int tmpfs, int keep)
+{
+	if (tmpfs || keep) {
+		if (tmpfs && rmdir(dir) < 0 && errno != ENOENT) {
+			errmsg("rmdir: %s", dir);
+			return -1;
 		}
+		return 0;
+	}
 
-		if (!strncasecmp("_umount", mounts[i]->mnt_type, 7)) {
-			if (verbose > 2)
-				info("umount from the isolation: %s", mpoint);
+	if (access(dir, F_OK) < 0)
+		return 0;
 
-			if (umount2(mpoint, MNT_DETACH) < 0)
-				myerror(EXIT_FAILURE, errno, "umount2: %s", mpoint);
+	if (verbose > 1)
+		info("removing overlay: %s", dir);
 
-			goto next;
-		}
+	return nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+}
 
-		if (verbose > 2) {
-			if (mflags.vfs_opts & MS_BIND)
-				info("mount(bind) into the isolation: %s", mpoint);
-			else if (mflags.vfs_opts & MS_MOVE)
-				info("mount(move) into the isolation: %s", mpoint);
-			else
-				info("mount into the isolation: %s", mpoint);
-		}
+/*
+ * Returns the size of the kernel object that describes one mount, or zero if
+ * the slab statistics are not available.
+ */
+static size_t
+mount_objsize(void)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t linesz = 0, objsize = 0;
+
+	if (!(fp = fopen("/proc/slabinfo", "r")))
+		return 0;
 
-		if (mount(mounts[i]->mnt_fsname, mpoint, mounts[i]->mnt_type, mflags.vfs_opts, mflags.data) < 0)
-			myerror(EXIT_FAILURE, errno, "mount: %s", mpoint);
+	while (getline(&line, &linesz, fp) > 0) {
+		if (sscanf(line, "mnt_cache %*u %*u %zu", &objsize) == 1)
+			break;
+	}
 
-		if (mflags.vfs_opts & MS_RDONLY)
-			remount_ro(mpoint);
-	next:
+	xfree(line);
+	fclose(fp);
 
-		xfree(mflags.data);
-		xfree(mpoint);
+	return objsize;
+}
 
-		free_mntent(mounts[i]);
-		i++;
+/*
+ * Returns the number of mounts in the namespace, or zero if the list can not be
+ * read. The new root may have no /proc.
+ */
+static size_t
+count_mounts(void)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t linesz = 0, nr = 0;
+
+	if (!(fp = fopen("/proc/self/mountinfo", "r")))
+		return 0;
+
+	while (getline(&line, &linesz, fp) > 0)
+		nr++;
+
+	xfree(line);
+	fclose(fp);
+
+	return nr;
+}
+
+/*
+ * The recursive self-bind of newroot has copied the mounts below it, so only
+ * the mounts left after the old root is gone are the kept ones.
+ */
+static void
+report_mounts(size_t before, size_t objsize)
+{
+	size_t kept;
+
+	if (!before || !(kept = count_mounts()) || kept > before)
+		return;
+
+	if (objsize > 0)
+		info("pivot_root: %zu mounts kept, %zu inherited mounts dropped (%zu KiB of mount objects)",
+		     kept, before - kept, (before - kept) * objsize / 1024);
+	else
+		info("pivot_root: %zu mounts kept, %zu inherited mounts dropped",
+		     kept, before - kept);
+}
+
+/*
+ * Makes newroot the root of the mount namespace and detaches the old root, so
+ * only the mounts below newroot stay in the namespace. The old root is stacked
+ * on top of the new one by pivot_root(".", ".") and then unmounted.
+ */
+void
+do_pivot_root(const char *newroot)
+{
+	size_t before = 0, objsize = 0;
+
+	if (verbose) {
+		before = count_mounts();
+		objsize = mount_objsize();
+	}
+
+	if (chdir(newroot) < 0)
+		myerror(EXIT_FAILURE, errno, "chdir: %s", newroot);
+
+	if (syscall(SYS_pivot_root, ".", ".") < 0)
+		myerror(EXIT_FAILURE, errno, "pivot_root: %s", newroot);
+
+	if (umount2(".", MNT_DETACH) < 0)
+		myerror(EXIT_FAILURE, errno, "umount2: old root");
+
+	if (chdir("/") < 0)
+		myerror(EXIT_FAILURE, errno, "chdir");
+
+	if (verbose)
+		report_mounts(before, objsize);
+}
+
+/*
+ * Executes the mount plan. All filesystems and bind mounts are first created
+ * detached, with their attributes already applied, and then attached to the
+ * new root in plan order. Entries that act on mounts already in place and
+ * kernels without the new mount API get mount(2).
+ */
+void
+do_mount(int rootfd, const char *statedir, struct mountspec **mounts)
+{
+	size_t i, nr_ops = 0;
+	struct mountop *ops;
+	int mountfd;
+
+	if (verbose)
+		info("changing mountpoints");
+
+	while (mounts && mounts[nr_ops])
+		nr_ops++;
+
+	ops = xcalloc(nr_ops, sizeof(*ops));
+	mountfd = mountfd_supported();
+
+	for (i = 0; i < nr_ops; i++) {
+		struct mountop *op = &ops[i];
+
+		op->spec = mounts[i];
+		op->fd = -1;
+
+		if (!mountfd || op->spec->mountpoint == MOUNTPOINT_MISSING)
+			continue;
+
+		switch (op->spec->kind) {
+			case MOUNT_FILESYSTEM:
+				op->fd = open_filesystem(op, op->spec->fstype, op->spec->source);
+				break;
+			case MOUNT_BIND:
+				op->fd = open_bind(op);
+				break;
+			case MOUNT_BINDENTS:
+				op->fd = open_filesystem(op, "tmpfs", "tmpfs");
+				break;
+			case MOUNT_UMOUNT:
+			case MOUNT_LEGACY:
+				break;
+		}
+	}
+
+	for (i = 0; i < nr_ops; i++) {
+		if (ops[i].spec->mountpoint != MOUNTPOINT_MISSING)
+			attach_mount(&ops[i], rootfd, statedir, mountfd);
+
+		if (ops[i].fd >= 0)
+			close(ops[i].fd);
+
+		free_mountspec(ops[i].spec);
 	}
+
+	xfree(ops);
 }
@@ -1,16 +1,46 @@
 #include <sys/param.h>
+#include <sys/syscall.h>
 
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <errno.h>
 
 #include "isolate.h"
 
+#ifndef __NR_clone3
+#define __NR_clone3 435
+#endif
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
 extern int verbose;
 
+/* Layout of struct clone_args up to CLONE_ARGS_SIZE_VER2. */
+struct clone3_args {
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t tls;
+	uint64_t set_tid;
+	uint64_t set_tid_size;
+	uint64_t cgroup;
+};
+
 static struct {
 	const char *name;
 	const char *clone_name;
@@ -89,3 +119,38 @@ unshare_flags(const int flags)
 		}
 	}
 }
+
+pid_t
+clone3_flags(const int flags, const int cgroup_fd, int *pidfd)
+{
+	size_t i;
+	long pid;
+	struct clone3_args args = {};
+
+	for (i = 0; i < ARRAY_SIZE(clone_flags); i++) {
+		// For clone these flags mean sharing, so they are dropped:
+		// a new process already gets its own copy of them.
+		if (clone_flags[i].flag == CLONE_FS || clone_flags[i].flag == CLONE_SYSVSEM)
+			continue;
+
+		if (flags & clone_flags[i].flag) {
+			if (verbose > 2)
+				info("clone namespace %s (%s)", clone_flags[i].name, clone_flags[i].clone_name);
+
+			args.flags |= (uint64_t) clone_flags[i].flag;
+		}
+	}
+
+	args.flags |= CLONE_PIDFD;
+	args.pidfd = (uint64_t) (uintptr_t) pidfd;
+	args.exit_signal = SIGCHLD;
+
+	if (cgroup_fd >= 0) {
+		args.flags |= CLONE_INTO_CGROUP;
+		args.cgroup = (uint64_t) cgroup_fd;
+	}
+
+	pid = syscall(__NR_clone3, &args, sizeof(args));
+
+	return (pid_t) pid;
+}
@@ -0,0 +1,44 @@
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+int
+pidfd_open_pid(pid_t pid)
+{
+	return (int) syscall(__NR_pidfd_open, pid, 0);
+}
+
+int
+pidfd_wait(int pidfd, siginfo_t *info, int options)
+{
+	info->si_pid = 0;
+	return (int) TEMP_FAILURE_RETRY(waitid((idtype_t) P_PIDFD, (id_t) pidfd, info, WEXITED | options));
+}
+
+int
+get_siginfo_rc(const siginfo_t *info)
+{
+	switch (info->si_code) {
+		case CLD_EXITED:
+			return info->si_status;
+		case CLD_KILLED:
+		case CLD_DUMPED:
+			return 128 + info->si_status;
+	}
+	return 255;
+}
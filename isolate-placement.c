@@ -0,0 +1,402 @@
+#include <sys/param.h>
+#include <sys/syscall.h>
+
+#include <linux/mempolicy.h>
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+#define SYSFS_NODE "/sys/devices/system/node"
+#define SYSFS_CPU  "/sys/devices/system/cpu"
+
+#define PLACEMENT_BUFSIZ 4096
+#define PLACEMENT_MAX_NODES 1024
+#define PLACEMENT_WEIGHT 100
+
+extern int verbose;
+
+static const struct {
+	const char *name;
+	int mode;
+} mempolicies[] = {
+	[MEMPOLICY_NONE]       = { "none",       MPOL_DEFAULT    },
+	[MEMPOLICY_BIND]       = { "bind",       MPOL_BIND       },
+	[MEMPOLICY_PREFERRED]  = { "preferred",  MPOL_PREFERRED  },
+	[MEMPOLICY_INTERLEAVE] = { "interleave", MPOL_INTERLEAVE },
+	[MEMPOLICY_LOCAL]      = { "local",      MPOL_LOCAL      },
+};
+
+/*
+ * Parses a list like "0-3,8" and sets the bits of the numbers that fit into the
+ * mask. Returns how many numbers there are or -1 if the list is malformed.
+ */
+static ssize_t
+parse_list(const char *str, unsigned long *mask, size_t nbits)
+{
+	const char *p = str;
+	ssize_t nr = 0;
+
+	while (*p) {
+		char *end;
+		unsigned long first, last;
+
+		if (*p < '0' || *p > '9')
+			return -1;
+
+		first = last = strtoul(p, &end, 10);
+
+		if (*end == '-') {
+			p = end + 1;
+
+			if (*p < '0' || *p > '9' || (last = strtoul(p, &end, 10)) < first)
+				return -1;
+		}
+
+		nr += (ssize_t) (last - first + 1);
+
+		for (unsigned long i = first; mask && i <= last && i < nbits; i++)
+			mask[i / LONG_BIT] |= 1UL << (i % LONG_BIT);
+
+		p = end;
+
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+	}
+
+	return nr;
+}
+
+static int
+test_node(const unsigned long *mask, int id)
+{
+	return id < PLACEMENT_MAX_NODES && (mask[id / LONG_BIT] & (1UL << (id % LONG_BIT)));
+}
+
+static int
+read_line(const char *path, char *buf, size_t size)
+{
+	FILE *fp;
+
+	if (!(fp = fopen(path, "re")))
+		return -1;
+
+	if (!fgets(buf, (int) size, fp))
+		buf[0] = '\0';
+
+	fclose(fp);
+
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int
+read_cgroup(struct cgroups *cg, const char *controller, const char *file, char *buf, size_t size)
+{
+	int fd;
+	ssize_t len;
+
+	if ((fd = cgroup_open(cg, controller, file)) < 0)
+		return -1;
+
+	len = TEMP_FAILURE_RETRY(read(fd, buf, size - 1));
+	close(fd);
+
+	if (len < 0)
+		return -1;
+
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return 0;
+}
+
+static void
+topology_add(struct topology *topo, int id, const char *cpus)
+{
+	ssize_t nr_cpus = parse_list(cpus, NULL, 0);
+	struct numa_node *node;
+
+	topo->nodes = xrealloc(topo->nodes, topo->nr_nodes + 1, sizeof(struct numa_node));
+
+	node = &topo->nodes[topo->nr_nodes++];
+	node->id = id;
+	node->cpus = xstrdup(cpus);
+	node->nr_cpus = nr_cpus > 0 ? (size_t) nr_cpus : 0;
+	node->load = 0;
+}
+
+/*
+ * Reads the online nodes and their cpus from sysfs. A kernel without NUMA has
+ * no node directory, all its cpus are on the node 0.
+ */
+int
+topology_load(struct topology *topo)
+{
+	unsigned long online[PLACEMENT_MAX_NODES / LONG_BIT] = {};
+	char path[MAXPATHLEN + 1], buf[PLACEMENT_BUFSIZ];
+
+	memset(topo, 0, sizeof(*topo));
+
+	if (read_line(SYSFS_NODE "/online", buf, sizeof(buf)) < 0) {
+		if (read_line(SYSFS_CPU "/online", buf, sizeof(buf)) < 0) {
+			errmsg("open: %s", SYSFS_CPU "/online");
+			return -1;
+		}
+		topology_add(topo, 0, buf);
+		return 0;
+	}
+
+	if (parse_list(buf, online, PLACEMENT_MAX_NODES) < 0) {
+		info("bad list of nodes: %s", buf);
+		return -1;
+	}
+
+	for (int id = 0; id < PLACEMENT_MAX_NODES; id++) {
+		if (!test_node(online, id))
+			continue;
+
+		snprintf(path, MAXPATHLEN, "%s/node%d/cpulist", SYSFS_NODE, id);
+
+		if (read_line(path, buf, sizeof(buf)) < 0) {
+			errmsg("open: %s", path);
+			topology_free(topo);
+			return -1;
+		}
+
+		topology_add(topo, id, buf);
+	}
+
+	return 0;
+}
+
+void
+topology_free(struct topology *topo)
+{
+	for (size_t i = 0; i < topo->nr_nodes; i++)
+		xfree(topo->nodes[i].cpus);
+
+	topo->nodes = xfree(topo->nodes);
+	topo->nr_nodes = 0;
+}
+
+/*
+ * The cpu weight of a running container. The v1 shares are converted back to
+ * the weight.
+ */
+uint64_t
+placement_weight(struct cgroups *cg)
+{
+	char buf[64];
+	uint64_t value;
+
+	if (cgroup_version(cg) == CGROUP_V2) {
+		if (read_cgroup(cg, "cpu", "cpu.weight", buf, sizeof(buf)) == 0 &&
+		    (value = strtoull(buf, NULL, 10)) > 0)
+			return value;
+	} else {
+		if (read_cgroup(cg, "cpu", "cpu.shares", buf, sizeof(buf)) == 0 &&
+		    (value = strtoull(buf, NULL, 10)) > 0)
+			return MAX(1, value * 100 / 1024);
+	}
+
+	return PLACEMENT_WEIGHT;
+}
+
+static void
+account_container(struct topology *topo, struct cgroups *cg)
+{
+	unsigned long mems[PLACEMENT_MAX_NODES / LONG_BIT] = {};
+	char buf[PLACEMENT_BUFSIZ];
+	uint64_t weight;
+	size_t i, nr = 0;
+
+	// An empty cpuset.mems of v2 means the nodes of the parent.
+	if ((read_cgroup(cg, "cpuset", "cpuset.mems", buf, sizeof(buf)) < 0 || !buf[0]) &&
+	    read_cgroup(cg, "cpuset", "cpuset.mems.effective", buf, sizeof(buf)) < 0)
+		return;
+
+	if (parse_list(buf, mems, PLACEMENT_MAX_NODES) <= 0)
+		return;
+
+	for (i = 0; i < topo->nr_nodes; i++) {
+		if (test_node(mems, topo->nodes[i].id))
+			nr++;
+	}
+
+	if (!nr)
+		return;
+
+	// A container spread over several nodes loads each of them a bit.
+	weight = placement_weight(cg);
+
+	for (i = 0; i < topo->nr_nodes; i++) {
+		if (test_node(mems, topo->nodes[i].id))
+			topo->nodes[i].load += weight / nr;
+	}
+}
+
+/*
+ * Adds the weights of the running containers of the group to the nodes they
+ * are on. The container itself and the containers listed in skip are left out.
+ */
+void
+topology_account(struct topology *topo, struct cgroups *cg, char **skip)
+{
+	char **names = cgroup_siblings(cg, "cpuset");
+
+	for (size_t i = 0; names && names[i]; i++) {
+		struct cgroups sibling = *cg;
+		size_t k;
+
+		for (k = 0; skip && skip[k] && strcmp(skip[k], names[i]); k++);
+
+		sibling.name = names[i];
+
+		if (!(skip && skip[k]) && cgroup_populated(&sibling))
+			account_container(topo, &sibling);
+
+		xfree(names[i]);
+	}
+
+	xfree(names);
+}
+
+/*
+ * Picks the node with the least load per cpu after adding the weight, and adds
+ * the weight to it. Nodes with memory only are never picked.
+ */
+struct numa_node *
+topology_pick(struct topology *topo, uint64_t weight)
+{
+	struct numa_node *best = NULL;
+
+	for (size_t i = 0; i < topo->nr_nodes; i++) {
+		struct numa_node *node = &topo->nodes[i];
+
+		if (!node->nr_cpus)
+			continue;
+
+		if (!best || (node->load + weight) * best->nr_cpus < (best->load + weight) * node->nr_cpus)
+			best = node;
+	}
+
+	if (best)
+		best->load += weight;
+
+	return best;
+}
+
+/*
+ * Places a container with "placement = auto" on one node. The cpus and mems are
+ * stored as limits, so the cgroup gets them when it is created.
+ */
+int
+placement_assign(struct container *data)
+{
+	struct topology topo;
+	struct numa_node *node;
+	const char *value;
+	uint64_t weight = PLACEMENT_WEIGHT;
+	char id[16];
+	int rc = -1;
+
+	if (data->placement != PLACEMENT_AUTO)
+		return 0;
+
+	if (topology_load(&topo) < 0)
+		return -1;
+
+	if ((value = cgroup_limit_value(data->cgroups, "cpu-weight")))
+		weight = strtoull(value, NULL, 10);
+
+	topology_account(&topo, data->cgroups, NULL);
+
+	if (!(node = topology_pick(&topo, weight))) {
+		info("%s: no node with cpus to place the container", data->name);
+		goto out;
+	}
+
+	snprintf(id, sizeof(id), "%d", node->id);
+
+	if (cgroup_limit(data->cgroups, "cpus", node->cpus) < 0 ||
+	    cgroup_limit(data->cgroups, "mems", id) < 0)
+		goto out;
+
+	if (verbose)
+		info("%s: placed on node %d, cpus %s", data->name, node->id, node->cpus);
+
+	rc = 0;
+out:
+	topology_free(&topo);
+	return rc;
+}
+
+/*
+ * Moves a running container to the node, the memory follows the mems. Returns
+ * zero if the container is already there and one if it has been moved.
+ */
+int
+placement_move(struct cgroups *cg, const struct numa_node *node)
+{
+	char id[16], cpus[PLACEMENT_BUFSIZ], mems[PLACEMENT_BUFSIZ];
+
+	snprintf(id, sizeof(id), "%d", node->id);
+
+	if (read_cgroup(cg, "cpuset", "cpuset.cpus", cpus, sizeof(cpus)) == 0 && !strcmp(cpus, node->cpus) &&
+	    read_cgroup(cg, "cpuset", "cpuset.mems", mems, sizeof(mems)) == 0 && !strcmp(mems, id))
+		return 0;
+
+	if (cgroup_set_limit(cg, "cpus", node->cpus) < 0 ||
+	    cgroup_set_limit(cg, "mems", id) < 0)
+		return -1;
+
+	return 1;
+}
+
+/*
+ * Sets the memory policy of the init, it is inherited by all the processes of
+ * the container. The policy applies to the nodes of the cpuset or to all the
+ * online nodes if the container has no mems.
+ */
+void
+apply_mempolicy(struct container *data)
+{
+	unsigned long mask[PLACEMENT_MAX_NODES / LONG_BIT] = {};
+	char buf[PLACEMENT_BUFSIZ];
+	const char *mems;
+	int mode = mempolicies[data->mempolicy].mode;
+
+	if (data->mempolicy == MEMPOLICY_NONE)
+		return;
+
+	if (data->mempolicy == MEMPOLICY_LOCAL) {
+		if (syscall(SYS_set_mempolicy, mode, NULL, 0) < 0)
+			myerror(EXIT_FAILURE, errno, "set_mempolicy(local)");
+		return;
+	}
+
+	if (!(mems = cgroup_limit_value(data->cgroups, "mems"))) {
+		if (read_line(SYSFS_NODE "/online", buf, sizeof(buf)) < 0)
+			strcpy(buf, "0");
+		mems = buf;
+	}
+
+	if (parse_list(mems, mask, PLACEMENT_MAX_NODES) <= 0)
+		myerror(EXIT_FAILURE, 0, "bad list of nodes: %s", mems);
+
+	// The kernel takes one bit less than maxnode.
+	if (syscall(SYS_set_mempolicy, mode, mask, PLACEMENT_MAX_NODES + 1) < 0)
+		myerror(EXIT_FAILURE, errno, "set_mempolicy(%s): %s", mempolicies[data->mempolicy].name, mems);
+
+	if (verbose > 1)
+		info("memory policy %s on nodes %s", mempolicies[data->mempolicy].name, mems);
+}
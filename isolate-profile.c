@@ -0,0 +1,826 @@
+#include <sys/param.h>
+#include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+extern int verbose;
+extern char pidfile[MAXPATHLEN];
+
+/*
+ * A profile is a fully resolved struct container as produced by read_config().
+ * All references inside the file are offsets from its beginning (0 is NULL),
+ * so it can be mapped at any address.
+ */
+#define PROFILE_MAGIC "ISOPROF"
+#define PROFILE_VERSION 13
+
+struct profile_source {
+	uint32_t path;
+	uint32_t pad;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_sec;
+	uint64_t mtime_nsec;
+	uint64_t hash;
+};
+
+struct profile_mountspec {
+	uint32_t kind;
+	uint32_t mkdir;
+	uint64_t vfs_opts;
+	uint32_t source;
+	uint32_t target;
+	uint32_t fstype;
+	uint32_t data;
+	uint32_t include;
+	uint32_t exclude;
+};
+
+struct profile_devnode {
+	uint32_t kind;
+	uint32_t path;
+	uint32_t target;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t dev;
+};
+
+struct profile_stop_signal {
+	int32_t signum;
+	int32_t timeout;
+};
+
+struct profile_pressure {
+	int32_t full;
+	int32_t threshold;
+	int32_t window;
+};
+
+struct profile_action {
+	uint32_t flags;
+	int32_t cpu_weight;
+	int32_t freeze_time;
+	uint32_t pad;
+	uint64_t reclaim;
+};
+
+struct profile_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	uint64_t key;
+
+	uint32_t machine;
+	uint32_t release;
+	uint32_t sources;
+	uint32_t nr_sources;
+
+	int32_t verbose;
+	int32_t nice;
+	int32_t no_new_privs;
+	int32_t pivot_root;
+	int32_t overlay_keep;
+	int32_t devices_tmpfs;
+	int32_t unshare_flags;
+	int32_t start_timeout;
+	int32_t warm_pool;
+	int32_t spawn;
+	int32_t placement;
+	int32_t mempolicy;
+	uint32_t uid;
+	uint32_t gid;
+
+	uint32_t pidfile;
+	uint32_t name;
+	uint32_t root;
+	uint32_t root_image;
+	uint32_t hostname;
+	uint32_t devfile;
+	uint32_t envfile;
+	uint32_t fstabfile;
+	uint32_t overlay;
+	uint32_t seccomp;
+	uint32_t statedir;
+	uint32_t input;
+	uint32_t output;
+	uint32_t timing_file;
+	uint32_t trace_file;
+
+	uint32_t argv;
+	uint32_t envs;
+	uint32_t after;
+	uint32_t mounts;
+	uint32_t nr_mounts;
+	uint32_t devices;
+	uint32_t nr_devices;
+	uint32_t caps;
+	uint32_t caps_size;
+	uint32_t stop_signals;
+	uint32_t nr_stop_signals;
+
+	struct profile_pressure pressure[PRESSURE_MAX];
+	struct profile_action pressure_action;
+	struct profile_action oom_action;
+
+	uint32_t cg_rootdir;
+	uint32_t cg_group;
+	uint32_t cg_controllers;
+	uint32_t cg_dirnames;
+	uint32_t cg_limits;
+};
+
+struct profile_writer {
+	char *buf;
+	size_t len;
+};
+
+struct profile_reader {
+	const char *map;
+	size_t size;
+	int bad;
+};
+
+static uint32_t
+pw_put(struct profile_writer *w, const void *data, size_t len)
+{
+	size_t off = (w->len + 7) & ~(size_t) 7;
+
+	if (off + len > UINT32_MAX)
+		myerror(EXIT_FAILURE, 0, "profile is too big");
+
+	w->buf = xrealloc(w->buf, off + len, 1);
+	memset(w->buf + w->len, 0, off - w->len);
+
+	if (data)
+		memcpy(w->buf + off, data, len);
+	else
+		memset(w->buf + off, 0, len);
+
+	w->len = off + len;
+	return (uint32_t) off;
+}
+
+static uint32_t
+pw_str(struct profile_writer *w, const char *s)
+{
+	return s ? pw_put(w, s, strlen(s) + 1) : 0;
+}
+
+static uint32_t
+pw_strv(struct profile_writer *w, char **v, size_t nr)
+{
+	uint32_t off, *offs;
+
+	if (!v)
+		return 0;
+
+	offs = xcalloc(nr + 1, sizeof(uint32_t));
+	offs[0] = (uint32_t) nr;
+
+	for (size_t i = 0; i < nr; i++)
+		offs[i + 1] = pw_str(w, v[i]);
+
+	off = pw_put(w, offs, (nr + 1) * sizeof(uint32_t));
+	xfree(offs);
+
+	return off;
+}
+
+static size_t
+strv_len(char **v)
+{
+	size_t n = 0;
+
+	while (v && v[n])
+		n++;
+	return n;
+}
+
+static const void *
+pr_ptr(struct profile_reader *r, uint32_t off, size_t len)
+{
+	if (!off || off > r->size || len > r->size - off) {
+		r->bad = 1;
+		return NULL;
+	}
+	return r->map + off;
+}
+
+static const char *
+pr_cstr(struct profile_reader *r, uint32_t off)
+{
+	if (!off)
+		return NULL;
+
+	if (off >= r->size || !memchr(r->map + off, '\0', r->size - off)) {
+		r->bad = 1;
+		return NULL;
+	}
+	return r->map + off;
+}
+
+static char *
+pr_str(struct profile_reader *r, uint32_t off)
+{
+	const char *s = pr_cstr(r, off);
+	return s ? xstrdup(s) : NULL;
+}
+
+static char **
+pr_strv(struct profile_reader *r, uint32_t off, size_t *nr)
+{
+	const uint32_t *offs;
+	char **v;
+
+	*nr = 0;
+
+	if (!off)
+		return NULL;
+
+	if (!(offs = pr_ptr(r, off, sizeof(uint32_t))) ||
+	    !(offs = pr_ptr(r, off, (offs[0] + 1ULL) * sizeof(uint32_t))))
+		return NULL;
+
+	*nr = offs[0];
+	v = xcalloc(*nr + 1, sizeof(char *));
+
+	for (size_t i = 0; i < *nr; i++)
+		v[i] = pr_str(r, offs[i + 1]);
+
+	return v;
+}
+
+static uint64_t
+hash_file(const char *filename)
+{
+	uint64_t hash;
+	struct mapfile f = {};
+
+	if (open_map((char *) filename, &f, 1) < 0)
+		return 0;
+
+	hash = fnv1a(FNV1A_INIT, f.map, f.size);
+	close_map(&f);
+
+	return hash;
+}
+
+static void
+pw_source(struct profile_writer *w, struct profile_source *src, const char *filename)
+{
+	struct stat sb;
+
+	memset(src, 0, sizeof(*src));
+
+	if (stat(filename, &sb) < 0)
+		myerror(EXIT_FAILURE, errno, "stat: %s", filename);
+
+	src->ino        = sb.st_ino;
+	src->size       = (uint64_t) sb.st_size;
+	src->mtime_sec  = (uint64_t) sb.st_mtim.tv_sec;
+	src->mtime_nsec = (uint64_t) sb.st_mtim.tv_nsec;
+	src->hash       = hash_file(filename);
+	src->path       = pw_str(w, filename);
+}
+
+/*
+ * Sources are trusted while their inode, size and mtime are unchanged. If only
+ * the mtime moved, the content hash decides.
+ */
+static int
+source_is_fresh(struct profile_reader *r, const struct profile_source *src)
+{
+	struct stat sb;
+	const char *filename = pr_cstr(r, src->path);
+
+	if (!filename || stat(filename, &sb) < 0)
+		return 0;
+
+	if (src->size != (uint64_t) sb.st_size)
+		return 0;
+
+	if (src->ino == sb.st_ino &&
+	    src->mtime_sec == (uint64_t) sb.st_mtim.tv_sec &&
+	    src->mtime_nsec == (uint64_t) sb.st_mtim.tv_nsec)
+		return 1;
+
+	return src->hash == hash_file(filename);
+}
+
+static void
+profile_uname(struct utsname *buf)
+{
+	if (uname(buf) < 0)
+		myerror(EXIT_FAILURE, errno, "uname");
+}
+
+/*
+ * Everything that influences read_config() besides the sources themselves: the
+ * section and the global options that the config may or may not override.
+ */
+static uint64_t
+profile_key(const char *filename, const char *section, struct container *data)
+{
+	uint64_t key = FNV1A_INIT;
+
+	key = fnv1a(key, VERSION, sizeof(VERSION));
+	key = fnv1a(key, filename, strlen(filename) + 1);
+	key = fnv1a(key, section, strlen(section) + 1);
+	key = fnv1a(key, &verbose, sizeof(verbose));
+
+	if (data->cgroups->rootdir)
+		key = fnv1a(key, data->cgroups->rootdir, strlen(data->cgroups->rootdir) + 1);
+
+	return key;
+}
+
+static void
+profile_put_action(struct profile_action *dst, const struct monitor_action *src)
+{
+	dst->flags       = (uint32_t) src->flags;
+	dst->cpu_weight  = src->cpu_weight;
+	dst->freeze_time = src->freeze_time;
+	dst->reclaim     = src->reclaim;
+}
+
+static void
+profile_get_action(struct monitor_action *dst, const struct profile_action *src)
+{
+	dst->flags       = (int) src->flags;
+	dst->cpu_weight  = src->cpu_weight;
+	dst->freeze_time = src->freeze_time;
+	dst->reclaim     = src->reclaim;
+}
+
+static void
+profile_build(struct profile_writer *wr, uint64_t key, const char *filename, struct container *data)
+{
+	size_t i, n;
+	struct utsname buf;
+	struct profile_writer w = {};
+	struct profile_hdr hdr = {};
+	struct profile_source sources[4];
+	const char *files[] = { filename, data->fstabfile, data->devfile, data->envfile };
+
+	profile_uname(&buf);
+
+	memcpy(hdr.magic, PROFILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = PROFILE_VERSION;
+	hdr.key     = key;
+
+	pw_put(&w, NULL, sizeof(hdr));
+
+	hdr.machine = pw_str(&w, buf.machine);
+	hdr.release = pw_str(&w, buf.release);
+
+	for (i = 0, n = 0; i < ARRAY_SIZE(files); i++) {
+		if (files[i])
+			pw_source(&w, &sources[n++], files[i]);
+	}
+	hdr.nr_sources = (uint32_t) n;
+	hdr.sources    = pw_put(&w, sources, n * sizeof(sources[0]));
+
+	hdr.verbose       = verbose;
+	hdr.nice          = data->nice;
+	hdr.no_new_privs  = data->no_new_privs;
+	hdr.pivot_root    = data->pivot_root;
+	hdr.overlay_keep  = data->overlay_keep;
+	hdr.devices_tmpfs = data->devices_tmpfs;
+	hdr.unshare_flags = data->unshare_flags;
+	hdr.start_timeout = data->start_timeout;
+	hdr.warm_pool     = data->warm_pool;
+	hdr.spawn         = data->spawn;
+	hdr.placement     = data->placement;
+	hdr.mempolicy     = data->mempolicy;
+	hdr.uid           = data->uid;
+	hdr.gid           = data->gid;
+
+	hdr.pidfile     = pw_str(&w, pidfile);
+	hdr.name        = pw_str(&w, data->name);
+	hdr.root        = pw_str(&w, data->root);
+	hdr.root_image  = pw_str(&w, data->root_image);
+	hdr.hostname    = pw_str(&w, data->hostname);
+	hdr.devfile     = pw_str(&w, data->devfile);
+	hdr.envfile     = pw_str(&w, data->envfile);
+	hdr.fstabfile   = pw_str(&w, data->fstabfile);
+	hdr.overlay     = pw_str(&w, data->overlay);
+	hdr.seccomp     = pw_str(&w, data->seccomp);
+	hdr.statedir    = pw_str(&w, data->statedir);
+	hdr.input       = pw_str(&w, data->input);
+	hdr.output      = pw_str(&w, data->output);
+	hdr.timing_file = pw_str(&w, data->timing_file);
+	hdr.trace_file  = pw_str(&w, data->trace_file);
+
+	hdr.argv  = pw_strv(&w, data->argv, strv_len(data->argv));
+	hdr.envs  = pw_strv(&w, data->envs, strv_len(data->envs));
+	hdr.after = pw_strv(&w, data->after, strv_len(data->after));
+
+	if (data->mounts) {
+		struct profile_mountspec *ents;
+
+		n = 0;
+		while (data->mounts[n])
+			n++;
+
+		ents = xcalloc(n + 1, sizeof(*ents));
+
+		for (i = 0; i < n; i++) {
+			struct mountspec *spec = data->mounts[i];
+
+			ents[i].kind     = spec->kind;
+			ents[i].mkdir    = spec->mkdir;
+			ents[i].vfs_opts = spec->vfs_opts;
+			ents[i].source   = pw_str(&w, spec->source);
+			ents[i].target   = pw_str(&w, spec->target);
+			ents[i].fstype   = pw_str(&w, spec->fstype);
+			ents[i].data     = pw_str(&w, spec->data);
+			ents[i].include  = pw_strv(&w, spec->include, strv_len(spec->include));
+			ents[i].exclude  = pw_strv(&w, spec->exclude, strv_len(spec->exclude));
+		}
+
+		hdr.nr_mounts = (uint32_t) n;
+		hdr.mounts    = pw_put(&w, ents, (n + 1) * sizeof(*ents));
+		xfree(ents);
+	}
+
+	if (data->devices) {
+		struct profile_devnode *devs;
+
+		n = 0;
+		while (data->devices[n])
+			n++;
+
+		devs = xcalloc(n + 1, sizeof(*devs));
+
+		for (i = 0; i < n; i++) {
+			devs[i].kind   = data->devices[i]->kind;
+			devs[i].path   = pw_str(&w, data->devices[i]->path);
+			devs[i].target = pw_str(&w, data->devices[i]->target);
+			devs[i].mode   = data->devices[i]->mode;
+			devs[i].uid    = data->devices[i]->uid;
+			devs[i].gid    = data->devices[i]->gid;
+			devs[i].dev    = data->devices[i]->dev;
+		}
+
+		hdr.nr_devices = (uint32_t) n;
+		hdr.devices    = pw_put(&w, devs, (n + 1) * sizeof(*devs));
+		xfree(devs);
+	}
+
+	if (data->caps) {
+		ssize_t size = cap_size(data->caps);
+
+		if (size <= 0)
+			myerror(EXIT_FAILURE, errno, "cap_size");
+
+		hdr.caps_size = (uint32_t) size;
+		hdr.caps      = pw_put(&w, NULL, (size_t) size);
+
+		if (cap_copy_ext(w.buf + hdr.caps, data->caps, size) != size)
+			myerror(EXIT_FAILURE, errno, "cap_copy_ext");
+	}
+
+	if (data->stop_signals) {
+		struct profile_stop_signal *sigs;
+
+		n = 0;
+		while (data->stop_signals[n].signum)
+			n++;
+
+		sigs = xcalloc(n + 1, sizeof(*sigs));
+
+		for (i = 0; i < n; i++) {
+			sigs[i].signum  = data->stop_signals[i].signum;
+			sigs[i].timeout = data->stop_signals[i].timeout;
+		}
+
+		hdr.nr_stop_signals = (uint32_t) n;
+		hdr.stop_signals    = pw_put(&w, sigs, (n + 1) * sizeof(*sigs));
+		xfree(sigs);
+	}
+
+	for (i = 0; i < PRESSURE_MAX; i++) {
+		hdr.pressure[i].full      = data->pressure[i].full;
+		hdr.pressure[i].threshold = data->pressure[i].threshold;
+		hdr.pressure[i].window    = data->pressure[i].window;
+	}
+
+	profile_put_action(&hdr.pressure_action, &data->pressure_action);
+	profile_put_action(&hdr.oom_action, &data->oom_action);
+
+	n = strv_len(data->cgroups->controller);
+
+	hdr.cg_rootdir     = pw_str(&w, data->cgroups->rootdir);
+	hdr.cg_group       = pw_str(&w, data->cgroups->group);
+	hdr.cg_controllers = pw_strv(&w, data->cgroups->controller, n);
+	hdr.cg_dirnames    = pw_strv(&w, data->cgroups->dirname, n);
+	hdr.cg_limits      = pw_strv(&w, data->cgroups->limits, strv_len(data->cgroups->limits));
+
+	hdr.size = (uint32_t) w.len;
+	memcpy(w.buf, &hdr, sizeof(hdr));
+
+	*wr = w;
+}
+
+static void
+profile_store(const char *dir, const char *name, uint64_t key, const char *filename, struct container *data)
+{
+	struct profile_writer w;
+	struct iovec iov;
+
+	profile_build(&w, key, filename, data);
+
+	iov.iov_base = w.buf;
+	iov.iov_len  = w.len;
+
+	store_file(dir, name, &iov, 1);
+
+	xfree(w.buf);
+}
+
+static int
+profile_parse(struct profile_reader *r, uint64_t key, struct container *data, int globals)
+{
+	size_t i, k, n;
+	struct utsname buf;
+	const struct profile_hdr *hdr;
+	const struct profile_source *sources;
+	const char *s;
+
+	if (r->size < sizeof(*hdr))
+		return -1;
+
+	hdr = (const struct profile_hdr *) r->map;
+
+	if (memcmp(hdr->magic, PROFILE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != PROFILE_VERSION ||
+	    hdr->size != r->size ||
+	    hdr->key != key)
+		return -1;
+
+	profile_uname(&buf);
+
+	if (!(s = pr_cstr(r, hdr->machine)) || strcmp(s, buf.machine) ||
+	    !(s = pr_cstr(r, hdr->release)) || strcmp(s, buf.release))
+		return -1;
+
+	if (!(sources = pr_ptr(r, hdr->sources, hdr->nr_sources * sizeof(*sources))))
+		return -1;
+
+	for (i = 0; i < hdr->nr_sources; i++) {
+		if (!source_is_fresh(r, &sources[i])) {
+			if (verbose > 1)
+				info("profile is outdated: %s", pr_cstr(r, sources[i].path));
+			return -1;
+		}
+	}
+
+	data->nice          = hdr->nice;
+	data->no_new_privs  = hdr->no_new_privs;
+	data->pivot_root    = hdr->pivot_root;
+	data->overlay_keep  = hdr->overlay_keep;
+	data->devices_tmpfs = hdr->devices_tmpfs;
+	data->unshare_flags = hdr->unshare_flags;
+	data->start_timeout = hdr->start_timeout;
+	data->warm_pool     = hdr->warm_pool;
+	data->spawn         = (spawn_t) hdr->spawn;
+	data->placement     = (placement_t) hdr->placement;
+	data->mempolicy     = (mempolicy_t) hdr->mempolicy;
+	data->uid           = hdr->uid;
+	data->gid           = hdr->gid;
+
+	data->name        = pr_str(r, hdr->name);
+	data->root        = pr_str(r, hdr->root);
+	data->root_image  = pr_str(r, hdr->root_image);
+	data->hostname    = pr_str(r, hdr->hostname);
+	data->devfile     = pr_str(r, hdr->devfile);
+	data->envfile     = pr_str(r, hdr->envfile);
+	data->fstabfile   = pr_str(r, hdr->fstabfile);
+	data->overlay     = pr_str(r, hdr->overlay);
+	data->seccomp     = pr_str(r, hdr->seccomp);
+	data->statedir    = pr_str(r, hdr->statedir);
+	data->input       = pr_str(r, hdr->input);
+	data->output      = pr_str(r, hdr->output);
+	data->timing_file = pr_str(r, hdr->timing_file);
+	data->trace_file  = pr_str(r, hdr->trace_file);
+
+	data->argv  = pr_strv(r, hdr->argv, &n);
+	data->envs  = pr_strv(r, hdr->envs, &n);
+	data->after = pr_strv(r, hdr->after, &n);
+
+	if (hdr->mounts) {
+		const struct profile_mountspec *ents;
+
+		if (!(ents = pr_ptr(r, hdr->mounts, hdr->nr_mounts * sizeof(*ents))))
+			return -1;
+
+		data->mounts = xcalloc(hdr->nr_mounts + 1, sizeof(struct mountspec *));
+
+		for (i = 0; i < hdr->nr_mounts; i++) {
+			struct mountspec *spec = xcalloc(1, sizeof(*spec));
+
+			if (ents[i].kind > MOUNT_LEGACY)
+				r->bad = 1;
+
+			spec->kind     = (mount_kind_t) ents[i].kind;
+			spec->mkdir    = (mode_t) ents[i].mkdir;
+			spec->vfs_opts = ents[i].vfs_opts;
+			spec->source   = pr_str(r, ents[i].source);
+			spec->target   = pr_str(r, ents[i].target);
+			spec->fstype   = pr_str(r, ents[i].fstype);
+			spec->data     = pr_str(r, ents[i].data);
+			spec->include  = pr_strv(r, ents[i].include, &n);
+			spec->exclude  = pr_strv(r, ents[i].exclude, &n);
+
+			data->mounts[i] = spec;
+		}
+	}
+
+	if (hdr->devices) {
+		const struct profile_devnode *devs;
+
+		if (!(devs = pr_ptr(r, hdr->devices, hdr->nr_devices * sizeof(*devs))))
+			return -1;
+
+		data->devices = xcalloc(hdr->nr_devices + 1, sizeof(struct devnode *));
+
+		for (i = 0; i < hdr->nr_devices; i++) {
+			data->devices[i] = xcalloc(1, sizeof(struct devnode));
+			data->devices[i]->kind   = (device_kind_t) devs[i].kind;
+			data->devices[i]->path   = pr_str(r, devs[i].path);
+			data->devices[i]->target = pr_str(r, devs[i].target);
+			data->devices[i]->mode   = devs[i].mode;
+			data->devices[i]->uid    = devs[i].uid;
+			data->devices[i]->gid    = devs[i].gid;
+			data->devices[i]->dev    = devs[i].dev;
+		}
+	}
+
+	if (hdr->caps) {
+		const void *ext;
+
+		if (!(ext = pr_ptr(r, hdr->caps, hdr->caps_size)) ||
+		    !(data->caps = cap_copy_int(ext)))
+			return -1;
+	}
+
+	if (hdr->stop_signals) {
+		const struct profile_stop_signal *sigs;
+
+		if (!(sigs = pr_ptr(r, hdr->stop_signals, hdr->nr_stop_signals * sizeof(*sigs))))
+			return -1;
+
+		data->stop_signals = xcalloc(hdr->nr_stop_signals + 1, sizeof(struct stop_signal));
+
+		for (i = 0; i < hdr->nr_stop_signals; i++) {
+			data->stop_signals[i].signum  = sigs[i].signum;
+			data->stop_signals[i].timeout = sigs[i].timeout;
+
+			if (sigs[i].signum <= 0)
+				return -1;
+		}
+	}
+
+	for (i = 0; i < PRESSURE_MAX; i++) {
+		data->pressure[i].full      = hdr->pressure[i].full;
+		data->pressure[i].threshold = hdr->pressure[i].threshold;
+		data->pressure[i].window    = hdr->pressure[i].window;
+	}
+
+	profile_get_action(&data->pressure_action, &hdr->pressure_action);
+	profile_get_action(&data->oom_action, &hdr->oom_action);
+
+	data->cgroups->rootdir    = pr_str(r, hdr->cg_rootdir);
+	data->cgroups->group      = pr_str(r, hdr->cg_group);
+	data->cgroups->controller = pr_strv(r, hdr->cg_controllers, &n);
+	data->cgroups->dirname    = pr_strv(r, hdr->cg_dirnames, &i);
+	data->cgroups->limits     = pr_strv(r, hdr->cg_limits, &k);
+	data->cgroups->name       = data->name;
+
+	if (r->bad || n != i || (n && !data->cgroups->dirname) ||
+	    !(s = pr_cstr(r, hdr->pidfile)) || strlen(s) >= MAXPATHLEN)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (!data->cgroups->controller[i])
+			return -1;
+	}
+
+	for (i = 0; i < k; i++) {
+		if (!data->cgroups->limits[i])
+			return -1;
+	}
+
+	if (globals) {
+		verbose = hdr->verbose;
+		snprintf(pidfile, MAXPATHLEN, "%s", s);
+	}
+
+	return 0;
+}
+
+static int
+profile_unpack(const char *buf, size_t size, uint64_t key, struct container *data, int globals)
+{
+	struct profile_reader r = {};
+	struct container tmp = {};
+
+	r.map  = buf;
+	r.size = size;
+
+	tmp.cgroups = xcalloc(1, sizeof(struct cgroups));
+
+	if (profile_parse(&r, key, &tmp, globals) < 0) {
+		free_data(&tmp);
+		return -1;
+	}
+
+	free_data(data);
+	*data = tmp;
+
+	return 0;
+}
+
+static int
+profile_load(const char *profile, uint64_t key, struct container *data)
+{
+	int rc = -1;
+	struct mapfile f = {};
+
+	if (access(profile, R_OK) < 0)
+		return -1;
+
+	if (open_map((char *) profile, &f, 1) < 0 || !f.map)
+		goto out;
+
+	if (profile_unpack(f.map, f.size, key, data, 1) < 0)
+		goto out;
+
+	if (verbose > 1)
+		info("using profile: %s", profile);
+
+	rc = 0;
+out:
+	close_map(&f);
+	return rc;
+}
+
+void
+load_config(const char *filename, char *section, struct container *data)
+{
+	uint64_t key;
+	char *dir = NULL, *name = NULL, *profile = NULL;
+
+	if (!data->statedir) {
+		read_config(filename, section, data);
+		return;
+	}
+
+	key = profile_key(filename, section, data);
+
+	xasprintf(&dir, "%s/profiles", data->statedir);
+	xasprintf(&name, "%016llx.prof", (unsigned long long) key);
+	xasprintf(&profile, "%s/%s", dir, name);
+
+	if (profile_load(profile, key, data) < 0) {
+		read_config(filename, section, data);
+		profile_store(dir, name, key, filename, data);
+	}
+
+	xfree(profile);
+	xfree(name);
+	xfree(dir);
+}
+
+/*
+ * Serializes an already loaded container, e.g. to hand it over to another
+ * process. Unlike a stored profile this does not touch the global options.
+ */
+void
+profile_encode(const char *filename, struct container *data, char **buf, size_t *size)
+{
+	struct profile_writer w;
+
+	profile_build(&w, 0, filename, data);
+
+	*buf  = w.buf;
+	*size = w.len;
+}
+
+int
+profile_decode(const char *buf, size_t size, struct container *data)
+{
+	return profile_unpack(buf, size, 0, data, 0);
+}
@@ -0,0 +1,123 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+#define REAPER_BUDGET 1024
+
+extern int verbose;
+
+struct reaper_child *
+reaper_track(struct reaper *r, int fd_ep, pid_t pid, int pidfd)
+{
+	struct reaper_child *child;
+
+	if (pidfd < 0 && (pidfd = pidfd_open_pid(pid)) < 0)
+		myerror(EXIT_FAILURE, errno, "pidfd_open(%d)", pid);
+
+	r->children = xrealloc(r->children, r->nr_children + 1, sizeof(struct reaper_child *));
+
+	child = xcalloc(1, sizeof(struct reaper_child));
+	child->pid = pid;
+	child->pidfd = pidfd;
+
+	r->children[r->nr_children++] = child;
+
+	// The pidfd is only a wakeup source, the status is collected by reaper_drain().
+	epollin_add(fd_ep, pidfd);
+
+	return child;
+}
+
+void
+reaper_untrack(struct reaper *r, int fd_ep, struct reaper_child *child)
+{
+	size_t i;
+
+	if (!child)
+		return;
+
+	for (i = 0; i < r->nr_children; i++) {
+		if (r->children[i] != child)
+			continue;
+
+		r->nr_children--;
+		r->children[i] = r->children[r->nr_children];
+		break;
+	}
+
+	epollin_remove(fd_ep, child->pidfd);
+	xfree(child);
+}
+
+static void
+reaper_account(struct reaper *r, const siginfo_t *info)
+{
+	size_t i;
+	int rc = get_siginfo_rc(info);
+
+	r->nr_reaped++;
+
+	if (info->si_code == CLD_KILLED || info->si_code == CLD_DUMPED)
+		r->nr_signaled++;
+	else if (rc != EXIT_SUCCESS)
+		r->nr_failed++;
+
+	for (i = 0; i < r->nr_children; i++) {
+		if (r->children[i]->pid != info->si_pid)
+			continue;
+
+		r->children[i]->exited = 1;
+		r->children[i]->rc = rc;
+		return;
+	}
+
+	r->nr_orphans++;
+
+	if (verbose > 2)
+		info("reaped orphan process (pid=%d, rc=%d)", info->si_pid, rc);
+}
+
+int
+reaper_drain(struct reaper *r)
+{
+	siginfo_t info;
+	size_t n;
+
+	for (n = 0; n < REAPER_BUDGET; n++) {
+		info.si_pid = 0;
+
+		if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ECHILD)
+				errmsg("waitid");
+			return 0;
+		}
+
+		if (!info.si_pid)
+			return 0;
+
+		reaper_account(r, &info);
+	}
+
+	// More children may be waiting, the caller has to come back without sleeping.
+	return 1;
+}
+
+void
+reaper_free(struct reaper *r, int fd_ep)
+{
+	while (r->nr_children > 0)
+		reaper_untrack(r, fd_ep, r->children[0]);
+
+	r->children = xfree(r->children);
+
+	if (verbose > 1)
+		info("reaped %zu processes (orphans=%zu, failed=%zu, signaled=%zu)",
+		     r->nr_reaped, r->nr_orphans, r->nr_failed, r->nr_signaled);
+}
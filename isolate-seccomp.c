@@ -1,8 +1,18 @@
 #include <linux/seccomp.h>
+#include <linux/filter.h>
 #include <sys/prctl.h>
+#include <sys/utsname.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
 #include <errno.h>
 
 #include <kafel.h>
@@ -11,24 +21,238 @@
 
 extern int verbose;
 
-void
-load_seccomp(FILE *fd, const char *filename)
+#define SECCOMP_CACHE_MAGIC "ISECBPF"
+#define SECCOMP_CACHE_VERSION 2
+
+struct seccomp_cache_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t len;
+	uint64_t policy_hash;
+	uint64_t policy_size;
+	uint64_t kafel_id;
+	char arch[sizeof(((struct utsname *) 0)->machine)];
+};
+
+/*
+ * The kafel library does not export its version, so identify the build by the
+ * object that provides kafel_compile().
+ */
+static uint64_t
+kafel_id(void)
+{
+	Dl_info dli;
+	struct stat sb;
+	uint64_t hash = FNV1A_INIT;
+
+	if (!dladdr((void *) kafel_compile, &dli) || !dli.dli_fname || stat(dli.dli_fname, &sb) < 0)
+		return hash;
+
+	hash = fnv1a(hash, &sb.st_ino, sizeof(sb.st_ino));
+	hash = fnv1a(hash, &sb.st_size, sizeof(sb.st_size));
+	hash = fnv1a(hash, &sb.st_mtim, sizeof(sb.st_mtim));
+	hash = fnv1a(hash, VERSION, sizeof(VERSION));
+
+	return hash;
+}
+
+static void
+fill_header(struct seccomp_cache_hdr *hdr, struct mapfile *policy)
 {
-	struct sock_fprog prog;
+	struct utsname buf = { 0 };
+
+	if (uname(&buf) < 0)
+		myerror(EXIT_FAILURE, errno, "uname");
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, SECCOMP_CACHE_MAGIC, sizeof(hdr->magic));
+
+	hdr->version     = SECCOMP_CACHE_VERSION;
+	hdr->policy_size = policy->size;
+	hdr->policy_hash = fnv1a(FNV1A_INIT, policy->map, policy->size);
+	hdr->kafel_id    = kafel_id();
+
+	snprintf(hdr->arch, sizeof(hdr->arch), "%s", buf.machine);
+}
+
+static char *
+cache_name(struct seccomp_cache_hdr *hdr)
+{
+	char *name = NULL;
+
+	xasprintf(&name, "%016llx-%016llx-%s.bpf",
+	          (unsigned long long) hdr->policy_hash,
+	          (unsigned long long) hdr->kafel_id,
+	          hdr->arch);
+
+	return name;
+}
+
+static int
+cache_load(struct seccomp_filter *f, const char *filename, struct seccomp_cache_hdr *want)
+{
+	struct stat sb;
+	struct seccomp_cache_hdr *hdr;
+
+	if ((f->cache.fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT)
+			errmsg("open: %s", filename);
+		return -1;
+	}
+
+	if (fstat(f->cache.fd, &sb) < 0) {
+		errmsg("fstat: %s", filename);
+		goto fail;
+	}
+
+	if ((size_t) sb.st_size < sizeof(*hdr))
+		goto invalid;
+
+	f->cache.size = (size_t) sb.st_size;
+
+	if ((f->cache.map = mmap(NULL, f->cache.size, PROT_READ, MAP_PRIVATE, f->cache.fd, 0)) == MAP_FAILED) {
+		errmsg("mmap: %s", filename);
+		goto fail;
+	}
+
+	f->cache.filename = xstrdup(filename);
+	hdr = (struct seccomp_cache_hdr *) f->cache.map;
+
+	if (memcmp(hdr->magic, want->magic, sizeof(hdr->magic)) ||
+	    hdr->version != want->version ||
+	    hdr->policy_hash != want->policy_hash ||
+	    hdr->policy_size != want->policy_size ||
+	    hdr->kafel_id != want->kafel_id ||
+	    strncmp(hdr->arch, want->arch, sizeof(hdr->arch)) ||
+	    !hdr->len || hdr->len > BPF_MAXINSNS ||
+	    f->cache.size != sizeof(*hdr) + hdr->len * sizeof(struct sock_filter))
+		goto invalid;
+
+	f->prog.len    = (unsigned short) hdr->len;
+	f->prog.filter = (struct sock_filter *) (f->cache.map + sizeof(*hdr));
 
 	if (verbose > 1)
-		info("applying seccomp-filter: %s", filename);
+		info("seccomp-filter cache hit: %s", filename);
+
+	return 0;
+invalid:
+	if (verbose)
+		info("ignoring invalid seccomp-filter cache: %s", filename);
+fail:
+	seccomp_release(f);
+	return -1;
+}
+
+static void
+cache_store(struct seccomp_filter *f, const char *dir, const char *name, struct seccomp_cache_hdr *hdr)
+{
+	struct iovec iov[2];
+
+	hdr->len = f->prog.len;
 
-	kafel_ctxt_t ctx = kafel_ctxt_create();
+	iov[0].iov_base = hdr;
+	iov[0].iov_len  = sizeof(*hdr);
+	iov[1].iov_base = f->prog.filter;
+	iov[1].iov_len  = f->prog.len * sizeof(struct sock_filter);
+
+	store_file(dir, name, iov, ARRAY_SIZE(iov));
+}
+
+static void
+compile_policy(struct seccomp_filter *f, const char *filename)
+{
+	FILE *fd;
+	kafel_ctxt_t ctx;
+
+	if (!(fd = fopen(filename, "r")))
+		myerror(EXIT_FAILURE, errno, "fopen: %s", filename);
+
+	ctx = kafel_ctxt_create();
 	kafel_set_input_file(ctx, fd);
 
-	if (kafel_compile(ctx, &prog))
+	if (kafel_compile(ctx, &f->prog))
 		myerror(EXIT_FAILURE, errno, "policy compilation failed: %s", kafel_error_msg(ctx));
 
 	kafel_ctxt_destroy(&ctx);
+	fclose(fd);
+
+	f->compiled = 1;
+}
+
+void
+seccomp_prepare(struct seccomp_filter *f, const char *filename, const char *statedir)
+{
+	char *dir = NULL, *name = NULL, *cachefile = NULL;
+	struct seccomp_cache_hdr hdr;
+	struct mapfile policy = {};
+
+	memset(f, 0, sizeof(*f));
+	f->cache.fd = -1;
+
+	if (statedir) {
+		if (open_map((char *) filename, &policy, 1) < 0)
+			myerror(EXIT_FAILURE, 0, "unable to read seccomp-filter: %s", filename);
+
+		// The key covers only this file, the included ones could change
+		// without it. Such a policy is compiled every time.
+		if (memmem(policy.map, policy.size, "#include", 8)) {
+			if (verbose > 1)
+				info("not caching seccomp-filter with includes: %s", filename);
+			close_map(&policy);
+			goto compile;
+		}
+
+		fill_header(&hdr, &policy);
+		close_map(&policy);
+
+		name = cache_name(&hdr);
+		xasprintf(&dir, "%s/seccomp", statedir);
+		xasprintf(&cachefile, "%s/%s", dir, name);
+
+		if (!cache_load(f, cachefile, &hdr))
+			goto out;
+	}
+
+compile:
+	if (verbose > 1)
+		info("compiling seccomp-filter: %s", filename);
+
+	compile_policy(f, filename);
+
+	if (dir)
+		cache_store(f, dir, name, &hdr);
+out:
+	xfree(cachefile);
+	xfree(name);
+	xfree(dir);
+}
+
+void
+seccomp_release(struct seccomp_filter *f)
+{
+	if (f->compiled)
+		xfree(f->prog.filter);
+
+	if (f->cache.map && f->cache.map != MAP_FAILED)
+		munmap(f->cache.map, f->cache.size);
+
+	if (f->cache.fd >= 0)
+		close(f->cache.fd);
+
+	xfree(f->cache.filename);
+
+	memset(f, 0, sizeof(*f));
+	f->cache.fd = -1;
+}
+
+void
+load_seccomp(struct seccomp_filter *f, const char *filename)
+{
+	if (verbose > 1)
+		info("applying seccomp-filter: %s", filename);
 
-	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0) < 0)
+	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &f->prog, 0, 0) < 0)
 		myerror(EXIT_FAILURE, errno, "prctl(PR_SET_SECCOMP)");
 
-	xfree(prog.filter);
+	seccomp_release(f);
 }
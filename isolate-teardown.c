@@ -0,0 +1,331 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+/*
+ * With more processes than that the v1 teardown watches the first ones and
+ * looks at the cgroup again when they are gone.
+ */
+#define TEARDOWN_MAX_PIDFDS 64
+
+/*
+ * How many times the last signal is repeated while the cgroup is not empty.
+ */
+#define TEARDOWN_MAX_ROUNDS 10
+
+extern int verbose;
+
+/*
+ * The container gets every signal in turn and the time to exit after it. The
+ * init of a pid namespace ignores the signals it has no handler for, so only
+ * the last one is sure to work.
+ */
+static const struct stop_signal default_signals[] = {
+	{ SIGPWR, 1000 },
+	{ SIGTERM, 1000 },
+	{ SIGKILL, 1000 },
+	{ 0, 0 },
+};
+
+static const struct stop_signal kill_signals[] = {
+	{ SIGKILL, 1000 },
+	{ 0, 0 },
+};
+
+static const struct {
+	const char *name;
+	int signum;
+} signal_names[] = {
+	{ "HUP",  SIGHUP  },
+	{ "INT",  SIGINT  },
+	{ "QUIT", SIGQUIT },
+	{ "KILL", SIGKILL },
+	{ "USR1", SIGUSR1 },
+	{ "USR2", SIGUSR2 },
+	{ "TERM", SIGTERM },
+	{ "PWR",  SIGPWR  },
+};
+
+static int
+parse_signal(const char *name)
+{
+	char *end;
+	long value;
+
+	if (!strncasecmp(name, "SIG", 3))
+		name += 3;
+
+	for (size_t i = 0; i < ARRAY_SIZE(signal_names); i++) {
+		if (!strcasecmp(name, signal_names[i].name))
+			return signal_names[i].signum;
+	}
+
+	value = strtol(name, &end, 10);
+
+	if (*name && !*end && value > 0 && value < NSIG)
+		return (int) value;
+
+	return 0;
+}
+
+/*
+ * Parses a list of SIGNAL[:MSEC] separated by commas, for example
+ * "TERM:5000,KILL". A signal without a timeout gets one second.
+ */
+struct stop_signal *
+parse_stop_signals(const char *arg)
+{
+	size_t n = 0;
+	char *s, *str, *token, *saveptr;
+	struct stop_signal *signals = NULL;
+
+	s = str = xstrdup(arg);
+
+	while ((token = strtok_r(s, ",", &saveptr))) {
+		char *timeout = strchr(token, ':');
+		struct stop_signal sig = { 0, 1000 };
+
+		s = NULL;
+
+		if (timeout) {
+			char *end;
+			long value;
+
+			*timeout++ = '\0';
+			value = strtol(timeout, &end, 10);
+
+			if (!*timeout || *end || value < 0 || value > INT_MAX)
+				myerror(EXIT_FAILURE, 0, "bad timeout of the stop signal: %s", timeout);
+
+			sig.timeout = (int) value;
+		}
+
+		if (!(sig.signum = parse_signal(token)))
+			myerror(EXIT_FAILURE, 0, "unknown stop signal: %s", token);
+
+		signals = xrealloc(signals, n + 2, sizeof(*signals));
+		signals[n++] = sig;
+	}
+
+	xfree(str);
+
+	if (!n)
+		return NULL;
+
+	signals[n].signum = 0;
+	signals[n].timeout = 0;
+
+	return signals;
+}
+
+static void
+unwatch_pids(struct teardown *td)
+{
+	for (size_t i = 0; i < td->nr_pidfds; i++)
+		epollin_remove(td->fd_ep, td->pidfds[i]);
+
+	td->pidfds = xfree(td->pidfds);
+	td->nr_pidfds = 0;
+}
+
+/*
+ * Without cgroup.events the processes are watched through their pidfds.
+ * Returns zero if the cgroup is empty.
+ */
+static size_t
+watch_pids(struct teardown *td)
+{
+	pid_t pids[TEARDOWN_MAX_PIDFDS];
+	size_t nr;
+
+	unwatch_pids(td);
+
+	nr = cgroup_pids(td->cg, pids, ARRAY_SIZE(pids));
+
+	if (nr > ARRAY_SIZE(pids))
+		nr = ARRAY_SIZE(pids);
+
+	td->pidfds = xcalloc(nr, sizeof(int));
+
+	for (size_t i = 0; i < nr; i++) {
+		int fd;
+
+		// The process has already gone.
+		if ((fd = pidfd_open_pid(pids[i])) < 0)
+			continue;
+
+		epollin_add(td->fd_ep, fd);
+		td->pidfds[td->nr_pidfds++] = fd;
+	}
+
+	// The timer takes care of the processes that can not be watched.
+	return td->nr_pidfds ? td->nr_pidfds : cgroup_pids(td->cg, NULL, 0);
+}
+
+static void
+teardown_done(struct teardown *td)
+{
+	unwatch_pids(td);
+
+	epollin_remove(td->fd_ep, td->fd_timer);
+	epollin_remove(td->fd_ep, td->fd_notify);
+
+	td->fd_timer = td->fd_notify = -1;
+	td->state = TEARDOWN_DONE;
+}
+
+static void
+teardown_signal(struct teardown *td)
+{
+	const struct stop_signal *sig = &td->signals[td->stage];
+
+	if (verbose > 1)
+		info("killing container by signal=%d", sig->signum);
+
+	if (sig->signum != SIGKILL || cgroup_kill(td->cg) < 0) {
+		// Nothing can fork past the signal while the cgroup is frozen.
+		cgroup_freeze(td->cg);
+		cgroup_signal(td->cg, sig->signum);
+		cgroup_unfreeze(td->cg);
+	}
+
+	timerfd_arm(td->fd_timer, sig->timeout > 0 ? sig->timeout : 1);
+
+	if (td->fd_notify < 0 && !watch_pids(td))
+		teardown_done(td);
+}
+
+/*
+ * Starts stopping the processes of the container. The descriptors are added to
+ * fd_ep and the events for them must be passed to teardown_event() until the
+ * state becomes TEARDOWN_DONE.
+ */
+void
+teardown_start(struct teardown *td, struct cgroups *cg, const struct stop_signal *signals, int fd_ep)
+{
+	memset(td, 0, sizeof(*td));
+
+	td->cg = cg;
+	td->signals = signals ? signals : default_signals;
+	td->fd_ep = fd_ep;
+	td->fd_timer = td->fd_notify = -1;
+	td->state = TEARDOWN_SIGNAL;
+
+	if (!cg || !cgroup_populated(cg)) {
+		td->state = TEARDOWN_DONE;
+		return;
+	}
+
+	if (verbose == 1)
+		info("killing container");
+
+	td->fd_timer = timerfd_init();
+	epollin_add(fd_ep, td->fd_timer);
+
+	// The watch is set before the signal, so the change can not be missed.
+	if ((td->fd_notify = cgroup_watch(cg)) >= 0)
+		epollin_add(fd_ep, td->fd_notify);
+
+	teardown_signal(td);
+
+	if (td->state == TEARDOWN_SIGNAL && td->fd_notify >= 0 && !cgroup_populated(cg))
+		teardown_done(td);
+}
+
+/*
+ * Returns zero if the descriptor does not belong to the teardown.
+ */
+int
+teardown_event(struct teardown *td, int fd)
+{
+	size_t i;
+
+	if (td->state != TEARDOWN_SIGNAL || fd < 0)
+		return 0;
+
+	if (fd == td->fd_timer) {
+		timerfd_ack(fd);
+
+		if (td->signals[td->stage + 1].signum) {
+			td->stage++;
+			teardown_signal(td);
+			return 1;
+		}
+
+		// The cgroup can not be removed while anything is left in it, so the
+		// last signal is repeated until the processes have gone.
+		if (cgroup_populated(td->cg)) {
+			if (++td->rounds < TEARDOWN_MAX_ROUNDS) {
+				teardown_signal(td);
+				return 1;
+			}
+
+			info("processes left in the container after signal=%d",
+			     td->signals[td->stage].signum);
+		}
+
+		teardown_done(td);
+		return 1;
+	}
+
+	if (fd == td->fd_notify) {
+		char buf[4096];
+
+		while (read(fd, buf, sizeof(buf)) > 0);
+
+		if (!cgroup_populated(td->cg))
+			teardown_done(td);
+		return 1;
+	}
+
+	for (i = 0; i < td->nr_pidfds; i++) {
+		if (td->pidfds[i] == fd)
+			break;
+	}
+
+	if (i == td->nr_pidfds)
+		return 0;
+
+	epollin_remove(td->fd_ep, fd);
+	td->pidfds[i] = td->pidfds[--td->nr_pidfds];
+
+	// The children may have been forked after the last look.
+	if (!td->nr_pidfds && !watch_pids(td))
+		teardown_done(td);
+
+	return 1;
+}
+
+/*
+ * Skips the rest of the stop signals and kills what is left of the container.
+ * Returns zero if there is nothing to skip.
+ */
+int
+teardown_kill(struct teardown *td)
+{
+	if (td->state != TEARDOWN_SIGNAL || td->signals == kill_signals)
+		return 0;
+
+	td->signals = kill_signals;
+	td->stage = 0;
+	td->rounds = 0;
+
+	teardown_signal(td);
+	return 1;
+}
+
+void
+teardown_cancel(struct teardown *td)
+{
+	if (td->state == TEARDOWN_SIGNAL)
+		teardown_done(td);
+
+	td->state = TEARDOWN_IDLE;
+}
@@ -0,0 +1,51 @@
+#include <sys/timerfd.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+int
+timerfd_init(void)
+{
+	int fd;
+
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		myerror(EXIT_FAILURE, errno, "timerfd_create");
+
+	return fd;
+}
+
+void
+timerfd_arm(int fd, long msec)
+{
+	struct itimerspec its = {};
+
+	its.it_value.tv_sec = msec / 1000;
+	its.it_value.tv_nsec = (msec % 1000) * 1000000;
+
+	if (timerfd_settime(fd, 0, &its, NULL) < 0)
+		myerror(EXIT_FAILURE, errno, "timerfd_settime");
+}
+
+void
+timerfd_disarm(int fd)
+{
+	struct itimerspec its = {};
+
+	if (timerfd_settime(fd, 0, &its, NULL) < 0)
+		myerror(EXIT_FAILURE, errno, "timerfd_settime");
+}
+
+uint64_t
+timerfd_ack(int fd)
+{
+	uint64_t expirations = 0;
+
+	if (TEMP_FAILURE_RETRY(read(fd, &expirations, sizeof(expirations))) < 0 && errno != EAGAIN)
+		myerror(EXIT_FAILURE, errno, "read(timerfd)");
+
+	return expirations;
+}
@@ -0,0 +1,216 @@
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include "isolate.h"
+
+extern const char *program_subname;
+
+static struct timing timing;
+
+uint64_t
+timing_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		myerror(EXIT_FAILURE, errno, "clock_gettime");
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+struct timing *
+timing_get(void)
+{
+	return &timing;
+}
+
+void
+timing_begin(const char *name)
+{
+	struct timing_phase *ph;
+
+	if (timing.nr_phases >= ARRAY_SIZE(timing.phases))
+		return;
+
+	ph = &timing.phases[timing.nr_phases++];
+
+	snprintf(ph->name, sizeof(ph->name), "%s", name);
+	snprintf(ph->process, sizeof(ph->process), "%s", (program_subname ? program_subname : "parent"));
+
+	ph->start_ns = timing_now();
+	ph->end_ns = 0;
+
+	if (!timing.base_ns)
+		timing.base_ns = ph->start_ns;
+}
+
+void
+timing_end(const char *name)
+{
+	size_t i = timing.nr_phases;
+
+	while (i-- > 0) {
+		if (!timing.phases[i].end_ns && !strcmp(timing.phases[i].name, name)) {
+			timing.phases[i].end_ns = timing_now();
+			return;
+		}
+	}
+}
+
+const struct timing_phase *
+timing_lookup(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < timing.nr_phases; i++) {
+		if (!strcmp(timing.phases[i].name, name))
+			return &timing.phases[i];
+	}
+
+	return NULL;
+}
+
+void
+timing_merge(const struct timing_phase *phases, size_t nr_phases, const char *skip_process)
+{
+	size_t i;
+
+	for (i = 0; i < nr_phases; i++) {
+		if (timing.nr_phases >= ARRAY_SIZE(timing.phases))
+			return;
+
+		// A cloned client inherits the phases recorded by the parent before the clone.
+		if (!strcmp(phases[i].process, skip_process))
+			continue;
+
+		timing.phases[timing.nr_phases] = phases[i];
+		timing.phases[timing.nr_phases].name[sizeof(phases[i].name) - 1] = '\0';
+		timing.phases[timing.nr_phases].process[sizeof(phases[i].process) - 1] = '\0';
+		timing.nr_phases++;
+	}
+}
+
+static void
+json_string(FILE *fd, const char *s)
+{
+	fputc('"', fd);
+
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fd, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(fd, "\\u%04x", *s);
+		else
+			fputc(*s, fd);
+	}
+
+	fputc('"', fd);
+}
+
+static FILE *
+open_report(const char *filename)
+{
+	FILE *fd;
+
+	if (!(fd = fopen(filename, "w")))
+		errmsg("fopen: %s", filename);
+
+	return fd;
+}
+
+static int
+close_report(FILE *fd, const char *filename)
+{
+	if (ferror(fd) | fclose(fd)) {
+		errmsg("unable to write: %s", filename);
+		return -1;
+	}
+	return 0;
+}
+
+int
+timing_write_json(const char *filename, const char *name)
+{
+	FILE *fd;
+	size_t i;
+
+	if (!(fd = open_report(filename)))
+		return -1;
+
+	fprintf(fd, "{\n\t\"name\": ");
+	json_string(fd, name);
+	fprintf(fd, ",\n\t\"clock\": \"CLOCK_MONOTONIC\",\n\t\"base_ns\": %" PRIu64 ",\n\t\"phases\": [", timing.base_ns);
+
+	for (i = 0; i < timing.nr_phases; i++) {
+		const struct timing_phase *ph = &timing.phases[i];
+
+		fprintf(fd, "%s\n\t\t{ \"name\": ", (i ? "," : ""));
+		json_string(fd, ph->name);
+		fprintf(fd, ", \"process\": ");
+		json_string(fd, ph->process);
+		fprintf(fd, ", \"start_ns\": %" PRIu64 ", \"duration_ns\": %" PRIu64 " }",
+		        ph->start_ns - timing.base_ns,
+		        (ph->end_ns ? ph->end_ns - ph->start_ns : 0));
+	}
+
+	fprintf(fd, "\n\t]\n}\n");
+
+	return close_report(fd, filename);
+}
+
+static int
+trace_tid(const char *process)
+{
+	if (!strcmp(process, "parent"))
+		return 1;
+	if (!strcmp(process, "child"))
+		return 2;
+	return 3;
+}
+
+int
+timing_write_trace(const char *filename, const char *name)
+{
+	FILE *fd;
+	size_t i;
+	pid_t pid = getpid();
+	const char *processes[] = { "parent", "child", "client" };
+
+	if (!(fd = open_report(filename)))
+		return -1;
+
+	fprintf(fd, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(fd, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":", pid);
+	json_string(fd, name);
+	fprintf(fd, "}}");
+
+	for (i = 0; i < ARRAY_SIZE(processes); i++)
+		fprintf(fd, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		        pid, trace_tid(processes[i]), processes[i]);
+
+	for (i = 0; i < timing.nr_phases; i++) {
+		const struct timing_phase *ph = &timing.phases[i];
+
+		if (!ph->end_ns)
+			continue;
+
+		// The trace format uses microseconds.
+		fprintf(fd, ",\n{\"ph\":\"X\",\"cat\":\"isolate\",\"name\":");
+		json_string(fd, ph->name);
+		fprintf(fd, ",\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64 ".%03" PRIu64 ",\"dur\":%" PRIu64 ".%03" PRIu64 "}",
+		        pid, trace_tid(ph->process),
+		        (ph->start_ns - timing.base_ns) / 1000, (ph->start_ns - timing.base_ns) % 1000,
+		        (ph->end_ns - ph->start_ns) / 1000, (ph->end_ns - ph->start_ns) % 1000);
+	}
+
+	fprintf(fd, "\n]}\n");
+
+	return close_report(fd, filename);
+}
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <errno.h>
 
 #include "isolate.h"
@@ -55,3 +56,23 @@ setgroups_control(const pid_t pid, const char *value)
 	close(fd);
 	xfree(file);
 }
+
+int
+setgroups_denied(void)
+{
+	char buf[8];
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(PROC_ROOT "/self/setgroups", O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	return !strncmp(buf, "deny", 4);
+}
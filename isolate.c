@@ -1,3 +1,5 @@
+#include <sys/wait.h>
+
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
@@ -10,6 +12,68 @@ extern char *configfile;
 
 const char *program_subname;
 
+static int
+run_command(struct container *data, int argc, char **argv, char *cmd, char *name, int nargs, char **args)
+{
+	int rc = EXIT_SUCCESS;
+
+	load_config(configfile, name, data);
+	parse_section_arguments(argc, argv, data);
+
+	if (chdir("/") < 0)
+		myerror(EXIT_FAILURE, errno, "chdir(/)");
+
+	if (!strcmp(cmd, "start"))
+		rc = cmd_start(data);
+	else if (!strcmp(cmd, "stop"))
+		rc = cmd_stop(data);
+	else if (!strcmp(cmd, "status"))
+		rc = cmd_status(data);
+	else if (!strcmp(cmd, "bench"))
+		rc = cmd_bench(data);
+	else if (!strcmp(cmd, "prewarm"))
+		rc = cmd_prewarm(data);
+	else if (!strcmp(cmd, "update"))
+		rc = cmd_update(data, nargs, args);
+	else
+		info("unknown command `%s'", cmd);
+
+	return rc;
+}
+
+/*
+ * Handles the containers that the supervisor does not manage, they could have
+ * been started without it. The config is loaded over the defaults, so each
+ * container gets its own process.
+ */
+static int
+run_unmanaged(struct container *data, int argc, char **argv, char *cmd, char **names)
+{
+	int rc = EXIT_SUCCESS;
+
+	for (size_t i = 0; names[i]; i++) {
+		int status;
+		pid_t pid;
+
+		if ((pid = fork()) < 0)
+			myerror(EXIT_FAILURE, errno, "fork");
+
+		if (!pid)
+			exit(run_command(data, argc, argv, cmd, names[i], 0, NULL));
+
+		if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) < 0)
+			myerror(EXIT_FAILURE, errno, "waitpid");
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			rc = EXIT_FAILURE;
+
+		xfree(names[i]);
+	}
+
+	xfree(names);
+	return rc;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -21,12 +85,59 @@ main(int argc, char **argv)
 	set_cgroups_group(&data, (char *) "");
 	set_cgroups_dir(&data, (char *) "");
 	set_unshare(&data, (char *) "filesystem");
+	set_start_timeout(&data, 5000);
+	set_state_dir(&data, (char *) "/var/lib/isolate");
 
 	// enforce freezer controller
 	cgroup_controller(data.cgroups, "freezer", CGROUP_FREEZER);
 
 	parse_global_arguments(argc, argv, &data);
 
+	if ((argc - optind) == 1 && !strcmp(argv[optind], "daemon")) {
+		rc = cmd_daemon(&data);
+		free_data(&data);
+		return rc;
+	}
+
+	if ((argc - optind) >= 1) {
+		int has_options = has_section_arguments(argc, argv);
+		char **unmanaged = NULL;
+
+		rc = control_forward(argv[optind], argv + optind + 1, (size_t) (argc - optind - 1), has_options,
+		                     &unmanaged);
+		if (rc >= 0) {
+			if (unmanaged && run_unmanaged(&data, argc, argv, argv[optind], unmanaged) != EXIT_SUCCESS)
+				rc = EXIT_FAILURE;
+			free_data(&data);
+			return rc;
+		}
+		rc = EXIT_SUCCESS;
+	}
+
+	if ((argc - optind) >= 1 && !strcmp(argv[optind], "image")) {
+		rc = cmd_image(data.statedir, argc - optind - 1, argv + optind + 1);
+		free_data(&data);
+		return rc;
+	}
+
+	if ((argc - optind) >= 1 && !strcmp(argv[optind], "stats")) {
+		rc = cmd_stats(configfile, &data, argc - optind - 1, argv + optind + 1);
+		free_data(&data);
+		return rc;
+	}
+
+	if ((argc - optind) >= 1 && !strcmp(argv[optind], "rebalance")) {
+		rc = cmd_rebalance(configfile, &data, argc - optind - 1, argv + optind + 1);
+		free_data(&data);
+		return rc;
+	}
+
+	if ((argc - optind) == 1 && !strcmp(argv[optind], "prewarm")) {
+		rc = cmd_prewarm_all(configfile, data.statedir);
+		free_data(&data);
+		return rc;
+	}
+
 	if ((argc - optind) < 2) {
 		free_data(&data);
 		info("more arguments required");
@@ -36,20 +147,11 @@ main(int argc, char **argv)
 	char *cmd = argv[optind++];
 	char *name = argv[optind++];
 
-	read_config(configfile, name, &data);
-	parse_section_arguments(argc, argv, &data);
-
-	if (chdir("/") < 0)
-		myerror(EXIT_FAILURE, errno, "chdir(/)");
+	// All the options are in front of the arguments after the first parsing.
+	int nargs = argc - optind;
+	char **args = argv + optind;
 
-	if (!strcmp(cmd, "start"))
-		rc = cmd_start(&data);
-	else if (!strcmp(cmd, "stop"))
-		rc = cmd_stop(&data);
-	else if (!strcmp(cmd, "status"))
-		rc = cmd_status(&data);
-	else
-		info("unknown command `%s'", cmd);
+	rc = run_command(&data, argc, argv, cmd, name, nargs, args);
 
 	free_data(&data);
 
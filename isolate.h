@@ -2,6 +2,7 @@
 #define _CONTAINER_H_
 
 #include <sys/types.h>
+#include <stdint.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -12,12 +13,125 @@ struct mapfile {
 	char *map;
 };
 
+typedef enum {
+	SPAWN_CLONE3 = 0,
+	SPAWN_FORK,
+} spawn_t;
+
+typedef enum {
+	PLACEMENT_NONE = 0,
+	PLACEMENT_AUTO,
+} placement_t;
+
+typedef enum {
+	MEMPOLICY_NONE = 0,
+	MEMPOLICY_BIND,
+	MEMPOLICY_PREFERRED,
+	MEMPOLICY_INTERLEAVE,
+	MEMPOLICY_LOCAL,
+} mempolicy_t;
+
+typedef enum {
+	DEVICE_NODE = 0,
+	DEVICE_BIND,
+	DEVICE_SYMLINK,
+	DEVICE_DIR,
+} device_kind_t;
+
+struct devnode {
+	device_kind_t kind;
+	char *path;
+	char *target;
+	size_t line;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	dev_t dev;
+};
+
+typedef enum {
+	MOUNT_FILESYSTEM = 0,
+	MOUNT_BIND,
+	MOUNT_BINDENTS,
+	MOUNT_UMOUNT,
+	MOUNT_LEGACY,
+} mount_kind_t;
+
+typedef enum {
+	MOUNTPOINT_UNKNOWN = 0,
+	MOUNTPOINT_FOUND,
+	MOUNTPOINT_MISSING,
+} mountpoint_t;
+
+/*
+ * Compiled fstab entry. MOUNT_LEGACY covers entries that act on mounts already
+ * in place (move, remount, propagation) and always go through mount(2).
+ */
+struct mountspec {
+	mount_kind_t kind;
+	mountpoint_t mountpoint;
+	unsigned long vfs_opts;
+	mode_t mkdir;
+	char *source;
+	char *target;
+	char *fstype;
+	char *data;
+	char **include;
+	char **exclude;
+};
+
+typedef enum {
+	CGROUP_UNKNOWN = 0,
+	CGROUP_V1,
+	CGROUP_V2,
+} cgroup_version_t;
+
 struct cgroups {
+	cgroup_version_t version;
 	char *rootdir;
 	char *group;
 	char *name;
 	char **dirname;
 	char **controller;
+	char **limits;
+};
+
+struct stop_signal {
+	int signum;
+	int timeout;
+};
+
+typedef enum {
+	PRESSURE_CPU = 0,
+	PRESSURE_MEMORY,
+	PRESSURE_IO,
+	PRESSURE_MAX,
+} pressure_t;
+
+/*
+ * The trigger fires when the tasks stall for threshold ms within the window.
+ * A zero window means no trigger.
+ */
+struct pressure_trigger {
+	int full;
+	int threshold;
+	int window;
+};
+
+#define MONITOR_LOG     (1 << 0)
+#define MONITOR_FREEZE  (1 << 1)
+#define MONITOR_WEIGHT  (1 << 2)
+#define MONITOR_RECLAIM (1 << 3)
+#define MONITOR_RESTART (1 << 4)
+
+// How long the freeze action keeps the container frozen by default, in ms.
+#define MONITOR_FREEZE_TIME 10000
+
+struct monitor_action {
+	int flags;
+	int cpu_weight;
+	int freeze_time;
+	uint64_t reclaim;
 };
 
 #include <sys/capability.h>
@@ -26,20 +140,42 @@ struct container {
 	char *name;
 	char **argv;
 	char *root;
+	char *root_image;
 	char *hostname;
 	char *devfile;
 	char *envfile;
+	char *fstabfile;
+	char *overlay;
+	char *overlay_dir;
 	char *seccomp;
+	char *statedir;
 	char *input;
 	char *output;
+	char *timing_file;
+	char *trace_file;
 	cap_t caps;
 	int nice;
 	int no_new_privs;
+	int pivot_root;
+	int overlay_keep;
+	int devices_tmpfs;
 	int unshare_flags;
+	int start_timeout;
+	int warm_pool;
+	spawn_t spawn;
+	placement_t placement;
+	mempolicy_t mempolicy;
 	uid_t uid;
 	gid_t gid;
-	struct mntent **mounts;
+	struct mountspec **mounts;
+	struct devnode **devices;
+	char **envs;
+	char **after;
 	struct cgroups *cgroups;
+	struct stop_signal *stop_signals;
+	struct pressure_trigger pressure[PRESSURE_MAX];
+	struct monitor_action pressure_action;
+	struct monitor_action oom_action;
 };
 
 // isolate-arguments.c
@@ -47,51 +183,139 @@ void __attribute__((noreturn)) usage(int code);
 void __attribute__((noreturn)) print_version_and_exit(void);
 void parse_global_arguments(int argc, char **argv, struct container *data);
 void parse_section_arguments(int argc, char **argv, struct container *data);
+int has_section_arguments(int argc, char **argv);
 
 // isolate-env.c
-void load_environ(struct mapfile *envs);
+char **parse_environ(char *filename);
+void load_environ(char **envs);
+
+// isolate-image.c
+void mount_image(const char *image, const char *target, const char *statedir);
 
 // isolate-mknod.c
-void make_devices(const char *rootdir, struct mapfile *devs);
+struct devnode **parse_devices(char *filename);
+void make_devices(int rootfd, struct devnode **devs, int tmpfs);
+int has_device_binds(struct devnode **devs);
+void free_devnode(struct devnode *dev);
 
 // isolate-fds.c
 int open_map(char *filename, struct mapfile *file, int quiet);
 void close_map(struct mapfile *file);
 void reopen_fd(const char *filename, int fileno);
 int sanitize_fds(void);
+void close_fds(int keep);
 void cloexec_fds(void);
 
+struct iovec;
+int store_file(const char *dir, const char *name, const struct iovec *iov, int iovcnt);
+
+int openat_resolve(int dirfd, const char *path, int flags, uint64_t resolve);
+int open_in_root(int rootfd, const char *path, int flags);
+int open_parent_in_root(int rootfd, const char *path, const char **base);
+
 // isolate-ns.c
 int parse_unshare_flags(int *flags, char *arg);
 void unshare_flags(const int flags);
+pid_t clone3_flags(const int flags, const int cgroup_fd, int *pidfd);
 
 // isolate-netns.c
 void setup_network(void);
 
 #include <stdio.h>
+#include <linux/filter.h>
 
-// isolate-seccomp.c
-void load_seccomp(FILE *fd, const char *filename);
+struct seccomp_filter {
+	struct sock_fprog prog;
+	struct mapfile cache;
+	int compiled;
+};
 
-#include <stdint.h>
+// isolate-seccomp.c
+void seccomp_prepare(struct seccomp_filter *f, const char *filename, const char *statedir);
+void seccomp_release(struct seccomp_filter *f);
+void load_seccomp(struct seccomp_filter *f, const char *filename);
 
 // isolate-userns.c
 void map_id(const char *type, const char *filename, const pid_t pid, const unsigned int from, const uint64_t to);
 void setgroups_control(const pid_t pid, const char *value);
-
-#include <mntent.h>
+int setgroups_denied(void);
 
 // isolate-mount.c
-void do_mount(const char *newroot, struct mntent **mounts);
-struct mntent **parse_fstab(const char *fstabname);
-void free_mntent(struct mntent *ent);
+struct mountspec *compile_mount(const char *source, const char *target, const char *fstype, const char *opts);
+struct mountspec **parse_fstab(const char *fstabname);
+int check_mounts(const char *newroot, const char *skipdir, struct mountspec **mounts);
+int bind_fd(const char *source, int targetfd);
+void do_mount(int rootfd, const char *statedir, struct mountspec **mounts);
+void do_pivot_root(const char *newroot);
+void mount_overlay(const char *newroot, const char *dir, int tmpfs);
+int remove_overlay(const char *dir, int tmpfs, int keep);
+void free_mountspec(struct mountspec *spec);
 
 #include <sys/epoll.h>
 
 int epollin_init(void);
 void epollin_add(int fd_ep, int fd);
+void epollpri_add(int fd_ep, int fd);
 void epollin_remove(int fd_ep, int fd);
 
+// isolate-timerfd.c
+int timerfd_init(void);
+void timerfd_arm(int fd, long msec);
+void timerfd_disarm(int fd);
+uint64_t timerfd_ack(int fd);
+
+#include <signal.h>
+
+// isolate-pidfd.c
+int pidfd_open_pid(pid_t pid);
+int pidfd_wait(int pidfd, siginfo_t *info, int options);
+int get_siginfo_rc(const siginfo_t *info);
+
+struct reaper_child {
+	pid_t pid;
+	int pidfd;
+	int exited;
+	int rc;
+};
+
+struct reaper {
+	struct reaper_child **children;
+	size_t nr_children;
+	size_t nr_reaped;
+	size_t nr_orphans;
+	size_t nr_failed;
+	size_t nr_signaled;
+};
+
+struct timing_phase {
+	char name[24];
+	char process[8];
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+struct timing {
+	uint64_t base_ns;
+	size_t nr_phases;
+	struct timing_phase phases[48];
+};
+
+// isolate-timing.c
+uint64_t timing_now(void);
+struct timing *timing_get(void);
+void timing_begin(const char *name);
+void timing_end(const char *name);
+const struct timing_phase *timing_lookup(const char *name);
+void timing_merge(const struct timing_phase *phases, size_t nr_phases, const char *skip_process);
+int timing_write_json(const char *filename, const char *name);
+int timing_write_trace(const char *filename, const char *name);
+
+// isolate-reaper.c
+struct reaper_child *reaper_track(struct reaper *r, int fd_ep, pid_t pid, int pidfd);
+void reaper_untrack(struct reaper *r, int fd_ep, struct reaper_child *child);
+int reaper_drain(struct reaper *r);
+void reaper_free(struct reaper *r, int fd_ep);
+
 #include <sys/capability.h>
 
 // isolate-caps.c
@@ -102,14 +326,40 @@ void apply_caps(cap_t caps);
 // isolate-cgroups.c
 #define CGROUP_FREEZER "freezer0"
 
-void cgroup_create(struct cgroups *cg);
+int cgroup_create(struct cgroups *cg);
 void cgroup_destroy(struct cgroups *cg);
 void cgroup_add(struct cgroups *cg, pid_t pid);
+int cgroup_open_unified(struct cgroups *cg);
 void cgroup_controller(struct cgroups *cg, const char *controller, const char *dirname);
+void cgroup_copy_controllers(struct cgroups *cg, const struct cgroups *from);
+void cgroup_free_controllers(struct cgroups *cg);
 void cgroup_split_controllers(struct cgroups *cg, const char *opts);
 void cgroup_freeze(struct cgroups *cg);
 void cgroup_unfreeze(struct cgroups *cg);
+int cgroup_set_frozen(struct cgroups *cg, int frozen);
+int cgroup_frozen(struct cgroups *cg);
 size_t cgroup_signal(struct cgroups *cg, int signum);
+int cgroup_kill(struct cgroups *cg);
+int cgroup_populated(struct cgroups *cg);
+int cgroup_watch(struct cgroups *cg);
+size_t cgroup_pids(struct cgroups *cg, pid_t *pids, size_t max);
+int cgroup_pressure_trigger(struct cgroups *cg, const char *file, const struct pressure_trigger *trigger);
+int cgroup_oom_watch(struct cgroups *cg, int *fd_stat);
+cgroup_version_t cgroup_version(struct cgroups *cg);
+int cgroup_rename(struct cgroups *cg, const char *name);
+int cgroup_open(struct cgroups *cg, const char *controller, const char *file);
+char **cgroup_siblings(struct cgroups *cg, const char *controller);
+int cgroup_write(struct cgroups *cg, const char *controller, const char *file, const char *value);
+int cgroup_printf(struct cgroups *cg, const char *controller, const char *file, const char *fmt, ...)
+	__attribute__((__format__(__printf__, 4, 5)));
+
+// isolate-limits.c
+int parse_size(const char *value, uint64_t *size);
+const char *limit_key(size_t i);
+int cgroup_limit(struct cgroups *cg, const char *key, const char *value);
+const char *cgroup_limit_value(struct cgroups *cg, const char *key);
+int cgroup_set_limit(struct cgroups *cg, const char *key, const char *value);
+int cgroup_apply_limits(struct cgroups *cg, char **limits);
 
 // isolate-common.c
 void *xmalloc(size_t size);
@@ -119,6 +369,10 @@ void *xrealloc(void *ptr, size_t nmemb, size_t size);
 char *xstrdup(const char *s);
 int xasprintf(char **ptr, const char *fmt, ...);
 
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+uint64_t fnv1a(uint64_t hash, const void *buf, size_t len);
+
 void (*myerror_progname)(char **);
 void __attribute__((format(printf, 3, 4))) myerror(const int exitnum, const int errnum, const char *fmt, ...);
 
@@ -136,6 +390,7 @@ void set_output(struct container *data, char *arg);
 void set_devices_file(struct container *data, char *arg);
 void set_environ_file(struct container *data, char *arg);
 void set_seccomp_file(struct container *data, char *arg);
+void set_state_dir(struct container *data, char *arg);
 void set_fstab_file(struct container *data, char *arg);
 void set_cap_add(struct container *data, char *arg);
 void set_cap_drop(struct container *data, char *arg);
@@ -144,18 +399,154 @@ void set_uid(struct container *data, int arg);
 void set_gid(struct container *data, int arg);
 void set_unshare(struct container *data, char *arg);
 void set_cgroups(struct container *data, char *arg);
+void set_limit(struct container *data, const char *key, char *arg);
 void set_nice(struct container *data, int arg);
 void set_no_new_privs(struct container *data, int arg);
+void set_pivot_root(struct container *data, int arg);
+void set_root_image(struct container *data, char *arg);
+void set_overlay(struct container *data, char *arg);
+void set_overlay_keep(struct container *data, int arg);
+void set_devices_tmpfs(struct container *data, int arg);
+void set_start_timeout(struct container *data, int arg);
+void set_stop_signals(struct container *data, char *arg);
+void set_pressure(struct container *data, pressure_t type, char *arg);
+void set_pressure_action(struct container *data, char *arg);
+void set_oom_action(struct container *data, char *arg);
+void set_warm_pool(struct container *data, int arg);
+void set_spawn(struct container *data, char *arg);
+void set_placement(struct container *data, char *arg);
+void set_mempolicy(struct container *data, char *arg);
+void set_timing_file(struct container *data, char *arg);
+void set_trace_file(struct container *data, char *arg);
 void set_argv(struct container *data, char *arg);
+void set_after(struct container *data, char *arg);
 
+char **read_config_sections(const char *filename);
 void read_config(const char *filename, char *section, struct container *data);
 
+// isolate-profile.c
+void load_config(const char *filename, char *section, struct container *data);
+void profile_encode(const char *filename, struct container *data, char **buf, size_t *size);
+int profile_decode(const char *buf, size_t size, struct container *data);
+
 // isolate-cmd-common.c
 void myerror_progname_subname(char **out);
 void free_data(struct container *data);
-void kill_container(struct container *data);
+void kill_container(struct container *data, int force);
+
+typedef enum {
+	TEARDOWN_IDLE = 0,
+	TEARDOWN_SIGNAL,
+	TEARDOWN_DONE,
+} teardown_state_t;
+
+struct teardown {
+	teardown_state_t state;
+	struct cgroups *cg;
+	const struct stop_signal *signals;
+	size_t stage;
+	int rounds;
+	int fd_ep;
+	int fd_timer;
+	int fd_notify;
+	int *pidfds;
+	size_t nr_pidfds;
+};
+
+// isolate-teardown.c
+void teardown_start(struct teardown *td, struct cgroups *cg, const struct stop_signal *signals, int fd_ep);
+int teardown_event(struct teardown *td, int fd);
+int teardown_kill(struct teardown *td);
+void teardown_cancel(struct teardown *td);
+struct stop_signal *parse_stop_signals(const char *arg);
+
+struct monitor {
+	struct cgroups *cg;
+	const struct container *data;
+	int fd_ep;
+	int fd_pressure[PRESSURE_MAX];
+	int fd_oom;
+	int fd_oom_stat;
+	int fd_freeze;
+	int fd_thaw;
+	int64_t oom_kills;
+	int frozen;
+	int restart;
+};
+
+// isolate-monitor.c
+void parse_pressure_trigger(const char *arg, struct pressure_trigger *trigger);
+void parse_monitor_action(const char *arg, struct monitor_action *action);
+void monitor_start(struct monitor *mon, struct container *data, int fd_ep);
+int monitor_event(struct monitor *mon, int fd);
+void monitor_stop(struct monitor *mon);
+
+/*
+ * The load of a node is the sum of the cpu weights of the containers placed
+ * on it.
+ */
+struct numa_node {
+	int id;
+	char *cpus;
+	size_t nr_cpus;
+	uint64_t load;
+};
+
+struct topology {
+	struct numa_node *nodes;
+	size_t nr_nodes;
+};
+
+// isolate-placement.c
+int topology_load(struct topology *topo);
+void topology_free(struct topology *topo);
+void topology_account(struct topology *topo, struct cgroups *cg, char **skip);
+struct numa_node *topology_pick(struct topology *topo, uint64_t weight);
+uint64_t placement_weight(struct cgroups *cg);
+int placement_assign(struct container *data);
+int placement_move(struct cgroups *cg, const struct numa_node *node);
+void apply_mempolicy(struct container *data);
+
+/*
+ * The monitor restarts a container at most RESTART_BURST times in
+ * RESTART_INTERVAL ms, each time RESTART_DELAY ms after the stop.
+ */
+#define RESTART_DELAY    1000
+#define RESTART_BURST    5
+#define RESTART_INTERVAL 60000
+
+struct restarts {
+	uint64_t since;
+	unsigned int count;
+};
+
+struct instance {
+	struct container *data;
+	struct reaper *reaper;
+	struct reaper_child *temp;
+	struct reaper_child *init;
+	int sock;
+	int fd_timer;
+	int hold;
+	int ready;
+	int exec_sent;
+	int running;
+	int done;
+	int restart;
+	int rc;
+	struct teardown td;
+	struct monitor mon;
+};
 
 // isolate-cmd-start.c
+int instance_spawn(struct instance *in, struct container *data, struct reaper *reaper, int fd_ep);
+int instance_event(struct instance *in, int fd_ep, int fd);
+void instance_update(struct instance *in, int fd_ep);
+int instance_release(struct instance *in);
+int instance_teardown(struct instance *in, int fd_ep);
+void instance_stop(struct instance *in, int fd_ep);
+void instance_restart(struct instance *in, int fd_ep);
+int restart_allowed(struct restarts *rs, const char *name);
 int cmd_start(struct container *data);
 
 // isolate-cmd-stop.c
@@ -164,4 +555,35 @@ int cmd_stop(struct container *data);
 // isolate-cmd-status.c
 int cmd_status(struct container *data);
 
+// isolate-cmd-update.c
+int cmd_update(struct container *data, int argc, char **argv);
+
+// isolate-cmd-stats.c
+int cmd_stats(const char *filename, struct container *defaults, int argc, char **argv);
+
+// isolate-cmd-rebalance.c
+int cmd_rebalance(const char *filename, struct container *defaults, int argc, char **argv);
+
+// isolate-cmd-bench.c
+int cmd_bench(struct container *data);
+
+// isolate-cmd-daemon.c
+int cmd_daemon(struct container *defaults);
+
+// isolate-control.c
+#define CONTROL_UNMANAGED 2
+
+int control_listen(const char *path);
+int control_connect(const char *path);
+int control_send(int fd, const char *buf, size_t len);
+int control_request(int fd, char **requests, size_t nr_requests, char ***unmanaged);
+int control_forward(const char *cmd, char **names, size_t nr_names, int has_options, char ***unmanaged);
+
+// isolate-cmd-image.c
+int cmd_image(const char *statedir, int argc, char **argv);
+
+// isolate-cmd-prewarm.c
+int cmd_prewarm(struct container *data);
+int cmd_prewarm_all(const char *filename, char *statedir);
+
 #endif /* _CONTAINER_H_ */